@@ -29,6 +29,7 @@
 ConVar rr_debugresponses( "rr_debugresponses", "0", FCVAR_NONE, "Show verbose matching output (1 for simple, 2 for rule scoring). If set to 3, it will only show response success/failure for npc_selected NPCs." );
 ConVar rr_debugrule( "rr_debugrule", "", FCVAR_NONE, "If set to the name of the rule, that rule's score will be shown whenever a concept is passed into the response rules system.");
 ConVar rr_dumpresponses( "rr_dumpresponses", "0", FCVAR_NONE, "Dump all response_rules.txt and rules (requires restart)" );
+ConVar rr_compiled_rules( "rr_compiled_rules", "1", FCVAR_NONE, "Select rules with the compiled rule set, which only scores the rules that can match the query's concept. Set to 0 to score every rule." );
 
 static CUtlSymbolTable g_RS;
 
@@ -683,6 +684,40 @@ public:
 	float		LookupEnumeration( const char *name, bool& found );
 
 	int			FindBestMatchingRule( const AI_CriteriaSet& set, bool verbose );
+	void		CollectBestMatchingRules( const AI_CriteriaSet& set, bool verbose, bool compiled, CUtlVector< int > &bestrules );
+
+	// Compiled rule set, see CompileRules()
+	struct CompiledCriterion_t
+	{
+		int			criterion;			// index into m_Criteria
+		int			nameid;				// index into m_CompiledNames, -1 for subcriteria
+		const char	*token;				// matcher token, resolved once
+		float		tokenval;			// matcher token parsed as a number
+	};
+
+	struct CompiledRule_t
+	{
+		int			firstGate;			// required equality tests into m_CompiledGates, checked before scoring
+		int			gateCount;
+		int			firstCriterion;		// all criteria into m_CompiledCriteria, in rule order
+		int			criterionCount;
+	};
+
+	struct QueryValue_t
+	{
+		int			generation;
+		int			index;				// into the criteria set, -1 if it doesn't have the criterion
+		const char	*name;
+		const char	*value;
+		float		numeric;
+		float		weight;
+	};
+
+	bool		IsCompiled() const;
+	void		CompileRules();
+	const QueryValue_t &LookupQueryValue( const AI_CriteriaSet& set, int nameid );
+	bool		CompareUsingCompiledMatcher( const QueryValue_t &value, const CompiledCriterion_t &cc, const Matcher& m );
+	float		ScoreCompiledRule( const AI_CriteriaSet& set, int irule );
 
 	float		ScoreCriteriaAgainstRule( const AI_CriteriaSet& set, int irule, bool verbose = false );
 	float		RecursiveScoreSubcriteriaAgainstRule( const AI_CriteriaSet& set, Criteria *parent, bool& exclude, bool verbose /*=false*/ );
@@ -727,6 +762,20 @@ public:
 
 	CUtlVector< ScriptEntry >		m_ScriptStack;
 
+	bool							m_bRulesCompiled;
+	int								m_nCompiledRuleCount;
+	int								m_nCompiledCriteriaCount;
+	CUtlVector< CompiledRule_t >	m_CompiledRules;
+	CUtlVector< CompiledCriterion_t > m_CompiledCriteria;
+	CUtlVector< CompiledCriterion_t > m_CompiledGates;
+	CUtlDict< int, int >			m_CompiledNames;		// criterion name -> nameid
+	CUtlDict< int, int >			m_ConceptBuckets;		// concept -> index into m_ConceptRules
+	CUtlVector< CUtlVector< int > >	m_ConceptRules;			// rules requiring each concept, in rule order
+	CUtlVector< int >				m_AnyConceptRules;		// rules that don't require a concept, in rule order
+	int								m_nConceptNameId;
+	CUtlVector< QueryValue_t >		m_QueryValues;			// indexed by nameid
+	int								m_nQueryGeneration;
+
 	friend class CDefaultResponseSystemSaveRestoreBlockHandler;
 	friend class CResponseSystemSaveRestoreOps;
 };
@@ -762,6 +811,11 @@ CResponseSystem::CResponseSystem()
 	m_bUnget = false;
 	m_bPrecache = true;
 	m_bCustomManagable = false;
+	m_bRulesCompiled = false;
+	m_nCompiledRuleCount = 0;
+	m_nCompiledCriteriaCount = 0;
+	m_nConceptNameId = -1;
+	m_nQueryGeneration = 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -817,6 +871,7 @@ void CResponseSystem::Clear()
 	m_Criteria.RemoveAll();
 	m_Rules.RemoveAll();
 	m_Enumerations.RemoveAll();
+	m_bRulesCompiled = false;
 }
 
 //-----------------------------------------------------------------------------
@@ -1677,35 +1732,377 @@ bool CResponseSystem::GetBestResponse( ResponseSearchResult& searchResult, Rule
 }
 
 //-----------------------------------------------------------------------------
-// Purpose: 
-// Input  : set - 
-//			verbose - 
-// Output : int
+// Purpose: The compiled rule set is only valid for the rules and criteria it was
+//  built from.  Custom response systems copy rules in after loading, so check the
+//  counts as well.
 //-----------------------------------------------------------------------------
-int CResponseSystem::FindBestMatchingRule( const AI_CriteriaSet& set, bool verbose )
+bool CResponseSystem::IsCompiled() const
 {
-	CUtlVector< int >	bestrules;
-	float bestscore = 0.001f;
+	return m_bRulesCompiled && 
+		m_nCompiledRuleCount == m_Rules.Count() && 
+		m_nCompiledCriteriaCount == m_Criteria.Count();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Build the indexed form of m_Rules used by FindBestMatchingRule.  Each
+//  criterion name gets a small integer id so a query looks it up in the criteria
+//  set only once, matcher tokens are resolved and parsed up front, and rules are
+//  bucketed by the concept they require so a query only scores the rules for its
+//  own concept plus the rules that accept any concept.
+//-----------------------------------------------------------------------------
+void CResponseSystem::CompileRules()
+{
+	m_CompiledRules.Purge();
+	m_CompiledCriteria.Purge();
+	m_CompiledGates.Purge();
+	m_CompiledNames.Purge();
+	m_ConceptBuckets.Purge();
+	m_ConceptRules.Purge();
+	m_AnyConceptRules.Purge();
+	m_QueryValues.Purge();
+	m_nConceptNameId = -1;
 
 	int c = m_Rules.Count();
-	int i;
-	for ( i = 0; i < c; i++ )
+	m_CompiledRules.EnsureCapacity( c );
+	for ( int i = 0; i < c; i++ )
+	{
+		Rule *rule = &m_Rules[ i ];
+		CompiledRule_t &compiled = m_CompiledRules[ m_CompiledRules.AddToTail() ];
+		compiled.firstGate = m_CompiledGates.Count();
+		compiled.firstCriterion = m_CompiledCriteria.Count();
+
+		const char *concept = NULL;
+
+		int count = rule->m_Criteria.Count();
+		for ( int j = 0; j < count; j++ )
+		{
+			int icriterion = rule->m_Criteria[ j ];
+			Criteria *crit = &m_Criteria[ icriterion ];
+
+			CompiledCriterion_t cc;
+			cc.criterion = icriterion;
+			cc.nameid = -1;
+			cc.token = "";
+			cc.tokenval = 0.0f;
+
+			if ( !crit->IsSubCriteriaType() )
+			{
+				const char *name = crit->name ? crit->name : "";
+				int idx = m_CompiledNames.Find( name );
+				if ( idx == m_CompiledNames.InvalidIndex() )
+				{
+					idx = m_CompiledNames.Insert( name, m_QueryValues.Count() );
+
+					QueryValue_t &qv = m_QueryValues[ m_QueryValues.AddToTail() ];
+					qv.name = name;
+					qv.generation = 0;
+				}
+
+				cc.nameid = m_CompiledNames[ idx ];
+				cc.token = crit->matcher.GetToken();
+				cc.tokenval = (float)atof( cc.token );
+
+				// A required plain string compare rejects the rule by itself, so those are tested
+				// before any scoring.  The concept is the most selective of them.
+				const Matcher &m = crit->matcher;
+				if ( crit->required && m.valid && !m.usemin && !m.usemax && !m.notequal && !m.isnumeric )
+				{
+					m_CompiledGates.AddToTail( cc );
+
+					if ( !concept && !Q_stricmp( name, "concept" ) )
+					{
+						concept = cc.token;
+					}
+				}
+			}
+
+			m_CompiledCriteria.AddToTail( cc );
+		}
+
+		compiled.gateCount = m_CompiledGates.Count() - compiled.firstGate;
+		compiled.criterionCount = m_CompiledCriteria.Count() - compiled.firstCriterion;
+
+		if ( concept )
+		{
+			int bucket = m_ConceptBuckets.Find( concept );
+			if ( bucket == m_ConceptBuckets.InvalidIndex() )
+			{
+				bucket = m_ConceptBuckets.Insert( concept, m_ConceptRules.AddToTail() );
+			}
+			m_ConceptRules[ m_ConceptBuckets[ bucket ] ].AddToTail( i );
+		}
+		else
+		{
+			m_AnyConceptRules.AddToTail( i );
+		}
+	}
+
+	int conceptName = m_CompiledNames.Find( "concept" );
+	if ( conceptName != m_CompiledNames.InvalidIndex() )
+	{
+		m_nConceptNameId = m_CompiledNames[ conceptName ];
+	}
+
+	m_nQueryGeneration = 0;
+	m_nCompiledRuleCount = c;
+	m_nCompiledCriteriaCount = m_Criteria.Count();
+	m_bRulesCompiled = true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Find a criterion in the set at most once per query
+//-----------------------------------------------------------------------------
+const CResponseSystem::QueryValue_t &CResponseSystem::LookupQueryValue( const AI_CriteriaSet& set, int nameid )
+{
+	QueryValue_t &qv = m_QueryValues[ nameid ];
+	if ( qv.generation == m_nQueryGeneration )
+		return qv;
+
+	qv.generation = m_nQueryGeneration;
+	qv.index = set.FindCriterionIndex( qv.name );
+	if ( qv.index != -1 )
+	{
+		qv.value = set.GetValue( qv.index );
+		qv.weight = set.GetWeight( qv.index );
+	}
+	else
+	{
+		qv.value = "";
+		qv.weight = 1.0f;
+	}
+
+	// Same conversion CompareUsingMatcher does for every compare
+	qv.numeric = (float)atof( qv.value );
+	if ( qv.value[0] == '[' )
+	{
+		bool found = false;
+		qv.numeric = LookupEnumeration( qv.value, found );
+	}
+
+	return qv;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: CompareUsingMatcher with the set value and matcher token already parsed
+//-----------------------------------------------------------------------------
+bool CResponseSystem::CompareUsingCompiledMatcher( const QueryValue_t &value, const CompiledCriterion_t &cc, const Matcher& m )
+{
+	if ( !m.valid )
+		return false;
+
+	float v = value.numeric;
+
+	int minmaxcount = 0;
+
+	if ( m.usemin )
+	{
+		if ( m.minequals ? ( v < m.minval ) : ( v <= m.minval ) )
+			return false;
+
+		++minmaxcount;
+	}
+
+	if ( m.usemax )
+	{
+		if ( m.maxequals ? ( v > m.maxval ) : ( v >= m.maxval ) )
+			return false;
+
+		++minmaxcount;
+	}
+
+	// Had one or both criteria and met them
+	if ( minmaxcount >= 1 )
+		return true;
+
+	if ( m.notequal )
+	{
+		if ( m.isnumeric )
+			return v != cc.tokenval;
+
+		return Q_stricmp( value.value, cc.token ) ? true : false;
+	}
+
+	if ( m.isnumeric )
+	{
+		// If the setValue is "", the NPC doesn't have the key at all,
+		// in which case we shouldn't match "0".
+		if ( !value.value[0] )
+			return false;
+
+		return v == cc.tokenval;
+	}
+
+	return !Q_stricmp( value.value, cc.token ) ? true : false;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: ScoreCriteriaAgainstRule using the compiled rule set.  Scores are summed
+//  in the same order, so they are bit identical to the original.
+//-----------------------------------------------------------------------------
+float CResponseSystem::ScoreCompiledRule( const AI_CriteriaSet& set, int irule )
+{
+	Rule *rule = &m_Rules[ irule ];
+	if ( !rule->IsEnabled() )
+		return 0.0f;
+
+	const CompiledRule_t &compiled = m_CompiledRules[ irule ];
+
+	for ( int i = 0; i < compiled.gateCount; i++ )
+	{
+		const CompiledCriterion_t &cc = m_CompiledGates[ compiled.firstGate + i ];
+		if ( Q_stricmp( LookupQueryValue( set, cc.nameid ).value, cc.token ) )
+			return 0.0f;
+	}
+
+	float score = 0.0f;
+	for ( int i = 0; i < compiled.criterionCount; i++ )
 	{
-		float score = ScoreCriteriaAgainstRule( set, i, verbose );
-		// Check equals so that we keep track of all matching rules
-		if ( score >= bestscore )
+		const CompiledCriterion_t &cc = m_CompiledCriteria[ compiled.firstCriterion + i ];
+		Criteria *c = &m_Criteria[ cc.criterion ];
+
+		bool exclude = false;
+		if ( cc.nameid == -1 )
+		{
+			score += ScoreCriteriaAgainstRuleCriteria( set, cc.criterion, exclude );
+		}
+		else
 		{
-			// Reset bucket
-			if( score != bestscore )
+			const QueryValue_t &qv = LookupQueryValue( set, cc.nameid );
+			if ( CompareUsingCompiledMatcher( qv, cc, c->matcher ) )
 			{
-				bestscore = score;
-				bestrules.RemoveAll();
+				score += qv.weight * c->weight.GetFloat();
 			}
+			else
+			{
+				exclude = c->required;
+			}
+		}
 
-			// Add to bucket
-			bestrules.AddToTail( i );
+		if ( exclude )
+			return 0.0f;
+	}
+
+	return score;
+}
+
+static void AddToBestRules( CUtlVector< int > &bestrules, float &bestscore, int irule, float score )
+{
+	// Check equals so that we keep track of all matching rules
+	if ( score >= bestscore )
+	{
+		// Reset bucket
+		if( score != bestscore )
+		{
+			bestscore = score;
+			bestrules.RemoveAll();
 		}
+
+		// Add to bucket
+		bestrules.AddToTail( irule );
 	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Find all of the rules tied for the best score, in rule order
+//-----------------------------------------------------------------------------
+void CResponseSystem::CollectBestMatchingRules( const AI_CriteriaSet& set, bool verbose, bool compiled, CUtlVector< int > &bestrules )
+{
+	bestrules.RemoveAll();
+	float bestscore = 0.001f;
+
+	if ( !compiled )
+	{
+		int c = m_Rules.Count();
+		for ( int i = 0; i < c; i++ )
+		{
+			float score = ScoreCriteriaAgainstRule( set, i, verbose );
+			AddToBestRules( bestrules, bestscore, i, score );
+		}
+		return;
+	}
+
+	if ( !IsCompiled() )
+	{
+		CompileRules();
+	}
+
+	if ( ++m_nQueryGeneration == 0 )
+	{
+		FOR_EACH_VEC( m_QueryValues, it )
+		{
+			m_QueryValues[ it ].generation = 0;
+		}
+		m_nQueryGeneration = 1;
+	}
+
+	const CUtlVector< int > *conceptRules = NULL;
+	if ( m_nConceptNameId != -1 )
+	{
+		int bucket = m_ConceptBuckets.Find( LookupQueryValue( set, m_nConceptNameId ).value );
+		if ( bucket != m_ConceptBuckets.InvalidIndex() )
+		{
+			conceptRules = &m_ConceptRules[ m_ConceptBuckets[ bucket ] ];
+		}
+	}
+
+	// Merge the rules for this concept with the rules for any concept, keeping rule order
+	// so ties come out the same as the full scan
+	int anyCount = m_AnyConceptRules.Count();
+	int conceptCount = conceptRules ? conceptRules->Count() : 0;
+	int iany = 0;
+	int iconcept = 0;
+	while ( iany < anyCount || iconcept < conceptCount )
+	{
+		int irule;
+		if ( iconcept >= conceptCount || ( iany < anyCount && m_AnyConceptRules[ iany ] < (*conceptRules)[ iconcept ] ) )
+		{
+			irule = m_AnyConceptRules[ iany++ ];
+		}
+		else
+		{
+			irule = (*conceptRules)[ iconcept++ ];
+		}
+
+		float score = ScoreCompiledRule( set, irule );
+		AddToBestRules( bestrules, bestscore, irule, score );
+	}
+}
+
+static CUtlVector< AI_CriteriaSet * > s_RecordedCriteria;
+static int s_nRecordCriteriaRemaining = 0;
+
+//-----------------------------------------------------------------------------
+// Purpose: Free the criteria sets recorded by rr_record_criteria and stop recording
+//-----------------------------------------------------------------------------
+static void ResetRecordedCriteria( void )
+{
+	s_RecordedCriteria.PurgeAndDeleteElements();
+	s_nRecordCriteriaRemaining = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: 
+// Input  : set - 
+//			verbose - 
+// Output : int
+//-----------------------------------------------------------------------------
+int CResponseSystem::FindBestMatchingRule( const AI_CriteriaSet& set, bool verbose )
+{
+	if ( s_nRecordCriteriaRemaining > 0 )
+	{
+		s_RecordedCriteria.AddToTail( new AI_CriteriaSet( set ) );
+		if ( --s_nRecordCriteriaRemaining == 0 )
+		{
+			Msg( "rr_record_criteria: recorded %d criteria sets\n", s_RecordedCriteria.Count() );
+		}
+	}
+
+	// The compiled rules don't print anything, so use the full scan when debugging
+	const char *pszDebugRule = rr_debugrule.GetString();
+	bool compiled = rr_compiled_rules.GetBool() && !verbose && !( pszDebugRule && pszDebugRule[0] );
+
+	CUtlVector< int >	bestrules;
+	CollectBestMatchingRules( set, verbose, compiled, bestrules );
 
 	int bestCount = bestrules.Count();
 	if ( bestCount <= 0 )
@@ -2003,6 +2400,8 @@ void CResponseSystem::LoadRuleSet( const char *basescript )
 
 	UTIL_FreeFile( buffer );
 
+	CompileRules();
+
 	Assert( m_ScriptStack.Count() == 0 );
 }
 
@@ -2883,6 +3282,12 @@ public:
 	{
 	}
 
+	virtual void LevelShutdownPostEntity()
+	{
+		// a recording only makes sense for the level it was made on
+		ResetRecordedCriteria();
+	}
+
 	virtual void Release()
 	{
 		Assert( 0 );
@@ -3051,6 +3456,81 @@ CON_COMMAND( rr_reloadresponsesystems, "Reload all response system scripts." )
 #endif
 }
 
+CON_COMMAND_F( rr_record_criteria, "Record the criteria sets of the next response rule queries for rr_bench_rules, replacing any previous recording. Arguments: [query count]", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	ResetRecordedCriteria();
+	s_nRecordCriteriaRemaining = ( args.ArgC() > 1 ) ? MAX( 1, atoi( args[1] ) ) : 1000;
+
+	Msg( "rr_record_criteria: recording the next %d queries\n", s_nRecordCriteriaRemaining );
+}
+
+CON_COMMAND_F( rr_bench_rules, "Replay the criteria sets recorded by rr_record_criteria against the full rule scan and the compiled rule set of the default response system. Arguments: [passes]", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	int setCount = s_RecordedCriteria.Count();
+	if ( setCount == 0 )
+	{
+		Msg( "rr_bench_rules: nothing recorded, use rr_record_criteria first\n" );
+		return;
+	}
+
+	int passes = ( args.ArgC() > 1 ) ? MAX( 1, atoi( args[1] ) ) : 10;
+
+	CUtlVector< int > scanRules;
+	CUtlVector< int > compiledRules;
+
+	// Both must produce the same set of tied rules, in the same order, for the random pick to agree
+	int mismatchCount = 0;
+	int matchedCount = 0;
+	FOR_EACH_VEC( s_RecordedCriteria, it )
+	{
+		defaultresponsesytem.CollectBestMatchingRules( *s_RecordedCriteria[ it ], false, false, scanRules );
+		defaultresponsesytem.CollectBestMatchingRules( *s_RecordedCriteria[ it ], false, true, compiledRules );
+
+		if ( scanRules.Count() )
+		{
+			++matchedCount;
+		}
+
+		if ( scanRules.Count() != compiledRules.Count() ||
+			 ( scanRules.Count() && V_memcmp( scanRules.Base(), compiledRules.Base(), scanRules.Count() * sizeof( int ) ) ) )
+		{
+			++mismatchCount;
+		}
+	}
+
+	double start = Plat_FloatTime();
+	for ( int pass = 0; pass < passes; ++pass )
+	{
+		FOR_EACH_VEC( s_RecordedCriteria, it )
+		{
+			defaultresponsesytem.CollectBestMatchingRules( *s_RecordedCriteria[ it ], false, false, scanRules );
+		}
+	}
+	double scanTime = Plat_FloatTime() - start;
+
+	start = Plat_FloatTime();
+	for ( int pass = 0; pass < passes; ++pass )
+	{
+		FOR_EACH_VEC( s_RecordedCriteria, it )
+		{
+			defaultresponsesytem.CollectBestMatchingRules( *s_RecordedCriteria[ it ], false, true, compiledRules );
+		}
+	}
+	double compiledTime = Plat_FloatTime() - start;
+
+	int queryCount = setCount * passes;
+	Msg( "rr_bench_rules: %d criteria sets x %d passes, %d with a matching rule\n", setCount, passes, matchedCount );
+	Msg( "  Full rule scan:    %8.3f ms (%.3f us/query)\n", scanTime * 1000.0, scanTime * 1000000.0 / queryCount );
+	Msg( "  Compiled rule set: %8.3f ms (%.3f us/query)\n", compiledTime * 1000.0, compiledTime * 1000000.0 / queryCount );
+	Msg( "  Best rule mismatches: %d\n", mismatchCount );
+}
+
 static short RESPONSESYSTEM_SAVE_RESTORE_VERSION = 1;
 
 // note:  this won't save/restore settings from instanced response systems.  Could add that with a CDefSaveRestoreOps implementation if needed
@@ -3318,6 +3798,7 @@ void CDefaultResponseSystem::Shutdown()
 
 	// Clear outselves
 	Clear();
+	ResetRecordedCriteria();
 	// IServerSystem chain
 	BaseClass::Shutdown();
 }
@@ -6,6 +6,7 @@
 
 #include "NextBotManager.h"
 #include "NextBotInterface.h"
+#include "NextBotVisionInterface.h"
 
 #ifdef TERROR
 #include "ZombieBot/Infected/Infected.h"
@@ -14,6 +15,7 @@
 #endif
 
 #include "SharedFunctorUtils.h"
+#include "vstdlib/jobthread.h"
 //#include "../../common/blackbox_helper.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
@@ -25,6 +27,8 @@ ConVar nb_update_frequency( "nb_update_frequency", ".1", FCVAR_CHEAT );
 ConVar nb_update_framelimit( "nb_update_framelimit", ( IsDebug() ) ? "30" : "15", FCVAR_CHEAT );
 ConVar nb_update_maxslide( "nb_update_maxslide", "2", FCVAR_CHEAT );
 ConVar nb_update_debug( "nb_update_debug", "0", FCVAR_CHEAT );
+ConVar nb_update_parallel( "nb_update_parallel", "0", FCVAR_CHEAT, "Compute line-of-sight for the vision scans of all bots updating this tick on the job pool" );
+ConVar nb_update_parallel_deterministic( "nb_update_parallel_deterministic", "0", FCVAR_CHEAT, "Compute the nb_update_parallel vision scans on the main thread in bot order, for comparison with the job pool results" );
 
 //---------------------------------------------------------------------------------------------
 //---------------------------------------------------------------------------------------------
@@ -391,6 +395,11 @@ void NextBotManager::Update( void )
 			nScheduled = m_botList.Count();
 		}
 
+		if ( nb_update_parallel.GetBool() )
+		{
+			UpdatePerceptionParallel();
+		}
+
 		if ( nb_update_debug.GetBool() )
 		{
 			int nIntentionalSliders = 0;
@@ -412,6 +421,64 @@ void NextBotManager::Update( void )
 	}
 }
 
+//---------------------------------------------------------------------------------------------
+static void ComputeVisionScan( IVision *&vision )
+{
+	vision->ComputeVisionScan();
+}
+
+
+//---------------------------------------------------------------------------------------------
+/**
+ * Compute the read-only perception work of every bot due to update this tick up front,
+ * spread across the job pool. Each bot's Update() then only applies the results.
+ * Results are stored per bot and consumed in think order, so they don't depend on
+ * which thread computed them.
+ */
+void NextBotManager::UpdatePerceptionParallel( void )
+{
+	VPROF_BUDGET( "NextBotManager::UpdatePerceptionParallel", "NextBot" );
+
+	m_perceptionVisionList.RemoveAll();
+
+	for( int i = m_botList.Head(); i != m_botList.InvalidIndex(); i = m_botList.Next( i ) )
+	{
+		INextBot *bot = m_botList[i];
+
+		// when throttled, only bots flagged by the scheduler above are going to update
+		if ( m_iUpdateTickrate > 0 && !bot->IsFlaggedForUpdate() )
+			continue;
+
+		if ( IsDead( bot ) )
+			continue;
+
+		// throttled vision would throw the results away
+		IVision *vision = bot->GetVisionInterface();
+		if ( vision && vision->IsScanDue() )
+		{
+			// collecting candidates may touch game state, so it stays on the main thread
+			vision->BeginVisionScan();
+			m_perceptionVisionList.AddToTail( vision );
+		}
+	}
+
+	if ( m_perceptionVisionList.Count() == 0 )
+		return;
+
+	if ( nb_update_parallel_deterministic.GetBool() )
+	{
+		FOR_EACH_VEC( m_perceptionVisionList, it )
+		{
+			m_perceptionVisionList[ it ]->ComputeVisionScan();
+		}
+	}
+	else
+	{
+		ParallelProcess( "NextBotManager::UpdatePerceptionParallel", m_perceptionVisionList.Base(), m_perceptionVisionList.Count(), &ComputeVisionScan );
+	}
+}
+
+
 //---------------------------------------------------------------------------------------------
 bool NextBotManager::ShouldUpdate( INextBot *bot )
 {
@@ -145,7 +145,10 @@ protected:
 	int Register( INextBot *bot );
 	void UnRegister( INextBot *bot );
 
+	void UpdatePerceptionParallel( void );			// compute perception for bots updating this tick on the job pool
+
 	CUtlLinkedList< INextBot * > m_botList;				// list of all active NextBots
+	CUtlVector< IVision * > m_perceptionVisionList;		// scratch list for UpdatePerceptionParallel()
 
 	int m_iUpdateTickrate;
 	double m_CurUpdateStartTime;
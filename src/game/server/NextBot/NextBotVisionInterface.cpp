@@ -18,6 +18,8 @@
 #endif
 
 #include "tier0/vprof.h"
+#include "tier1/generichash.h"
+#include "tier1/utlhashtable.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -25,6 +27,171 @@
 
 ConVar nb_blind( "nb_blind", "0", FCVAR_CHEAT, "Disable vision" );
 ConVar nb_debug_known_entities( "nb_debug_known_entities", "0", FCVAR_CHEAT, "Show the 'known entities' for the bot that is the current spectator target" );
+ConVar nb_vision_cache( "nb_vision_cache", "1", FCVAR_CHEAT, "Share line-of-sight-to-entity trace results between bots within a tick" );
+ConVar nb_vision_cache_grid( "nb_vision_cache_grid", "8", FCVAR_CHEAT, "Eye positions are snapped to a grid of this size when looking up shared line-of-sight results. 0 only shares between identical eye positions." );
+
+
+//------------------------------------------------------------------------------------------
+/**
+ * Per-tick cache of IsLineOfSightClearToEntity() results, shared by all bots.
+ * The traces ignore all actors, so the result only depends on where the trace starts
+ * and which entity it goes to - not on which bot is looking or which team it is on.
+ * Lookups are locked since vision scans may run on the job pool.
+ */
+class CNextBotVisionLOSCache
+{
+public:
+	CNextBotVisionLOSCache( void )
+	{
+		m_tick = -1;
+		m_tickHits = m_tickMisses = 0;
+		m_totalHits = m_totalMisses = 0;
+		m_totalTicks = 0;
+	}
+
+	struct Key
+	{
+		int eye[3];
+		unsigned long subject;		// EHANDLE of the subject, so a reused entindex won't match
+	};
+
+	struct Result
+	{
+		Vector visibleSpot;
+		bool isClear;
+	};
+
+	bool Find( const Key &key, Result *result )
+	{
+		AUTO_LOCK( m_mutex );
+
+		StartTick();
+
+		UtlHashHandle_t h = m_table.Find( key );
+		if ( h == m_table.InvalidHandle() )
+		{
+			++m_tickMisses;
+			return false;
+		}
+
+		++m_tickHits;
+		*result = m_table[ h ];
+		return true;
+	}
+
+	void Insert( const Key &key, const Result &result )
+	{
+		AUTO_LOCK( m_mutex );
+
+		StartTick();
+		m_table.Insert( key, result );
+	}
+
+	static void MakeKey( const Vector &eye, const CBaseEntity *subject, Key *key )
+	{
+		float grid = nb_vision_cache_grid.GetFloat();
+		if ( grid > 0.0f )
+		{
+			float invGrid = 1.0f / grid;
+			for( int i=0; i<3; ++i )
+			{
+				key->eye[i] = (int)floorf( eye[i] * invGrid );
+			}
+		}
+		else
+		{
+			// bitwise identical eye positions only
+			V_memcpy( key->eye, eye.Base(), sizeof( key->eye ) );
+		}
+
+		key->subject = subject->GetRefEHandle().ToInt();
+	}
+
+	void PrintStats( void ) const
+	{
+		unsigned int totalHits = m_totalHits + m_tickHits;
+		unsigned int totalLookups = totalHits + m_totalMisses + m_tickMisses;
+		int ticks = m_totalTicks + ( ( m_tickHits + m_tickMisses ) ? 1 : 0 );
+
+		Msg( "Vision LOS cache: %u lookups over %d ticks, %u traces saved (%.1f%%), %.1f traces saved per tick\n",
+			 totalLookups, ticks, totalHits,
+			 totalLookups ? 100.0f * totalHits / totalLookups : 0.0f,
+			 ticks ? (float)totalHits / ticks : 0.0f );
+	}
+
+	void ResetStats( void )
+	{
+		AUTO_LOCK( m_mutex );
+
+		m_tickHits = m_tickMisses = 0;
+		m_totalHits = m_totalMisses = 0;
+		m_totalTicks = 0;
+	}
+
+private:
+	void StartTick( void )
+	{
+		if ( m_tick == gpGlobals->tickcount )
+			return;
+
+		if ( m_tickHits + m_tickMisses )
+		{
+			VPROF_INCREMENT_COUNTER( "IVision LOS cache hits", m_tickHits );
+			VPROF_INCREMENT_COUNTER( "IVision LOS cache misses", m_tickMisses );
+
+			m_totalHits += m_tickHits;
+			m_totalMisses += m_tickMisses;
+			++m_totalTicks;
+		}
+
+		m_tick = gpGlobals->tickcount;
+		m_tickHits = m_tickMisses = 0;
+		m_table.RemoveAll();
+	}
+
+	struct KeyHash
+	{
+		unsigned int operator()( const Key &key ) const { return Hash16( &key ); }
+	};
+
+	struct KeyEqual
+	{
+		bool operator()( const Key &a, const Key &b ) const
+		{
+			return a.subject == b.subject && a.eye[0] == b.eye[0] && a.eye[1] == b.eye[1] && a.eye[2] == b.eye[2];
+		}
+	};
+
+	CThreadFastMutex m_mutex;
+	CUtlHashtable< Key, Result, KeyHash, KeyEqual > m_table;
+	int m_tick;
+
+	unsigned int m_tickHits;
+	unsigned int m_tickMisses;
+	unsigned int m_totalHits;
+	unsigned int m_totalMisses;
+	int m_totalTicks;
+};
+
+COMPILE_TIME_ASSERT( sizeof( CNextBotVisionLOSCache::Key ) == 16 );
+
+static CNextBotVisionLOSCache s_visionLOSCache;
+
+
+//------------------------------------------------------------------------------------------
+CON_COMMAND_F( nb_vision_cache_stats, "Show how many line-of-sight traces the shared vision cache has saved. Pass 'reset' to clear the counters.", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( args.ArgC() > 1 && !V_stricmp( args[1], "reset" ) )
+	{
+		s_visionLOSCache.ResetStats();
+		return;
+	}
+
+	s_visionLOSCache.PrintStats();
+}
 
 
 //------------------------------------------------------------------------------------------
@@ -46,6 +213,9 @@ void IVision::Reset( void )
 	m_lastVisionUpdateTimestamp = 0.0f;
 	m_primaryThreat = NULL;
 
+	m_visionScan.RemoveAll();
+	m_visionScanTick = -1;
+
 	m_FOV = GetDefaultFieldOfView();
 	m_cosHalfFOV = cos( 0.5f * m_FOV * M_PI / 180.0f );
 	
@@ -340,26 +510,26 @@ public:
 			 entity != m_vision->GetBot()->GetEntity() &&
 			 m_vision->IsAbleToSee( entity, IVision::USE_FOV ) )
 		{
-			m_recognized.AddToTail( entity );	
+			Add( entity );
 		}
 			
 		return true;
 	}
+
+	void Add( CBaseEntity *entity )
+	{
+		m_recognized.AddToTail( entity );
+		m_recognizedSet.Set( entity->entindex() );
+	}
 	
 	bool Contains( CBaseEntity *entity ) const
 	{
-		for( int i=0; i < m_recognized.Count(); ++i )
-		{
-			if ( entity->entindex() == m_recognized[ i ]->entindex() )
-			{
-				return true;
-			}
-		}
-		return false;
+		return m_recognizedSet.IsBitSet( entity->entindex() );
 	}
 	
 	IVision *m_vision;
 	CUtlVector< CBaseEntity * > m_recognized;
+	CBitVec< MAX_EDICTS > m_recognizedSet;
 };
 
 
@@ -368,18 +538,43 @@ void IVision::UpdateKnownEntities( void )
 {
 	VPROF_BUDGET( "IVision::UpdateKnownEntities", "NextBot" );
 
-	// construct set of potentially visible objects
-	CUtlVector< CBaseEntity * > potentiallyVisible;
-	CollectPotentiallyVisibleEntities( &potentiallyVisible );
-
 	// collect set of visible and recognized entities at this moment
 	CollectVisible visibleNow( this );
-	FOR_EACH_VEC( potentiallyVisible, pit )
+
+	if ( m_visionScanTick == gpGlobals->tickcount )
+	{
+		VPROF_BUDGET( "IVision::UpdateKnownEntities( collect scanned )", "NextBot" );
+
+		// line of sight was already tested this tick - just apply the checks that depend on bot state
+		FOR_EACH_VEC( m_visionScan, sit )
+		{
+			CBaseEntity *entity = m_visionScan[ sit ].m_subject;
+
+			if ( entity &&
+				 m_visionScan[ sit ].m_isInLineOfSight &&
+				 !IsIgnored( entity ) &&
+				 entity->IsAlive() &&
+				 IsVisibleEntityNoticed( entity ) )
+			{
+				visibleNow.Add( entity );
+			}
+		}
+
+		m_visionScanTick = -1;
+	}
+	else
 	{
-		VPROF_BUDGET( "IVision::UpdateKnownEntities( collect visible )", "NextBot" );
+		// construct set of potentially visible objects
+		CUtlVector< CBaseEntity * > potentiallyVisible;
+		CollectPotentiallyVisibleEntities( &potentiallyVisible );
 
-		if ( visibleNow( potentiallyVisible[ pit ] ) == false )
-			break;
+		FOR_EACH_VEC( potentiallyVisible, pit )
+		{
+			VPROF_BUDGET( "IVision::UpdateKnownEntities( collect visible )", "NextBot" );
+
+			if ( visibleNow( potentiallyVisible[ pit ] ) == false )
+				break;
+		}
 	}
 	
 	// update known set with new data
@@ -460,18 +655,15 @@ void IVision::UpdateKnownEntities( void )
 	// check for new recognizes that were not in the known set
 	{	VPROF_BUDGET( "IVision::UpdateKnownEntities( new recognizes )", "NextBot" );
 
-		int i, j;
-		for( i=0; i < visibleNow.m_recognized.Count(); ++i )
+		CBitVec< MAX_EDICTS > knownSet;
+		for( int j=0; j < m_knownEntityVector.Count(); ++j )
+		{
+			knownSet.Set( m_knownEntityVector[j].GetEntity()->entindex() );
+		}
+
+		for( int i=0; i < visibleNow.m_recognized.Count(); ++i )
 		{	
-			for( j=0; j < m_knownEntityVector.Count(); ++j )
-			{
-				if ( visibleNow.m_recognized[i] == m_knownEntityVector[j].GetEntity() )
-				{
-					break;
-				}
-			}
-			
-			if ( j == m_knownEntityVector.Count() )
+			if ( !knownSet.IsBitSet( visibleNow.m_recognized[i]->entindex() ) )
 			{
 				// recognized a previously unknown entity (emit OnSight() event after reaction time has passed)
 				CKnownEntity known( visibleNow.m_recognized[i] );
@@ -564,11 +756,78 @@ void IVision::Update( void )
 }
 
 
+//------------------------------------------------------------------------------------------
+/**
+ * Collect the entities to be tested by ComputeVisionScan().
+ * Must be called on the main thread, as collection may update cached entity lists.
+ */
+void IVision::BeginVisionScan( void )
+{
+	VPROF_BUDGET( "IVision::BeginVisionScan", "NextBot" );
+
+	m_visionScan.RemoveAll();
+	m_visionScanTick = -1;
+
+	if ( nb_blind.GetBool() )
+		return;
+
+	CUtlVector< CBaseEntity * > potentiallyVisible;
+	CollectPotentiallyVisibleEntities( &potentiallyVisible );
+
+	m_visionScan.EnsureCapacity( potentiallyVisible.Count() );
+	FOR_EACH_VEC( potentiallyVisible, pit )
+	{
+		CBaseEntity *entity = potentiallyVisible[ pit ];
+
+		// same early outs as CollectVisible, so we don't trace to entities it would skip
+		if ( entity &&
+			 !IsIgnored( entity ) &&
+			 entity->IsAlive() &&
+			 entity != GetBot()->GetEntity() )
+		{
+			VisionScanResult &result = m_visionScan[ m_visionScan.AddToTail() ];
+			result.m_subject = entity;
+			result.m_isInLineOfSight = false;
+		}
+	}
+
+	m_visionScanTick = gpGlobals->tickcount;
+}
+
+
+//------------------------------------------------------------------------------------------
+/**
+ * Test line of sight to each entity collected by BeginVisionScan().
+ * Only reads world state, so it is safe to run on a worker thread.
+ */
+void IVision::ComputeVisionScan( void )
+{
+	FOR_EACH_VEC( m_visionScan, sit )
+	{
+		CBaseEntity *entity = m_visionScan[ sit ].m_subject;
+
+		m_visionScan[ sit ].m_isInLineOfSight = entity && IsInLineOfSight( entity, USE_FOV );
+	}
+}
+
+
 //------------------------------------------------------------------------------------------
 bool IVision::IsAbleToSee( CBaseEntity *subject, FieldOfViewCheckType checkFOV, Vector *visibleSpot ) const
 {
 	VPROF_BUDGET( "IVision::IsAbleToSee", "NextBotExpensive" );
 
+	if ( !IsInLineOfSight( subject, checkFOV, visibleSpot ) )
+	{
+		return false;
+	}
+
+	return IsVisibleEntityNoticed( subject );
+}
+
+
+//------------------------------------------------------------------------------------------
+bool IVision::IsInLineOfSight( CBaseEntity *subject, FieldOfViewCheckType checkFOV, Vector *visibleSpot ) const
+{
 	if ( GetBot()->IsRangeGreaterThan( subject, GetMaxVisionRange() ) )
 	{
 		return false;
@@ -602,12 +861,7 @@ bool IVision::IsAbleToSee( CBaseEntity *subject, FieldOfViewCheckType checkFOV,
 	}
 
 	// do actual line-of-sight trace
-	if ( !IsLineOfSightClearToEntity( subject ) )
-	{
-		return false;
-	}
-
-	return IsVisibleEntityNoticed( subject );
+	return IsLineOfSightClearToEntity( subject );
 }
 
 
@@ -749,6 +1003,24 @@ bool IVision::IsLineOfSightClearToEntity( const CBaseEntity *subject, Vector *vi
 	// TODO: Use plain-old traces until querycache/etc gets integrated
 	VPROF_BUDGET( "IVision::IsLineOfSightClearToEntity", "NextBot" );
 
+	CNextBotVisionLOSCache::Key cacheKey;
+	CNextBotVisionLOSCache::Result cacheResult;
+	bool useCache = nb_vision_cache.GetBool();
+	if ( useCache )
+	{
+		CNextBotVisionLOSCache::MakeKey( GetBot()->GetBodyInterface()->GetEyePosition(), subject, &cacheKey );
+
+		if ( s_visionLOSCache.Find( cacheKey, &cacheResult ) )
+		{
+			if ( visibleSpot )
+			{
+				*visibleSpot = cacheResult.visibleSpot;
+			}
+
+			return cacheResult.isClear;
+		}
+	}
+
 	trace_t result;
 	NextBotTraceFilterIgnoreActors filter( subject, COLLISION_GROUP_NONE );
 
@@ -768,7 +1040,16 @@ bool IVision::IsLineOfSightClearToEntity( const CBaseEntity *subject, Vector *vi
 		*visibleSpot = result.endpos;
 	}
 
-	return ( result.fraction >= 1.0f && !result.startsolid );
+	bool isClear = ( result.fraction >= 1.0f && !result.startsolid );
+
+	if ( useCache )
+	{
+		cacheResult.visibleSpot = result.endpos;
+		cacheResult.isClear = isClear;
+		s_visionLOSCache.Insert( cacheKey, cacheResult );
+	}
+
+	return isClear;
 
 #endif
 }
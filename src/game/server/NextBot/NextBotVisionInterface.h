@@ -108,6 +108,26 @@ public:
 	virtual bool IsLookingAt( const Vector &pos, float cosTolerance = 0.95f ) const;					// are we looking at the given position
 	virtual bool IsLookingAt( const CBaseCombatCharacter *actor, float cosTolerance = 0.95f ) const;	// are we looking at the given actor
 
+	//-- multithreaded update support -----------------------------------------------------------
+
+	/**
+	 * The line-of-sight part of the vision scan can be computed ahead of Update() by the NextBotManager.
+	 * BeginVisionScan() collects the candidates and must be called on the main thread.
+	 * ComputeVisionScan() only reads world state and may be called on any thread.
+	 * The results are consumed by the next Update() in the same tick, which still decides
+	 * on the main thread whether each visible entity is noticed.
+	 */
+	void BeginVisionScan( void );
+	void ComputeVisionScan( void );
+
+	virtual bool IsScanDue( void ) const { return true; }		// return false if the next Update() is going to skip the scan, so it's not worth precomputing
+
+	/**
+	 * Return true if the subject is in range, in view (if requested), and not occluded.
+	 * Unlike IsAbleToSee(), does not ask whether the subject is noticed, and never changes bot state.
+	 */
+	bool IsInLineOfSight( CBaseEntity *subject, FieldOfViewCheckType checkFOV, Vector *visibleSpot = NULL ) const;
+
 private:
 	CountdownTimer m_scanTimer;			// for throttling update rate
 	
@@ -121,6 +141,14 @@ private:
 
 	float m_lastVisionUpdateTimestamp;
 	IntervalTimer m_notVisibleTimer[ MAX_TEAMS ];		// for tracking interval since last saw a member of the given team
+
+	struct VisionScanResult
+	{
+		CHandle< CBaseEntity > m_subject;
+		bool m_isInLineOfSight;
+	};
+	CUtlVector< VisionScanResult > m_visionScan;		// potentially visible entities collected by BeginVisionScan()
+	int m_visionScanTick;								// tick m_visionScan was collected on, or -1
 };
 
 inline void IVision::CollectKnownEntities( CUtlVector< CKnownEntity > *knownVector )
@@ -9,6 +9,7 @@
 #include "NextBotInterface.h"
 
 #include "tier0/vprof.h"
+#include "nav_pathsearch.h"
 
 #define PATH_NO_LENGTH_LIMIT 0.0f				// non-default argument value for Path::Compute()
 #define PATH_TRUNCATE_INCOMPLETE_PATH false		// non-default argument value for Path::Compute()
@@ -190,7 +191,17 @@ public:
 		// Compute shortest path to subject
 		//
 		CNavArea *closestArea = NULL;
-		bool pathResult = NavAreaBuildPath( startArea, subjectArea, &subjectPos, costFunc, &closestArea, maxPathLength, bot->GetEntity()->GetTeamNumber() );
+		// off the main thread (or if requested) use a reentrant search so queries can run concurrently
+		CNavPathSearch *search = CNavPathSearch::GetPathingSearch();
+		bool pathResult;
+		if ( search )
+		{
+			pathResult = search->BuildPath( startArea, subjectArea, &subjectPos, costFunc, &closestArea, maxPathLength, bot->GetEntity()->GetTeamNumber() );
+		}
+		else
+		{
+			pathResult = NavAreaBuildPath( startArea, subjectArea, &subjectPos, costFunc, &closestArea, maxPathLength, bot->GetEntity()->GetTeamNumber() );
+		}
 
 		// Failed?
 		if ( closestArea == NULL )
@@ -203,7 +214,7 @@ public:
 		// get count
 		int count = 0;
 		CNavArea *area;
-		for( area = closestArea; area; area = area->GetParent() )
+		for( area = closestArea; area; area = GetSearchParent( search, area ) )
 		{
 			++count;
 
@@ -224,11 +235,11 @@ public:
 
 		// assemble path
 		m_segmentCount = count;
-		for( area = closestArea; count && area; area = area->GetParent() )
+		for( area = closestArea; count && area; area = GetSearchParent( search, area ) )
 		{
 			--count;
 			m_path[ count ].area = area;
-			m_path[ count ].how = area->GetParentHow();
+			m_path[ count ].how = search ? search->GetParentHow( area ) : area->GetParentHow();
 			m_path[ count ].type = ON_GROUND;
 		}
 
@@ -318,7 +329,17 @@ public:
 		// Compute shortest path to goal
 		//
 		CNavArea *closestArea = NULL;
-		bool pathResult = NavAreaBuildPath( startArea, goalArea, &goal, costFunc, &closestArea, maxPathLength, bot->GetEntity()->GetTeamNumber() );
+		// off the main thread (or if requested) use a reentrant search so queries can run concurrently
+		CNavPathSearch *search = CNavPathSearch::GetPathingSearch();
+		bool pathResult;
+		if ( search )
+		{
+			pathResult = search->BuildPath( startArea, goalArea, &goal, costFunc, &closestArea, maxPathLength, bot->GetEntity()->GetTeamNumber() );
+		}
+		else
+		{
+			pathResult = NavAreaBuildPath( startArea, goalArea, &goal, costFunc, &closestArea, maxPathLength, bot->GetEntity()->GetTeamNumber() );
+		}
 
 		// Failed?
 		if ( closestArea == NULL )
@@ -331,7 +352,7 @@ public:
 		// get count
 		int count = 0;
 		CNavArea *area;
-		for( area = closestArea; area; area = area->GetParent() )
+		for( area = closestArea; area; area = GetSearchParent( search, area ) )
 		{
 			++count;
 
@@ -352,11 +373,11 @@ public:
 
 		// assemble path
 		m_segmentCount = count;
-		for( area = closestArea; count && area; area = area->GetParent() )
+		for( area = closestArea; count && area; area = GetSearchParent( search, area ) )
 		{
 			--count;
 			m_path[ count ].area = area;
-			m_path[ count ].how = area->GetParentHow();
+			m_path[ count ].how = search ? search->GetParentHow( area ) : area->GetParentHow();
 			m_path[ count ].type = ON_GROUND;
 		}
 
@@ -599,6 +620,12 @@ private:
 	int FindNextOccludedNode( INextBot *bot, int anchor );	// used by Optimize()
 
 	void InsertSegment( Segment newSegment, int i );		// insert new segment at index i
+
+	// parent links come from the search context if one was used, otherwise from the areas themselves
+	static CNavArea *GetSearchParent( const CNavPathSearch *search, const CNavArea *area )
+	{
+		return search ? search->GetParent( area ) : area->GetParent();
+	}
 	
 	mutable Vector m_pathPos;								// used by GetPosition()
 	mutable Vector m_closePos;								// used by GetClosestPosition()
@@ -99,6 +99,8 @@ bool CBaseEntity::s_bAbsQueriesValid = true;
 ConVar sv_netvisdist( "sv_netvisdist", "10000", FCVAR_CHEAT | FCVAR_DEVELOPMENTONLY, "Test networking visibility distance" );
 
 ConVar sv_script_think_interval("sv_script_think_interval", "0.1");
+ConVar sv_script_cache_functions( "sv_script_cache_functions", "0", FCVAR_NONE, "Keep entity script function handles between calls instead of looking each function up by name. Cached handles are dropped whenever script code is run, but a function replaced by assignment from inside a running script keeps calling the old one." );
+ConVar sv_script_think_batch( "sv_script_think_batch", "0", FCVAR_NONE, "Run the script thinks that are due each frame together after all entity thinks, instead of from each entity's own think." );
 
 // This table encodes edict data.
 void SendProxy_AnimTime( const SendProp *pProp, const void *pStruct, const void *pVarData, DVariant *pOut, int iElement, int objectID )
@@ -702,6 +704,13 @@ CBaseEntity *CBaseEntity::GetFollowedEntity()
 void CBaseEntity::SetClassname( const char *className )
 {
 	m_iClassname = AllocPooledString( className );
+	gEntList.ReportEntityNameChanged( this );
+}
+
+void CBaseEntity::SetName( string_t newName )
+{
+	m_iName = newName;
+	gEntList.ReportEntityNameChanged( this );
 }
 
 void CBaseEntity::SetModelIndex( int index )
@@ -3736,6 +3745,9 @@ void CBaseEntity::OnRestore()
 
 	SimThink_EntityChanged( this );
 
+	// name and classname were restored directly into the fields
+	gEntList.ReportEntityNameChanged( this );
+
 	// touchlinks get recomputed
 	if ( IsEFlagSet( EFL_CHECK_UNTOUCH ) )
 	{
@@ -7323,6 +7335,18 @@ float g_debugCounter = 0;
 // NOTE:	Assumes the function takes no parameters at the moment.
 //-----------------------------------------------------------------------------
 bool CBaseEntity::CallScriptFunction( const char *pFunctionName, ScriptVariant_t *pFunctionReturn, bool bNoDelegation )
+{
+	return CallScriptFunctionInternal( pFunctionName, pFunctionReturn, bNoDelegation, true );
+}
+
+// Depth of script function calls made through CallScriptFunctionInternal
+static int s_nScriptFunctionCallDepth = 0;
+
+//-----------------------------------------------------------------------------
+// bClearOwningInstance is false when the caller makes several calls in a row
+// and clears 'owninginstance' itself once they are done.
+//-----------------------------------------------------------------------------
+bool CBaseEntity::CallScriptFunctionInternal( const char *pFunctionName, ScriptVariant_t *pFunctionReturn, bool bNoDelegation, bool bClearOwningInstance )
 {
 	START_VMPROFILE
 
@@ -7332,8 +7356,11 @@ bool CBaseEntity::CallScriptFunction( const char *pFunctionName, ScriptVariant_t
 		return false;
 	}
 
+	// A nested call may run code that drops cached handles, so only use the cache for
+	// outermost calls where no cached function can still be running.
+	bool bCached = sv_script_cache_functions.GetBool() && s_nScriptFunctionCallDepth == 0;
 
-	HSCRIPT hFunc = m_ScriptScope.LookupFunction( pFunctionName, bNoDelegation );
+	HSCRIPT hFunc = bCached ? m_ScriptScope.LookupCachedFunction( pFunctionName, bNoDelegation ) : m_ScriptScope.LookupFunction( pFunctionName, bNoDelegation );
 
 	if( hFunc )
 	{
@@ -7342,9 +7369,17 @@ bool CBaseEntity::CallScriptFunction( const char *pFunctionName, ScriptVariant_t
 		// the entity who is connected to the output and who has this function in their scope
 		// will be set to 'owninginstance'. In this situation, it can be a different instance than 'self'.
 		g_pScriptVM->SetValue( "owninginstance", ScriptVariant_t( GetScriptInstance() ) );
+		++s_nScriptFunctionCallDepth;
 		m_ScriptScope.Call( hFunc, pFunctionReturn );
-		m_ScriptScope.ReleaseFunction( hFunc );
-		g_pScriptVM->ClearValue( "owninginstance" );
+		--s_nScriptFunctionCallDepth;
+		if ( !bCached )
+		{
+			m_ScriptScope.ReleaseFunction( hFunc );
+		}
+		if ( bClearOwningInstance )
+		{
+			g_pScriptVM->ClearValue( "owninginstance" );
+		}
 
 		UPDATE_VMPROFILE
 
@@ -7417,12 +7452,78 @@ void CBaseEntity::DisconnectOutputFromScript( const char *pszOutput, const char
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Runs all of the script thinks that come due in a frame back to back, once
+// every entity has thought, so they share one pass through the script VM setup.
+//-----------------------------------------------------------------------------
+class CScriptThinkBatch : public CAutoGameSystemPerFrame
+{
+public:
+	CScriptThinkBatch() : CAutoGameSystemPerFrame( "CScriptThinkBatch" )
+	{
+	}
+
+	void Add( CBaseEntity *pEntity )
+	{
+		m_Pending.AddToTail( pEntity );
+	}
+
+	virtual void FrameUpdatePostEntityThink()
+	{
+		if ( m_Pending.Count() == 0 )
+			return;
+
+		VPROF_BUDGET( "CScriptThinkBatch", VPROF_BUDGETGROUP_GAME );
+
+		// Swap out the list, thinks may schedule entities that are due right away
+		CUtlVector< EHANDLE > pending;
+		pending.Swap( m_Pending );
+
+		FOR_EACH_VEC( pending, i )
+		{
+			CBaseEntity *pEntity = pending[i];
+			if ( pEntity && !pEntity->IsMarkedForDeletion() )
+			{
+				pEntity->RunBatchedScriptThink();
+			}
+		}
+
+		if ( g_pScriptVM )
+		{
+			g_pScriptVM->ClearValue( "owninginstance" );
+		}
+	}
+
+	virtual void LevelShutdownPostEntity()
+	{
+		m_Pending.Purge();
+	}
+
+private:
+	CUtlVector< EHANDLE > m_Pending;
+};
+
+static CScriptThinkBatch g_ScriptThinkBatch;
+
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 void CBaseEntity::ScriptThink( void )
+{
+	if ( sv_script_think_batch.GetBool() )
+	{
+		g_ScriptThinkBatch.Add( this );
+		return;
+	}
+
+	RunScriptThink();
+}
+
+//-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+void CBaseEntity::RunScriptThink( bool bClearOwningInstance )
 {
 	ScriptVariant_t varThinkRetVal;
-	if( CallScriptFunction( m_iszScriptThinkFunction.ToCStr(), &varThinkRetVal ) )
+	if( CallScriptFunctionInternal( m_iszScriptThinkFunction.ToCStr(), &varThinkRetVal, false, bClearOwningInstance ) )
 	{
 		float flThinkFrequency = 0.0f;
 		if ( !varThinkRetVal.AssignTo( &flThinkFrequency ) )
@@ -7439,6 +7540,23 @@ void CBaseEntity::ScriptThink( void )
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Called by CScriptThinkBatch later in the frame that ScriptThink() was due.
+//-----------------------------------------------------------------------------
+void CBaseEntity::RunBatchedScriptThink()
+{
+	// Skip the think if script cancelled or rescheduled it since it was queued
+	int iIndex = GetIndexForThinkContext( "ScriptThink" );
+	if ( iIndex == NO_THINK_CONTEXT )
+		return;
+
+	if ( m_aThinkFunctions[ iIndex ].m_pfnThink != static_cast< BASEPTR >( &CBaseEntity::ScriptThink ) ||
+		 m_aThinkFunctions[ iIndex ].m_nNextThinkTick != TICK_NEVER_THINK )
+		return;
+
+	RunScriptThink( false );
+}
+
 
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
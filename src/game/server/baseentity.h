@@ -1252,9 +1252,12 @@ public:
 	bool ValidateScriptScope();
 	virtual void RunVScripts();
 	bool CallScriptFunction( const char *pFunctionName, ScriptVariant_t *pFunctionReturn, bool bNoDelegation = false );
+	bool CallScriptFunctionInternal( const char *pFunctionName, ScriptVariant_t *pFunctionReturn, bool bNoDelegation, bool bClearOwningInstance );
 	void ConnectOutputToScript( const char *pszOutput, const char *pszScriptFunc );
 	void DisconnectOutputFromScript( const char *pszOutput, const char *pszScriptFunc );
 	void ScriptThink( );
+	void RunScriptThink( bool bClearOwningInstance = true );
+	void RunBatchedScriptThink();
 	const char *GetScriptId();
 	const char *GetScriptThinkFunc();
 	HSCRIPT GetScriptScope();
@@ -2167,10 +2170,6 @@ inline const char *CBaseEntity::GetPreTemplateName()
 	return szStrippedName;
 }
 
-inline void CBaseEntity::SetName( string_t newName )
-{
-	m_iName = newName;
-}
 
 
 inline bool CBaseEntity::NameMatches( const char *pszNameOrWildcard )
@@ -0,0 +1,185 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Counts how often changed edicts need a full send table compare
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "cbase.h"
+#include "edictchangestats.h"
+#include "server_class.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#ifdef EDICT_CHANGE_STATS
+
+// Checked inline by CBaseEdict::StateChanged, so NetworkVar writes don't pay for a call while this is off
+bool g_bEdictChangeStats = false;
+
+static void OnNetPropChangeStatsChanged( IConVar *var, const char *pOldValue, float flOldValue )
+{
+	g_bEdictChangeStats = ( (ConVar *)var )->GetBool();
+}
+
+ConVar sv_netprop_change_stats_enable( "sv_netprop_change_stats_enable", "0", 0, "Count how often changed edicts overflow the engine's change offset list, see sv_netprop_change_stats.", OnNetPropChangeStatsChanged );
+
+CEdictChangeStats g_EdictChangeStats;
+
+
+//-----------------------------------------------------------------------------
+// Called by CBaseEdict::StateChanged.
+//-----------------------------------------------------------------------------
+void EdictChangeStats_StateChanged( CBaseEdict *pEdict, EdictFullChange_t reason )
+{
+	g_EdictChangeStats.StateChanged( pEdict, reason );
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose:
+//-----------------------------------------------------------------------------
+CEdictChangeStats::CEdictChangeStats()
+{
+	m_pEdictFrames = NULL;
+	ResetStats();
+}
+
+CEdictChangeStats::~CEdictChangeStats()
+{
+	delete [] m_pEdictFrames;
+}
+
+
+//-----------------------------------------------------------------------------
+CEdictChangeStats::ClassStats_t *CEdictChangeStats::FindClassStats( ServerClass *pClass )
+{
+	int iClass = pClass->m_ClassID;
+	if ( iClass < 0 )
+		return NULL;
+
+	while ( iClass >= m_ClassStats.Count() )
+	{
+		ClassStats_t &stats = m_ClassStats[ m_ClassStats.AddToTail() ];
+		memset( &stats, 0, sizeof( stats ) );
+	}
+
+	ClassStats_t *pStats = &m_ClassStats[iClass];
+	if ( pStats->m_pClass != pClass )
+	{
+		memset( pStats, 0, sizeof( *pStats ) );
+		pStats->m_pClass = pClass;
+	}
+
+	return pStats;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Counts each edict once per frame, and each reason it needed a full
+//			compare once per frame.
+//-----------------------------------------------------------------------------
+void CEdictChangeStats::StateChanged( CBaseEdict *pEdict, EdictFullChange_t reason )
+{
+	if ( !g_pSharedChangeInfo )
+		return;
+
+	int iEdict = pEdict->m_EdictIndex;
+	if ( iEdict < 0 || iEdict >= MAX_EDICTS )
+		return;
+
+	if ( !m_pEdictFrames )
+	{
+		m_pEdictFrames = new EdictFrame_t[ MAX_EDICTS ];
+		memset( m_pEdictFrames, 0, MAX_EDICTS * sizeof( EdictFrame_t ) );
+	}
+
+	ServerClass *pClass = pEdict->m_pNetworkable ? pEdict->m_pNetworkable->GetServerClass() : NULL;
+	ClassStats_t *pStats = pClass ? FindClassStats( pClass ) : NULL;
+
+	EdictFrame_t *pFrame = &m_pEdictFrames[iEdict];
+	if ( pFrame->m_iSerialNumber != g_pSharedChangeInfo->m_iSerialNumber || pFrame->m_pNetworkable != pEdict->m_pNetworkable )
+	{
+		pFrame->m_iSerialNumber = g_pSharedChangeInfo->m_iSerialNumber;
+		pFrame->m_pNetworkable = pEdict->m_pNetworkable;
+		pFrame->m_nCounted = 0;
+
+		m_nChanged++;
+		if ( pStats )
+		{
+			pStats->m_nChanged++;
+		}
+	}
+
+	if ( reason == EDICT_FULL_CHANGE_NONE || ( pFrame->m_nCounted & ( 1 << reason ) ) )
+		return;
+
+	pFrame->m_nCounted |= ( 1 << reason );
+
+	m_nFullChanges[reason]++;
+	if ( pStats )
+	{
+		pStats->m_nFullChanges[reason]++;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Stats
+//-----------------------------------------------------------------------------
+void CEdictChangeStats::ResetStats()
+{
+	m_nChanged = 0;
+	memset( m_nFullChanges, 0, sizeof( m_nFullChanges ) );
+
+	for ( int i = 0; i < m_ClassStats.Count(); i++ )
+	{
+		m_ClassStats[i].m_nChanged = 0;
+		memset( m_ClassStats[i].m_nFullChanges, 0, sizeof( m_ClassStats[i].m_nFullChanges ) );
+	}
+}
+
+static float ChangePercent( int n, int nTotal )
+{
+	return nTotal ? 100.0f * n / nTotal : 0.0f;
+}
+
+void CEdictChangeStats::PrintStats()
+{
+	if ( !g_bEdictChangeStats )
+	{
+		Msg( "sv_netprop_change_stats_enable is 0, nothing is being counted.\n" );
+	}
+
+	Msg( "%d edict changes\n", m_nChanged );
+	Msg( "  StateChanged() without offset: %d (%.1f%%)\n", m_nFullChanges[EDICT_FULL_CHANGE_EXPLICIT], ChangePercent( m_nFullChanges[EDICT_FULL_CHANGE_EXPLICIT], m_nChanged ) );
+	Msg( "  more than %d offsets: %d (%.1f%%)\n", MAX_CHANGE_OFFSETS, m_nFullChanges[EDICT_FULL_CHANGE_OFFSET_LIMIT], ChangePercent( m_nFullChanges[EDICT_FULL_CHANGE_OFFSET_LIMIT], m_nChanged ) );
+	Msg( "  more than %d changed edicts: %d (%.1f%%)\n", MAX_EDICT_CHANGE_INFOS, m_nFullChanges[EDICT_FULL_CHANGE_INFO_LIMIT], ChangePercent( m_nFullChanges[EDICT_FULL_CHANGE_INFO_LIMIT], m_nChanged ) );
+
+	Msg( "\n%-32s %8s %8s %8s %8s\n", "class", "changed", "explicit", "offsets", "edicts" );
+	for ( int i = 0; i < m_ClassStats.Count(); i++ )
+	{
+		const ClassStats_t &stats = m_ClassStats[i];
+		if ( !stats.m_pClass || !stats.m_nChanged )
+			continue;
+
+		Msg( "%-32s %8d %8d %8d %8d\n", stats.m_pClass->GetName(), stats.m_nChanged,
+			stats.m_nFullChanges[EDICT_FULL_CHANGE_EXPLICIT], stats.m_nFullChanges[EDICT_FULL_CHANGE_OFFSET_LIMIT], stats.m_nFullChanges[EDICT_FULL_CHANGE_INFO_LIMIT] );
+	}
+}
+
+CON_COMMAND( sv_netprop_change_stats, "Print how often changed edicts needed a full send table compare. Pass 'reset' to clear the counts." )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( args.ArgC() > 1 && !V_stricmp( args[1], "reset" ) )
+	{
+		g_EdictChangeStats.ResetStats();
+		return;
+	}
+
+	g_EdictChangeStats.PrintStats();
+}
+
+#endif // EDICT_CHANGE_STATS
@@ -0,0 +1,74 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Counts how often changed edicts need a full send table compare
+//
+// $NoKeywords: $
+//=============================================================================//
+// CBaseEdict::StateChanged( offset ) records changed offsets in the engine's shared
+// CEdictChangeInfo, which only has room for MAX_CHANGE_OFFSETS of them per edict and
+// MAX_EDICT_CHANGE_INFOS edicts per frame. Past either limit the edict is compared prop
+// by prop in full. CEdictChangeStats counts how often that happens, per server class,
+// so the limits can be tuned against real games.
+//
+// Only built when EDICT_CHANGE_STATS is defined (see edict.h).
+
+#ifndef EDICTCHANGESTATS_H
+#define EDICTCHANGESTATS_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "edict.h"
+#include "utlvector.h"
+
+#ifdef EDICT_CHANGE_STATS
+
+class ServerClass;
+
+//-----------------------------------------------------------------------------
+// Purpose:
+//-----------------------------------------------------------------------------
+class CEdictChangeStats
+{
+public:
+	CEdictChangeStats();
+	~CEdictChangeStats();
+
+	void StateChanged( CBaseEdict *pEdict, EdictFullChange_t reason );
+
+	void PrintStats();
+	void ResetStats();
+
+private:
+	struct ClassStats_t
+	{
+		ServerClass *m_pClass;
+
+		// Edicts of this class that changed, and why the engine had to compare all of their props.
+		int m_nChanged;
+		int m_nFullChanges[ EDICT_FULL_CHANGE_COUNT ];
+	};
+
+	// What has already been counted for an edict this frame
+	struct EdictFrame_t
+	{
+		unsigned short m_iSerialNumber;			// g_pSharedChangeInfo serial this belongs to
+		unsigned char m_nCounted;				// ( 1 << reason ) for each full change reason counted
+		IServerNetworkable *m_pNetworkable;
+	};
+
+	ClassStats_t *FindClassStats( ServerClass *pClass );
+
+	CUtlVector< ClassStats_t > m_ClassStats;		// indexed by ServerClass::m_ClassID
+	EdictFrame_t *m_pEdictFrames;					// MAX_EDICTS entries, allocated on first use
+
+	// Totals since the last reset.
+	int m_nChanged;
+	int m_nFullChanges[ EDICT_FULL_CHANGE_COUNT ];
+};
+
+extern CEdictChangeStats g_EdictChangeStats;
+
+#endif // EDICT_CHANGE_STATS
+
+#endif // EDICTCHANGESTATS_H
@@ -290,10 +290,188 @@ CBaseEntityClassList::~CBaseEntityClassList()
 {
 }
 
+ConVar ent_find_index( "ent_find_index", "1", 0, "Use the name/classname index for entity searches by exact name or classname." );
+ConVar ent_find_index_verify( "ent_find_index_verify", "0", FCVAR_CHEAT, "Compare every indexed entity search against a full scan of the entity list and warn on mismatches." );
+
 CGlobalEntityList::CGlobalEntityList()
 {
 	m_iHighestEnt = m_iNumEnts = m_iNumEdicts = 0;
 	m_bClearingEntities = false;
+	m_nNextIndexSerial = 0;
+	m_bSkipIndex = false;
+	V_memset( m_EntityIndexInfo, 0, sizeof( m_EntityIndexInfo ) );
+}
+
+
+//-----------------------------------------------------------------------------
+// Name/classname index
+//-----------------------------------------------------------------------------
+int CEntityStringIndex::FirstAfter( const Bucket_t &bucket, unsigned int nSerial )
+{
+	int lo = 0;
+	int hi = bucket.Count();
+	while ( lo < hi )
+	{
+		int mid = ( lo + hi ) >> 1;
+		if ( bucket[mid].m_nSerial <= nSerial )
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+void CEntityStringIndex::Insert( string_t key, unsigned int nSerial, CBaseEntity *pEntity )
+{
+	if ( key == NULL_STRING )
+		return;
+
+	UtlHashHandle_t h = m_BucketLookup.Find( STRING( key ) );
+	if ( h == m_BucketLookup.InvalidHandle() )
+	{
+		h = m_BucketLookup.Insert( STRING( key ), m_Buckets.AddToTail() );
+	}
+
+	// entities are usually named right after creation, so this is almost always an append
+	Bucket_t &bucket = m_Buckets[ m_BucketLookup[h] ];
+	int i = FirstAfter( bucket, nSerial );
+	bucket.InsertBefore( i );
+	bucket[i].m_nSerial = nSerial;
+	bucket[i].m_pEntity = pEntity;
+}
+
+void CEntityStringIndex::Remove( string_t key, unsigned int nSerial )
+{
+	if ( key == NULL_STRING )
+		return;
+
+	UtlHashHandle_t h = m_BucketLookup.Find( STRING( key ) );
+	if ( h == m_BucketLookup.InvalidHandle() )
+	{
+		Assert( 0 );
+		return;
+	}
+
+	// empty buckets are kept, the same strings tend to get reused
+	Bucket_t &bucket = m_Buckets[ m_BucketLookup[h] ];
+	int i = FirstAfter( bucket, nSerial ) - 1;
+	if ( i >= 0 && bucket[i].m_nSerial == nSerial )
+	{
+		bucket.Remove( i );
+	}
+	else
+	{
+		Assert( 0 );
+	}
+}
+
+const CEntityStringIndex::Bucket_t *CEntityStringIndex::Find( string_t key ) const
+{
+	UtlHashHandle_t h = m_BucketLookup.Find( STRING( key ) );
+	if ( h == m_BucketLookup.InvalidHandle() )
+		return NULL;
+
+	return &m_Buckets[ m_BucketLookup[h] ];
+}
+
+void CEntityStringIndex::Purge()
+{
+	m_BucketLookup.Purge();
+	m_Buckets.Purge();
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns true if a search for szName can use the index, and the
+//			pooled key to search for. Wildcard searches need a full scan.
+//			The game string pool is case insensitive just like NamesMatch(),
+//			and entities are filed under the pooled copy of their name, so an
+//			exact name never matches anything but its own pooled string.
+//-----------------------------------------------------------------------------
+bool CGlobalEntityList::GetIndexKey( const char *szName, string_t *pKey ) const
+{
+	if ( m_bSkipIndex || !ent_find_index.GetBool() )
+		return false;
+
+	if ( !szName || !szName[0] || V_strchr( szName, '*' ) )
+		return false;
+
+	*pKey = FindPooledString( szName );
+	return true;
+}
+
+CBaseEntity *CGlobalEntityList::FindEntityInIndex( const CEntityStringIndex &index, string_t key, CBaseEntity *pStartEntity, IEntityFindFilter *pFilter )
+{
+	// a string that was never pooled can't be anybody's name
+	if ( key == NULL_STRING )
+		return NULL;
+
+	const CEntityStringIndex::Bucket_t *pBucket = index.Find( key );
+	if ( !pBucket )
+		return NULL;
+
+	unsigned int nStartSerial = pStartEntity ? m_EntityIndexInfo[ pStartEntity->GetRefEHandle().GetEntryIndex() ].m_nSerial : 0;
+	for ( int i = CEntityStringIndex::FirstAfter( *pBucket, nStartSerial ); i < pBucket->Count(); i++ )
+	{
+		CBaseEntity *pEntity = pBucket->Element( i ).m_pEntity;
+		if ( pFilter && !pFilter->ShouldFindEntity( pEntity ) )
+			continue;
+
+		return pEntity;
+	}
+
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Names aren't always pooled (MAKE_STRING on a member buffer is
+//			common), so entities are filed under the pooled copy of the string
+//-----------------------------------------------------------------------------
+static string_t GetPooledIndexKey( string_t iszName )
+{
+	if ( iszName == NULL_STRING )
+		return NULL_STRING;
+
+	return AllocPooledString( STRING( iszName ) );
+}
+
+void CGlobalEntityList::ReportEntityNameChanged( CBaseEntity *pEntity )
+{
+	// entities get named and classed before and after they are in the list, only track them while they are
+	CBaseHandle hEnt = pEntity->GetRefEHandle();
+	if ( hEnt == INVALID_EHANDLE || LookupEntity( hEnt ) != pEntity )
+		return;
+
+	EntityIndexInfo_t &info = m_EntityIndexInfo[ hEnt.GetEntryIndex() ];
+
+	string_t iszName = pEntity->GetEntityName();
+	if ( info.m_iName != iszName )
+	{
+		string_t iszKey = GetPooledIndexKey( iszName );
+		if ( info.m_iNameKey != iszKey )
+		{
+			m_NameIndex.Remove( info.m_iNameKey, info.m_nSerial );
+			m_NameIndex.Insert( iszKey, info.m_nSerial, pEntity );
+			info.m_iNameKey = iszKey;
+		}
+		info.m_iName = iszName;
+	}
+
+	if ( info.m_iClassname != pEntity->m_iClassname )
+	{
+		string_t iszKey = GetPooledIndexKey( pEntity->m_iClassname );
+		if ( info.m_iClassnameKey != iszKey )
+		{
+			m_ClassnameIndex.Remove( info.m_iClassnameKey, info.m_nSerial );
+			m_ClassnameIndex.Insert( iszKey, info.m_nSerial, pEntity );
+			info.m_iClassnameKey = iszKey;
+		}
+		info.m_iClassname = pEntity->m_iClassname;
+	}
 }
 
 
@@ -481,6 +659,23 @@ bool CGlobalEntityList::IsEntityPtr( void *pTest )
 //-----------------------------------------------------------------------------
 CBaseEntity *CGlobalEntityList::FindEntityByClassname( CBaseEntity *pStartEntity, const char *szName, IEntityFindFilter *pFilter )
 {
+	string_t iszName;
+	if ( GetIndexKey( szName, &iszName ) )
+	{
+		CBaseEntity *pResult = FindEntityInIndex( m_ClassnameIndex, iszName, pStartEntity, pFilter );
+		if ( ent_find_index_verify.GetBool() )
+		{
+			m_bSkipIndex = true;
+			CBaseEntity *pScanResult = FindEntityByClassname( pStartEntity, szName, pFilter );
+			m_bSkipIndex = false;
+			if ( pScanResult != pResult )
+			{
+				Warning( "FindEntityByClassname( \"%s\" ): index found %d, scan found %d\n", szName, pResult ? pResult->entindex() : -1, pScanResult ? pScanResult->entindex() : -1 );
+			}
+		}
+		return pResult;
+	}
+
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
 	for ( ;pInfo; pInfo = pInfo->m_pNext )
@@ -595,6 +790,23 @@ CBaseEntity *CGlobalEntityList::FindEntityByName( CBaseEntity *pStartEntity, con
 
 		return NULL;
 	}
+
+	string_t iszName;
+	if ( GetIndexKey( szName, &iszName ) )
+	{
+		CBaseEntity *pResult = FindEntityInIndex( m_NameIndex, iszName, pStartEntity, pFilter );
+		if ( ent_find_index_verify.GetBool() )
+		{
+			m_bSkipIndex = true;
+			CBaseEntity *pScanResult = FindEntityByName( pStartEntity, szName, pSearchingEntity, pActivator, pCaller, pFilter );
+			m_bSkipIndex = false;
+			if ( pScanResult != pResult )
+			{
+				Warning( "FindEntityByName( \"%s\" ): index found %d, scan found %d\n", szName, pResult ? pResult->entindex() : -1, pScanResult ? pScanResult->entindex() : -1 );
+			}
+		}
+		return pResult;
+	}
 	
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
@@ -1125,6 +1337,17 @@ void CGlobalEntityList::OnAddEntity( IHandleEntity *pEnt, CBaseHandle handle )
 	CBaseEntity *pBaseEnt = static_cast<IServerUnknown*>(pEnt)->GetBaseEntity();
 	if ( pBaseEnt->edict() )
 		m_iNumEdicts++;
+
+	// entities are always appended to the list, so the serial orders them the same way the list does.
+	// Most are already classed (and some named) by now, so file them under what they have; later
+	// changes come through ReportEntityNameChanged().
+	EntityIndexInfo_t &info = m_EntityIndexInfo[ handle.GetEntryIndex() ];
+	info.m_iName = NULL_STRING;
+	info.m_iClassname = NULL_STRING;
+	info.m_iNameKey = NULL_STRING;
+	info.m_iClassnameKey = NULL_STRING;
+	info.m_nSerial = ++m_nNextIndexSerial;
+	ReportEntityNameChanged( pBaseEnt );
 	
 	// NOTE: Must be a CBaseEntity on server
 	Assert( pBaseEnt );
@@ -1158,6 +1381,14 @@ void CGlobalEntityList::OnRemoveEntity( IHandleEntity *pEnt, CBaseHandle handle
 	if ( pBaseEnt->edict() )
 		m_iNumEdicts--;
 
+	EntityIndexInfo_t &info = m_EntityIndexInfo[ handle.GetEntryIndex() ];
+	m_NameIndex.Remove( info.m_iNameKey, info.m_nSerial );
+	m_ClassnameIndex.Remove( info.m_iClassnameKey, info.m_nSerial );
+	info.m_iName = NULL_STRING;
+	info.m_iClassname = NULL_STRING;
+	info.m_iNameKey = NULL_STRING;
+	info.m_iClassnameKey = NULL_STRING;
+
 	m_iNumEnts--;
 }
 
@@ -1667,3 +1898,153 @@ CON_COMMAND(report_simthinklist, "Lists all simulating/thinking entities")
 	list.ReportEntityList();
 }
 
+
+//-----------------------------------------------------------------------------
+// Purpose: Times name and classname searches with and without the lookup index
+//			against a batch of temporary logical entities.
+//-----------------------------------------------------------------------------
+static double TimeEntitySearches( int nNames, int nPasses )
+{
+	double flStart = Plat_FloatTime();
+
+	char szName[64];
+	for ( int iPass = 0; iPass < nPasses; iPass++ )
+	{
+		for ( int i = 0; i < nNames; i++ )
+		{
+			V_snprintf( szName, sizeof( szName ), "ent_bench_%d", i );
+			CBaseEntity *pEntity = NULL;
+			while ( ( pEntity = gEntList.FindEntityByName( pEntity, szName ) ) != NULL )
+			{
+			}
+		}
+
+		// a name nobody has, typical of outputs targeting removed entities
+		gEntList.FindEntityByName( NULL, "ent_bench_missing" );
+		gEntList.FindEntityByClassnameNearest( "logic_relay", vec3_origin, 0.0f );
+	}
+
+	return Plat_FloatTime() - flStart;
+}
+
+CON_COMMAND_F( ent_bench_find, "Benchmark entity searches by name and classname. Arguments: [entity count] [passes]", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	int nEntities = ( args.ArgC() > 1 ) ? atoi( args[1] ) : 1500;
+	int nPasses = ( args.ArgC() > 2 ) ? atoi( args[2] ) : 10;
+	nEntities = clamp( nEntities, 1, NUM_ENT_ENTRIES / 2 - gEntList.NumberOfEntities() );
+	nPasses = MAX( nPasses, 1 );
+
+	// four entities per name, like relays sharing a targetname
+	const int nPerName = 4;
+	int nNames = ( nEntities + nPerName - 1 ) / nPerName;
+
+	CUtlVector< CBaseEntity * > entities;
+	char szName[64];
+	for ( int i = 0; i < nEntities; i++ )
+	{
+		CBaseEntity *pEntity = CreateEntityByName( "logic_relay" );
+		if ( !pEntity )
+			break;
+
+		V_snprintf( szName, sizeof( szName ), "ent_bench_%d", i / nPerName );
+		pEntity->SetName( AllocPooledString( szName ) );
+		entities.AddToTail( pEntity );
+	}
+
+	bool bIndexWasEnabled = ent_find_index.GetBool();
+
+	ent_find_index.SetValue( 0 );
+	double flScanTime = TimeEntitySearches( nNames, nPasses );
+
+	ent_find_index.SetValue( 1 );
+	double flIndexTime = TimeEntitySearches( nNames, nPasses );
+
+	ent_find_index.SetValue( bIndexWasEnabled );
+
+	int nQueries = nPasses * ( nNames + 2 );
+	Msg( "ent_bench_find: %d entities in list, %d temporary, %d searches\n", gEntList.NumberOfEntities(), entities.Count(), nQueries );
+	Msg( "  full scan: %8.3f ms (%.3f us/search)\n", flScanTime * 1000.0, flScanTime * 1000000.0 / nQueries );
+	Msg( "  index:     %8.3f ms (%.3f us/search)\n", flIndexTime * 1000.0, flIndexTime * 1000000.0 / nQueries );
+
+	FOR_EACH_VEC( entities, i )
+	{
+		UTIL_Remove( entities[i] );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Checks that indexed searches find entities created by code as well
+//			as everything already in the list.
+//-----------------------------------------------------------------------------
+static bool IsFoundByClassname( CBaseEntity *pTarget )
+{
+	CBaseEntity *pEntity = NULL;
+	while ( ( pEntity = gEntList.FindEntityByClassname( pEntity, pTarget->GetClassname() ) ) != NULL )
+	{
+		if ( pEntity == pTarget )
+			return true;
+	}
+	return false;
+}
+
+static bool IsFoundByName( CBaseEntity *pTarget )
+{
+	CBaseEntity *pEntity = NULL;
+	while ( ( pEntity = gEntList.FindEntityByName( pEntity, pTarget->GetEntityName() ) ) != NULL )
+	{
+		if ( pEntity == pTarget )
+			return true;
+	}
+	return false;
+}
+
+static int CheckEntityIndexed( CBaseEntity *pEntity )
+{
+	int nFailed = 0;
+	if ( pEntity->m_iClassname != NULL_STRING && !IsFoundByClassname( pEntity ) )
+	{
+		Warning( "ent_find_index_check: #%d (%s) not found by classname\n", pEntity->entindex(), pEntity->GetClassname() );
+		nFailed++;
+	}
+
+	// procedural and wildcard names don't go through the index
+	const char *pszName = STRING( pEntity->GetEntityName() );
+	if ( pszName && pszName[0] && pszName[0] != '!' && !V_strchr( pszName, '*' ) && !IsFoundByName( pEntity ) )
+	{
+		Warning( "ent_find_index_check: #%d (%s) not found by name '%s'\n", pEntity->entindex(), pEntity->GetClassname(), pszName );
+		nFailed++;
+	}
+	return nFailed;
+}
+
+CON_COMMAND_F( ent_find_index_check, "Creates an entity by name and checks the name/classname index finds it, then checks every entity in the list.", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	bool bIndexWasEnabled = ent_find_index.GetBool();
+	ent_find_index.SetValue( 1 );
+
+	int nFailed = 0;
+	CBaseEntity *pEntity = CreateEntityByName( "logic_relay" );
+	if ( pEntity )
+	{
+		pEntity->SetName( AllocPooledString( "ent_find_index_check" ) );
+		nFailed += CheckEntityIndexed( pEntity );
+		UTIL_Remove( pEntity );
+	}
+
+	int nChecked = 0;
+	for ( CBaseEntity *pCheck = gEntList.FirstEnt(); pCheck; pCheck = gEntList.NextEnt( pCheck ) )
+	{
+		nFailed += CheckEntityIndexed( pCheck );
+		nChecked++;
+	}
+
+	ent_find_index.SetValue( bIndexWasEnabled );
+
+	Msg( "ent_find_index_check: %d entities checked, %d failed lookups\n", nChecked, nFailed );
+}
@@ -14,6 +14,7 @@
 #endif
 
 #include "baseentity.h"
+#include "tier1/utlhashtable.h"
 
 class IEntityListener;
 
@@ -66,6 +67,35 @@ public:
 	virtual CBaseEntity *GetFilterResult( void ) = 0;
 };
 
+//-----------------------------------------------------------------------------
+// Purpose: Maps a pooled string to the entities using it. Each bucket is kept
+//			sorted by the order the entities were added to the entity list, so
+//			walking a bucket visits entities in the same order as walking the
+//			list itself.
+//-----------------------------------------------------------------------------
+class CEntityStringIndex
+{
+public:
+	struct Entry_t
+	{
+		unsigned int m_nSerial;		// position in the entity list, see CGlobalEntityList::OnAddEntity
+		CBaseEntity *m_pEntity;
+	};
+	typedef CUtlVector< Entry_t > Bucket_t;
+
+	void Insert( string_t key, unsigned int nSerial, CBaseEntity *pEntity );
+	void Remove( string_t key, unsigned int nSerial );
+	const Bucket_t *Find( string_t key ) const;
+	void Purge();
+
+	// returns the index of the first entry added after nSerial
+	static int FirstAfter( const Bucket_t &bucket, unsigned int nSerial );
+
+private:
+	CUtlHashtable< const void *, int > m_BucketLookup;
+	CUtlVector< Bucket_t > m_Buckets;
+};
+
 //-----------------------------------------------------------------------------
 // Purpose: a global list of all the entities in the game.  All iteration through
 //			entities is done through this object.
@@ -81,6 +111,24 @@ private:
 	bool m_bClearingEntities;
 	CUtlVector<IEntityListener *>	m_entityListeners;
 
+	// name and classname lookup index
+	struct EntityIndexInfo_t
+	{
+		string_t m_iName;			// name and classname as of the last report
+		string_t m_iClassname;
+		string_t m_iNameKey;		// pooled copies of them, which the entity is filed under
+		string_t m_iClassnameKey;
+		unsigned int m_nSerial;
+	};
+	EntityIndexInfo_t m_EntityIndexInfo[NUM_ENT_ENTRIES];
+	unsigned int m_nNextIndexSerial;
+	CEntityStringIndex m_NameIndex;
+	CEntityStringIndex m_ClassnameIndex;
+	bool m_bSkipIndex;			// forces a full scan, for verification and benchmarking
+
+	CBaseEntity *FindEntityInIndex( const CEntityStringIndex &index, string_t key, CBaseEntity *pStartEntity, IEntityFindFilter *pFilter );
+	bool GetIndexKey( const char *szName, string_t *pKey ) const;
+
 public:
 	IServerNetworkable* GetServerNetworkable( CBaseHandle hEnt ) const;
 	CBaseNetworkable* GetBaseNetworkable( CBaseHandle hEnt ) const;
@@ -108,6 +156,9 @@ public:
 
 	void ReportEntityFlagsChanged( CBaseEntity *pEntity, unsigned int flagsOld, unsigned int flagsNow );
 
+	// call after changing an entity's name or classname, keeps the lookup index current
+	void ReportEntityNameChanged( CBaseEntity *pEntity );
+
 	// entity is about to be removed, notify the listeners
 	void NotifyCreateEntity( CBaseEntity *pEnt );
 	void NotifySpawn( CBaseEntity *pEnt );
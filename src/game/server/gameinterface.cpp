@@ -41,6 +41,7 @@
 #include "physics_saverestore.h"
 #include "achievement_saverestore.h"
 #include "tier0/vprof.h"
+#include "vstdlib/jobthread.h"
 #include "effect_dispatch_data.h"
 #include "engine/IStaticPropMgr.h"
 #include "TemplateEntities.h"
@@ -205,6 +206,8 @@ static ConVar s_UseNetworkVars( "UseNetworkVars", "1", FCVAR_CHEAT, "For profili
 extern ConVar sv_noclipduringpause;
 ConVar sv_massreport( "sv_massreport", "0" );
 ConVar sv_force_transmit_ents( "sv_force_transmit_ents", "0", FCVAR_CHEAT | FCVAR_DEVELOPMENTONLY, "Will transmit all entities to client, regardless of PVS conditions (will still skip based on transmit flags, however)." );
+ConVar sv_parallel_checktransmit( "sv_parallel_checktransmit", "0", 0, "Evaluate entity PVS visibility for each client on the job thread pool before running the transmit rules." );
+ConVar sv_parallel_checktransmit_minents( "sv_parallel_checktransmit_minents", "512", 0, "Minimum number of PVS-checked entities before sv_parallel_checktransmit uses the job pool." );
 
 ConVar sv_autosave( "sv_autosave", "1", 0, "Set to 1 to autosave game on level transition. Does not affect autosave triggers." );
 ConVar *sv_maxreplay = NULL;
@@ -2477,8 +2480,132 @@ inline void CServerNetworkProperty::CheckTransmit( CCheckTransmitInfo *pInfo )
 	}
 } */
 
+//-----------------------------------------------------------------------------
+// Parallel CheckTransmit support.
+//
+// The engine calls CheckTransmit once per client with the same edict list. The
+// first call of a tick brings the PVS information of every PVS-checked entity up
+// to date and records them in a shared candidate list. Every client then tests
+// the candidates against its own PVS and areas on the job pool, writing into a
+// per-client result table, before the usual (serial) transmit rules run and
+// pick the results up instead of calling IsInPVS themselves.
+//-----------------------------------------------------------------------------
+enum TransmitPVSResult_t
+{
+	TRANSMIT_PVS_UNKNOWN = 0,
+	TRANSMIT_PVS_VISIBLE,
+	TRANSMIT_PVS_HIDDEN,
+};
+
+class CTransmitPVSCache
+{
+public:
+	CTransmitPVSCache()
+	{
+		m_nTick = -1;
+		m_pEdictIndices = NULL;
+		m_nEdicts = 0;
+		m_pInfo = NULL;
+		m_pBaseEdict = NULL;
+	}
+
+	// Rebuilds the shared candidate list if this is the first call for this tick / edict list
+	void Update( edict_t *pBaseEdict, const unsigned short *pEdictIndices, int nEdicts )
+	{
+		if ( m_nTick == gpGlobals->tickcount && m_pEdictIndices == pEdictIndices && m_nEdicts == nEdicts )
+			return;
+
+		m_nTick = gpGlobals->tickcount;
+		m_pEdictIndices = pEdictIndices;
+		m_nEdicts = nEdicts;
+		m_pBaseEdict = pBaseEdict;
+		m_Candidates.RemoveAll();
+
+		for ( int i=0; i < nEdicts; i++ )
+		{
+			int iEdict = pEdictIndices[i];
+			edict_t *pEdict = &pBaseEdict[iEdict];
+			if ( !( pEdict->m_fStateFlags & FL_EDICT_PVSCHECK ) || ( pEdict->m_fStateFlags & FL_EDICT_DONTSEND ) )
+				continue;
+
+			CServerNetworkProperty *netProp = static_cast<CServerNetworkProperty*>( pEdict->GetNetworkable() );
+			if ( !netProp )
+				continue;
+
+			// worker threads must only read PVS information, so resolve it here
+			netProp->RecomputePVSInformation();
+			m_Candidates.AddToTail( iEdict );
+		}
+	}
+
+	int CandidateCount() const { return m_Candidates.Count(); }
+
+	// Tests all candidates against this client's PVS on the job pool
+	void ComputeVisibility( const CCheckTransmitInfo *pInfo )
+	{
+		V_memset( m_Result, TRANSMIT_PVS_UNKNOWN, sizeof( m_Result ) );
+
+		const int nBlockSize = 64;
+		int nBlocks = ( m_Candidates.Count() + nBlockSize - 1 ) / nBlockSize;
+
+		m_Blocks.SetCount( nBlocks );
+		for ( int i=0; i < nBlocks; i++ )
+		{
+			m_Blocks[i].m_pCache = this;
+			m_Blocks[i].m_nFirst = i * nBlockSize;
+			m_Blocks[i].m_nCount = MIN( nBlockSize, m_Candidates.Count() - i * nBlockSize );
+		}
+
+		m_pInfo = pInfo;
+		ParallelProcess( "CheckTransmit", m_Blocks.Base(), m_Blocks.Count(), &ProcessBlock );
+		m_pInfo = NULL;
+	}
+
+	TransmitPVSResult_t GetResult( int iEdict ) const { return (TransmitPVSResult_t)m_Result[iEdict]; }
+
+private:
+	struct Block_t
+	{
+		CTransmitPVSCache *m_pCache;
+		int m_nFirst;
+		int m_nCount;
+	};
+
+	static void ProcessBlock( Block_t &block )
+	{
+		CTransmitPVSCache *pCache = block.m_pCache;
+		for ( int i = block.m_nFirst; i < block.m_nFirst + block.m_nCount; i++ )
+		{
+			int iEdict = pCache->m_Candidates[i];
+			edict_t *pEdict = &pCache->m_pBaseEdict[iEdict];
+
+			// the recipient is never PVS tested against itself, leave it to the serial path
+			if ( pEdict == pCache->m_pInfo->m_pClientEnt )
+				continue;
+
+			CServerNetworkProperty *netProp = static_cast<CServerNetworkProperty*>( pEdict->GetNetworkable() );
+
+			// each edict has its own byte, so blocks never write to shared memory
+			pCache->m_Result[iEdict] = netProp->IsInPVS( pCache->m_pInfo ) ? TRANSMIT_PVS_VISIBLE : TRANSMIT_PVS_HIDDEN;
+		}
+	}
+
+	int m_nTick;
+	const unsigned short *m_pEdictIndices;
+	int m_nEdicts;
+	edict_t *m_pBaseEdict;
+	CUtlVector< unsigned short > m_Candidates;
+	CUtlVector< Block_t > m_Blocks;
+	const CCheckTransmitInfo *m_pInfo;
+	uint8 m_Result[MAX_EDICTS];
+};
+
+static CTransmitPVSCache s_TransmitPVSCache;
+
 void CServerGameEnts::CheckTransmit( CCheckTransmitInfo *pInfo, const unsigned short *pEdictIndices, int nEdicts )
 {
+	VPROF_BUDGET( "CServerGameEnts::CheckTransmit", VPROF_BUDGETGROUP_CHECKTRANSMIT );
+
 	// NOTE: for speed's sake, this assumes that all networkables are CBaseEntities and that the edict list
 	// is consecutive in memory. If either of these things change, then this routine needs to change, but
 	// ideally we won't be calling any virtual from this routine. This speedy routine was added as an
@@ -2503,8 +2630,25 @@ void CServerGameEnts::CheckTransmit( CCheckTransmitInfo *pInfo, const unsigned s
 	// m_pTransmitAlways must be set if HLTV client
 	Assert( bIsHLTV == ( pInfo->m_pTransmitAlways != NULL) ||
 		    bIsReplay == ( pInfo->m_pTransmitAlways != NULL) );
+#else
+	const bool bIsHLTV = false;
+	const bool bIsReplay = false;
 #endif
 
+	// HLTV and Replay don't cull against the PVS, so there is nothing to precompute for them
+	bool bParallelPVS = false;
+	if ( sv_parallel_checktransmit.GetBool() && !bIsHLTV && !bIsReplay )
+	{
+		VPROF_BUDGET( "CheckTransmit - Parallel PVS", VPROF_BUDGETGROUP_CHECKTRANSMIT );
+
+		s_TransmitPVSCache.Update( pBaseEdict, pEdictIndices, nEdicts );
+		if ( s_TransmitPVSCache.CandidateCount() >= sv_parallel_checktransmit_minents.GetInt() )
+		{
+			s_TransmitPVSCache.ComputeVisibility( pInfo );
+			bParallelPVS = true;
+		}
+	}
+
 	for ( int i=0; i < nEdicts; i++ )
 	{
 		int iEdict = pEdictIndices[i];
@@ -2599,7 +2743,17 @@ void CServerGameEnts::CheckTransmit( CCheckTransmitInfo *pInfo, const unsigned s
 			continue;
 		}
 
-		bool bInPVS = netProp->IsInPVS( pInfo );
+		bool bInPVS;
+		TransmitPVSResult_t cachedResult = bParallelPVS ? s_TransmitPVSCache.GetResult( iEdict ) : TRANSMIT_PVS_UNKNOWN;
+		if ( cachedResult != TRANSMIT_PVS_UNKNOWN )
+		{
+			bInPVS = ( cachedResult == TRANSMIT_PVS_VISIBLE );
+		}
+		else
+		{
+			bInPVS = netProp->IsInPVS( pInfo );
+		}
+
 		if ( bInPVS || sv_force_transmit_ents.GetBool() )
 		{
 			// only send if entity is in PVS
@@ -2653,8 +2807,17 @@ void CServerGameEnts::CheckTransmit( CCheckTransmitInfo *pInfo, const unsigned s
 			if ( checkFlags & FL_EDICT_PVSCHECK )
 			{
 				// Check pvs
-				check->RecomputePVSInformation();
-				bool bMoveParentInPVS = check->IsInPVS( pInfo );
+				bool bMoveParentInPVS;
+				TransmitPVSResult_t parentResult = bParallelPVS ? s_TransmitPVSCache.GetResult( checkIndex ) : TRANSMIT_PVS_UNKNOWN;
+				if ( parentResult != TRANSMIT_PVS_UNKNOWN )
+				{
+					bMoveParentInPVS = ( parentResult == TRANSMIT_PVS_VISIBLE );
+				}
+				else
+				{
+					check->RecomputePVSInformation();
+					bMoveParentInPVS = check->IsInPVS( pInfo );
+				}
 				if ( bMoveParentInPVS )
 				{
 					orig->SetTransmit( pInfo, true );
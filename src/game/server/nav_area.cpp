@@ -3608,17 +3608,34 @@ void CNavArea::SetCorner( NavCornerType corner, const Vector& newPosition )
 
 //--------------------------------------------------------------------------------------------------------------
 /**
- * Returns true if an existing hiding spot is too close to given position
+ * UTIL_TraceLine for the analysis steps.  Skips the r_visualizetraces overlay on worker threads,
+ * since debug overlays may only be drawn from the main thread.
  */
-bool CNavArea::IsHidingSpotCollision( const Vector &pos ) const
+static void AnalysisTraceLine( const Vector &from, const Vector &to, unsigned int mask, trace_t *result )
+{
+	if ( ThreadInMainThread() )
+	{
+		UTIL_TraceLine( from, to, mask, NULL, COLLISION_GROUP_NONE, result );
+		return;
+	}
+
+	Ray_t ray;
+	ray.Init( from, to );
+	CTraceFilterSimple traceFilter( NULL, COLLISION_GROUP_NONE );
+	enginetrace->TraceRay( ray, mask, &traceFilter, result );
+}
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Returns true if a hiding spot already found is too close to given position
+ */
+static bool IsHidingSpotCollision( const CNavArea::HidingSpotCandidate *spots, int count, const Vector &pos )
 {
 	const float collisionRange = 30.0f;
 
-	FOR_EACH_VEC( m_hidingSpots, it )
+	for( int i=0; i<count; ++i )
 	{
-		const HidingSpot *spot = m_hidingSpots[ it ];
-
-		if ((spot->GetPosition() - pos).IsLengthLessThan( collisionRange ))
+		if ((spots[i].pos - pos).IsLengthLessThan( collisionRange ))
 			return true;
 	}
 
@@ -3638,7 +3655,7 @@ bool IsHidingSpotInCover( const Vector &spot )
 
 	// if we are crouched underneath something, that counts as good cover
 	to = from + Vector( 0, 0, 20.0f );
-	UTIL_TraceLine( from, to, MASK_NPCSOLID_BRUSHONLY, NULL, COLLISION_GROUP_NONE, &result );
+	AnalysisTraceLine( from, to, MASK_NPCSOLID_BRUSHONLY, &result );
 	if (result.fraction != 1.0f)
 		return true;
 
@@ -3649,7 +3666,7 @@ bool IsHidingSpotInCover( const Vector &spot )
 	{
 		to = from + Vector( coverRange * (float)cos(angle), coverRange * (float)sin(angle), HalfHumanHeight );
 
-		UTIL_TraceLine( from, to, MASK_NPCSOLID_BRUSHONLY, NULL, COLLISION_GROUP_NONE, &result );
+		AnalysisTraceLine( from, to, MASK_NPCSOLID_BRUSHONLY, &result );
 
 		// if traceline hit something, it hit "cover"
 		if (result.fraction != 1.0f)
@@ -3669,7 +3686,7 @@ bool IsHidingSpotInCover( const Vector &spot )
  * Finds the hiding spot position in a corner's area.  If the typical inset is off the nav area (small
  * hand-constructed areas), it tries to fit the position inside the area.
  */
-static Vector FindPositionInArea( CNavArea *area, NavCornerType corner )
+static Vector FindPositionInArea( const CNavArea *area, NavCornerType corner )
 {
 	int multX = 1, multY = 1;
 	switch ( corner )
@@ -3729,6 +3746,40 @@ static Vector FindPositionInArea( CNavArea *area, NavCornerType corner )
  * Analyze local area neighborhood to find "hiding spots" for this area
  */
 void CNavArea::ComputeHidingSpots( void )
+{
+	HidingSpotCandidate spots[ NUM_CORNERS ];
+	int count = FindHidingSpots( spots );
+
+	SetHidingSpots( spots, count );
+}
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Replace this area's hiding spots with the given ones
+ */
+void CNavArea::SetHidingSpots( const HidingSpotCandidate *spots, int count )
+{
+	FOR_EACH_VEC( m_hidingSpots, it )
+	{
+		TheHidingSpots.FindAndRemove( m_hidingSpots[ it ] );
+	}
+	m_hidingSpots.PurgeAndDeleteElements();
+
+	for( int i=0; i<count; ++i )
+	{
+		HidingSpot *spot = TheNavMesh->CreateHidingSpot();
+		spot->SetPosition( spots[i].pos );
+		spot->SetFlags( spots[i].flags );
+		m_hidingSpots.AddToTail( spot );
+	}
+}
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Find the "hiding spots" for this area.  Only reads the mesh and traces, so it is safe to run
+ * on worker threads.
+ */
+int CNavArea::FindHidingSpots( HidingSpotCandidate spots[ NUM_CORNERS ] ) const
 {
 	struct
 	{
@@ -3736,16 +3787,15 @@ void CNavArea::ComputeHidingSpots( void )
 	}
 	extent;
 
-	m_hidingSpots.PurgeAndDeleteElements();
-
+	int spotCount = 0;
 
 	// "jump areas" cannot have hiding spots
 	if ( GetAttributes() & NAV_MESH_JUMP )
-		return;
+		return 0;
 
 	// "don't hide areas" cannot have hiding spots
 	if ( GetAttributes() & NAV_MESH_DONT_HIDE )
-		return;
+		return 0;
 
 	int cornerCount[NUM_CORNERS];
 	for( int i=0; i<NUM_CORNERS; ++i )
@@ -3834,15 +3884,16 @@ void CNavArea::ComputeHidingSpots( void )
 		if (cornerCount[c] == 2)
 		{
 			Vector pos = FindPositionInArea( this, (NavCornerType)c );
-			if ( !c || !IsHidingSpotCollision( pos ) )
+			if ( !c || !IsHidingSpotCollision( spots, spotCount, pos ) )
 			{
-				HidingSpot *spot = TheNavMesh->CreateHidingSpot();
-				spot->SetPosition( pos );
-				spot->SetFlags( IsHidingSpotInCover( pos ) ? HidingSpot::IN_COVER : HidingSpot::EXPOSED );
-				m_hidingSpots.AddToTail( spot );
+				spots[ spotCount ].pos = pos;
+				spots[ spotCount ].flags = IsHidingSpotInCover( pos ) ? HidingSpot::IN_COVER : HidingSpot::EXPOSED;
+				++spotCount;
 			}
 		}
 	}
+
+	return spotCount;
 }
 
 //--------------------------------------------------------------------------------------------------------------
@@ -3892,7 +3943,7 @@ void ClassifySniperSpot( HidingSpot *spot )
 				walkable.z = area->GetZ( walkable ) + HalfHumanHeight;
 				
 				// check line of sight
-				UTIL_TraceLine( eye, walkable, CONTENTS_SOLID|CONTENTS_MOVEABLE|CONTENTS_PLAYERCLIP, NULL, COLLISION_GROUP_NONE, &result );
+				AnalysisTraceLine( eye, walkable, CONTENTS_SOLID|CONTENTS_MOVEABLE|CONTENTS_PLAYERCLIP, &result );
 
 				if (result.fraction == 1.0f && !result.startsolid)
 				{
@@ -3988,6 +4039,50 @@ SpotEncounter *CNavArea::GetSpotEncounter( const CNavArea *from, const CNavArea
 	return NULL;
 }
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Per-thread replacement for HidingSpot::Mark(), indexed like TheHidingSpots, so spot
+ * encounters can be computed on worker threads.
+ */
+class SpotEncounterMarks
+{
+public:
+	SpotEncounterMarks( void ) : m_marker( 0 ) { }
+
+	static SpotEncounterMarks *GetThreadMarks( void );		// get this thread's marks, with a new marker
+
+	bool IsMarked( int spotIndex ) const	{ return m_marks[ spotIndex ] == m_marker; }
+	void Mark( int spotIndex )				{ m_marks[ spotIndex ] = m_marker; }
+
+private:
+	CUtlVector< unsigned int > m_marks;
+	unsigned int m_marker;
+};
+
+static CTHREADLOCALPTR( SpotEncounterMarks ) s_pSpotEncounterMarks;
+
+SpotEncounterMarks *SpotEncounterMarks::GetThreadMarks( void )
+{
+	SpotEncounterMarks *marks = s_pSpotEncounterMarks;
+	if ( marks == NULL )
+	{
+		marks = new SpotEncounterMarks;
+		s_pSpotEncounterMarks = marks;
+	}
+
+	++marks->m_marker;
+
+	// hiding spots are only created on the main thread between analysis steps
+	if ( marks->m_marks.Count() < TheHidingSpots.Count() || marks->m_marker == 0 )
+	{
+		marks->m_marks.SetCount( TheHidingSpots.Count() );
+		V_memset( marks->m_marks.Base(), 0, marks->m_marks.Count() * sizeof( unsigned int ) );
+		marks->m_marker = 1;
+	}
+
+	return marks;
+}
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Add spot encounter data when moving from area to area
@@ -4015,10 +4110,10 @@ void CNavArea::AddSpotEncounters( const CNavArea *from, NavDirType fromDir, cons
 	float length = dir.NormalizeInPlace();
 
 	// create unique marker to flag used spots
-	HidingSpot::ChangeMasterMarker();
+	SpotEncounterMarks *marks = SpotEncounterMarks::GetThreadMarks();
 
 	const float stepSize = 25.0f;		// 50
-	const float seeSpotRange = 2000.0f;	// 3000
+	const float seeSpotRange = GetSpotEncounterRange();	// 3000
 	trace_t result;
 
 	Vector eye, delta;
@@ -4048,7 +4143,7 @@ void CNavArea::AddSpotEncounters( const CNavArea *from, NavDirType fromDir, cons
 			if (!spot->HasGoodCover())
 				continue;
 
-			if (spot->IsMarked())
+			if (marks->IsMarked( it ))
 				continue;
 
 			const Vector &spotPos = spot->GetPosition();
@@ -4063,7 +4158,7 @@ void CNavArea::AddSpotEncounters( const CNavArea *from, NavDirType fromDir, cons
 
 			// check if we have LOS
 			// BOTPORT: ignore glass here
-			UTIL_TraceLine( eye, Vector( spotPos.x, spotPos.y, spotPos.z + HalfHumanHeight ), MASK_NPCSOLID_BRUSHONLY, NULL, COLLISION_GROUP_NONE, &result );
+			AnalysisTraceLine( eye, Vector( spotPos.x, spotPos.y, spotPos.z + HalfHumanHeight ), MASK_NPCSOLID_BRUSHONLY, &result );
 			if (result.fraction != 1.0f)
 				continue;
 
@@ -4084,7 +4179,7 @@ void CNavArea::AddSpotEncounters( const CNavArea *from, NavDirType fromDir, cons
 			}
 
 			// mark spot as encountered
-			spot->Mark();
+			marks->Mark( it );
 		}
 	}
 
@@ -4099,7 +4194,7 @@ void CNavArea::AddSpotEncounters( const CNavArea *from, NavDirType fromDir, cons
  */
 void CNavArea::ComputeSpotEncounters( void )
 {
-	m_spotEncounters.RemoveAll();
+	m_spotEncounters.PurgeAndDeleteElements();
 
 	if (nav_quicksave.GetBool())
 		return;
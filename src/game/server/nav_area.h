@@ -23,6 +23,11 @@ enum { MAX_NAV_TEAMS = 2 };
 class CFuncElevator;
 class CFuncNavPrerequisite;
 class CFuncNavCost;
+class CNavPathSearch;
+
+// set while a CNavPathSearch is running on this thread (see nav_pathsearch.h)
+extern CTHREADLOCALPTR( CNavPathSearch ) g_pActiveNavPathSearch;
+extern float NavPathSearchGetCostSoFar( const CNavPathSearch *search, const CNavArea *area );
 
 class CNavVectorNoEditAllocator
 {
@@ -275,6 +280,8 @@ public:
 	virtual void Save( CUtlBuffer &fileBuffer, unsigned int version ) const;	// (EXTEND)
 	virtual NavErrorType Load( CUtlBuffer &fileBuffer, unsigned int version, unsigned int subVersion );		// (EXTEND)
 	virtual NavErrorType PostLoad( void );								// (EXTEND) invoked after all areas have been loaded - for pointer binding, etc
+	virtual void SavePackedCustomData( CUtlBuffer &fileBuffer ) const { }	// (EXTEND) store derived class data in the packed nav file
+	virtual NavErrorType LoadPackedCustomData( CUtlBuffer &fileBuffer, unsigned int subVersion ) { return NAV_OK; }	// (EXTEND) load derived class data from the packed nav file - PostLoad() is not invoked for packed files
 
 	virtual void SaveToSelectedSet( KeyValues *areaKey ) const;		// (EXTEND) saves attributes for the area to a KeyValues
 	virtual void RestoreFromSelectedSet( KeyValues *areaKey );		// (EXTEND) restores attributes from a KeyValues
@@ -450,7 +457,7 @@ public:
 	float GetTotalCost( void ) const	{ DebuggerBreakOnNaN_StagingOnly( m_totalCost ); return m_totalCost; }
 
 	void SetCostSoFar( float value )	{ DebuggerBreakOnNaN_StagingOnly( value ); Assert( value >= 0.0 && !IS_NAN(value) ); m_costSoFar = value; }
-	float GetCostSoFar( void ) const	{ DebuggerBreakOnNaN_StagingOnly( m_costSoFar ); return m_costSoFar; }
+	float GetCostSoFar( void ) const;							// redirected to the active CNavPathSearch on this thread, if any
 
 	void SetPathLengthSoFar( float value )	{ DebuggerBreakOnNaN_StagingOnly( value ); Assert( value >= 0.0 && !IS_NAN(value) ); m_pathLengthSoFar = value; }
 	float GetPathLengthSoFar( void ) const	{ DebuggerBreakOnNaN_StagingOnly( m_pathLengthSoFar ); return m_pathLengthSoFar; }
@@ -476,10 +483,23 @@ public:
 	void AddLadderDown( CNavLadder *ladder );
 
 	//- generation and analysis -------------------------------------------------------------------------
+	struct HidingSpotCandidate
+	{
+		Vector pos;
+		unsigned char flags;
+	};
+
+	// The analysis steps below may run on worker threads, except SetHidingSpots() and anything
+	// else that creates or destroys mesh data. ComputeEarliestOccupyTimes() is only threaded when
+	// IsEarliestOccupyTimeThreadSafe() is true.
 	virtual void ComputeHidingSpots( void );					// analyze local area neighborhood to find "hiding spots" in this area - for map learning
+	virtual int FindHidingSpots( HidingSpotCandidate spots[ NUM_CORNERS ] ) const;	// find the hiding spots of this area without creating them, return how many
+	void SetHidingSpots( const HidingSpotCandidate *spots, int count );	// replace our hiding spots - main thread only
 	virtual void ComputeSniperSpots( void );					// analyze local area neighborhood to find "sniper spots" in this area - for map learning
 	virtual void ComputeSpotEncounters( void );					// compute spot encounter data - for map learning
 	virtual void ComputeEarliestOccupyTimes( void );
+	static bool IsEarliestOccupyTimeThreadSafe( void );
+	static float GetSpotEncounterRange( void )	{ return 2000.0f; }	// hiding spots farther than this from a path thru an area are not encountered
 	virtual void CustomAnalysis( bool isIncremental = false ) { }	// for game-specific analysis
 	virtual bool ComputeLighting( void );						// compute 0..1 light intensity at corners and center (requires client via listenserver)
 	bool TestStairs( void );									// Test an area for being on stairs
@@ -687,7 +707,6 @@ private:
 
 	//- hiding spots ------------------------------------------------------------------------------------
 	HidingSpotVector m_hidingSpots;
-	bool IsHidingSpotCollision( const Vector &pos ) const;		// returns true if an existing hiding spot is too close to given position
 
 	//- encounter spots ---------------------------------------------------------------------------------
 	SpotEncounterVector m_spotEncounters;						// list of possible ways to move thru this area, and the spots to look at as we do
@@ -857,6 +876,18 @@ inline CNavArea *CNavArea::PopOpenList( void )
 	return NULL;
 }
 
+//--------------------------------------------------------------------------------------------------------------
+inline float CNavArea::GetCostSoFar( void ) const
+{
+	// cost functors read the cost of the area they are coming from - a reentrant search keeps that itself
+	CNavPathSearch *search = g_pActiveNavPathSearch;
+	if ( search )
+		return NavPathSearchGetCostSoFar( search, this );
+
+	DebuggerBreakOnNaN_StagingOnly( m_costSoFar );
+	return m_costSoFar;
+}
+
 //--------------------------------------------------------------------------------------------------------------
 inline bool CNavArea::IsClosed( void ) const
 {
@@ -11,10 +11,12 @@
 
 #include "cbase.h"
 #include "nav_mesh.h"
+#include "nav_packed.h"
 #include "gamerules.h"
 #include "datacache/imdlcache.h"
 
 #include "tier1/fmtstr.h"
+#include "tier0/fasttimer.h"
 
 #include "tier2/tier2.h"
 #include "tier2/p4helpers.h"
@@ -46,6 +48,9 @@
 // TODO: Was changed from 15, update when latest 360 code is integrated (MSB 5/5/09)
 const int NavCurrentVersion = 16;
 
+ConVar nav_load_packed( "nav_load_packed", "1", FCVAR_GAMEDLL, "Load the packed nav file (.navp) instead of the .nav file when it is up to date." );
+ConVar nav_save_packed( "nav_save_packed", "0", FCVAR_GAMEDLL | FCVAR_CHEAT, "Also write the packed nav file (.navp) whenever the Navigation Mesh is saved." );
+
 //--------------------------------------------------------------------------------------------------------------
 //
 // The 'place directory' is used to save and load places from
@@ -850,6 +855,20 @@ float NavAreaTravelDistance( const Vector &startPos, const Vector &goalPos, Cost
 	}
 }
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return true if ComputeEarliestOccupyTimes() can run on a worker thread.  The cstrike
+ * version walks the entity list and runs path searches, which share global markers.
+ */
+bool CNavArea::IsEarliestOccupyTimeThreadSafe( void )
+{
+#ifdef CSTRIKE_DLL
+	return false;
+#else
+	return true;
+#endif
+}
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Determine the earliest time this hiding spot can be reached by either team
@@ -1220,6 +1239,11 @@ bool CNavMesh::Save( void ) const
 	unsigned int navSize = filesystem->Size( filename );
 	DevMsg( "Size of nav file '%s' is %u bytes.\n", filename, navSize );
 
+	if ( nav_save_packed.GetBool() )
+	{
+		SavePacked();
+	}
+
 	return true;
 }
 
@@ -1446,6 +1470,12 @@ NavErrorType CNavMesh::Load( void )
 
 	CNavArea::m_nextID = 1;
 
+	// the packed nav file is much faster to load, if it is up to date
+	if ( nav_load_packed.GetBool() && LoadPacked() == NAV_OK )
+	{
+		return NAV_OK;
+	}
+
 	bool navIsInBsp = false;
 	CUtlBuffer fileBuffer( 4096, 1024*1024, CUtlBuffer::READ_ONLY );
 	NavErrorType readResult = GetNavDataFromFile( fileBuffer, &navIsInBsp );
@@ -1719,8 +1749,895 @@ NavErrorType CNavMesh::PostLoad( unsigned int version )
 		m_avoidanceObstacles[i]->OnNavMeshLoaded();
 	}
 
+	// remember what was analyzed, so edits can be re-analyzed incrementally
+	if ( m_isAnalyzed )
+	{
+		SnapshotAnalyzedAreas();
+	}
+
 	// the Navigation Mesh has been successfully loaded
 	m_isLoaded = true;
 	
 	return NAV_OK;
 }
+
+
+//--------------------------------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return the names of this map's nav file and packed nav file, relative to the game directory
+ */
+static void GetPackedNavFilenames( char *navFilename, char *packedFilename, int size )
+{
+	char maptmp[256];
+	const char *pszMapName = GetCleanMapName( STRING( gpGlobals->mapname ), maptmp );
+
+	Q_snprintf( navFilename, size, FORMAT_NAVFILE, pszMapName );
+	Q_snprintf( packedFilename, size, FORMAT_NAVFILE "p", pszMapName );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return the index of the given item in the packed file, or NAV_PACKED_NO_INDEX
+ */
+template < typename T >
+static unsigned int GetPackedIndex( const CUtlMap< const T *, unsigned int, int > &indices, const T *item )
+{
+	int i = indices.Find( item );
+	return indices.IsValidIndex( i ) ? indices[ i ] : NAV_PACKED_NO_INDEX;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Append a section to the packed file, starting on a cache line boundary
+ */
+static void PutPackedSection( CUtlBuffer &fileBuffer, NavPackedHeader *header, NavPackedSectionType type, const void *data, int size, int count )
+{
+	while( fileBuffer.TellPut() % NAV_PACKED_ALIGN )
+	{
+		fileBuffer.PutUnsignedChar( 0 );
+	}
+
+	header->section[ type ].offset = fileBuffer.TellPut();
+	header->section[ type ].size = size;
+	header->section[ type ].count = count;
+	header->section[ type ].reserved = 0;
+
+	if ( size > 0 )
+	{
+		fileBuffer.Put( data, size );
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Store the Navigation Mesh to the packed nav file.  The packed file is only used while the .nav file
+ * it was written next to is unchanged, so this should be called right after the .nav file is saved or loaded.
+ */
+bool CNavMesh::SavePacked( void ) const
+{
+	const char *filename = GetFilename();
+	if ( filename == NULL )
+		return false;
+
+	char navFilename[ MAX_PATH ];
+	Q_strncpy( navFilename, filename, sizeof( navFilename ) );
+	COM_FixSlashes( navFilename );
+
+	char packedFilename[ MAX_PATH ];
+	Q_snprintf( packedFilename, sizeof( packedFilename ), "%sp", navFilename );
+
+	char *bspFilename = GetBspFilename( navFilename );
+	if ( bspFilename == NULL )
+		return false;
+
+	NavPackedHeader header;
+	V_memset( &header, 0, sizeof( header ) );
+	header.magic = NAV_PACKED_MAGIC_NUMBER;
+	header.version = NavPackedVersion;
+	header.navVersion = NavCurrentVersion;
+	header.subVersion = GetSubVersionNumber();
+	header.bspSize = filesystem->Size( bspFilename );
+	header.navSize = filesystem->Size( navFilename );
+	header.navTime = (unsigned int)filesystem->GetFileTime( navFilename );
+	header.isAnalyzed = m_isAnalyzed;
+
+	if ( header.navSize == 0 )
+	{
+		Msg( "Cannot write a packed nav file without '%s'.\n", navFilename );
+		return false;
+	}
+
+	// the packed file refers to areas, hiding spots, and ladders by their index
+	CUtlMap< const CNavArea *, unsigned int, int > areaIndex( DefLessFunc( const CNavArea * ) );
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		areaIndex.Insert( TheNavAreas[ it ], it );
+	}
+
+	CUtlMap< const CNavLadder *, unsigned int, int > ladderIndex( DefLessFunc( const CNavLadder * ) );
+	FOR_EACH_VEC( m_ladders, it )
+	{
+		ladderIndex.Insert( m_ladders[ it ], it );
+	}
+
+	// store hiding spots in area order, so each area owns a contiguous range of them
+	CUtlVector< NavPackedHidingSpot > spots;
+	CUtlMap< const HidingSpot *, unsigned int, int > spotIndex( DefLessFunc( const HidingSpot * ) );
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		const HidingSpotVector &areaSpots = TheNavAreas[ it ]->m_hidingSpots;
+		FOR_EACH_VEC( areaSpots, sit )
+		{
+			const HidingSpot *spot = areaSpots[ sit ];
+			spotIndex.Insert( spot, spots.Count() );
+
+			NavPackedHidingSpot &packed = spots[ spots.AddToTail() ];
+			packed.id = spot->m_id;
+			packed.pos[0] = spot->m_pos.x;
+			packed.pos[1] = spot->m_pos.y;
+			packed.pos[2] = spot->m_pos.z;
+			packed.flags = spot->m_flags;
+
+			// same as HidingSpot::PostLoad()
+			const CNavArea *spotArea = GetNavArea( spot->m_pos + Vector( 0, 0, HalfHumanHeight ) );
+			packed.area = GetPackedIndex( areaIndex, spotArea );
+		}
+	}
+
+	// use our own directory, the global one belongs to the .nav file being loaded or saved
+	PlaceDirectory places;
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		places.AddPlace( TheNavAreas[ it ]->GetPlace() );
+	}
+
+	CUtlBuffer placeData;
+	places.Save( placeData );
+
+	CUtlVector< NavPackedArea > areas;
+	CUtlVector< NavPackedConnect > connects;
+	CUtlVector< NavPackedEncounter > encounters;
+	CUtlVector< NavPackedEncounterSpot > encounterSpots;
+	CUtlVector< unsigned int > ladderConnects;
+	CUtlVector< NavPackedVisibleArea > visibleAreas;
+	CUtlBuffer customAreaData;
+
+	areas.SetCount( TheNavAreas.Count() );
+	unsigned int firstSpot = 0;
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		const CNavArea *area = TheNavAreas[ it ];
+		NavPackedArea &packed = areas[ it ];
+		V_memset( &packed, 0, sizeof( packed ) );
+
+		packed.id = area->m_id;
+		packed.attributeFlags = area->m_attributeFlags;
+		V_memcpy( packed.nwCorner, &area->m_nwCorner, sizeof( packed.nwCorner ) );
+		V_memcpy( packed.seCorner, &area->m_seCorner, sizeof( packed.seCorner ) );
+		packed.neZ = area->m_neZ;
+		packed.swZ = area->m_swZ;
+		V_memcpy( packed.earliestOccupyTime, area->m_earliestOccupyTime, sizeof( packed.earliestOccupyTime ) );
+		V_memcpy( packed.lightIntensity, area->m_lightIntensity, sizeof( packed.lightIntensity ) );
+		packed.placeEntry = places.GetIndex( area->GetPlace() );
+		packed.flags = area->m_isUnderwater ? NAV_PACKED_AREA_UNDERWATER : 0;
+
+		// outgoing connections, then incoming ones
+		packed.firstConnect = connects.Count();
+		for( int i=0; i<2*NUM_DIRECTIONS; ++i )
+		{
+			const NavConnectVector &connectList = ( i < NUM_DIRECTIONS ) ? area->m_connect[ i ] : area->m_incomingConnect[ i - NUM_DIRECTIONS ];
+			FOR_EACH_VEC( connectList, cit )
+			{
+				const CNavArea *other = connectList[ cit ].area;
+
+				NavPackedConnect &connect = connects[ connects.AddToTail() ];
+				connect.area = GetPackedIndex( areaIndex, other );
+				connect.length = connectList[ cit ].length;
+				if ( connect.length < 0.0f )
+				{
+					connect.length = ( other->GetCenter() - area->GetCenter() ).Length();
+				}
+			}
+
+			if ( i < NUM_DIRECTIONS )
+				packed.connectCount[ i ] = connectList.Count();
+			else
+				packed.incomingConnectCount[ i - NUM_DIRECTIONS ] = connectList.Count();
+		}
+
+		packed.firstHidingSpot = firstSpot;
+		packed.hidingSpotCount = area->m_hidingSpots.Count();
+		firstSpot += area->m_hidingSpots.Count();
+
+		packed.firstEncounter = encounters.Count();
+		FOR_EACH_VEC( area->m_spotEncounters, eit )
+		{
+			const SpotEncounter *e = area->m_spotEncounters[ eit ];
+
+			// encounters with a missing area can't be used, and the .nav loader reports them as corrupt
+			unsigned int from = GetPackedIndex( areaIndex, (const CNavArea *)e->from.area );
+			unsigned int to = GetPackedIndex( areaIndex, (const CNavArea *)e->to.area );
+			if ( from == NAV_PACKED_NO_INDEX || to == NAV_PACKED_NO_INDEX )
+				continue;
+
+			NavPackedEncounter &encounter = encounters[ encounters.AddToTail() ];
+			encounter.fromArea = from;
+			encounter.toArea = to;
+			encounter.fromDir = e->fromDir;
+			encounter.toDir = e->toDir;
+			encounter.firstSpot = encounterSpots.Count();
+
+			// store the path CNavArea::PostLoad() computes, analysis leaves it at eye height instead
+			Vector pathFrom, pathTo;
+			float halfWidth;
+			area->ComputePortal( e->to.area, e->toDir, &pathTo, &halfWidth );
+			area->ComputePortal( e->from.area, e->fromDir, &pathFrom, &halfWidth );
+			pathFrom.z = e->from.area->GetZ( pathFrom ) + HalfHumanHeight;
+			pathTo.z = e->to.area->GetZ( pathTo ) + HalfHumanHeight;
+			V_memcpy( encounter.pathFrom, &pathFrom, sizeof( encounter.pathFrom ) );
+			V_memcpy( encounter.pathTo, &pathTo, sizeof( encounter.pathTo ) );
+
+			FOR_EACH_VEC( e->spots, sit )
+			{
+				// order->spot may be NULL if we've loaded a nav mesh that has been edited but not re-analyzed
+				unsigned int spot = GetPackedIndex( spotIndex, (const HidingSpot *)e->spots[ sit ].spot );
+				if ( spot == NAV_PACKED_NO_INDEX )
+					continue;
+
+				NavPackedEncounterSpot &encounterSpot = encounterSpots[ encounterSpots.AddToTail() ];
+				encounterSpot.spot = spot;
+				encounterSpot.t = e->spots[ sit ].t;
+			}
+
+			encounter.spotCount = encounterSpots.Count() - encounter.firstSpot;
+		}
+		packed.encounterCount = encounters.Count() - packed.firstEncounter;
+
+		// up ladders, then down ladders
+		packed.firstLadder = ladderConnects.Count();
+		for( int l=0; l<CNavLadder::NUM_LADDER_DIRECTIONS; ++l )
+		{
+			FOR_EACH_VEC( area->m_ladder[ l ], lit )
+			{
+				ladderConnects.AddToTail( GetPackedIndex( ladderIndex, (const CNavLadder *)area->m_ladder[ l ][ lit ].ladder ) );
+			}
+			packed.ladderCount[ l ] = area->m_ladder[ l ].Count();
+		}
+
+		packed.firstVisibleArea = visibleAreas.Count();
+		FOR_EACH_VEC( area->m_potentiallyVisibleAreas, vit )
+		{
+			unsigned int visible = GetPackedIndex( areaIndex, (const CNavArea *)area->m_potentiallyVisibleAreas[ vit ].area );
+			if ( visible == NAV_PACKED_NO_INDEX )
+				continue;
+
+			NavPackedVisibleArea &info = visibleAreas[ visibleAreas.AddToTail() ];
+			info.area = visible;
+			info.attributes = area->m_potentiallyVisibleAreas[ vit ].attributes;
+		}
+		packed.visibleAreaCount = visibleAreas.Count() - packed.firstVisibleArea;
+
+		packed.inheritVisibilityFrom = GetPackedIndex( areaIndex, (const CNavArea *)area->m_inheritVisibilityFrom.area );
+
+		area->SavePackedCustomData( customAreaData );
+	}
+
+	CUtlBuffer ladderData;
+	FOR_EACH_VEC( m_ladders, it )
+	{
+		m_ladders[ it ]->Save( ladderData, NavCurrentVersion );
+	}
+
+	CUtlBuffer customPreAreaData;
+	SaveCustomDataPreArea( customPreAreaData );
+
+	CUtlBuffer customData;
+	SaveCustomData( customData );
+
+	CUtlBuffer fileBuffer( 4096, 1024*1024 );
+	fileBuffer.Put( &header, sizeof( header ) );
+
+	PutPackedSection( fileBuffer, &header, NAV_PACKED_PLACES, placeData.Base(), placeData.TellPut(), 0 );
+	PutPackedSection( fileBuffer, &header, NAV_PACKED_CUSTOM_PRE_AREA, customPreAreaData.Base(), customPreAreaData.TellPut(), 0 );
+	PutPackedSection( fileBuffer, &header, NAV_PACKED_AREAS, areas.Base(), areas.Count() * sizeof( NavPackedArea ), areas.Count() );
+	PutPackedSection( fileBuffer, &header, NAV_PACKED_CONNECTIONS, connects.Base(), connects.Count() * sizeof( NavPackedConnect ), connects.Count() );
+	PutPackedSection( fileBuffer, &header, NAV_PACKED_HIDING_SPOTS, spots.Base(), spots.Count() * sizeof( NavPackedHidingSpot ), spots.Count() );
+	PutPackedSection( fileBuffer, &header, NAV_PACKED_ENCOUNTERS, encounters.Base(), encounters.Count() * sizeof( NavPackedEncounter ), encounters.Count() );
+	PutPackedSection( fileBuffer, &header, NAV_PACKED_ENCOUNTER_SPOTS, encounterSpots.Base(), encounterSpots.Count() * sizeof( NavPackedEncounterSpot ), encounterSpots.Count() );
+	PutPackedSection( fileBuffer, &header, NAV_PACKED_LADDER_CONNECTIONS, ladderConnects.Base(), ladderConnects.Count() * sizeof( unsigned int ), ladderConnects.Count() );
+	PutPackedSection( fileBuffer, &header, NAV_PACKED_VISIBLE_AREAS, visibleAreas.Base(), visibleAreas.Count() * sizeof( NavPackedVisibleArea ), visibleAreas.Count() );
+	PutPackedSection( fileBuffer, &header, NAV_PACKED_LADDERS, ladderData.Base(), ladderData.TellPut(), m_ladders.Count() );
+	PutPackedSection( fileBuffer, &header, NAV_PACKED_CUSTOM_AREA, customAreaData.Base(), customAreaData.TellPut(), 0 );
+	PutPackedSection( fileBuffer, &header, NAV_PACKED_CUSTOM, customData.Base(), customData.TellPut(), 0 );
+
+	// now that the section offsets are known, store the real header
+	V_memcpy( fileBuffer.Base(), &header, sizeof( header ) );
+
+	if ( !filesystem->WriteFile( packedFilename, "MOD", fileBuffer ) )
+	{
+		Warning( "Unable to save %d bytes to %s\n", fileBuffer.TellPut(), packedFilename );
+		return false;
+	}
+
+	DevMsg( "Size of packed nav file '%s' is %u bytes.\n", packedFilename, fileBuffer.TellPut() );
+
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+static bool IsPackedRangeValid( uint64 first, uint64 count, unsigned int limit )
+{
+	return first + count <= limit;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Check every section and every index of a packed nav file, so building the mesh from it can't fail halfway
+ */
+static bool IsPackedNavDataValid( const byte *data, unsigned int size )
+{
+	if ( size < sizeof( NavPackedHeader ) )
+		return false;
+
+	const NavPackedHeader *header = (const NavPackedHeader *)data;
+	if ( header->magic != NAV_PACKED_MAGIC_NUMBER || header->version != NavPackedVersion || header->navVersion != (unsigned int)NavCurrentVersion )
+		return false;
+
+	static const unsigned int recordSize[ NAV_PACKED_SECTION_COUNT ] =
+	{
+		0,									// NAV_PACKED_PLACES
+		0,									// NAV_PACKED_CUSTOM_PRE_AREA
+		sizeof( NavPackedArea ),			// NAV_PACKED_AREAS
+		sizeof( NavPackedConnect ),			// NAV_PACKED_CONNECTIONS
+		sizeof( NavPackedHidingSpot ),		// NAV_PACKED_HIDING_SPOTS
+		sizeof( NavPackedEncounter ),		// NAV_PACKED_ENCOUNTERS
+		sizeof( NavPackedEncounterSpot ),	// NAV_PACKED_ENCOUNTER_SPOTS
+		sizeof( unsigned int ),				// NAV_PACKED_LADDER_CONNECTIONS
+		sizeof( NavPackedVisibleArea ),		// NAV_PACKED_VISIBLE_AREAS
+		0,									// NAV_PACKED_LADDERS
+		0,									// NAV_PACKED_CUSTOM_AREA
+		0,									// NAV_PACKED_CUSTOM
+	};
+
+	for( int i=0; i<NAV_PACKED_SECTION_COUNT; ++i )
+	{
+		const NavPackedSection &section = header->section[i];
+
+		if ( section.offset % NAV_PACKED_ALIGN || section.offset < sizeof( NavPackedHeader ) || !IsPackedRangeValid( section.offset, section.size, size ) )
+			return false;
+
+		if ( recordSize[i] && (uint64)section.count * recordSize[i] != section.size )
+			return false;
+	}
+
+	const unsigned int areaCount = header->section[ NAV_PACKED_AREAS ].count;
+	const unsigned int connectCount = header->section[ NAV_PACKED_CONNECTIONS ].count;
+	const unsigned int spotCount = header->section[ NAV_PACKED_HIDING_SPOTS ].count;
+	const unsigned int encounterCount = header->section[ NAV_PACKED_ENCOUNTERS ].count;
+	const unsigned int encounterSpotCount = header->section[ NAV_PACKED_ENCOUNTER_SPOTS ].count;
+	const unsigned int ladderConnectCount = header->section[ NAV_PACKED_LADDER_CONNECTIONS ].count;
+	const unsigned int visibleAreaCount = header->section[ NAV_PACKED_VISIBLE_AREAS ].count;
+	const unsigned int ladderCount = header->section[ NAV_PACKED_LADDERS ].count;
+
+	if ( areaCount == 0 )
+		return false;
+
+	const NavPackedArea *areas = (const NavPackedArea *)( data + header->section[ NAV_PACKED_AREAS ].offset );
+	for( unsigned int i=0; i<areaCount; ++i )
+	{
+		const NavPackedArea &area = areas[i];
+
+		uint64 connections = 0;
+		for( int d=0; d<NUM_DIRECTIONS; ++d )
+		{
+			connections += area.connectCount[d] + area.incomingConnectCount[d];
+		}
+
+		if ( !IsPackedRangeValid( area.firstConnect, connections, connectCount ) ||
+			 !IsPackedRangeValid( area.firstHidingSpot, area.hidingSpotCount, spotCount ) ||
+			 !IsPackedRangeValid( area.firstEncounter, area.encounterCount, encounterCount ) ||
+			 !IsPackedRangeValid( area.firstLadder, (uint64)area.ladderCount[0] + area.ladderCount[1], ladderConnectCount ) ||
+			 !IsPackedRangeValid( area.firstVisibleArea, area.visibleAreaCount, visibleAreaCount ) )
+			return false;
+
+		if ( area.inheritVisibilityFrom != NAV_PACKED_NO_INDEX && area.inheritVisibilityFrom >= areaCount )
+			return false;
+	}
+
+	const NavPackedConnect *connects = (const NavPackedConnect *)( data + header->section[ NAV_PACKED_CONNECTIONS ].offset );
+	for( unsigned int i=0; i<connectCount; ++i )
+	{
+		if ( connects[i].area >= areaCount )
+			return false;
+	}
+
+	const NavPackedHidingSpot *spots = (const NavPackedHidingSpot *)( data + header->section[ NAV_PACKED_HIDING_SPOTS ].offset );
+	for( unsigned int i=0; i<spotCount; ++i )
+	{
+		if ( spots[i].area != NAV_PACKED_NO_INDEX && spots[i].area >= areaCount )
+			return false;
+	}
+
+	const NavPackedEncounter *encounters = (const NavPackedEncounter *)( data + header->section[ NAV_PACKED_ENCOUNTERS ].offset );
+	for( unsigned int i=0; i<encounterCount; ++i )
+	{
+		const NavPackedEncounter &encounter = encounters[i];
+
+		if ( encounter.fromArea >= areaCount || encounter.toArea >= areaCount ||
+			 encounter.fromDir >= NUM_DIRECTIONS || encounter.toDir >= NUM_DIRECTIONS ||
+			 !IsPackedRangeValid( encounter.firstSpot, encounter.spotCount, encounterSpotCount ) )
+			return false;
+	}
+
+	const NavPackedEncounterSpot *encounterSpots = (const NavPackedEncounterSpot *)( data + header->section[ NAV_PACKED_ENCOUNTER_SPOTS ].offset );
+	for( unsigned int i=0; i<encounterSpotCount; ++i )
+	{
+		if ( encounterSpots[i].spot >= spotCount )
+			return false;
+	}
+
+	const unsigned int *ladderConnects = (const unsigned int *)( data + header->section[ NAV_PACKED_LADDER_CONNECTIONS ].offset );
+	for( unsigned int i=0; i<ladderConnectCount; ++i )
+	{
+		if ( ladderConnects[i] >= ladderCount )
+			return false;
+	}
+
+	const NavPackedVisibleArea *visibleAreas = (const NavPackedVisibleArea *)( data + header->section[ NAV_PACKED_VISIBLE_AREAS ].offset );
+	for( unsigned int i=0; i<visibleAreaCount; ++i )
+	{
+		if ( visibleAreas[i].area >= areaCount )
+			return false;
+	}
+
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+static void *AllocPackedNavBuffer( const char *pszFilename, unsigned nBytes )
+{
+	return MemAlloc_AllocAligned( nBytes, NAV_PACKED_ALIGN );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Load the Navigation Mesh from the packed nav file.  Returns an error without touching the current mesh
+ * if the packed file is missing, invalid, or older than the .nav file.
+ */
+NavErrorType CNavMesh::LoadPacked( void )
+{
+	char navFilename[ MAX_PATH ];
+	char packedFilename[ MAX_PATH ];
+	GetPackedNavFilenames( navFilename, packedFilename, sizeof( navFilename ) );
+
+	// read the whole file at once into a cache line aligned block
+	void *data = NULL;
+	int size = filesystem->ReadFileEx( packedFilename, "MOD", &data, false, false, 0, 0, AllocPackedNavBuffer );
+	if ( data == NULL )
+	{
+		return NAV_CANT_ACCESS_FILE;
+	}
+
+	NavErrorType result = NAV_CANT_ACCESS_FILE;
+	if ( size > 0 )
+	{
+		result = LoadPackedData( (const byte *)data, size, navFilename );
+	}
+
+	MemAlloc_FreeAligned( data );
+
+	return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Build the Navigation Mesh from the contents of a packed nav file
+ */
+NavErrorType CNavMesh::LoadPackedData( const byte *data, unsigned int size, const char *navFilename )
+{
+	if ( !IsPackedNavDataValid( data, size ) )
+	{
+		Warning( "Invalid packed navigation file for '%s'.\n", navFilename );
+		return NAV_INVALID_FILE;
+	}
+
+	const NavPackedHeader *header = (const NavPackedHeader *)data;
+	if ( header->subVersion != GetSubVersionNumber() )
+	{
+		DevMsg( "Packed navigation file has a different sub-version than '%s', ignoring it.\n", navFilename );
+		return NAV_BAD_FILE_VERSION;
+	}
+
+	// the packed file is only a cache of the .nav file it was written from
+	if ( header->navSize != filesystem->Size( navFilename, "MOD" ) || header->navTime != (unsigned int)filesystem->GetFileTime( navFilename, "MOD" ) )
+	{
+		DevMsg( "Packed navigation file is older than '%s', ignoring it.\n", navFilename );
+		return NAV_FILE_OUT_OF_DATE;
+	}
+
+	// verify the bsp hasn't changed since the mesh was built
+	char bspFilename[MAX_PATH] = { 0 };
+	Q_snprintf( bspFilename, sizeof( bspFilename ), FORMAT_BSPFILE , STRING( gpGlobals->mapname ) );
+
+	if ( filesystem->Size( bspFilename ) != header->bspSize )
+	{
+		DevWarning( "The Navigation Mesh was built using a different version of this map.\n" );
+		m_isOutOfDate = true;
+	}
+
+	m_isAnalyzed = header->isAnalyzed != 0;
+
+	const NavPackedArea *packedAreas = (const NavPackedArea *)( data + header->section[ NAV_PACKED_AREAS ].offset );
+	const NavPackedConnect *packedConnects = (const NavPackedConnect *)( data + header->section[ NAV_PACKED_CONNECTIONS ].offset );
+	const NavPackedHidingSpot *packedSpots = (const NavPackedHidingSpot *)( data + header->section[ NAV_PACKED_HIDING_SPOTS ].offset );
+	const NavPackedEncounter *packedEncounters = (const NavPackedEncounter *)( data + header->section[ NAV_PACKED_ENCOUNTERS ].offset );
+	const NavPackedEncounterSpot *packedEncounterSpots = (const NavPackedEncounterSpot *)( data + header->section[ NAV_PACKED_ENCOUNTER_SPOTS ].offset );
+	const unsigned int *packedLadderConnects = (const unsigned int *)( data + header->section[ NAV_PACKED_LADDER_CONNECTIONS ].offset );
+	const NavPackedVisibleArea *packedVisibleAreas = (const NavPackedVisibleArea *)( data + header->section[ NAV_PACKED_VISIBLE_AREAS ].offset );
+
+	// places, ladders, and custom data keep the encoding of the .nav file
+	const NavPackedSection &places = header->section[ NAV_PACKED_PLACES ];
+	CUtlBuffer placeBuffer( data + places.offset, places.size, CUtlBuffer::READ_ONLY );
+	placeDirectory.Load( placeBuffer, header->navVersion );
+
+	const NavPackedSection &customPreArea = header->section[ NAV_PACKED_CUSTOM_PRE_AREA ];
+	CUtlBuffer customPreAreaBuffer( data + customPreArea.offset, customPreArea.size, CUtlBuffer::READ_ONLY );
+	LoadCustomDataPreArea( customPreAreaBuffer, header->subVersion );
+
+	//
+	// Create the areas and compute total extent
+	//
+	const unsigned int areaCount = header->section[ NAV_PACKED_AREAS ].count;
+
+	Extent extent;
+	extent.lo.x = 9999999999.9f;
+	extent.lo.y = 9999999999.9f;
+	extent.hi.x = -9999999999.9f;
+	extent.hi.y = -9999999999.9f;
+
+	PreLoadAreas( areaCount );
+	TheNavAreas.EnsureCapacity( areaCount );
+
+	for( unsigned int i=0; i<areaCount; ++i )
+	{
+		const NavPackedArea &packed = packedAreas[i];
+		CNavArea *area = CreateArea();
+
+		area->m_id = packed.id;
+
+		// update nextID to avoid collisions
+		if ( area->m_id >= CNavArea::m_nextID )
+			CNavArea::m_nextID = area->m_id + 1;
+
+		area->m_attributeFlags = packed.attributeFlags;
+		area->m_nwCorner.Init( packed.nwCorner[0], packed.nwCorner[1], packed.nwCorner[2] );
+		area->m_seCorner.Init( packed.seCorner[0], packed.seCorner[1], packed.seCorner[2] );
+		area->m_center = ( area->m_nwCorner + area->m_seCorner ) / 2.0f;
+
+		if ( ( area->m_seCorner.x - area->m_nwCorner.x ) > 0.0f && ( area->m_seCorner.y - area->m_nwCorner.y ) > 0.0f )
+		{
+			area->m_invDxCorners = 1.0f / ( area->m_seCorner.x - area->m_nwCorner.x );
+			area->m_invDyCorners = 1.0f / ( area->m_seCorner.y - area->m_nwCorner.y );
+		}
+		else
+		{
+			area->m_invDxCorners = area->m_invDyCorners = 0;
+
+			DevWarning( "Degenerate Navigation Area #%d at setpos %g %g %g\n", 
+				area->m_id, area->m_center.x, area->m_center.y, area->m_center.z );
+		}
+
+		area->m_neZ = packed.neZ;
+		area->m_swZ = packed.swZ;
+		area->m_isUnderwater = ( packed.flags & NAV_PACKED_AREA_UNDERWATER ) != 0;
+		area->SetPlace( placeDirectory.IndexToPlace( packed.placeEntry ) );
+
+		V_memcpy( area->m_earliestOccupyTime, packed.earliestOccupyTime, sizeof( area->m_earliestOccupyTime ) );
+		V_memcpy( area->m_lightIntensity, packed.lightIntensity, sizeof( area->m_lightIntensity ) );
+
+		TheNavAreas.AddToTail( area );
+
+		extent.lo.x = MIN( extent.lo.x, area->m_nwCorner.x );
+		extent.lo.y = MIN( extent.lo.y, area->m_nwCorner.y );
+		extent.hi.x = MAX( extent.hi.x, area->m_seCorner.x );
+		extent.hi.y = MAX( extent.hi.y, area->m_seCorner.y );
+	}
+
+	// add the areas to the grid
+	AllocateGrid( extent.lo.x, extent.hi.x, extent.lo.y, extent.hi.y );
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		AddNavArea( TheNavAreas[ it ] );
+	}
+
+	//
+	// Create the hiding spots
+	//
+	const unsigned int spotCount = header->section[ NAV_PACKED_HIDING_SPOTS ].count;
+
+	CUtlVector< HidingSpot * > spots;
+	spots.SetCount( spotCount );
+	TheHidingSpots.EnsureCapacity( spotCount );
+
+	unsigned int nextSpotID = HidingSpot::m_nextID;
+	for( unsigned int i=0; i<spotCount; ++i )
+	{
+		const NavPackedHidingSpot &packed = packedSpots[i];
+		HidingSpot *spot = CreateHidingSpot();
+
+		spot->m_id = packed.id;
+		spot->m_pos.Init( packed.pos[0], packed.pos[1], packed.pos[2] );
+		spot->m_flags = packed.flags;
+		spot->m_area = ( packed.area != NAV_PACKED_NO_INDEX ) ? TheNavAreas[ packed.area ] : NULL;
+
+		if ( !spot->m_area )
+		{
+			DevWarning( "A Hiding Spot is off of the Nav Mesh at setpos %.0f %.0f %.0f\n", spot->m_pos.x, spot->m_pos.y, spot->m_pos.z );
+		}
+
+		nextSpotID = MAX( nextSpotID, spot->m_id + 1 );
+		spots[i] = spot;
+	}
+	HidingSpot::m_nextID = nextSpotID;
+
+	//
+	// Set up all the ladders, which refer to areas by ID
+	//
+	const NavPackedSection &ladders = header->section[ NAV_PACKED_LADDERS ];
+	CUtlBuffer ladderBuffer( data + ladders.offset, ladders.size, CUtlBuffer::READ_ONLY );
+	m_ladders.EnsureCapacity( ladders.count );
+
+	for( unsigned int i=0; i<ladders.count; ++i )
+	{
+		CNavLadder *ladder = new CNavLadder;
+		ladder->Load( ladderBuffer, header->navVersion );
+		m_ladders.AddToTail( ladder );
+	}
+
+	//
+	// Link everything together - every reference is an index, so there is nothing to look up
+	//
+	const NavPackedSection &customArea = header->section[ NAV_PACKED_CUSTOM_AREA ];
+	CUtlBuffer customAreaBuffer( data + customArea.offset, customArea.size, CUtlBuffer::READ_ONLY );
+
+	for( unsigned int i=0; i<areaCount; ++i )
+	{
+		const NavPackedArea &packed = packedAreas[i];
+		CNavArea *area = TheNavAreas[i];
+
+		const NavPackedConnect *connect = packedConnects + packed.firstConnect;
+		for( int d=0; d<NUM_DIRECTIONS; ++d )
+		{
+			area->m_connect[d].EnsureCapacity( packed.connectCount[d] );
+			for( int c=0; c<packed.connectCount[d]; ++c, ++connect )
+			{
+				NavConnect con;
+				con.area = TheNavAreas[ connect->area ];
+				con.length = connect->length;
+				area->m_connect[d].AddToTail( con );
+			}
+		}
+
+		for( int d=0; d<NUM_DIRECTIONS; ++d )
+		{
+			area->m_incomingConnect[d].EnsureCapacity( packed.incomingConnectCount[d] );
+			for( int c=0; c<packed.incomingConnectCount[d]; ++c, ++connect )
+			{
+				NavConnect con;
+				con.area = TheNavAreas[ connect->area ];
+				con.length = connect->length;
+				area->m_incomingConnect[d].AddToTail( con );
+			}
+		}
+
+		area->m_hidingSpots.EnsureCapacity( packed.hidingSpotCount );
+		for( int h=0; h<packed.hidingSpotCount; ++h )
+		{
+			area->m_hidingSpots.AddToTail( spots[ packed.firstHidingSpot + h ] );
+		}
+
+		area->m_spotEncounters.EnsureCapacity( packed.encounterCount );
+		for( int e=0; e<packed.encounterCount; ++e )
+		{
+			const NavPackedEncounter &packedEncounter = packedEncounters[ packed.firstEncounter + e ];
+			SpotEncounter *encounter = new SpotEncounter;
+
+			encounter->from.area = TheNavAreas[ packedEncounter.fromArea ];
+			encounter->fromDir = (NavDirType)packedEncounter.fromDir;
+			encounter->to.area = TheNavAreas[ packedEncounter.toArea ];
+			encounter->toDir = (NavDirType)packedEncounter.toDir;
+			encounter->path.from.Init( packedEncounter.pathFrom[0], packedEncounter.pathFrom[1], packedEncounter.pathFrom[2] );
+			encounter->path.to.Init( packedEncounter.pathTo[0], packedEncounter.pathTo[1], packedEncounter.pathTo[2] );
+
+			encounter->spots.EnsureCapacity( packedEncounter.spotCount );
+			for( int s=0; s<packedEncounter.spotCount; ++s )
+			{
+				const NavPackedEncounterSpot &packedSpot = packedEncounterSpots[ packedEncounter.firstSpot + s ];
+
+				SpotOrder order;
+				order.spot = spots[ packedSpot.spot ];
+				order.t = packedSpot.t;
+				encounter->spots.AddToTail( order );
+			}
+
+			area->m_spotEncounters.AddToTail( encounter );
+		}
+
+		const unsigned int *ladderConnect = packedLadderConnects + packed.firstLadder;
+		for( int l=0; l<CNavLadder::NUM_LADDER_DIRECTIONS; ++l )
+		{
+			area->m_ladder[l].EnsureCapacity( packed.ladderCount[l] );
+			for( int c=0; c<packed.ladderCount[l]; ++c, ++ladderConnect )
+			{
+				NavLadderConnect con;
+				con.ladder = m_ladders[ *ladderConnect ];
+				area->m_ladder[l].AddToTail( con );
+			}
+		}
+
+		area->m_potentiallyVisibleAreas.EnsureCapacity( packed.visibleAreaCount );
+		for( unsigned int v=0; v<packed.visibleAreaCount; ++v )
+		{
+			const NavPackedVisibleArea &packedVisible = packedVisibleAreas[ packed.firstVisibleArea + v ];
+
+			CNavArea::AreaBindInfo info;
+			info.area = TheNavAreas[ packedVisible.area ];
+			info.attributes = (unsigned char)packedVisible.attributes;
+			area->m_potentiallyVisibleAreas.AddToTail( info );
+		}
+
+		area->m_inheritVisibilityFrom.area = ( packed.inheritVisibilityFrom != NAV_PACKED_NO_INDEX ) ? TheNavAreas[ packed.inheritVisibilityFrom ] : NULL;
+
+		if ( area->LoadPackedCustomData( customAreaBuffer, header->subVersion ) != NAV_OK )
+		{
+			Warning( "CNavMesh::LoadPacked: Can't read custom data for area #%d.\n", area->GetID() );
+		}
+
+		// func avoid/prefer attributes are controlled by func_nav_cost entities
+		area->ClearAllNavCostEntities();
+	}
+
+	ValidateNavAreaConnections();
+
+	//
+	// Load derived class mesh info
+	//
+	const NavPackedSection &custom = header->section[ NAV_PACKED_CUSTOM ];
+	CUtlBuffer customBuffer( data + custom.offset, custom.size, CUtlBuffer::READ_ONLY );
+	LoadCustomData( customBuffer, header->subVersion );
+
+	ComputeBattlefrontAreas();
+
+	// TERROR: loading into a map directly creates entities before the mesh is loaded.  Tell the preexisting
+	// entities now that the mesh is loaded so they can update areas.
+	for ( int i=0; i<m_avoidanceObstacles.Count(); ++i )
+	{
+		m_avoidanceObstacles[i]->OnNavMeshLoaded();
+	}
+
+	if ( m_isAnalyzed )
+	{
+		SnapshotAnalyzedAreas();
+	}
+
+	// the Navigation Mesh has been successfully loaded
+	m_isLoaded = true;
+	m_isLoadedFromPackedFile = true;
+
+	WarnIfMeshNeedsAnalysis( NavCurrentVersion );
+
+	return NAV_OK;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Load the Navigation Mesh from either the .nav file or the packed nav file
+ */
+static NavErrorType LoadNavFileFormat( bool packed )
+{
+	bool wasPacked = nav_load_packed.GetBool();
+	nav_load_packed.SetValue( packed );
+
+	NavErrorType result = TheNavMesh->Load();
+
+	nav_load_packed.SetValue( wasPacked );
+	return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CommandNavConvertPacked( void )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( TheNavMesh->IsGenerating() )
+	{
+		Msg( "Cannot convert the Navigation Mesh while it is being generated.\n" );
+		return;
+	}
+
+	// convert what is in the .nav file, not what may have been edited since
+	if ( LoadNavFileFormat( false ) != NAV_OK )
+	{
+		Msg( "ERROR: Navigation Mesh load failed.\n" );
+		return;
+	}
+
+	if ( TheNavMesh->SavePacked() )
+	{
+		Msg( "Packed navigation map for '%s' saved.\n", STRING( gpGlobals->mapname ) );
+	}
+	else
+	{
+		Msg( "ERROR: Cannot save packed navigation map for '%s'.\n", STRING( gpGlobals->mapname ) );
+	}
+}
+static ConCommand nav_convert_packed( "nav_convert_packed", CommandNavConvertPacked, "Reloads the .nav file for the current map and writes it out as a packed nav file (.navp), which loads faster.", FCVAR_GAMEDLL | FCVAR_CHEAT );
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CommandNavBenchLoad( const CCommand &args )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( TheNavMesh->IsGenerating() )
+	{
+		Msg( "Cannot load the Navigation Mesh while it is being generated.\n" );
+		return;
+	}
+
+	int iterations = ( args.ArgC() > 1 ) ? MAX( 1, atoi( args[1] ) ) : 5;
+
+	for( int packed=0; packed<2; ++packed )
+	{
+		float totalTime = 0.0f;
+		float bestTime = FLT_MAX;
+		int loaded = 0;
+
+		for( int i=0; i<iterations; ++i )
+		{
+			CFastTimer timer;
+			timer.Start();
+			NavErrorType result = LoadNavFileFormat( packed != 0 );
+			timer.End();
+
+			if ( result != NAV_OK || TheNavMesh->IsLoadedFromPackedFile() != ( packed != 0 ) )
+				break;
+
+			float time = timer.GetDuration().GetMillisecondsF();
+			totalTime += time;
+			bestTime = MIN( bestTime, time );
+			++loaded;
+		}
+
+		const char *format = packed ? "packed .navp" : ".nav";
+		if ( loaded < iterations )
+		{
+			Msg( "%-14s could not be loaded%s\n", format, packed ? " - run nav_convert_packed first" : "" );
+			continue;
+		}
+
+		Msg( "%-14s %d areas, %d loads: average %.2f ms, best %.2f ms\n", format, TheNavAreas.Count(), loaded, totalTime / loaded, bestTime );
+	}
+
+	// leave the mesh loaded the usual way
+	if ( TheNavMesh->Load() != NAV_OK )
+	{
+		Msg( "ERROR: Navigation Mesh load failed.\n" );
+	}
+}
+static ConCommand nav_bench_load( "nav_bench_load", CommandNavBenchLoad, "Times loading the Navigation Mesh from the .nav file and from the packed nav file.  Arguments: [iterations]", FCVAR_GAMEDLL | FCVAR_CHEAT );
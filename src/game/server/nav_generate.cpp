@@ -17,6 +17,7 @@
 #include "viewport_panel_names.h"
 //#include "terror/TerrorShared.h"
 #include "fmtstr.h"
+#include "vstdlib/jobthread.h"
 
 #ifdef TERROR
 #include "func_simpleladder.h"
@@ -43,6 +44,7 @@ ConVar nav_generate_jump_connections( "nav_generate_jump_connections", "1", FCVA
 ConVar nav_generate_incremental_range( "nav_generate_incremental_range", "2000", FCVAR_CHEAT );
 ConVar nav_generate_incremental_tolerance( "nav_generate_incremental_tolerance", "0", FCVAR_CHEAT, "Z tolerance for adding new nav areas." );
 ConVar nav_area_max_size( "nav_area_max_size", "50", FCVAR_CHEAT, "Max area size created in nav generation" );
+ConVar nav_analyze_threaded( "nav_analyze_threaded", "1", FCVAR_CHEAT, "Run the nav mesh analysis steps on all available threads" );
 
 // Common bounding box for traces
 Vector NavTraceMins( -0.45, -0.45, 0 );
@@ -3489,7 +3491,7 @@ void CNavMesh::BeginGeneration( bool incremental )
 /**
  * Re-analyze an existing Mesh.  Determine Hiding Spots, Encounter Spots, etc.
  */
-void CNavMesh::BeginAnalysis( bool quitWhenFinished )
+void CNavMesh::BeginAnalysis( bool quitWhenFinished, bool incremental )
 {
 #ifdef TERROR
 	if ( !engine->IsDedicatedServer() )
@@ -3542,16 +3544,40 @@ void CNavMesh::BeginAnalysis( bool quitWhenFinished )
 		}
 	}
 
-	DestroyHidingSpots();
+	m_generationMode = GENERATE_ANALYSIS_ONLY;
+
+	if ( incremental )
+	{
+		if ( CollectIncrementalAnalysisAreas() )
+		{
+			m_generationMode = GENERATE_ANALYSIS_INCREMENTAL;
+		}
+		else
+		{
+			Msg( "Navigation mesh has not been analyzed since it was loaded.  Doing a full analysis.\n" );
+		}
+	}
+
+	if ( m_generationMode == GENERATE_ANALYSIS_ONLY )
+	{
+		DestroyHidingSpots();
+		m_analysisAreas = TheNavAreas;
+		m_encounterAreas = TheNavAreas;
+	}
+
 	m_generationState = FIND_HIDING_SPOTS;
 	m_generationIndex = 0;
-	m_generationMode = GENERATE_ANALYSIS_ONLY;
 	m_bQuitWhenFinished = quitWhenFinished;
 	lastMsgTime = 0.0f;
 	m_generationStartTime = Plat_FloatTime();
+	V_memset( m_analysisPhaseName, 0, sizeof( m_analysisPhaseName ) );
+	V_memset( m_analysisPhaseTime, 0, sizeof( m_analysisPhaseTime ) );
+	V_memset( m_analysisPhaseAreas, 0, sizeof( m_analysisPhaseAreas ) );
 }
 
 
+
+
 //--------------------------------------------------------------------------------------------------------------
 void ShowViewPortPanelToAll( const char * name, bool bShow, KeyValues *data )
 {
@@ -3628,6 +3654,325 @@ static void HideAnalysisProgress( void )
 }
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return a checksum of everything about an area that the analysis depends on
+ */
+CRC32_t CNavMesh::ComputeAnalysisSignature( const CNavArea *area ) const
+{
+	CRC32_t crc;
+	CRC32_Init( &crc );
+
+	for( int c=0; c<NUM_CORNERS; ++c )
+	{
+		Vector corner = area->GetCorner( (NavCornerType)c );
+		CRC32_ProcessBuffer( &crc, &corner, sizeof( corner ) );
+	}
+
+	int attributes = area->GetAttributes();
+	CRC32_ProcessBuffer( &crc, &attributes, sizeof( attributes ) );
+
+	for( int d=0; d<NUM_DIRECTIONS; ++d )
+	{
+		const NavConnectVector *adjacent = area->GetAdjacentAreas( (NavDirType)d );
+		FOR_EACH_VEC( (*adjacent), it )
+		{
+			unsigned int id = (*adjacent)[ it ].area->GetID();
+			CRC32_ProcessBuffer( &crc, &id, sizeof( id ) );
+		}
+
+		// separate the directions, so moving a connection to another side changes the checksum
+		CRC32_ProcessBuffer( &crc, &d, sizeof( d ) );
+	}
+
+	for( int l=0; l<CNavLadder::NUM_LADDER_DIRECTIONS; ++l )
+	{
+		const NavLadderConnectVector *ladders = area->GetLadders( (CNavLadder::LadderDirectionType)l );
+		FOR_EACH_VEC( (*ladders), it )
+		{
+			unsigned int id = (*ladders)[ it ].ladder->GetID();
+			CRC32_ProcessBuffer( &crc, &id, sizeof( id ) );
+		}
+	}
+
+	CRC32_Final( &crc );
+	return crc;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Remember the current state of every area, so later edits can be analyzed incrementally
+ */
+void CNavMesh::SnapshotAnalyzedAreas( void )
+{
+	m_analyzedAreas.RemoveAll();
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		const CNavArea *area = TheNavAreas[ it ];
+
+		AnalyzedArea analyzed;
+		analyzed.signature = ComputeAnalysisSignature( area );
+		area->GetExtent( &analyzed.extent );
+
+		m_analyzedAreas.Insert( area->GetID(), analyzed );
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Find the areas that have to be re-analyzed after the mesh was edited.  Areas that were added,
+ * resized, reconnected, or had their attributes changed, and their neighbors, get new hiding spots.
+ * Every area that can see a changed or deleted area gets new spot encounters.
+ */
+bool CNavMesh::CollectIncrementalAnalysisAreas( void )
+{
+	if ( m_analyzedAreas.Count() == 0 )
+		return false;
+
+	m_analysisAreas.RemoveAll();
+	m_encounterAreas.RemoveAll();
+
+	// the regions whose hiding spots may change - old and new extents of changed areas, and deleted areas
+	CUtlVector< Extent > changedRegions;
+
+	CUtlRBTree< unsigned int > liveIDs( 0, 0, DefLessFunc( unsigned int ) );
+
+	CNavArea::MakeNewMarker();
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		CNavArea *area = TheNavAreas[ it ];
+		liveIDs.Insert( area->GetID() );
+
+		unsigned short index = m_analyzedAreas.Find( area->GetID() );
+		if ( m_analyzedAreas.IsValidIndex( index ) )
+		{
+			if ( m_analyzedAreas[ index ].signature == ComputeAnalysisSignature( area ) )
+				continue;
+
+			changedRegions.AddToTail( m_analyzedAreas[ index ].extent );
+		}
+
+		// this area is new or changed - it and its neighbors need new hiding spots
+		if ( !area->IsMarked() )
+		{
+			area->Mark();
+			m_analysisAreas.AddToTail( area );
+		}
+
+		for( int d=0; d<NUM_DIRECTIONS; ++d )
+		{
+			const NavConnectVector *adjacent[2] = { area->GetAdjacentAreas( (NavDirType)d ), area->GetIncomingConnections( (NavDirType)d ) };
+			for( int a=0; a<2; ++a )
+			{
+				FOR_EACH_VEC( (*adjacent[a]), cit )
+				{
+					CNavArea *neighbor = (*adjacent[a])[ cit ].area;
+					if ( !neighbor->IsMarked() )
+					{
+						neighbor->Mark();
+						m_analysisAreas.AddToTail( neighbor );
+					}
+				}
+			}
+		}
+	}
+
+	FOR_EACH_MAP_FAST( m_analyzedAreas, mit )
+	{
+		if ( !liveIDs.HasElement( m_analyzedAreas.Key( mit ) ) )
+		{
+			changedRegions.AddToTail( m_analyzedAreas[ mit ].extent );
+		}
+	}
+
+	FOR_EACH_VEC( m_analysisAreas, it )
+	{
+		Extent extent;
+		m_analysisAreas[ it ]->GetExtent( &extent );
+		changedRegions.AddToTail( extent );
+	}
+
+	// any area whose paths pass within sight range of a changed region may encounter different spots
+	const float range = CNavArea::GetSpotEncounterRange() + HumanHeight;
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		CNavArea *area = TheNavAreas[ it ];
+
+		Extent extent;
+		area->GetExtent( &extent );
+		extent.lo -= Vector( range, range, range );
+		extent.hi += Vector( range, range, range );
+
+		FOR_EACH_VEC( changedRegions, rit )
+		{
+			if ( extent.IsOverlapping( changedRegions[ rit ] ) )
+			{
+				m_encounterAreas.AddToTail( area );
+				break;
+			}
+		}
+	}
+
+	// encounters refer to hiding spots and areas that are about to be destroyed, so drop them now
+	FOR_EACH_VEC( m_encounterAreas, it )
+	{
+		m_encounterAreas[ it ]->m_spotEncounters.PurgeAndDeleteElements();
+	}
+
+	// hiding spots of deleted areas are no longer owned by any area
+	CUtlRBTree< HidingSpot * > ownedSpots( 0, 0, DefLessFunc( HidingSpot * ) );
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		const HidingSpotVector *spots = TheNavAreas[ it ]->GetHidingSpots();
+		FOR_EACH_VEC( (*spots), sit )
+		{
+			ownedSpots.Insert( (*spots)[ sit ] );
+		}
+	}
+
+	for( int i=TheHidingSpots.Count()-1; i>=0; --i )
+	{
+		if ( !ownedSpots.HasElement( TheHidingSpots[i] ) )
+		{
+			delete TheHidingSpots[i];
+			TheHidingSpots.Remove( i );
+		}
+	}
+
+	Msg( "Incremental analysis: %d of %d areas changed, %d need new spot encounters.\n", m_analysisAreas.Count(), TheNavAreas.Count(), m_encounterAreas.Count() );
+
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+struct NavAnalysisJob
+{
+	CNavArea *area;
+	int spotCount;
+	CNavArea::HidingSpotCandidate spots[ NUM_CORNERS ];
+};
+
+static void FindHidingSpotsJob( NavAnalysisJob &job )
+{
+	job.spotCount = job.area->FindHidingSpots( job.spots );
+}
+
+static void ComputeSpotEncountersJob( NavAnalysisJob &job )
+{
+	job.area->ComputeSpotEncounters();
+}
+
+static void ComputeSniperSpotsJob( NavAnalysisJob &job )
+{
+	job.area->ComputeSniperSpots();
+}
+
+static void ComputeEarliestOccupyTimesJob( NavAnalysisJob &job )
+{
+	job.area->ComputeEarliestOccupyTimes();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Run the current per-area analysis step over the given areas, in batches of parallel jobs, until
+ * done or out of time.  Return true when every area has been processed.
+ */
+bool CNavMesh::RunAnalysisPhase( const char *msg, const NavAreaVector &areas, double startTime, float maxTime )
+{
+	void (*pfnJob)( NavAnalysisJob & ) = NULL;
+	bool isThreaded = nav_analyze_threaded.GetBool();
+
+	switch( m_generationState )
+	{
+		case FIND_HIDING_SPOTS:				pfnJob = FindHidingSpotsJob; break;
+		case FIND_ENCOUNTER_SPOTS:			pfnJob = ComputeSpotEncountersJob; break;
+		case FIND_SNIPER_SPOTS:				pfnJob = ComputeSniperSpotsJob; break;
+		case FIND_EARLIEST_OCCUPY_TIMES:
+			pfnJob = ComputeEarliestOccupyTimesJob;
+			isThreaded = isThreaded && CNavArea::IsEarliestOccupyTimeThreadSafe();
+			break;
+		default:
+			Assert( !"RunAnalysisPhase: not a per-area analysis step" );
+			return true;
+	}
+
+	if ( m_generationIndex == 0 )
+	{
+		m_analysisPhaseStartTime = Plat_FloatTime();
+	}
+
+	// small batches keep us responsive to the time allotment
+	const int batchSize = 64;
+	NavAnalysisJob jobs[ batchSize ];
+
+	while( m_generationIndex < areas.Count() )
+	{
+		int count = MIN( batchSize, areas.Count() - m_generationIndex );
+		for( int i=0; i<count; ++i )
+		{
+			jobs[i].area = areas[ m_generationIndex + i ];
+			jobs[i].spotCount = 0;
+		}
+
+		if ( isThreaded && count > 1 )
+		{
+			ParallelProcess( msg, jobs, count, pfnJob );
+		}
+		else
+		{
+			for( int i=0; i<count; ++i )
+			{
+				pfnJob( jobs[i] );
+			}
+		}
+
+		if ( m_generationState == FIND_HIDING_SPOTS )
+		{
+			// create the spots in area order, so their IDs don't depend on thread timing
+			for( int i=0; i<count; ++i )
+			{
+				jobs[i].area->SetHidingSpots( jobs[i].spots, jobs[i].spotCount );
+			}
+		}
+
+		m_generationIndex += count;
+
+		// don't go over our time allotment
+		if( Plat_FloatTime() - startTime > maxTime )
+		{
+			AnalysisProgress( msg, 100, 100 * m_generationIndex / areas.Count() );
+			return false;
+		}
+	}
+
+	FinishAnalysisPhase( msg, areas.Count() );
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Report the time spent in the current analysis step, started when m_generationIndex was zero
+ */
+void CNavMesh::FinishAnalysisPhase( const char *msg, int areaCount )
+{
+	float elapsed = Plat_FloatTime() - m_analysisPhaseStartTime;
+
+	m_analysisPhaseName[ m_generationState ] = msg;
+	m_analysisPhaseTime[ m_generationState ] += elapsed;
+	m_analysisPhaseAreas[ m_generationState ] = areaCount;
+
+	Msg( "%sDONE (%d areas, %.2f seconds)\n", msg, areaCount, elapsed );
+}
+
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Process the auto-generation for 'maxTime' seconds. return false if generation is complete.
@@ -3707,6 +4052,12 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 				}
 			}
 
+			m_analysisAreas = TheNavAreas;
+			m_encounterAreas = TheNavAreas;
+			V_memset( m_analysisPhaseName, 0, sizeof( m_analysisPhaseName ) );
+			V_memset( m_analysisPhaseTime, 0, sizeof( m_analysisPhaseTime ) );
+			V_memset( m_analysisPhaseAreas, 0, sizeof( m_analysisPhaseAreas ) );
+
 			m_generationState = FIND_HIDING_SPOTS;
 			m_generationIndex = 0;
 			return true;
@@ -3715,22 +4066,8 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 		//---------------------------------------------------------------------------
 		case FIND_HIDING_SPOTS:
 		{
-			while( m_generationIndex < TheNavAreas.Count() )
-			{
-				CNavArea *area = TheNavAreas[ m_generationIndex ];
-				++m_generationIndex;
-
-				area->ComputeHidingSpots();
-
-				// don't go over our time allotment
-				if( Plat_FloatTime() - startTime > maxTime )
-				{
-					AnalysisProgress( "Finding hiding spots...", 100, 100 * m_generationIndex / TheNavAreas.Count() );
-					return true;
-				}
-			}
-
-			Msg( "Finding hiding spots...DONE\n" );
+			if ( !RunAnalysisPhase( "Finding hiding spots...", m_analysisAreas, startTime, maxTime ) )
+				return true;
 
 			m_generationState = FIND_ENCOUNTER_SPOTS;
 			m_generationIndex = 0;
@@ -3740,22 +4077,8 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 		//---------------------------------------------------------------------------
 		case FIND_ENCOUNTER_SPOTS:
 		{
-			while( m_generationIndex < TheNavAreas.Count() )
-			{
-				CNavArea *area = TheNavAreas[ m_generationIndex ];
-				++m_generationIndex;
-
-				area->ComputeSpotEncounters();
-
-				// don't go over our time allotment
-				if( Plat_FloatTime() - startTime > maxTime )
-				{
-					AnalysisProgress( "Finding encounter spots...", 100, 100 * m_generationIndex / TheNavAreas.Count() );
-					return true;
-				}
-			}
-
-			Msg( "Finding encounter spots...DONE\n" );
+			if ( !RunAnalysisPhase( "Finding encounter spots...", m_encounterAreas, startTime, maxTime ) )
+				return true;
 
 			m_generationState = FIND_SNIPER_SPOTS;
 			m_generationIndex = 0;
@@ -3765,25 +4088,21 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 		//---------------------------------------------------------------------------
 		case FIND_SNIPER_SPOTS:
 		{
-			while( m_generationIndex < TheNavAreas.Count() )
-			{
-				CNavArea *area = TheNavAreas[ m_generationIndex ];
-				++m_generationIndex;
+			if ( !RunAnalysisPhase( "Finding sniper spots...", m_analysisAreas, startTime, maxTime ) )
+				return true;
 
-				area->ComputeSniperSpots();
+			m_generationIndex = 0;
 
-				// don't go over our time allotment
-				if( Plat_FloatTime() - startTime > maxTime )
-				{
-					AnalysisProgress( "Finding sniper spots...", 100, 100 * m_generationIndex / TheNavAreas.Count() );
-					return true;
-				}
+			if ( m_generationMode == GENERATE_ANALYSIS_INCREMENTAL )
+			{
+				// editing the mesh already threw away the visibility of the areas involved
+				Msg( "Skipping mesh visibility - run a full nav_analyze to recompute it.\n" );
+				m_generationState = FIND_EARLIEST_OCCUPY_TIMES;
+				return true;
 			}
 
-			Msg( "Finding sniper spots...DONE\n" );
-
 			m_generationState = COMPUTE_MESH_VISIBILITY;
-			m_generationIndex = 0;
+			m_analysisPhaseStartTime = Plat_FloatTime();
 			BeginVisibilityComputations();
 			Msg( "Computing mesh visibility...\n" );
 		
@@ -3812,7 +4131,7 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 
 			EndVisibilityComputations();
 
-			Msg( "Computing mesh visibility...DONE\n" );
+			FinishAnalysisPhase( "Computing mesh visibility...", TheNavAreas.Count() );
 
 			m_generationState = FIND_EARLIEST_OCCUPY_TIMES;
 			m_generationIndex = 0;
@@ -3822,25 +4141,11 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 		//---------------------------------------------------------------------------
 		case FIND_EARLIEST_OCCUPY_TIMES:
 		{
-			while( m_generationIndex < TheNavAreas.Count() )
-			{
-				CNavArea *area = TheNavAreas[ m_generationIndex ];
-				++m_generationIndex;
-
-				area->ComputeEarliestOccupyTimes();
-
-				// don't go over our time allotment
-				if( Plat_FloatTime() - startTime > maxTime )
-				{
-					AnalysisProgress( "Finding earliest occupy times...", 100, 100 * m_generationIndex / TheNavAreas.Count() );
-					return true;
-				}
-			}
-
-			Msg( "Finding earliest occupy times...DONE\n" );
+			if ( !RunAnalysisPhase( "Finding earliest occupy times...", m_analysisAreas, startTime, maxTime ) )
+				return true;
 
 #ifdef NAV_ANALYZE_LIGHT_INTENSITY
-			bool shouldSkipLightComputation = ( m_generationMode == GENERATE_INCREMENTAL || engine->IsDedicatedServer() );
+			bool shouldSkipLightComputation = ( IsIncrementalGeneration() || engine->IsDedicatedServer() );
 #else
 			bool shouldSkipLightComputation = true;
 #endif
@@ -3958,7 +4263,8 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 		{
 			if ( m_generationIndex == 0 )
 			{
-				BeginCustomAnalysis( m_generationMode == GENERATE_INCREMENTAL );
+				m_analysisPhaseStartTime = Plat_FloatTime();
+				BeginCustomAnalysis( IsIncrementalGeneration() );
 				Msg( "Start custom...\n ");
 			}
 			while( m_generationIndex < TheNavAreas.Count() )
@@ -3966,7 +4272,7 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 				CNavArea *area = TheNavAreas[ m_generationIndex ];
 				++m_generationIndex;
 
-				area->CustomAnalysis( m_generationMode == GENERATE_INCREMENTAL );
+				area->CustomAnalysis( IsIncrementalGeneration() );
 
 				// don't go over our time allotment
 				if( Plat_FloatTime() - startTime > maxTime )
@@ -3980,7 +4286,7 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 			PostCustomAnalysis();
 
 			EndCustomAnalysis();
-			Msg( "Custom game-specific analysis...DONE\n" );
+			FinishAnalysisPhase( "Custom game-specific analysis...", TheNavAreas.Count() );
 
 			m_generationState = SAVE_NAV_MESH;
 			m_generationIndex = 0;
@@ -3998,10 +4304,22 @@ bool CNavMesh::UpdateGeneration( float maxTime )
 				m_isAnalyzed = true;
 			}
 
+			if ( m_isAnalyzed )
+			{
+				SnapshotAnalyzedAreas();
+			}
+
 			// generation complete!
 			float generationTime = Plat_FloatTime() - m_generationStartTime;
 			Msg( "Generation complete!  %0.1f seconds elapsed.\n", generationTime );
-			bool restart = m_generationMode != GENERATE_INCREMENTAL;
+			for( int i=0; i<NUM_GENERATION_STATES; ++i )
+			{
+				if ( m_analysisPhaseName[i] )
+				{
+					Msg( "  %-40s %6d areas %8.2f seconds\n", m_analysisPhaseName[i], m_analysisPhaseAreas[i], m_analysisPhaseTime[i] );
+				}
+			}
+			bool restart = !IsIncrementalGeneration();
 			m_generationMode = GENERATE_NONE;
 			m_isLoaded = true;
 			ClearWalkableSeeds();
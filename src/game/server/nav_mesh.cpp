@@ -71,6 +71,7 @@ CNavMesh::CNavMesh( void )
 	m_hostThreadModeRestoreValue = 0;
 	m_placeCount = 0;
 	m_placeName = NULL;
+	m_analyzedAreas.SetLessFunc( DefLessFunc( unsigned int ) );
 
 	LoadPlaceDatabase();
 
@@ -110,6 +111,9 @@ void CNavMesh::Reset( void )
 	ClearWalkableSeeds();
 
 	m_isAnalyzed = false;
+	m_isLoadedFromPackedFile = false;
+	m_analyzedAreas.RemoveAll();
+	V_memset( m_analysisPhaseName, 0, sizeof( m_analysisPhaseName ) );
 	m_isOutOfDate = false;
 	m_isEditing = false;
 	m_navPlace = UNDEFINED_PLACE;
@@ -212,6 +216,7 @@ void CNavMesh::DestroyNavigationMesh( bool incremental )
 		m_grid.RemoveAll();
 		m_gridSizeX = 0;
 		m_gridSizeY = 0;
+		m_spatialIndex.Purge();
 	}
 
 	// clear the hash table
@@ -291,6 +296,8 @@ void CNavMesh::Update( void )
 		}
 	}
 
+	UpdateSpatialIndex();
+
 	if (nav_show_danger.GetBool())
 	{
 		DrawDanger();
@@ -462,6 +469,38 @@ void CNavMesh::AllocateGrid( float minX, float maxX, float minY, float maxY )
 	m_gridSizeY = (int)((maxY - minY) / m_gridCellSize) + 1;
 
 	m_grid.SetCount( m_gridSizeX * m_gridSizeY );
+
+	m_spatialIndex.Invalidate();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Rebuild the packed spatial index if the grid has changed since it was built.
+ * Areas can be reshaped in place while editing, so the index is not used until editing stops.
+ */
+void CNavMesh::UpdateSpatialIndex( void )
+{
+	if ( !nav_spatial_index.GetBool() )
+	{
+		if ( m_spatialIndex.GetCellCount() )
+		{
+			m_spatialIndex.Purge();
+		}
+		return;
+	}
+
+	if ( m_isEditing || IsGenerating() || !m_grid.Count() )
+	{
+		m_spatialIndex.Invalidate();
+		return;
+	}
+
+	bool buildBVH = nav_spatial_index_bvh.GetBool();
+	if ( m_spatialIndex.IsValid() && m_spatialIndex.WasBuiltWithBVH() == buildBVH )
+		return;
+
+	m_spatialIndex.Build( m_grid, buildBVH );
 }
 
 //--------------------------------------------------------------------------------------------------------------
@@ -514,6 +553,8 @@ void CNavMesh::AddNavArea( CNavArea *area )
 		m_transientAreas.AddToTail( area );
 	}
 
+	m_spatialIndex.Invalidate();
+
 	++m_areaCount;
 }
 
@@ -537,6 +578,8 @@ void CNavMesh::RemoveNavArea( CNavArea *area )
 		}
 	}
 
+	m_spatialIndex.Invalidate();
+
 	// remove from hash table
 	int key = ComputeHashKey( area->GetID() );
 
@@ -698,40 +741,41 @@ CNavArea *CNavMesh::GetNavArea( const Vector &pos, float beneathLimit ) const
 	if ( !m_grid.Count() )
 		return NULL;
 
+	if ( CNavAreaSpatialIndex::IsRecording() )
+	{
+		CNavAreaSpatialIndex::RecordQuery( pos );
+	}
+
 	// get list in cell that contains position
 	int x = WorldToGridX( pos.x );
 	int y = WorldToGridY( pos.y );
-	NavAreaVector *areaVector = &m_grid[ x + y*m_gridSizeX ];
+	int cell = x + y*m_gridSizeX;
 
 	// search cell list to find correct area
 	CNavArea *use = NULL;
 	float useZ = -99999999.9f;
 	Vector testPos = pos + Vector( 0, 0, 5 );
 
-	FOR_EACH_VEC( (*areaVector), it )
+	// only visits areas whose 2D boundaries contain the position
+	CNavAreaSpatialIndex::OverlapIterator overlapping( m_spatialIndex, m_grid[ cell ], cell, testPos );
+	while( CNavArea *area = overlapping.Next() )
 	{
-		CNavArea *area = (*areaVector)[ it ];
-
-		// check if position is within 2D boundaries of this area
-		if (area->IsOverlapping( testPos ))
-		{
-			// project position onto area to get Z
-			float z = area->GetZ( testPos );
+		// project position onto area to get Z
+		float z = area->GetZ( testPos );
 
-			// if area is above us, skip it
-			if (z > testPos.z)
-				continue;
+		// if area is above us, skip it
+		if (z > testPos.z)
+			continue;
 
-			// if area is too far below us, skip it
-			if (z < pos.z - beneathLimit)
-				continue;
+		// if area is too far below us, skip it
+		if (z < pos.z - beneathLimit)
+			continue;
 
-			// if area is higher than the one we have, use this instead
-			if (z > useZ)
-			{
-				use = area;
-				useZ = z;
-			}
+		// if area is higher than the one we have, use this instead
+		if (z > useZ)
+		{
+			use = area;
+			useZ = z;
 		}
 	}
 
@@ -766,24 +810,26 @@ CNavArea *CNavMesh::GetNavArea( CBaseEntity *pEntity, int nFlags, float flBeneat
 		flStepHeight = StepHeight;
 	}
 
+	if ( CNavAreaSpatialIndex::IsRecording() )
+	{
+		CNavAreaSpatialIndex::RecordQuery( testPos );
+	}
+
 	// get list in cell that contains position
 	int x = WorldToGridX( testPos.x );
 	int y = WorldToGridY( testPos.y );
-	NavAreaVector *areaVector = &m_grid[ x + y*m_gridSizeX ];
+	int cell = x + y*m_gridSizeX;
 
 	// search cell list to find correct area
 	CNavArea *use = NULL;
 	float useZ = -99999999.9f;
 
 	bool bSkipBlockedAreas = ( ( nFlags & GETNAVAREA_ALLOW_BLOCKED_AREAS ) == 0 );
-	FOR_EACH_VEC( (*areaVector), it )
-	{
-		CNavArea *pArea = (*areaVector)[ it ];
-
-		// check if position is within 2D boundaries of this area
-		if ( !pArea->IsOverlapping( testPos ) )
-			continue;
 
+	// only visits areas whose 2D boundaries contain the position
+	CNavAreaSpatialIndex::OverlapIterator overlapping( m_spatialIndex, m_grid[ cell ], cell, testPos );
+	while( CNavArea *pArea = overlapping.Next() )
+	{
 		// don't consider blocked areas
 		if ( bSkipBlockedAreas && pArea->IsBlocked( pEntity->GetTeamNumber() ) )
 			continue;
@@ -865,7 +911,77 @@ CNavArea *CNavMesh::GetNearestNavArea( const Vector &pos, bool anyZ, float maxDi
 
 	source.z += HalfHumanHeight;
 
+	// compute the distance to an area, or return false if it can't be used
+	auto isCandidateArea = [&]( CNavArea *area, float closeDistSq, float *distSq ) -> bool
+	{
+		// don't consider blocked areas
+		if ( area->IsBlocked( team ) )
+			return false;
+
+		Vector areaPos;
+		area->GetClosestPointOnArea( source, &areaPos );
+
+		// TERROR: Using the original pos for distance calculations.  Since it's a pure 3D distance,
+		// with no Z restrictions or LOS checks, this should work for passing in bot foot positions.
+		// This needs to be ported back to CS:S.
+		*distSq = ( areaPos - pos ).LengthSqr();
+
+		// keep the closest area
+		if ( *distSq >= closeDistSq )
+			return false;
+
+		// check LOS to area
+		// REMOVED: If we do this for !anyZ, it's likely we wont have LOS and will enumerate every area in the mesh
+		// It is still good to do this in some isolated cases, however
+		if ( checkLOS )
+		{
+			trace_t result;
+
+			// make sure 'pos' is not embedded in the world
+			Vector safePos;
+
+			UTIL_TraceLine( pos, pos + Vector( 0, 0, StepHeight ), MASK_NPCSOLID_BRUSHONLY, NULL, COLLISION_GROUP_NONE, &result );
+			if ( result.startsolid )
+			{
+				// it was embedded - move it out
+				safePos = result.endpos + Vector( 0, 0, 1.0f );
+			}
+			else
+			{
+				safePos = pos;
+			}
+
+			// Don't bother tracing from the nav area up to safePos.z if it's within StepHeight of the area, since areas can be embedded in the ground a bit
+			float heightDelta = fabs(areaPos.z - safePos.z);
+			if ( heightDelta > StepHeight )
+			{
+				// trace to the height of the original point
+				UTIL_TraceLine( areaPos + Vector( 0, 0, StepHeight ), Vector( areaPos.x, areaPos.y, safePos.z ), MASK_NPCSOLID_BRUSHONLY, NULL, COLLISION_GROUP_NONE, &result );
+				
+				if ( result.fraction != 1.0f )
+				{
+					return false;
+				}
+			}
+
+			// trace to the original point's height above the area
+			UTIL_TraceLine( safePos, Vector( areaPos.x, areaPos.y, safePos.z + StepHeight ), MASK_NPCSOLID_BRUSHONLY, NULL, COLLISION_GROUP_NONE, &result );
+
+			if ( result.fraction != 1.0f )
+			{
+				return false;
+			}
+		}
+
+		return true;
+	};
+
 	// find closest nav area
+	if ( m_spatialIndex.HasBVH() )
+	{
+		// exact branch-and-bound search, the distance to an area's extent never exceeds the distance to its closest point
+		return m_spatialIndex.FindNearest( pos, closeDistSq, isCandidateArea );
+	}
 
 	// use a unique marker for this method, so it can be used within a SearchSurroundingArea() call
 	static unsigned int searchMarker = RandomInt(0, 1024*1024 );
@@ -921,68 +1037,13 @@ CNavArea *CNavMesh::GetNearestNavArea( const Vector &pos, bool anyZ, float maxDi
 					if ( area->m_nearNavSearchMarker == searchMarker )
 						continue;
 
-					// don't consider blocked areas
-					if ( area->IsBlocked( team ) )
-						continue;
-
 					// mark as visited
 					area->m_nearNavSearchMarker = searchMarker;
 
-					Vector areaPos;
-					area->GetClosestPointOnArea( source, &areaPos );
-
-					// TERROR: Using the original pos for distance calculations.  Since it's a pure 3D distance,
-					// with no Z restrictions or LOS checks, this should work for passing in bot foot positions.
-					// This needs to be ported back to CS:S.
-					float distSq = ( areaPos - pos ).LengthSqr();
-
-					// keep the closest area
-					if ( distSq >= closeDistSq )
+					float distSq;
+					if ( !isCandidateArea( area, closeDistSq, &distSq ) )
 						continue;
 
-					// check LOS to area
-					// REMOVED: If we do this for !anyZ, it's likely we wont have LOS and will enumerate every area in the mesh
-					// It is still good to do this in some isolated cases, however
-					if ( checkLOS )
-					{
-						trace_t result;
-
-						// make sure 'pos' is not embedded in the world
-						Vector safePos;
-
-						UTIL_TraceLine( pos, pos + Vector( 0, 0, StepHeight ), MASK_NPCSOLID_BRUSHONLY, NULL, COLLISION_GROUP_NONE, &result );
-						if ( result.startsolid )
-						{
-							// it was embedded - move it out
-							safePos = result.endpos + Vector( 0, 0, 1.0f );
-						}
-						else
-						{
-							safePos = pos;
-						}
-
-						// Don't bother tracing from the nav area up to safePos.z if it's within StepHeight of the area, since areas can be embedded in the ground a bit
-						float heightDelta = fabs(areaPos.z - safePos.z);
-						if ( heightDelta > StepHeight )
-						{
-							// trace to the height of the original point
-							UTIL_TraceLine( areaPos + Vector( 0, 0, StepHeight ), Vector( areaPos.x, areaPos.y, safePos.z ), MASK_NPCSOLID_BRUSHONLY, NULL, COLLISION_GROUP_NONE, &result );
-							
-							if ( result.fraction != 1.0f )
-							{
-								continue;
-							}
-						}
-
-						// trace to the original point's height above the area
-						UTIL_TraceLine( safePos, Vector( areaPos.x, areaPos.y, safePos.z + StepHeight ), MASK_NPCSOLID_BRUSHONLY, NULL, COLLISION_GROUP_NONE, &result );
-
-						if ( result.fraction != 1.0f )
-						{
-							continue;
-						}
-					}
-
 					closeDistSq = distSq;
 					close = area;
 
@@ -2634,6 +2695,20 @@ void CommandNavAnalyze( void )
 static ConCommand nav_analyze( "nav_analyze", CommandNavAnalyze, "Re-analyze the current Navigation Mesh and save it to disk.", FCVAR_GAMEDLL | FCVAR_CHEAT );
 
 
+//--------------------------------------------------------------------------------------------------------------
+void CommandNavAnalyzeIncremental( void )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( nav_edit.GetBool() )
+	{
+		TheNavMesh->BeginAnalysis( false, true );
+	}
+}
+static ConCommand nav_analyze_incremental( "nav_analyze_incremental", CommandNavAnalyzeIncremental, "Re-analyze only the areas edited since the last analysis and save the Navigation Mesh to disk.", FCVAR_GAMEDLL | FCVAR_CHEAT );
+
+
 //--------------------------------------------------------------------------------------------------------------
 void CommandNavAnalyzeScripted( const CCommand &args )
 {
@@ -20,12 +20,15 @@
 #define _NAV_MESH_H_
 
 #include "utlbuffer.h"
+#include "utlmap.h"
+#include "checksum_crc.h"
 #include "filesystem.h"
 #include "GameEventListener.h"
 
 #include "nav.h"
 #include "nav_area.h"
 #include "nav_colors.h"
+#include "nav_spatialindex.h"
 
 
 class CNavArea;
@@ -279,6 +282,8 @@ public:
 	virtual void FireGameEvent( IGameEvent *event );					// incoming event processing
 
 	virtual NavErrorType Load( void );									// load navigation data from a file
+	NavErrorType LoadPacked( void );									// load navigation data from the packed nav file, if it is up to date
+	bool IsLoadedFromPackedFile( void ) const	{ return m_isLoadedFromPackedFile; }	// return true if the current mesh came from the packed nav file
 	virtual NavErrorType PostLoad( unsigned int version );				// (EXTEND) invoked after all areas have been loaded - for pointer binding, etc
 	bool IsLoaded( void ) const		{ return m_isLoaded; }				// return true if a Navigation Mesh has been loaded
 	bool IsAnalyzed( void ) const	{ return m_isAnalyzed; }			// return true if a Navigation Mesh has been analyzed
@@ -292,6 +297,7 @@ public:
 	const CUtlVector< Place > *GetPlacesFromNavFile( bool *hasUnnamedPlaces );	// Reads the used place names from the nav file (can be used to selectively precache before the nav is loaded)
 
 	virtual bool Save( void ) const;									// store Navigation Mesh to a file
+	bool SavePacked( void ) const;										// store Navigation Mesh to the packed nav file, for fast loading
 	bool IsOutOfDate( void ) const	{ return m_isOutOfDate; }			// return true if the Navigation Mesh is older than the current map version
 
 	virtual unsigned int GetSubVersionNumber( void ) const;										// returns sub-version number of data format used by derived classes
@@ -329,6 +335,7 @@ public:
 	CNavArea *GetNavAreaByID( unsigned int id ) const;
 	CNavArea *GetNearestNavArea( const Vector &pos, bool anyZ = false, float maxDist = 10000.0f, bool checkLOS = false, bool checkGround = true, int team = TEAM_ANY ) const;
 	CNavArea *GetNearestNavArea( CBaseEntity *pEntity, int nGetNavAreaFlags = GETNAVAREA_CHECK_GROUND, float maxDist = 10000.0f ) const;
+	void UpdateSpatialIndex( void );							// rebuild the packed spatial index if the mesh has changed since it was built
 
 	Place GetPlace( const Vector &pos ) const;							// return Place at given coordinate
 	const char *PlaceToName( Place place ) const;						// given a place, return its name
@@ -355,7 +362,7 @@ public:
 	//
 	#define INCREMENTAL_GENERATION true
 	void BeginGeneration( bool incremental = false );					// initiate the generation process
-	void BeginAnalysis( bool quitWhenFinished = false );						// re-analyze an existing Mesh.  Determine Hiding Spots, Encounter Spots, etc.
+	void BeginAnalysis( bool quitWhenFinished = false, bool incremental = false );	// re-analyze an existing Mesh.  Determine Hiding Spots, Encounter Spots, etc.
 
 	bool IsGenerating( void ) const		{ return m_generationMode != GENERATE_NONE; }	// return true while a Navigation Mesh is being generated
 	const char *GetPlayerSpawnName( void ) const;						// return name of player spawn entity
@@ -1091,6 +1098,7 @@ private:
 	friend class CNavUIBasePanel;
 
 	mutable CUtlVector<NavAreaVector> m_grid;
+	CNavAreaSpatialIndex m_spatialIndex;						// packed copy of m_grid, rebuilt whenever the grid changes
 	float m_gridCellSize;										// the width/height of a grid cell for spatially partitioning nav areas for fast access
 	int m_gridSizeX;
 	int m_gridSizeY;
@@ -1101,6 +1109,8 @@ private:
 	bool m_isLoaded;											// true if a Navigation Mesh has been loaded
 	bool m_isOutOfDate;											// true if the Navigation Mesh is older than the actual BSP
 	bool m_isAnalyzed;											// true if the Navigation Mesh needs analysis
+	bool m_isLoadedFromPackedFile;								// true if the Navigation Mesh was loaded from the packed nav file
+	NavErrorType LoadPackedData( const byte *data, unsigned int size, const char *navFilename );	// build the mesh from the contents of a packed nav file
 
 	enum { HASH_TABLE_SIZE = 256 };
 	CNavArea *m_hashTable[ HASH_TABLE_SIZE ];					// hash table to optimize lookup by ID
@@ -1239,9 +1249,30 @@ private:
 		GENERATE_INCREMENTAL,
 		GENERATE_SIMPLIFY,
 		GENERATE_ANALYSIS_ONLY,
+		GENERATE_ANALYSIS_INCREMENTAL,							// re-analyze only the areas changed since the last analysis
 	}
 	m_generationMode;											// true while a Navigation Mesh is being generated
 	int m_generationIndex;										// used for iterating nav areas during generation process
+	bool IsIncrementalGeneration( void ) const	{ return m_generationMode == GENERATE_INCREMENTAL || m_generationMode == GENERATE_ANALYSIS_INCREMENTAL; }
+
+	NavAreaVector m_analysisAreas;								// areas to find hiding spots, sniper spots, and occupy times for
+	NavAreaVector m_encounterAreas;								// areas to compute spot encounters for
+	bool RunAnalysisPhase( const char *msg, const NavAreaVector &areas, double startTime, float maxTime );	// run the current analysis phase over 'areas', return true when done
+	void FinishAnalysisPhase( const char *msg, int areaCount );	// report and record the time spent in the current phase
+	const char *m_analysisPhaseName[ NUM_GENERATION_STATES ];	// progress message of each analysis phase that ran
+	float m_analysisPhaseTime[ NUM_GENERATION_STATES ];			// seconds spent in each analysis phase
+	int m_analysisPhaseAreas[ NUM_GENERATION_STATES ];			// number of areas processed in each analysis phase
+	double m_analysisPhaseStartTime;
+
+	struct AnalyzedArea
+	{
+		CRC32_t signature;										// checksum of the area's geometry and connections
+		Extent extent;
+	};
+	CUtlMap< unsigned int, AnalyzedArea > m_analyzedAreas;		// the areas as of the last analysis, keyed by ID, for incremental analysis
+	CRC32_t ComputeAnalysisSignature( const CNavArea *area ) const;
+	void SnapshotAnalyzedAreas( void );							// remember the current areas as analyzed
+	bool CollectIncrementalAnalysisAreas( void );				// find the areas affected by edits since the last analysis, return false if there is no snapshot
 	int m_sampleTick;											// counter for displaying pseudo-progress while sampling walkable space
 	bool m_bQuitWhenFinished;
 	float m_generationStartTime;
@@ -0,0 +1,148 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Packed navigation mesh file layout
+//
+// $NoKeywords: $
+//
+//=============================================================================//
+// nav_packed.h
+// The packed nav file ("maps/<map>.navp") holds the same data as the .nav file, laid out
+// as flat arrays of fixed-size records.  Areas, hiding spots and ladders refer to each other
+// by array index instead of ID, so loading needs no ID lookups, and the path of each spot
+// encounter, the connection lengths, and the one-way connection lists are stored instead of
+// being recomputed.  Every section starts on a cache line boundary, and the whole file is
+// read with a single call into a cache line aligned block whose records are read in place
+// while building the mesh.
+//
+// The packed file is a cache of the .nav file it was converted from, never the original:
+// it is ignored whenever that .nav file or the bsp has changed since the conversion.
+
+#ifndef _NAV_PACKED_H_
+#define _NAV_PACKED_H_
+
+#include "nav_area.h"
+
+#define NAV_PACKED_MAGIC_NUMBER		0x5041564E	// "NVAP" - to help identify packed nav files
+#define NAV_PACKED_ALIGN			64			// alignment of every section, in bytes
+#define NAV_PACKED_NO_INDEX			0xFFFFFFFF	// an index that refers to nothing
+
+/// The version of the packed layout.  Bump this whenever any record below changes.
+const unsigned int NavPackedVersion = 2;
+
+enum NavPackedSectionType
+{
+	NAV_PACKED_PLACES,					// PlaceDirectory::Save() encoding
+	NAV_PACKED_CUSTOM_PRE_AREA,			// CNavMesh::SaveCustomDataPreArea() encoding
+	NAV_PACKED_AREAS,					// NavPackedArea[]
+	NAV_PACKED_CONNECTIONS,				// NavPackedConnect[], ranges owned by each area
+	NAV_PACKED_HIDING_SPOTS,			// NavPackedHidingSpot[]
+	NAV_PACKED_ENCOUNTERS,				// NavPackedEncounter[], ranges owned by each area
+	NAV_PACKED_ENCOUNTER_SPOTS,			// NavPackedEncounterSpot[], ranges owned by each encounter
+	NAV_PACKED_LADDER_CONNECTIONS,		// unsigned int ladder indices, ranges owned by each area
+	NAV_PACKED_VISIBLE_AREAS,			// NavPackedVisibleArea[], ranges owned by each area
+	NAV_PACKED_LADDERS,					// CNavLadder::Save() encoding, in order
+	NAV_PACKED_CUSTOM_AREA,				// CNavArea::SavePackedCustomData() encoding of each area, in order
+	NAV_PACKED_CUSTOM,					// CNavMesh::SaveCustomData() encoding
+
+	NAV_PACKED_SECTION_COUNT
+};
+
+struct NavPackedSection
+{
+	unsigned int offset;				// from the start of the file, a multiple of NAV_PACKED_ALIGN
+	unsigned int size;					// in bytes
+	unsigned int count;					// number of records, for the record sections
+	unsigned int reserved;
+};
+
+struct NavPackedHeader
+{
+	unsigned int magic;					// NAV_PACKED_MAGIC_NUMBER
+	unsigned int version;				// NavPackedVersion
+	unsigned int navVersion;			// the .nav file version the custom data was encoded with
+	unsigned int subVersion;			// CNavMesh::GetSubVersionNumber()
+	unsigned int bspSize;				// size of the bsp the mesh was built for
+	unsigned int navSize;				// size of the .nav file this was converted from
+	unsigned int navTime;				// modification time of the .nav file this was converted from
+	unsigned int isAnalyzed;
+
+	NavPackedSection section[ NAV_PACKED_SECTION_COUNT ];
+};
+
+enum NavPackedAreaFlags
+{
+	NAV_PACKED_AREA_UNDERWATER = 0x01,
+};
+
+struct NavPackedArea
+{
+	unsigned int id;
+	int attributeFlags;
+	float nwCorner[3];
+	float seCorner[3];
+	float neZ;
+	float swZ;
+	float earliestOccupyTime[ MAX_NAV_TEAMS ];
+	float lightIntensity[ NUM_CORNERS ];
+
+	unsigned int firstConnect;								// outgoing connections for each direction, then incoming ones
+	unsigned short connectCount[ NUM_DIRECTIONS ];
+	unsigned short incomingConnectCount[ NUM_DIRECTIONS ];
+
+	unsigned int firstHidingSpot;
+	unsigned int firstEncounter;
+	unsigned int firstLadder;								// up ladders, then down ladders
+	unsigned int firstVisibleArea;
+	unsigned int visibleAreaCount;
+	unsigned int inheritVisibilityFrom;						// area index or NAV_PACKED_NO_INDEX
+
+	unsigned short hidingSpotCount;
+	unsigned short encounterCount;
+	unsigned short ladderCount[ 2 ];
+	unsigned short placeEntry;								// PlaceDirectory::IndexType
+	unsigned char flags;									// NavPackedAreaFlags
+	unsigned char pad[ 9 ];
+};
+
+struct NavPackedConnect
+{
+	unsigned int area;
+	float length;
+};
+
+struct NavPackedHidingSpot
+{
+	unsigned int id;
+	float pos[3];
+	unsigned int area;										// area index of HidingSpot::GetArea() or NAV_PACKED_NO_INDEX
+	unsigned int flags;
+};
+
+struct NavPackedEncounter
+{
+	unsigned int fromArea;
+	unsigned int toArea;
+	unsigned char fromDir;
+	unsigned char toDir;
+	unsigned short spotCount;
+	unsigned int firstSpot;
+	float pathFrom[3];
+	float pathTo[3];
+};
+
+struct NavPackedEncounterSpot
+{
+	unsigned int spot;										// hiding spot index
+	float t;
+};
+
+struct NavPackedVisibleArea
+{
+	unsigned int area;
+	unsigned int attributes;								// CNavArea::VisibilityType
+};
+
+COMPILE_TIME_ASSERT( sizeof( NavPackedArea ) == 2 * NAV_PACKED_ALIGN );
+COMPILE_TIME_ASSERT( sizeof( NavPackedHeader ) % 16 == 0 );
+
+#endif // _NAV_PACKED_H_
@@ -0,0 +1,313 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Reentrant A* search over the Navigation Mesh
+//
+// $NoKeywords: $
+//
+//=============================================================================//
+// nav_pathsearch.cpp
+
+#include "cbase.h"
+
+#include "tier0/vprof.h"
+#include "vstdlib/jobthread.h"
+#include "vstdlib/random.h"
+
+#include "nav_mesh.h"
+#include "nav_pathfind.h"
+#include "nav_pathsearch.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+
+ConVar nav_pathfind_reentrant( "nav_pathfind_reentrant", "0", FCVAR_GAMEDLL, "If nonzero, path building on the main thread uses a per-thread search context instead of the shared nav area open list. Worker threads always use their own context." );
+
+CTHREADLOCALPTR( CNavPathSearch ) g_pActiveNavPathSearch;
+static CTHREADLOCALPTR( CNavPathSearch ) s_pThreadNavPathSearch;
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Used by CNavArea::GetCostSoFar() while a CNavPathSearch is running on this thread
+ */
+float NavPathSearchGetCostSoFar( const CNavPathSearch *search, const CNavArea *area )
+{
+	return search->GetCostSoFar( area );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavPathSearch::CNavPathSearch( void )
+{
+	m_generation = 0;
+	m_visitedCount = 0;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavPathSearch::CActiveScope::CActiveScope( CNavPathSearch *search )
+{
+	m_prev = g_pActiveNavPathSearch;
+	g_pActiveNavPathSearch = search;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavPathSearch::CActiveScope::~CActiveScope()
+{
+	g_pActiveNavPathSearch = m_prev;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Invalidate all nodes from the previous search.  Only touches the node table when the generation wraps.
+ */
+void CNavPathSearch::BeginSearch( void )
+{
+	++m_generation;
+	if ( m_generation == 0 )
+	{
+		FOR_EACH_VEC( m_nodes, it )
+		{
+			m_nodes[ it ].generation = 0;
+		}
+		m_generation = 1;
+	}
+
+	m_openHeap.RemoveAll();
+	m_visitedCount = 0;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathSearch::HeapPush( SearchNode_t &node )
+{
+	int index = m_openHeap.AddToTail();
+	m_openHeap[ index ].totalCost = node.totalCost;
+	m_openHeap[ index ].id = node.area->GetID();
+	node.heapIndex = index;
+
+	HeapSiftUp( index );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Remove the cheapest open node, mark it closed, and return its area ID
+ */
+unsigned int CNavPathSearch::HeapPop( void )
+{
+	Assert( m_openHeap.Count() );
+
+	unsigned int id = m_openHeap[0].id;
+	m_nodes[ id ].heapIndex = -1;
+
+	int last = m_openHeap.Count() - 1;
+	if ( last > 0 )
+	{
+		m_openHeap[0] = m_openHeap[ last ];
+		m_nodes[ m_openHeap[0].id ].heapIndex = 0;
+		m_openHeap.FastRemove( last );
+		HeapSiftDown( 0 );
+	}
+	else
+	{
+		m_openHeap.RemoveAll();
+	}
+
+	return id;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathSearch::HeapSiftUp( int index )
+{
+	HeapEntry_t entry = m_openHeap[ index ];
+
+	while( index > 0 )
+	{
+		int parent = ( index - 1 ) >> 1;
+		if ( m_openHeap[ parent ].totalCost <= entry.totalCost )
+			break;
+
+		m_openHeap[ index ] = m_openHeap[ parent ];
+		m_nodes[ m_openHeap[ index ].id ].heapIndex = index;
+		index = parent;
+	}
+
+	m_openHeap[ index ] = entry;
+	m_nodes[ entry.id ].heapIndex = index;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavPathSearch::HeapSiftDown( int index )
+{
+	int count = m_openHeap.Count();
+	HeapEntry_t entry = m_openHeap[ index ];
+
+	while( true )
+	{
+		int child = 2 * index + 1;
+		if ( child >= count )
+			break;
+
+		if ( child + 1 < count && m_openHeap[ child + 1 ].totalCost < m_openHeap[ child ].totalCost )
+		{
+			++child;
+		}
+
+		if ( entry.totalCost <= m_openHeap[ child ].totalCost )
+			break;
+
+		m_openHeap[ index ] = m_openHeap[ child ];
+		m_nodes[ m_openHeap[ index ].id ].heapIndex = index;
+		index = child;
+	}
+
+	m_openHeap[ index ] = entry;
+	m_nodes[ entry.id ].heapIndex = index;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavPathSearch *CNavPathSearch::GetActive( void )
+{
+	return g_pActiveNavPathSearch;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Each thread owns one search context for its lifetime. Job pool threads are persistent,
+ * so this is a handful of allocations per process.
+ */
+CNavPathSearch *CNavPathSearch::GetThreadSearch( void )
+{
+	CNavPathSearch *search = s_pThreadNavPathSearch;
+	if ( search == NULL )
+	{
+		search = new CNavPathSearch;
+		s_pThreadNavPathSearch = search;
+	}
+
+	return search;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavPathSearch *CNavPathSearch::GetPathingSearch( void )
+{
+	// the shared open list in CNavArea is only safe to use from the main thread
+	if ( ThreadInMainThread() && !nav_pathfind_reentrant.GetBool() )
+		return NULL;
+
+	return GetThreadSearch();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Benchmark support
+ */
+struct NavPathBenchQuery_t
+{
+	CNavArea *startArea;
+	CNavArea *goalArea;
+	bool result;
+	float cost;
+};
+
+static void NavPathBenchQueryReentrant( NavPathBenchQuery_t &query )
+{
+	CNavPathSearch *search = CNavPathSearch::GetThreadSearch();
+
+	ShortestPathCost cost;
+	query.result = search->BuildPath( query.startArea, query.goalArea, NULL, cost );
+	query.cost = query.result ? search->GetCostSoFar( query.goalArea ) : -1.0f;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CON_COMMAND_F( nav_bench_pathfind, "Compare NavAreaBuildPath against the reentrant search context on random area pairs of the current nav mesh. Arguments: [query count] [random seed]", FCVAR_GAMEDLL | FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( TheNavAreas.Count() < 2 )
+	{
+		Msg( "nav_bench_pathfind: no nav mesh loaded\n" );
+		return;
+	}
+
+	int queryCount = ( args.ArgC() > 1 ) ? MAX( 1, atoi( args[1] ) ) : 1000;
+	int seed = ( args.ArgC() > 2 ) ? atoi( args[2] ) : 1;
+
+	CUniformRandomStream random;
+	random.SetSeed( seed );
+
+	CUtlVector< NavPathBenchQuery_t > queries;
+	queries.SetCount( queryCount );
+	FOR_EACH_VEC( queries, it )
+	{
+		queries[ it ].startArea = TheNavAreas[ random.RandomInt( 0, TheNavAreas.Count()-1 ) ];
+		queries[ it ].goalArea = TheNavAreas[ random.RandomInt( 0, TheNavAreas.Count()-1 ) ];
+	}
+
+	// legacy linked-list open list
+	CUtlVector< float > legacyCost;
+	legacyCost.SetCount( queryCount );
+	int legacyFound = 0;
+
+	double start = Plat_FloatTime();
+	FOR_EACH_VEC( queries, it )
+	{
+		ShortestPathCost cost;
+		if ( NavAreaBuildPath( queries[ it ].startArea, queries[ it ].goalArea, NULL, cost ) )
+		{
+			legacyCost[ it ] = queries[ it ].goalArea->GetCostSoFar();
+			++legacyFound;
+		}
+		else
+		{
+			legacyCost[ it ] = -1.0f;
+		}
+	}
+	double legacyTime = Plat_FloatTime() - start;
+
+	// reentrant search, main thread only
+	start = Plat_FloatTime();
+	FOR_EACH_VEC( queries, it )
+	{
+		NavPathBenchQueryReentrant( queries[ it ] );
+	}
+	double serialTime = Plat_FloatTime() - start;
+
+	// trivial paths have no cost in either implementation, so only compare real searches
+	int mismatchCount = 0;
+	FOR_EACH_VEC( queries, it )
+	{
+		if ( queries[ it ].startArea == queries[ it ].goalArea )
+			continue;
+
+		bool legacyResult = ( legacyCost[ it ] >= 0.0f );
+		if ( legacyResult != queries[ it ].result ||
+			 ( legacyResult && fabs( legacyCost[ it ] - queries[ it ].cost ) > 0.01f * MAX( 1.0f, legacyCost[ it ] ) ) )
+		{
+			++mismatchCount;
+		}
+	}
+
+	// reentrant search across the job pool
+	start = Plat_FloatTime();
+	ParallelProcess( "nav_bench_pathfind", queries.Base(), queries.Count(), &NavPathBenchQueryReentrant );
+	double parallelTime = Plat_FloatTime() - start;
+
+	Msg( "nav_bench_pathfind: %d queries over %d areas, %d paths found\n", queryCount, TheNavAreas.Count(), legacyFound );
+	Msg( "  NavAreaBuildPath (shared open list): %8.3f ms (%.3f us/query)\n", legacyTime * 1000.0, legacyTime * 1000000.0 / queryCount );
+	Msg( "  CNavPathSearch (serial):             %8.3f ms (%.3f us/query)\n", serialTime * 1000.0, serialTime * 1000000.0 / queryCount );
+	Msg( "  CNavPathSearch (parallel):           %8.3f ms (%.3f us/query)\n", parallelTime * 1000.0, parallelTime * 1000000.0 / queryCount );
+	Msg( "  Cost mismatches: %d\n", mismatchCount );
+}
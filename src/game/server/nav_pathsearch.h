@@ -0,0 +1,484 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Reentrant A* search over the Navigation Mesh
+//
+// $NoKeywords: $
+//
+//=============================================================================//
+// nav_pathsearch.h
+// NavAreaBuildPath() keeps its open list and visited markers in static CNavArea members,
+// so only one search can run at a time and every open list insert is a linear walk.
+// CNavPathSearch owns all of the per-search bookkeeping instead: a binary heap for the
+// open list and a generation-stamped node table indexed by area ID.  Any number of searches
+// may run concurrently as long as each thread uses its own CNavPathSearch and the cost
+// functor only reads shared state.
+
+#ifndef _NAV_PATHSEARCH_H_
+#define _NAV_PATHSEARCH_H_
+
+#include "tier0/vprof.h"
+#include "tier0/threadtools.h"
+#include "tier1/utlvector.h"
+#include "nav_area.h"
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Per-query A* state.  Keep one instance per thread (see GetThreadSearch()) and reuse it;
+ * starting a new search is O(1) since stale nodes are detected by their generation stamp.
+ */
+class CNavPathSearch
+{
+public:
+	CNavPathSearch( void );
+
+	/**
+	 * Same contract as NavAreaBuildPath(), but all search state lives in this object.
+	 * While the search runs, CNavArea::GetCostSoFar() on this thread is redirected here
+	 * so existing cost functors work unchanged.
+	 */
+	template< typename CostFunctor >
+	bool BuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *goalPos, CostFunctor &costFunc, CNavArea **closestArea = NULL, float maxPathLength = 0.0f, int teamID = TEAM_ANY, bool ignoreNavBlockers = false );
+
+	// results of the most recent search - NULL/zero for areas it did not reach
+	CNavArea *GetParent( const CNavArea *area ) const;
+	NavTraverseType GetParentHow( const CNavArea *area ) const;
+	float GetCostSoFar( const CNavArea *area ) const;
+	float GetTotalCost( const CNavArea *area ) const;
+
+	int GetVisitedCount( void ) const		{ return m_visitedCount; }	// number of areas touched by the most recent search
+
+	static CNavPathSearch *GetActive( void );		// the search currently running on this thread, if any
+	static CNavPathSearch *GetThreadSearch( void );	// the search context owned by this thread, created on demand
+	static CNavPathSearch *GetPathingSearch( void );	// context path building should use on this thread, or NULL for the shared CNavArea lists
+
+private:
+	struct SearchNode_t
+	{
+		CNavArea *area;
+		CNavArea *parent;
+		float costSoFar;
+		float totalCost;
+		float pathLengthSoFar;
+		int heapIndex;								// position in m_openHeap, or -1 if closed
+		unsigned int generation;					// node is only valid if this equals m_generation
+		NavTraverseType parentHow;
+	};
+
+	struct HeapEntry_t
+	{
+		float totalCost;
+		unsigned int id;
+	};
+
+	void BeginSearch( void );
+	SearchNode_t *FindNode( const CNavArea *area ) const;	// NULL if not visited by the current search
+	SearchNode_t &VisitNode( CNavArea *area );				// reset node if stale and return it
+
+	void HeapPush( SearchNode_t &node );
+	unsigned int HeapPop( void );
+	void HeapSiftUp( int index );
+	void HeapSiftDown( int index );
+
+	CUtlVector< SearchNode_t > m_nodes;				// indexed by area ID
+	CUtlVector< HeapEntry_t > m_openHeap;
+	unsigned int m_generation;
+	int m_visitedCount;
+
+	// restores the previous active search when leaving scope
+	class CActiveScope
+	{
+	public:
+		CActiveScope( CNavPathSearch *search );
+		~CActiveScope();
+	private:
+		CNavPathSearch *m_prev;
+	};
+};
+
+
+//--------------------------------------------------------------------------------------------------------------
+inline CNavPathSearch::SearchNode_t *CNavPathSearch::FindNode( const CNavArea *area ) const
+{
+	unsigned int id = area->GetID();
+	if ( id >= (unsigned int)m_nodes.Count() || m_nodes[ id ].generation != m_generation )
+		return NULL;
+
+	return const_cast< SearchNode_t * >( &m_nodes[ id ] );
+}
+
+//--------------------------------------------------------------------------------------------------------------
+inline CNavPathSearch::SearchNode_t &CNavPathSearch::VisitNode( CNavArea *area )
+{
+	unsigned int id = area->GetID();
+	if ( id >= (unsigned int)m_nodes.Count() )
+	{
+		int oldCount = m_nodes.Count();
+		m_nodes.AddMultipleToTail( id + 1 - oldCount );
+		for( int i=oldCount; i<m_nodes.Count(); ++i )
+		{
+			m_nodes[i].generation = 0;
+		}
+	}
+
+	SearchNode_t &node = m_nodes[ id ];
+	if ( node.generation != m_generation )
+	{
+		node.area = area;
+		node.parent = NULL;
+		node.parentHow = NUM_TRAVERSE_TYPES;
+		node.costSoFar = 0.0f;
+		node.totalCost = 0.0f;
+		node.pathLengthSoFar = 0.0f;
+		node.heapIndex = -1;
+		node.generation = m_generation;
+		++m_visitedCount;
+	}
+
+	return node;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+inline CNavArea *CNavPathSearch::GetParent( const CNavArea *area ) const
+{
+	SearchNode_t *node = FindNode( area );
+	return node ? node->parent : NULL;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+inline NavTraverseType CNavPathSearch::GetParentHow( const CNavArea *area ) const
+{
+	SearchNode_t *node = FindNode( area );
+	return node ? node->parentHow : NUM_TRAVERSE_TYPES;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+inline float CNavPathSearch::GetCostSoFar( const CNavArea *area ) const
+{
+	SearchNode_t *node = FindNode( area );
+	return node ? node->costSoFar : 0.0f;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+inline float CNavPathSearch::GetTotalCost( const CNavArea *area ) const
+{
+	SearchNode_t *node = FindNode( area );
+	return node ? node->totalCost : 0.0f;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Find path from startArea to goalArea via an A* search, using supplied cost heuristic.
+ * See NavAreaBuildPath() for a description of the arguments.  The path is defined by
+ * following GetParent() back from the goal area to startArea.
+ */
+template< typename CostFunctor >
+bool CNavPathSearch::BuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *goalPos, CostFunctor &costFunc, CNavArea **closestArea, float maxPathLength, int teamID, bool ignoreNavBlockers )
+{
+	VPROF_BUDGET( "CNavPathSearch::BuildPath", "NextBotSpiky" );
+
+	if ( closestArea )
+	{
+		*closestArea = startArea;
+	}
+
+	if ( startArea == NULL )
+		return false;
+
+	BeginSearch();
+
+	CActiveScope activeScope( this );
+
+	SearchNode_t &startNode = VisitNode( startArea );
+
+	if ( goalArea != NULL && goalArea->IsBlocked( teamID, ignoreNavBlockers ) )
+		goalArea = NULL;
+
+	if ( goalArea == NULL && goalPos == NULL )
+		return false;
+
+	// if we are already in the goal area, build trivial path
+	if ( startArea == goalArea )
+		return true;
+
+	// determine actual goal position
+	Vector actualGoalPos = ( goalPos ) ? *goalPos : goalArea->GetCenter();
+
+	startNode.totalCost = ( startArea->GetCenter() - actualGoalPos ).Length();
+
+	float initCost = costFunc( startArea, NULL, NULL, NULL, -1.0f );
+	if ( initCost < 0.0f )
+		return false;
+
+	startNode.costSoFar = initCost;
+	startNode.pathLengthSoFar = 0.0f;
+
+	HeapPush( startNode );
+
+	// keep track of the area we visit that is closest to the goal
+	float closestAreaDist = startNode.totalCost;
+
+	bool bHaveMaxPathLength = ( maxPathLength > 0.0f );
+
+	// do A* search
+	while( m_openHeap.Count() )
+	{
+		// get next area to check - copy out the values we need, since visiting neighbors may grow m_nodes
+		unsigned int id = HeapPop();
+		CNavArea *area = m_nodes[ id ].area;
+		CNavArea *areaParent = m_nodes[ id ].parent;
+		float areaCostSoFar = m_nodes[ id ].costSoFar;
+		float areaPathLengthSoFar = m_nodes[ id ].pathLengthSoFar;
+
+		// don't consider blocked areas
+		if ( area->IsBlocked( teamID, ignoreNavBlockers ) )
+			continue;
+
+		// check if we have found the goal area or position
+		if ( area == goalArea || ( goalArea == NULL && goalPos && area->Contains( *goalPos ) ) )
+		{
+			if ( closestArea )
+			{
+				*closestArea = area;
+			}
+
+			return true;
+		}
+
+		// search adjacent areas
+		enum SearchType
+		{
+			SEARCH_FLOOR, SEARCH_LADDERS, SEARCH_ELEVATORS
+		};
+		SearchType searchWhere = SEARCH_FLOOR;
+		int searchIndex = 0;
+
+		int dir = NORTH;
+		const NavConnectVector *floorList = area->GetAdjacentAreas( NORTH );
+
+		bool ladderUp = true;
+		const NavLadderConnectVector *ladderList = NULL;
+		enum { AHEAD = 0, LEFT, RIGHT, BEHIND, NUM_TOP_DIRECTIONS };
+		int ladderTopDir = AHEAD;
+		float length = -1;
+
+		while( true )
+		{
+			CNavArea *newArea = NULL;
+			NavTraverseType how;
+			const CNavLadder *ladder = NULL;
+			const CFuncElevator *elevator = NULL;
+
+			//
+			// Get next adjacent area - either on floor or via ladder
+			//
+			if ( searchWhere == SEARCH_FLOOR )
+			{
+				// if exhausted adjacent connections in current direction, begin checking next direction
+				if ( searchIndex >= floorList->Count() )
+				{
+					++dir;
+
+					if ( dir == NUM_DIRECTIONS )
+					{
+						// checked all directions on floor - check ladders next
+						searchWhere = SEARCH_LADDERS;
+
+						ladderList = area->GetLadders( CNavLadder::LADDER_UP );
+						searchIndex = 0;
+						ladderTopDir = AHEAD;
+					}
+					else
+					{
+						// start next direction
+						floorList = area->GetAdjacentAreas( (NavDirType)dir );
+						searchIndex = 0;
+					}
+
+					continue;
+				}
+
+				const NavConnect &floorConnect = floorList->Element( searchIndex );
+				newArea = floorConnect.area;
+				length = floorConnect.length;
+				how = (NavTraverseType)dir;
+				++searchIndex;
+			}
+			else if ( searchWhere == SEARCH_LADDERS )
+			{
+				if ( searchIndex >= ladderList->Count() )
+				{
+					if ( !ladderUp )
+					{
+						// checked both ladder directions - check elevators next
+						searchWhere = SEARCH_ELEVATORS;
+						searchIndex = 0;
+						ladder = NULL;
+					}
+					else
+					{
+						// check down ladders
+						ladderUp = false;
+						ladderList = area->GetLadders( CNavLadder::LADDER_DOWN );
+						searchIndex = 0;
+					}
+					continue;
+				}
+
+				if ( ladderUp )
+				{
+					ladder = ladderList->Element( searchIndex ).ladder;
+
+					// do not use BEHIND connection, as its very hard to get to when going up a ladder
+					if ( ladderTopDir == AHEAD )
+					{
+						newArea = ladder->m_topForwardArea;
+					}
+					else if ( ladderTopDir == LEFT )
+					{
+						newArea = ladder->m_topLeftArea;
+					}
+					else if ( ladderTopDir == RIGHT )
+					{
+						newArea = ladder->m_topRightArea;
+					}
+					else
+					{
+						++searchIndex;
+						ladderTopDir = AHEAD;
+						continue;
+					}
+
+					how = GO_LADDER_UP;
+					++ladderTopDir;
+				}
+				else
+				{
+					newArea = ladderList->Element( searchIndex ).ladder->m_bottomArea;
+					how = GO_LADDER_DOWN;
+					ladder = ladderList->Element( searchIndex ).ladder;
+					++searchIndex;
+				}
+
+				if ( newArea == NULL )
+					continue;
+
+				length = -1.0f;
+			}
+			else // if ( searchWhere == SEARCH_ELEVATORS )
+			{
+				const NavConnectVector &elevatorAreas = area->GetElevatorAreas();
+
+				elevator = area->GetElevator();
+
+				if ( elevator == NULL || searchIndex >= elevatorAreas.Count() )
+				{
+					// done searching connected areas
+					elevator = NULL;
+					break;
+				}
+
+				newArea = elevatorAreas[ searchIndex++ ].area;
+				if ( newArea->GetCenter().z > area->GetCenter().z )
+				{
+					how = GO_ELEVATOR_UP;
+				}
+				else
+				{
+					how = GO_ELEVATOR_DOWN;
+				}
+
+				length = -1.0f;
+			}
+
+			// don't backtrack
+			Assert( newArea );
+			if ( newArea == areaParent )
+				continue;
+			if ( newArea == area ) // self neighbor?
+				continue;
+
+			// don't consider blocked areas
+			if ( newArea->IsBlocked( teamID, ignoreNavBlockers ) )
+				continue;
+
+			float newCostSoFar = costFunc( newArea, area, ladder, elevator, length );
+
+			// NaNs really mess this function up causing tough to track down hangs. If
+			//  we get inf back, clamp it down to a really high number.
+			DebuggerBreakOnNaN_StagingOnly( newCostSoFar );
+			if ( IS_NAN( newCostSoFar ) )
+				newCostSoFar = 1e30f;
+
+			// check if cost functor says this area is a dead-end
+			if ( newCostSoFar < 0.0f )
+				continue;
+
+			// Safety check against a bogus functor.  The cost of the path
+			// A...B, C should always be at least as big as the path A...B.
+			Assert( newCostSoFar >= areaCostSoFar );
+
+			// make sure that any jump to a new area incurs some pathfinding cost (see NavAreaBuildPath)
+			float minNewCostSoFar = areaCostSoFar * 1.00001f + 0.00001f;
+			newCostSoFar = Max( newCostSoFar, minNewCostSoFar );
+
+			// stop if path length limit reached
+			float newLengthSoFar = 0.0f;
+			if ( bHaveMaxPathLength )
+			{
+				// keep track of path length so far
+				float deltaLength = ( newArea->GetCenter() - area->GetCenter() ).Length();
+				newLengthSoFar = areaPathLengthSoFar + deltaLength;
+				if ( newLengthSoFar > maxPathLength )
+					continue;
+			}
+
+			SearchNode_t *newNode = FindNode( newArea );
+			if ( newNode && newNode->costSoFar <= newCostSoFar )
+			{
+				// this is a worse path - skip it
+				continue;
+			}
+
+			if ( !newNode )
+			{
+				newNode = &VisitNode( newArea );
+			}
+
+			// compute estimate of distance left to go
+			float distSq = ( newArea->GetCenter() - actualGoalPos ).LengthSqr();
+			float newCostRemaining = ( distSq > 0.0 ) ? FastSqrt( distSq ) : 0.0;
+
+			// track closest area to goal in case path fails
+			if ( closestArea && newCostRemaining < closestAreaDist )
+			{
+				*closestArea = newArea;
+				closestAreaDist = newCostRemaining;
+			}
+
+			newNode->costSoFar = newCostSoFar;
+			newNode->totalCost = newCostSoFar + newCostRemaining;
+			newNode->pathLengthSoFar = newLengthSoFar;
+			newNode->parent = area;
+			newNode->parentHow = how;
+
+			if ( newNode->heapIndex >= 0 )
+			{
+				// already open, cost can only have decreased
+				m_openHeap[ newNode->heapIndex ].totalCost = newNode->totalCost;
+				HeapSiftUp( newNode->heapIndex );
+			}
+			else
+			{
+				// new or re-opened from the closed set
+				HeapPush( *newNode );
+			}
+		}
+	}
+
+	return false;
+}
+
+
+#endif // _NAV_PATHSEARCH_H_
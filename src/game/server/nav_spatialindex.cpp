@@ -0,0 +1,394 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Packed spatial index over the Navigation Mesh grid
+//
+// $NoKeywords: $
+//
+//=============================================================================//
+// nav_spatialindex.cpp
+
+#include "cbase.h"
+
+#include "tier0/vprof.h"
+#include "vstdlib/random.h"
+
+#include "nav_mesh.h"
+#include "nav_spatialindex.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+
+ConVar nav_spatial_index( "nav_spatial_index", "1", FCVAR_GAMEDLL, "If nonzero, GetNavArea() tests the packed extents of each grid cell four at a time instead of checking each area in turn." );
+ConVar nav_spatial_index_bvh( "nav_spatial_index_bvh", "0", FCVAR_GAMEDLL, "If nonzero (and nav_spatial_index is set), GetNearestNavArea() uses a BVH over all nav areas instead of searching the grid in expanding rings." );
+
+int CNavAreaSpatialIndex::s_recordRemaining = 0;
+static CUtlVector< Vector > s_recordedQueries;
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavAreaSpatialIndex::CNavAreaSpatialIndex( void )
+{
+	m_isValid = false;
+	m_builtWithBVH = false;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavAreaSpatialIndex::Invalidate( void )
+{
+	m_isValid = false;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavAreaSpatialIndex::Purge( void )
+{
+	m_isValid = false;
+	m_builtWithBVH = false;
+	m_cells.Purge();
+	m_blocks.Purge();
+	m_blockAreas.Purge();
+	m_bvhNodes.Purge();
+	m_bvhAreas.Purge();
+	m_bvhBuild.Purge();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Pack the extents of every grid cell into blocks of four, keeping the cell's area order.
+ */
+void CNavAreaSpatialIndex::Build( const CUtlVector< NavAreaVector > &grid, bool buildBVH )
+{
+	VPROF_BUDGET( "CNavAreaSpatialIndex::Build", "NextBot" );
+
+	m_cells.SetCount( grid.Count() );
+	m_blocks.RemoveAll();
+	m_blockAreas.RemoveAll();
+
+	int blockCount = 0;
+	FOR_EACH_VEC( grid, it )
+	{
+		blockCount += ( grid[ it ].Count() + 3 ) / 4;
+	}
+	m_blocks.EnsureCapacity( blockCount );
+	m_blockAreas.EnsureCapacity( 4 * blockCount );
+
+	FOR_EACH_VEC( grid, cell )
+	{
+		const NavAreaVector &areas = grid[ cell ];
+
+		m_cells[ cell ].firstBlock = m_blocks.Count();
+		m_cells[ cell ].blockCount = ( areas.Count() + 3 ) / 4;
+
+		for( int i=0; i<areas.Count(); i += 4 )
+		{
+			AreaBlock_t &block = m_blocks[ m_blocks.AddToTail() ];
+
+			for( int lane=0; lane<4; ++lane )
+			{
+				CNavArea *area = ( i + lane < areas.Count() ) ? areas[ i + lane ] : NULL;
+				m_blockAreas.AddToTail( area );
+
+				if ( area )
+				{
+					Vector nw = area->GetCorner( NORTH_WEST );
+					Vector se = area->GetCorner( SOUTH_EAST );
+
+					SubFloat( block.loX, lane ) = nw.x;
+					SubFloat( block.loY, lane ) = nw.y;
+					SubFloat( block.hiX, lane ) = se.x;
+					SubFloat( block.hiY, lane ) = se.y;
+				}
+				else
+				{
+					// empty extent, never overlaps
+					SubFloat( block.loX, lane ) = FLT_MAX;
+					SubFloat( block.loY, lane ) = FLT_MAX;
+					SubFloat( block.hiX, lane ) = -FLT_MAX;
+					SubFloat( block.hiY, lane ) = -FLT_MAX;
+				}
+			}
+		}
+	}
+
+	m_bvhNodes.RemoveAll();
+	m_bvhAreas.RemoveAll();
+	if ( buildBVH )
+	{
+		BuildBVH();
+	}
+
+	m_builtWithBVH = buildBVH;
+	m_isValid = true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+static int s_bvhSortAxis = 0;
+
+int CNavAreaSpatialIndex::CompareBuildEntries( const void *a, const void *b )
+{
+	const Extent &extentA = ( (const BVHBuildEntry_t *)a )->extent;
+	const Extent &extentB = ( (const BVHBuildEntry_t *)b )->extent;
+
+	float centerA = extentA.lo[ s_bvhSortAxis ] + extentA.hi[ s_bvhSortAxis ];
+	float centerB = extentB.lo[ s_bvhSortAxis ] + extentB.hi[ s_bvhSortAxis ];
+
+	if ( centerA < centerB )
+		return -1;
+
+	if ( centerA > centerB )
+		return 1;
+
+	return 0;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Build a BVH over the 3D extents of every area in the mesh
+ */
+void CNavAreaSpatialIndex::BuildBVH( void )
+{
+	int areaCount = TheNavAreas.Count();
+	if ( areaCount == 0 )
+		return;
+
+	m_bvhBuild.SetCount( areaCount );
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		TheNavAreas[ it ]->GetExtent( &m_bvhBuild[ it ].extent );
+		m_bvhBuild[ it ].area = TheNavAreas[ it ];
+	}
+
+	m_bvhNodes.EnsureCapacity( 2 * areaCount );
+	m_bvhNodes.AddToTail();
+	int depth = BuildBVHNode( 0, 0, areaCount );
+
+	// leaves index straight into the area order produced by the build
+	m_bvhAreas.SetCount( areaCount );
+	FOR_EACH_VEC( m_bvhBuild, it )
+	{
+		m_bvhAreas[ it ] = m_bvhBuild[ it ].area;
+	}
+
+	m_bvhBuild.Purge();
+
+	// FindNearest() holds at most one pending sibling per level
+	Assert( depth < 64 );
+	NOTE_UNUSED( depth );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Fill in node 'nodeIndex' for build entries [first, first+count) and split it at the median
+ * of the longest axis of the area centers.  Returns the depth of the subtree.
+ */
+int CNavAreaSpatialIndex::BuildBVHNode( int nodeIndex, int first, int count )
+{
+	const int leafSize = 4;
+
+	Extent bounds = m_bvhBuild[ first ].extent;
+	Vector centerLo = bounds.lo + bounds.hi;
+	Vector centerHi = centerLo;
+	for( int i = first + 1; i < first + count; ++i )
+	{
+		const Extent &extent = m_bvhBuild[i].extent;
+		Vector center = extent.lo + extent.hi;
+
+		VectorMin( bounds.lo, extent.lo, bounds.lo );
+		VectorMax( bounds.hi, extent.hi, bounds.hi );
+		VectorMin( centerLo, center, centerLo );
+		VectorMax( centerHi, center, centerHi );
+	}
+
+	m_bvhNodes[ nodeIndex ].lo = bounds.lo;
+	m_bvhNodes[ nodeIndex ].hi = bounds.hi;
+
+	if ( count <= leafSize )
+	{
+		m_bvhNodes[ nodeIndex ].first = first;
+		m_bvhNodes[ nodeIndex ].count = count;
+		return 1;
+	}
+
+	Vector size = centerHi - centerLo;
+	s_bvhSortAxis = ( size.x > size.y ) ? ( ( size.x > size.z ) ? 0 : 2 ) : ( ( size.y > size.z ) ? 1 : 2 );
+	qsort( &m_bvhBuild[ first ], count, sizeof( BVHBuildEntry_t ), CompareBuildEntries );
+
+	int children = m_bvhNodes.AddMultipleToTail( 2 );
+	m_bvhNodes[ nodeIndex ].first = children;
+	m_bvhNodes[ nodeIndex ].count = 0;
+
+	int half = count / 2;
+	int depthLeft = BuildBVHNode( children, first, half );
+	int depthRight = BuildBVHNode( children + 1, first + half, count - half );
+
+	return 1 + MAX( depthLeft, depthRight );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Query recording for nav_bench_spatial_index
+ */
+void CNavAreaSpatialIndex::StartRecording( int count )
+{
+	s_recordedQueries.RemoveAll();
+	s_recordedQueries.EnsureCapacity( count );
+	s_recordRemaining = count;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavAreaSpatialIndex::RecordQuery( const Vector &pos )
+{
+	if ( s_recordRemaining <= 0 || !ThreadInMainThread() )
+		return;
+
+	s_recordedQueries.AddToTail( pos );
+	--s_recordRemaining;
+
+	if ( s_recordRemaining == 0 )
+	{
+		Msg( "nav_spatial_index_record: recorded %d queries\n", s_recordedQueries.Count() );
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CON_COMMAND_F( nav_spatial_index_record, "Record the positions of the next GetNavArea() queries for nav_bench_spatial_index. Arguments: [query count]", FCVAR_GAMEDLL | FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	int count = ( args.ArgC() > 1 ) ? MAX( 0, atoi( args[1] ) ) : 10000;
+	CNavAreaSpatialIndex::StartRecording( count );
+
+	Msg( "nav_spatial_index_record: recording the next %d queries\n", count );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CON_COMMAND_F( nav_bench_spatial_index, "Compare GetNavArea() and GetNearestNavArea() through the grid, the packed spatial index, and the nearest area BVH. Replays the positions recorded by nav_spatial_index_record, or random positions around the mesh if none were recorded. Arguments: [random query count] [random seed]", FCVAR_GAMEDLL | FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( TheNavAreas.Count() == 0 )
+	{
+		Msg( "nav_bench_spatial_index: no nav mesh loaded\n" );
+		return;
+	}
+
+	// don't record our own queries
+	bool recorded = ( s_recordedQueries.Count() > 0 );
+	CUtlVector< Vector > queries;
+	if ( recorded )
+	{
+		queries.CopyArray( s_recordedQueries.Base(), s_recordedQueries.Count() );
+	}
+	CNavAreaSpatialIndex::StartRecording( 0 );
+
+	if ( !recorded )
+	{
+		int queryCount = ( args.ArgC() > 1 ) ? MAX( 1, atoi( args[1] ) ) : 10000;
+		int seed = ( args.ArgC() > 2 ) ? atoi( args[2] ) : 1;
+
+		CUniformRandomStream random;
+		random.SetSeed( seed );
+
+		// points on the mesh, nudged around so some of them fall off of it
+		queries.SetCount( queryCount );
+		FOR_EACH_VEC( queries, it )
+		{
+			CNavArea *area = TheNavAreas[ random.RandomInt( 0, TheNavAreas.Count()-1 ) ];
+			queries[ it ] = area->GetRandomPoint() + Vector( random.RandomFloat( -100.0f, 100.0f ), random.RandomFloat( -100.0f, 100.0f ), random.RandomFloat( 0.0f, HalfHumanHeight ) );
+		}
+	}
+
+	bool wasEnabled = nav_spatial_index.GetBool();
+	bool wasBVH = nav_spatial_index_bvh.GetBool();
+
+	CUtlVector< CNavArea * > gridArea;
+	CUtlVector< CNavArea * > gridNearest;
+	gridArea.SetCount( queries.Count() );
+	gridNearest.SetCount( queries.Count() );
+
+	// grid
+	nav_spatial_index.SetValue( 0 );
+	TheNavMesh->UpdateSpatialIndex();
+
+	double start = Plat_FloatTime();
+	FOR_EACH_VEC( queries, it )
+	{
+		gridArea[ it ] = TheNavMesh->GetNavArea( queries[ it ] );
+	}
+	double gridTime = Plat_FloatTime() - start;
+
+	start = Plat_FloatTime();
+	FOR_EACH_VEC( queries, it )
+	{
+		gridNearest[ it ] = TheNavMesh->GetNearestNavArea( queries[ it ], false, 10000.0f, false, false );
+	}
+	double gridNearestTime = Plat_FloatTime() - start;
+
+	// packed index and BVH
+	nav_spatial_index.SetValue( 1 );
+	nav_spatial_index_bvh.SetValue( 1 );
+
+	start = Plat_FloatTime();
+	TheNavMesh->UpdateSpatialIndex();
+	double buildTime = Plat_FloatTime() - start;
+
+	int areaMismatch = 0;
+	start = Plat_FloatTime();
+	FOR_EACH_VEC( queries, it )
+	{
+		if ( TheNavMesh->GetNavArea( queries[ it ] ) != gridArea[ it ] )
+		{
+			++areaMismatch;
+		}
+	}
+	double indexTime = Plat_FloatTime() - start;
+
+	// the ring search can stop before reaching the true nearest area, so count how often the BVH did better
+	int nearestMismatch = 0;
+	int nearestCloser = 0;
+	start = Plat_FloatTime();
+	FOR_EACH_VEC( queries, it )
+	{
+		CNavArea *area = TheNavMesh->GetNearestNavArea( queries[ it ], false, 10000.0f, false, false );
+		if ( area != gridNearest[ it ] )
+		{
+			++nearestMismatch;
+
+			if ( area && gridNearest[ it ] )
+			{
+				Vector areaPos, gridPos;
+				area->GetClosestPointOnArea( queries[ it ], &areaPos );
+				gridNearest[ it ]->GetClosestPointOnArea( queries[ it ], &gridPos );
+				if ( ( areaPos - queries[ it ] ).LengthSqr() < ( gridPos - queries[ it ] ).LengthSqr() )
+				{
+					++nearestCloser;
+				}
+			}
+		}
+	}
+	double bvhNearestTime = Plat_FloatTime() - start;
+
+	nav_spatial_index.SetValue( wasEnabled );
+	nav_spatial_index_bvh.SetValue( wasBVH );
+	TheNavMesh->UpdateSpatialIndex();
+
+	int queryCount = queries.Count();
+	Msg( "nav_bench_spatial_index: %d %s queries over %d areas\n", queryCount, recorded ? "recorded" : "random", TheNavAreas.Count() );
+	Msg( "  Index build (cells + BVH):     %8.3f ms\n", buildTime * 1000.0 );
+	Msg( "  GetNavArea, grid:              %8.3f ms (%.3f us/query)\n", gridTime * 1000.0, gridTime * 1000000.0 / queryCount );
+	Msg( "  GetNavArea, packed index:      %8.3f ms (%.3f us/query), %d mismatches\n", indexTime * 1000.0, indexTime * 1000000.0 / queryCount, areaMismatch );
+	Msg( "  GetNearestNavArea, ring:       %8.3f ms (%.3f us/query)\n", gridNearestTime * 1000.0, gridNearestTime * 1000000.0 / queryCount );
+	Msg( "  GetNearestNavArea, BVH:        %8.3f ms (%.3f us/query), %d differ (%d closer)\n", bvhNearestTime * 1000.0, bvhNearestTime * 1000000.0 / queryCount, nearestMismatch, nearestCloser );
+}
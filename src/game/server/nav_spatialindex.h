@@ -0,0 +1,291 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Packed spatial index over the Navigation Mesh grid
+//
+// $NoKeywords: $
+//
+//=============================================================================//
+// nav_spatialindex.h
+// CNavMesh::m_grid keeps a NavAreaVector of area pointers per cell, so every point query
+// dereferences each candidate area just to read its 2D extent.  CNavAreaSpatialIndex
+// packs the extents of each cell contiguously in blocks of four so GetNavArea() can reject
+// whole blocks with a single SSE compare, and only touches the CNavArea of real candidates.
+// It can also build a BVH over the 3D area extents for an exact branch-and-bound
+// GetNearestNavArea() in place of the expanding ring search.
+//
+// The index is a snapshot: it is rebuilt by CNavMesh::Update() whenever the mesh changes,
+// and is not used while the mesh is being edited or generated.
+
+#ifndef _NAV_SPATIALINDEX_H_
+#define _NAV_SPATIALINDEX_H_
+
+#include "mathlib/ssemath.h"
+#include "utlvector.h"
+#include "nav_area.h"
+
+extern ConVar nav_spatial_index;
+extern ConVar nav_spatial_index_bvh;
+
+//--------------------------------------------------------------------------------------------------------------
+class CNavAreaSpatialIndex
+{
+public:
+	CNavAreaSpatialIndex( void );
+
+	void Build( const CUtlVector< NavAreaVector > &grid, bool buildBVH );	// snapshot the given grid
+	void Invalidate( void );									// stop using the index until it is rebuilt
+	void Purge( void );											// invalidate and free all memory
+
+	bool IsValid( void ) const		{ return m_isValid; }
+	bool HasBVH( void ) const		{ return m_isValid && m_bvhNodes.Count() > 0; }
+	bool WasBuiltWithBVH( void ) const	{ return m_builtWithBVH; }
+
+	/**
+	 * Walk the areas of grid cell 'cell' whose 2D extents contain 'pos', in the same order as the cell's NavAreaVector.
+	 * If the index is not valid, walks 'cellAreas' and tests each area with IsOverlapping() instead.
+	 */
+	class OverlapIterator
+	{
+	public:
+		OverlapIterator( const CNavAreaSpatialIndex &index, const NavAreaVector &cellAreas, int cell, const Vector &pos );
+
+		CNavArea *Next( void );
+
+	private:
+		const CNavAreaSpatialIndex *m_index;
+		const NavAreaVector *m_areas;
+		fltx4 m_x;
+		fltx4 m_y;
+		Vector m_pos;
+		int m_block;
+		int m_endBlock;
+		int m_mask;
+	};
+
+	/**
+	 * Find the area that minimizes the squared distance computed by 'distance', visiting areas in order
+	 * of the distance from 'pos' to their extent.  The functor is called as
+	 *	bool distance( CNavArea *area, float closeDistSq, float *distSq )
+	 * and returns false to reject the area.  Its distance must never be less than the distance
+	 * from 'pos' to the area's extent, or closer areas may be pruned.
+	 */
+	template < typename DistanceFunctor >
+	CNavArea *FindNearest( const Vector &pos, float closeDistSq, DistanceFunctor &distance ) const;
+
+	int GetCellCount( void ) const	{ return m_cells.Count(); }
+	int GetBlockCount( void ) const	{ return m_blocks.Count(); }
+	int GetBVHNodeCount( void ) const	{ return m_bvhNodes.Count(); }
+
+	static void StartRecording( int count );					// record the next 'count' query positions, replacing any previous recording
+	static void RecordQuery( const Vector &pos );				// store a GetNavArea() query position for nav_bench_spatial_index
+	static bool IsRecording( void )	{ return s_recordRemaining > 0; }
+
+private:
+	friend class OverlapIterator;
+
+	struct CellRange_t
+	{
+		int firstBlock;
+		int blockCount;
+	};
+
+	// 2D extents of four areas, padded with empty extents that never overlap
+	struct AreaBlock_t
+	{
+		fltx4 loX;
+		fltx4 loY;
+		fltx4 hiX;
+		fltx4 hiY;
+	};
+
+	struct BVHNode_t
+	{
+		Vector lo;
+		int first;												// leaf: first index into m_bvhAreas, interior: first of two adjacent children
+		Vector hi;
+		int count;												// leaf: number of areas, interior: 0
+	};
+
+	struct BVHBuildEntry_t
+	{
+		Extent extent;
+		CNavArea *area;
+	};
+
+	void BuildBVH( void );
+	int BuildBVHNode( int nodeIndex, int first, int count );
+	static int CompareBuildEntries( const void *a, const void *b );
+	float DistanceSqToNode( const BVHNode_t &node, const Vector &pos ) const;
+
+	bool m_isValid;
+	bool m_builtWithBVH;
+	CUtlVector< CellRange_t > m_cells;
+	CUtlVector< AreaBlock_t, CUtlMemoryAligned< AreaBlock_t, 16 > > m_blocks;
+	CUtlVector< CNavArea * > m_blockAreas;						// four entries per block, NULL for padding
+
+	CUtlVector< BVHNode_t > m_bvhNodes;
+	CUtlVector< CNavArea * > m_bvhAreas;
+	CUtlVector< BVHBuildEntry_t > m_bvhBuild;					// only used while building
+
+	static int s_recordRemaining;
+};
+
+
+//--------------------------------------------------------------------------------------------------------------
+inline CNavAreaSpatialIndex::OverlapIterator::OverlapIterator( const CNavAreaSpatialIndex &index, const NavAreaVector &cellAreas, int cell, const Vector &pos )
+{
+	m_pos = pos;
+	m_mask = 0;
+
+	if ( index.IsValid() )
+	{
+		m_index = &index;
+		m_areas = NULL;
+		m_x = ReplicateX4( pos.x );
+		m_y = ReplicateX4( pos.y );
+		m_block = index.m_cells[ cell ].firstBlock;
+		m_endBlock = m_block + index.m_cells[ cell ].blockCount;
+	}
+	else
+	{
+		m_index = NULL;
+		m_areas = &cellAreas;
+		m_x = Four_Zeros;
+		m_y = Four_Zeros;
+		m_block = 0;
+		m_endBlock = cellAreas.Count();
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+inline CNavArea *CNavAreaSpatialIndex::OverlapIterator::Next( void )
+{
+	if ( m_areas )
+	{
+		while( m_block < m_endBlock )
+		{
+			CNavArea *area = (*m_areas)[ m_block++ ];
+			if ( area->IsOverlapping( m_pos ) )
+				return area;
+		}
+
+		return NULL;
+	}
+
+	while( m_mask == 0 )
+	{
+		if ( m_block >= m_endBlock )
+			return NULL;
+
+		// same inclusive test as CNavArea::IsOverlapping()
+		const AreaBlock_t &block = m_index->m_blocks[ m_block ];
+		fltx4 inside = AndSIMD( CmpGeSIMD( m_x, block.loX ), CmpLeSIMD( m_x, block.hiX ) );
+		inside = AndSIMD( inside, CmpGeSIMD( m_y, block.loY ) );
+		inside = AndSIMD( inside, CmpLeSIMD( m_y, block.hiY ) );
+		m_mask = TestSignSIMD( inside );
+		++m_block;
+	}
+
+	// take the lowest lane first to preserve cell order
+	int lane = 0;
+	while( ( m_mask & ( 1 << lane ) ) == 0 )
+	{
+		++lane;
+	}
+	m_mask &= ~( 1 << lane );
+
+	return m_index->m_blockAreas[ 4 * ( m_block - 1 ) + lane ];
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+inline float CNavAreaSpatialIndex::DistanceSqToNode( const BVHNode_t &node, const Vector &pos ) const
+{
+	float distSq = 0.0f;
+	for( int i=0; i<3; ++i )
+	{
+		float d = MAX( node.lo[i] - pos[i], pos[i] - node.hi[i] );
+		if ( d > 0.0f )
+		{
+			distSq += d * d;
+		}
+	}
+	return distSq;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+template < typename DistanceFunctor >
+inline CNavArea *CNavAreaSpatialIndex::FindNearest( const Vector &pos, float closeDistSq, DistanceFunctor &distance ) const
+{
+	if ( !HasBVH() )
+		return NULL;
+
+	// the tree is built by median split, so its depth is logarithmic in the area count
+	const int maxStack = 64;
+	int stack[ maxStack ];
+	float stackDistSq[ maxStack ];
+	int depth = 0;
+
+	CNavArea *close = NULL;
+
+	stack[0] = 0;
+	stackDistSq[0] = DistanceSqToNode( m_bvhNodes[0], pos );
+	depth = 1;
+
+	while( depth > 0 )
+	{
+		--depth;
+		if ( stackDistSq[ depth ] >= closeDistSq )
+			continue;
+
+		const BVHNode_t &node = m_bvhNodes[ stack[ depth ] ];
+
+		if ( node.count > 0 )
+		{
+			for( int i = node.first; i < node.first + node.count; ++i )
+			{
+				float distSq;
+				if ( distance( m_bvhAreas[i], closeDistSq, &distSq ) && distSq < closeDistSq )
+				{
+					closeDistSq = distSq;
+					close = m_bvhAreas[i];
+				}
+			}
+			continue;
+		}
+
+		int nearChild = node.first;
+		int farChild = node.first + 1;
+		float nearDistSq = DistanceSqToNode( m_bvhNodes[ nearChild ], pos );
+		float farDistSq = DistanceSqToNode( m_bvhNodes[ farChild ], pos );
+		if ( farDistSq < nearDistSq )
+		{
+			V_swap( nearChild, farChild );
+			V_swap( nearDistSq, farDistSq );
+		}
+
+		Assert( depth + 2 <= maxStack );
+
+		// push the far child first so the near one is visited first and tightens the bound
+		if ( farDistSq < closeDistSq )
+		{
+			stack[ depth ] = farChild;
+			stackDistSq[ depth ] = farDistSq;
+			++depth;
+		}
+
+		if ( nearDistSq < closeDistSq )
+		{
+			stack[ depth ] = nearChild;
+			stackDistSq[ depth ] = nearDistSq;
+			++depth;
+		}
+	}
+
+	return close;
+}
+
+
+#endif // _NAV_SPATIALINDEX_H_
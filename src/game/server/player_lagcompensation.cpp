@@ -10,8 +10,9 @@
 #include "igamesystem.h"
 #include "ilagcompensationmanager.h"
 #include "inetchannelinfo.h"
-#include "utllinkedlist.h"
 #include "BaseAnimatingOverlay.h"
+#include "collisionutils.h"
+#include "mathlib/ssemath.h"
 #include "tier0/vprof.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
@@ -37,6 +38,10 @@ ConVar sv_showlagcompensation( "sv_showlagcompensation", "0", FCVAR_CHEAT, "Show
 
 ConVar sv_unlag_fixstuck( "sv_unlag_fixstuck", "0", FCVAR_DEVELOPMENTONLY, "Disallow backtracking a player for lag compensation if it will cause them to become stuck" );
 
+ConVar sv_unlag_ray_prefilter( "sv_unlag_ray_prefilter", "0", FCVAR_CHEAT, "Only lag compensate players whose current or backtracked bounds are near the shooter's view ray. Only use this if every lag compensated attack is traced along the view direction." );
+ConVar sv_unlag_ray_prefilter_spread( "sv_unlag_ray_prefilter_spread", "10", FCVAR_CHEAT, "Half-angle in degrees of the cone around the view ray used by sv_unlag_ray_prefilter", true, 0.0f, true, 45.0f );
+ConVar sv_unlag_ray_prefilter_bloat( "sv_unlag_ray_prefilter_bloat", "64", FCVAR_CHEAT, "Distance in units to expand player bounds by for sv_unlag_ray_prefilter, to cover hull traces and melee sweeps", true, 0.0f, false, 0.0f );
+
 //-----------------------------------------------------------------------------
 // Purpose: 
 //-----------------------------------------------------------------------------
@@ -126,6 +131,156 @@ public:
 	float					m_flPoseParameters[MAXSTUDIOPOSEPARAM];
 };
 
+//-----------------------------------------------------------------------------
+// Purpose: Animation state of a history record. Only read for the records we
+//			actually backtrack to, so it's kept apart from the data we search.
+//-----------------------------------------------------------------------------
+struct LagAnimRecord
+{
+	LayerRecord				m_layerRecords[MAX_LAYER_RECORDS];
+	int						m_masterSequence;
+	float					m_masterCycle;
+
+	float					m_flPoseParameters[MAXSTUDIOPOSEPARAM];
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Fixed capacity ring buffer of one player's history, stored as
+//			structure of arrays. Record 0 is the newest, and simulation times
+//			strictly decrease with the record index.
+//-----------------------------------------------------------------------------
+class CLagCompensationTrack
+{
+public:
+	CLagCompensationTrack()
+	{
+		m_nCapacity = 0;
+		m_nHead = 0;
+		m_nCount = 0;
+	}
+
+	// Capacity must be a power of two. Discards any existing history.
+	void Init( int nCapacity )
+	{
+		Assert( IsPowerOfTwo( nCapacity ) );
+
+		m_flSimulationTime.SetCount( nCapacity );
+		m_fFlags.SetCount( nCapacity );
+		m_vecAngles.SetCount( nCapacity );
+		m_Anim.SetCount( nCapacity );
+		m_Bounds.EnsureCapacity( nCapacity * 3 );
+
+		m_nCapacity = nCapacity;
+		m_nHead = 0;
+		m_nCount = 0;
+	}
+
+	void Purge()
+	{
+		m_flSimulationTime.Purge();
+		m_fFlags.Purge();
+		m_vecAngles.Purge();
+		m_Anim.Purge();
+		m_Bounds.Purge();
+
+		m_nCapacity = 0;
+		m_nHead = 0;
+		m_nCount = 0;
+	}
+
+	int Capacity() const	{ return m_nCapacity; }
+	int Count() const		{ return m_nCount; }
+	void RemoveAll()		{ m_nCount = 0; }
+	void RemoveTail()		{ Assert( m_nCount > 0 ); --m_nCount; }
+
+	// Makes room for a new record 0. Drops the oldest record if we're full.
+	void AddToHead()
+	{
+		Assert( m_nCapacity > 0 );
+		m_nHead = ( m_nHead + 1 ) & ( m_nCapacity - 1 );
+		m_nCount = MIN( m_nCount + 1, m_nCapacity );
+	}
+
+	float &SimulationTime( int i )				{ return m_flSimulationTime[ Slot( i ) ]; }
+	float SimulationTime( int i ) const			{ return m_flSimulationTime[ Slot( i ) ]; }
+	int &Flags( int i )							{ return m_fFlags[ Slot( i ) ]; }
+	int Flags( int i ) const					{ return m_fFlags[ Slot( i ) ]; }
+	QAngle &Angles( int i )						{ return m_vecAngles[ Slot( i ) ]; }
+	const QAngle &Angles( int i ) const			{ return m_vecAngles[ Slot( i ) ]; }
+	LagAnimRecord &Anim( int i )				{ return m_Anim[ Slot( i ) ]; }
+	const LagAnimRecord &Anim( int i ) const	{ return m_Anim[ Slot( i ) ]; }
+
+	// origin, mins and maxs (pre-scaled) packed with w = 0
+	const fltx4 &Origin( int i ) const			{ return m_Bounds[ Slot( i ) * 3 ]; }
+	const fltx4 &MinsPreScaled( int i ) const	{ return m_Bounds[ Slot( i ) * 3 + 1 ]; }
+	const fltx4 &MaxsPreScaled( int i ) const	{ return m_Bounds[ Slot( i ) * 3 + 2 ]; }
+
+	void SetBounds( int i, const Vector &vecOrigin, const Vector &vecMinsPreScaled, const Vector &vecMaxsPreScaled )
+	{
+		fltx4 *pBounds = &m_Bounds[ Slot( i ) * 3 ];
+		pBounds[0] = SetWToZeroSIMD( LoadUnaligned3SIMD( vecOrigin.Base() ) );
+		pBounds[1] = SetWToZeroSIMD( LoadUnaligned3SIMD( vecMinsPreScaled.Base() ) );
+		pBounds[2] = SetWToZeroSIMD( LoadUnaligned3SIMD( vecMaxsPreScaled.Base() ) );
+	}
+
+	// Returns the newest record at or before flTargetTime, or the oldest record if they are all newer
+	int FindRecord( float flTargetTime ) const
+	{
+		Assert( m_nCount > 0 );
+
+		int nLow = 0;
+		int nHigh = m_nCount - 1;
+		while ( nLow < nHigh )
+		{
+			int nMid = ( nLow + nHigh ) >> 1;
+			if ( SimulationTime( nMid ) <= flTargetTime )
+			{
+				nHigh = nMid;
+			}
+			else
+			{
+				nLow = nMid + 1;
+			}
+		}
+
+		return nLow;
+	}
+
+private:
+	int Slot( int i ) const
+	{
+		Assert( i >= 0 && i < m_nCount );
+		return ( m_nHead - i ) & ( m_nCapacity - 1 );
+	}
+
+	int								m_nCapacity;
+	int								m_nHead;			// slot of record 0
+	int								m_nCount;
+
+	CUtlVector< float >				m_flSimulationTime;
+	CUtlVector< int >				m_fFlags;
+	CUtlMemoryAligned< fltx4, 16 >	m_Bounds;
+	CUtlVector< QAngle >			m_vecAngles;
+	CUtlVector< LagAnimRecord >		m_Anim;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Where a player will be moved to, resolved from their history
+//-----------------------------------------------------------------------------
+struct LagBacktrackTarget
+{
+	CBasePlayer				*m_pPlayer;
+
+	int						m_iRecord;			// record at or before the target time
+	int						m_iPrevRecord;		// next newer record, or -1
+	float					m_flFrac;			// interpolation fraction from m_iRecord towards m_iPrevRecord
+
+	fltx4					m_vecOrigin;
+	fltx4					m_vecMinsPreScaled;
+	fltx4					m_vecMaxsPreScaled;
+	QAngle					m_vecAngles;
+};
+
 
 //
 // Try to take the player from his current origin to vWantedPos.
@@ -211,6 +366,9 @@ public:
 
 private:
 	void			BacktrackPlayer( CBasePlayer *player, float flTargetTime );
+	bool			FindBacktrackTarget( CBasePlayer *pPlayer, float flTargetTime, LagBacktrackTarget &target ) const;
+	void			ApplyBacktrack( const LagBacktrackTarget &target, float flTargetTime );
+	bool			IsBacktrackTargetNearRay( const LagBacktrackTarget &target, const fltx4 &vecRayStart, const fltx4 &vecRayDelta, const fltx4 &vecRayInvDelta, float flSpreadTan ) const;
 
 	void ClearHistory()
 	{
@@ -218,8 +376,11 @@ private:
 			m_PlayerTrack[i].Purge();
 	}
 
-	// keep a list of lag records for each player
-	CUtlFixedLinkedList< LagRecord >	m_PlayerTrack[ MAX_PLAYERS ];
+	// keep a history of lag records for each player
+	CLagCompensationTrack	m_PlayerTrack[ MAX_PLAYERS ];
+
+	// Scratchpad for the players we're about to move back
+	CUtlVector< LagBacktrackTarget, CUtlMemoryAligned< LagBacktrackTarget, 16 > >	m_BacktrackTargets;
 
 	// Scratchpad for determining what needs to be restored
 	CBitVec<MAX_PLAYERS>	m_RestorePlayer;
@@ -257,12 +418,15 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 	// remove all records before that time:
 	int flDeadtime = gpGlobals->curtime - sv_maxunlag.GetFloat();
 
+	// one record per tick over the whole window, plus slack for the records either side of it
+	int nTrackCapacity = SmallestPowerOfTwoGreaterOrEqual( TIME_TO_TICKS( sv_maxunlag.GetFloat() ) + 2 );
+
 	// Iterate all active players
 	for ( int i = 1; i <= gpGlobals->maxClients; i++ )
 	{
 		CBasePlayer *pPlayer = UTIL_PlayerByIndex( i );
 
-		CUtlFixedLinkedList< LagRecord > *track = &m_PlayerTrack[i-1];
+		CLagCompensationTrack *track = &m_PlayerTrack[i-1];
 
 		if ( !pPlayer )
 		{
@@ -274,47 +438,39 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 			continue;
 		}
 
-		Assert( track->Count() < 1000 ); // insanity check
+		if ( track->Capacity() < nTrackCapacity )
+		{
+			track->Init( nTrackCapacity );
+		}
 
 		// remove tail records that are too old
-		intp tailIndex = track->Tail();
-		while ( track->IsValidIndex( tailIndex ) )
+		while ( track->Count() > 0 && track->SimulationTime( track->Count() - 1 ) < flDeadtime )
 		{
-			LagRecord &tail = track->Element( tailIndex );
-
-			// if tail is within limits, stop
-			if ( tail.m_flSimulationTime >= flDeadtime )
-				break;
-			
-			// remove tail, get new tail
-			track->Remove( tailIndex );
-			tailIndex = track->Tail();
+			track->RemoveTail();
 		}
 
 		// check if head has same simulation time
 		if ( track->Count() > 0 )
 		{
-			LagRecord &head = track->Element( track->Head() );
-
 			// check if player changed simulation time since last time updated
-			if ( head.m_flSimulationTime >= pPlayer->GetSimulationTime() )
+			if ( track->SimulationTime( 0 ) >= pPlayer->GetSimulationTime() )
 				continue; // don't add new entry for same or older time
 		}
 
 		// add new record to player track
-		LagRecord &record = track->Element( track->AddToHead() );
+		track->AddToHead();
 
-		record.m_fFlags = 0;
+		track->Flags( 0 ) = 0;
 		if ( pPlayer->IsAlive() )
 		{
-			record.m_fFlags |= LC_ALIVE;
+			track->Flags( 0 ) |= LC_ALIVE;
 		}
 
-		record.m_flSimulationTime	= pPlayer->GetSimulationTime();
-		record.m_vecAngles			= pPlayer->GetLocalAngles();
-		record.m_vecOrigin			= pPlayer->GetLocalOrigin();
-		record.m_vecMinsPreScaled	= pPlayer->CollisionProp()->OBBMinsPreScaled();
-		record.m_vecMaxsPreScaled	= pPlayer->CollisionProp()->OBBMaxsPreScaled();
+		track->SimulationTime( 0 )	= pPlayer->GetSimulationTime();
+		track->Angles( 0 )			= pPlayer->GetLocalAngles();
+		track->SetBounds( 0, pPlayer->GetLocalOrigin(), pPlayer->CollisionProp()->OBBMinsPreScaled(), pPlayer->CollisionProp()->OBBMaxsPreScaled() );
+
+		LagAnimRecord &record = track->Anim( 0 );
 
 		int layerCount = pPlayer->GetNumAnimOverlays();
 		for( int layerIndex = 0; layerIndex < layerCount; ++layerIndex )
@@ -411,7 +567,11 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 		targettick = gpGlobals->tickcount - TIME_TO_TICKS( correct );
 	}
 	
-	// Iterate all active players
+	float flTargetTime = TICKS_TO_TIME( targettick );
+
+	// Iterate all active players, resolving where each one needs to go
+	m_BacktrackTargets.RemoveAll();
+
 	const CBitVec<MAX_EDICTS> *pEntityTransmitBits = engine->GetEntityTransmitBitsForClient( player->entindex() - 1 );
 	for ( int i = 1; i <= gpGlobals->maxClients; i++ )
 	{
@@ -432,111 +592,180 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 		if ( !player->WantsLagCompensationOnEntity( pPlayer, cmd, pEntityTransmitBits ) )
 			continue;
 
-		// Move other player back in time
-		BacktrackPlayer( pPlayer, TICKS_TO_TIME( targettick ) );
+		LagBacktrackTarget &target = m_BacktrackTargets[ m_BacktrackTargets.AddToTail() ];
+		if ( !FindBacktrackTarget( pPlayer, flTargetTime, target ) )
+		{
+			m_BacktrackTargets.RemoveMultipleFromTail( 1 );
+		}
 	}
+
+	// Skip anyone the shot can't reach either where they are now or where we'd move them to
+	if ( sv_unlag_ray_prefilter.GetBool() )
+	{
+		Vector vecForward;
+		AngleVectors( cmd->viewangles, &vecForward );
+
+		Vector vecEye = player->EyePosition();
+		fltx4 vecRayStart = SetWToZeroSIMD( LoadUnaligned3SIMD( vecEye.Base() ) );
+		fltx4 vecRayDelta = MulSIMD( SetWToZeroSIMD( LoadUnaligned3SIMD( vecForward.Base() ) ), ReplicateX4( MAX_TRACE_LENGTH ) );
+		fltx4 vecRayInvDelta = ReciprocalSIMD( vecRayDelta );
+		float flSpreadTan = tanf( DEG2RAD( sv_unlag_ray_prefilter_spread.GetFloat() ) );
+
+		FOR_EACH_VEC_BACK( m_BacktrackTargets, i )
+		{
+			if ( !IsBacktrackTargetNearRay( m_BacktrackTargets[i], vecRayStart, vecRayDelta, vecRayInvDelta, flSpreadTan ) )
+			{
+				m_BacktrackTargets.FastRemove( i );
+			}
+		}
+	}
+
+	// Move other players back in time
+	FOR_EACH_VEC( m_BacktrackTargets, i )
+	{
+		ApplyBacktrack( m_BacktrackTargets[i], flTargetTime );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Return true if a ray, widened into a cone, passes near either the
+//			player's current bounds or the bounds we're about to move them to.
+//-----------------------------------------------------------------------------
+bool CLagCompensationManager::IsBacktrackTargetNearRay( const LagBacktrackTarget &target, const fltx4 &vecRayStart, const fltx4 &vecRayDelta, const fltx4 &vecRayInvDelta, float flSpreadTan ) const
+{
+	CBasePlayer *pPlayer = target.m_pPlayer;
+	fltx4 vecScale = ReplicateX4( pPlayer->GetModelScale() );
+
+	fltx4 vecOrigin = SetWToZeroSIMD( LoadUnaligned3SIMD( pPlayer->GetLocalOrigin().Base() ) );
+	fltx4 vecMins = MaddSIMD( SetWToZeroSIMD( LoadUnaligned3SIMD( pPlayer->CollisionProp()->OBBMinsPreScaled().Base() ) ), vecScale, vecOrigin );
+	fltx4 vecMaxs = MaddSIMD( SetWToZeroSIMD( LoadUnaligned3SIMD( pPlayer->CollisionProp()->OBBMaxsPreScaled().Base() ) ), vecScale, vecOrigin );
+
+	vecMins = MinSIMD( vecMins, MaddSIMD( target.m_vecMinsPreScaled, vecScale, target.m_vecOrigin ) );
+	vecMaxs = MaxSIMD( vecMaxs, MaddSIMD( target.m_vecMaxsPreScaled, vecScale, target.m_vecOrigin ) );
+
+	// Widen by how far the spread cone has opened up at the far side of the box
+	fltx4 vecFar = MaxSIMD( fabs( SubSIMD( vecMins, vecRayStart ) ), fabs( SubSIMD( vecMaxs, vecRayStart ) ) );
+	float flFarDist = sqrtf( SubFloat( Dot3SIMD( vecFar, vecFar ), 0 ) );
+	float flTolerance = sv_unlag_ray_prefilter_bloat.GetFloat() + flFarDist * flSpreadTan;
+
+	return IsBoxIntersectingRay( vecMins, vecMaxs, vecRayStart, vecRayDelta, vecRayInvDelta, ReplicateX4( flTolerance ) );
 }
 
 void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTargetTime )
 {
-	Vector org;
-	Vector minsPreScaled;
-	Vector maxsPreScaled;
-	QAngle ang;
+	LagBacktrackTarget target;
+	if ( FindBacktrackTarget( pPlayer, flTargetTime, target ) )
+	{
+		ApplyBacktrack( target, flTargetTime );
+	}
+}
 
-	VPROF_BUDGET( "BacktrackPlayer", "CLagCompensationManager" );
+//-----------------------------------------------------------------------------
+// Purpose: Find the history records to move a player back to and interpolate
+//			their position and bounds. Returns false if we lost track of them.
+//-----------------------------------------------------------------------------
+bool CLagCompensationManager::FindBacktrackTarget( CBasePlayer *pPlayer, float flTargetTime, LagBacktrackTarget &target ) const
+{
+	VPROF_BUDGET( "FindBacktrackTarget", "CLagCompensationManager" );
 	int pl_index = pPlayer->entindex() - 1;
 
 	// get track history of this player
-	CUtlFixedLinkedList< LagRecord > *track = &m_PlayerTrack[ pl_index ];
+	const CLagCompensationTrack *track = &m_PlayerTrack[ pl_index ];
 
 	// check if we have at leat one entry
 	if ( track->Count() <= 0 )
-		return;
-
-	intp curr = track->Head();
+		return false;
 
-	LagRecord *prevRecord = NULL;
-	LagRecord *record = NULL;
+	int iRecord = track->FindRecord( flTargetTime );
 
+	// Walk context up to the record we found looking for any invalidating event
 	Vector prevOrg = pPlayer->GetLocalOrigin();
-	
-	// Walk context looking for any invalidating event
-	while( track->IsValidIndex(curr) )
+	for ( int i = 0; i <= iRecord; i++ )
 	{
-		// remember last record
-		prevRecord = record;
-
-		// get next record
-		record = &track->Element( curr );
-
-		if ( !(record->m_fFlags & LC_ALIVE) )
+		if ( !(track->Flags( i ) & LC_ALIVE) )
 		{
 			// player most be alive, lost track
-			return;
+			return false;
 		}
 
-		Vector delta = record->m_vecOrigin - prevOrg;
-		if ( delta.Length2DSqr() > m_flTeleportDistanceSqr )
+		const fltx4 &org = track->Origin( i );
+		float dx = SubFloat( org, 0 ) - prevOrg.x;
+		float dy = SubFloat( org, 1 ) - prevOrg.y;
+		if ( dx * dx + dy * dy > m_flTeleportDistanceSqr )
 		{
 			// lost track, too much difference
-			return; 
+			return false; 
 		}
 
-		// did we find a context smaller than target time ?
-		if ( record->m_flSimulationTime <= flTargetTime )
-			break; // hurra, stop
-
-		prevOrg = record->m_vecOrigin;
-
-		// go one step back
-		curr = track->Next( curr );
+		prevOrg.Init( SubFloat( org, 0 ), SubFloat( org, 1 ), SubFloat( org, 2 ) );
 	}
 
-	Assert( record );
+	target.m_pPlayer = pPlayer;
+	target.m_iRecord = iRecord;
+	target.m_iPrevRecord = iRecord - 1;
+	target.m_flFrac = 0.0f;
 
-	if ( !record )
-	{
-		if ( sv_unlag_debug.GetBool() )
-		{
-			DevMsg( "No valid positions in history for BacktrackPlayer client ( %s )\n", pPlayer->GetPlayerName() );
-		}
-
-		return; // that should never happen
-	}
-
-	float frac = 0.0f;
-	if ( prevRecord && 
-		 (record->m_flSimulationTime < flTargetTime) &&
-		 (record->m_flSimulationTime < prevRecord->m_flSimulationTime) )
+	float flRecordTime = track->SimulationTime( iRecord );
+	if ( target.m_iPrevRecord >= 0 && 
+		 (flRecordTime < flTargetTime) &&
+		 (flRecordTime < track->SimulationTime( target.m_iPrevRecord )) )
 	{
 		// we didn't find the exact time but have a valid previous record
 		// so interpolate between these two records;
+		int iPrevRecord = target.m_iPrevRecord;
+		float flPrevRecordTime = track->SimulationTime( iPrevRecord );
 
-		Assert( prevRecord->m_flSimulationTime > record->m_flSimulationTime );
-		Assert( flTargetTime < prevRecord->m_flSimulationTime );
+		Assert( flPrevRecordTime > flRecordTime );
+		Assert( flTargetTime < flPrevRecordTime );
 
 		// calc fraction between both records
-		frac = ( flTargetTime - record->m_flSimulationTime ) / 
-			( prevRecord->m_flSimulationTime - record->m_flSimulationTime );
+		float frac = ( flTargetTime - flRecordTime ) / ( flPrevRecordTime - flRecordTime );
 
 		Assert( frac > 0 && frac < 1 ); // should never extrapolate
 
-		ang				= Lerp( frac, record->m_vecAngles, prevRecord->m_vecAngles );
-		org				= Lerp( frac, record->m_vecOrigin, prevRecord->m_vecOrigin );
-		minsPreScaled	= Lerp( frac, record->m_vecMinsPreScaled, prevRecord->m_vecMinsPreScaled );
-		maxsPreScaled	= Lerp( frac, record->m_vecMaxsPreScaled, prevRecord->m_vecMaxsPreScaled );
+		fltx4 fracx4 = ReplicateX4( frac );
+		target.m_flFrac				= frac;
+		target.m_vecAngles			= Lerp( frac, track->Angles( iRecord ), track->Angles( iPrevRecord ) );
+		target.m_vecOrigin			= MaddSIMD( SubSIMD( track->Origin( iPrevRecord ), track->Origin( iRecord ) ), fracx4, track->Origin( iRecord ) );
+		target.m_vecMinsPreScaled	= MaddSIMD( SubSIMD( track->MinsPreScaled( iPrevRecord ), track->MinsPreScaled( iRecord ) ), fracx4, track->MinsPreScaled( iRecord ) );
+		target.m_vecMaxsPreScaled	= MaddSIMD( SubSIMD( track->MaxsPreScaled( iPrevRecord ), track->MaxsPreScaled( iRecord ) ), fracx4, track->MaxsPreScaled( iRecord ) );
 	}
 	else
 	{
 		// we found the exact record or no other record to interpolate with
 		// just copy these values since they are the best we have
-		org				= record->m_vecOrigin;
-		ang				= record->m_vecAngles;
-		minsPreScaled	= record->m_vecMinsPreScaled;
-		maxsPreScaled	= record->m_vecMaxsPreScaled;
+		target.m_vecAngles			= track->Angles( iRecord );
+		target.m_vecOrigin			= track->Origin( iRecord );
+		target.m_vecMinsPreScaled	= track->MinsPreScaled( iRecord );
+		target.m_vecMaxsPreScaled	= track->MaxsPreScaled( iRecord );
 	}
 
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Move a player to a resolved backtrack target
+//-----------------------------------------------------------------------------
+void CLagCompensationManager::ApplyBacktrack( const LagBacktrackTarget &target, float flTargetTime )
+{
+	VPROF_BUDGET( "BacktrackPlayer", "CLagCompensationManager" );
+
+	CBasePlayer *pPlayer = target.m_pPlayer;
+	int pl_index = pPlayer->entindex() - 1;
+
+	const CLagCompensationTrack *track = &m_PlayerTrack[ pl_index ];
+	const LagAnimRecord *record = &track->Anim( target.m_iRecord );
+	const LagAnimRecord *prevRecord = ( target.m_iPrevRecord >= 0 ) ? &track->Anim( target.m_iPrevRecord ) : NULL;
+	float frac = target.m_flFrac;
+
+	Vector org;
+	Vector minsPreScaled;
+	Vector maxsPreScaled;
+	QAngle ang = target.m_vecAngles;
+	StoreUnaligned3SIMD( org.Base(), target.m_vecOrigin );
+	StoreUnaligned3SIMD( minsPreScaled.Base(), target.m_vecMinsPreScaled );
+	StoreUnaligned3SIMD( maxsPreScaled.Base(), target.m_vecMaxsPreScaled );
+
 	// See if this is still a valid position for us to teleport to
 	if ( sv_unlag_fixstuck.GetBool() )
 	{
@@ -707,8 +936,8 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 			bool interpolated = false;
 			if( (frac > 0.0f)  &&  interpolationAllowed )
 			{
-				LayerRecord &recordsLayerRecord = record->m_layerRecords[layerIndex];
-				LayerRecord &prevRecordsLayerRecord = prevRecord->m_layerRecords[layerIndex];
+				const LayerRecord &recordsLayerRecord = record->m_layerRecords[layerIndex];
+				const LayerRecord &prevRecordsLayerRecord = prevRecord->m_layerRecords[layerIndex];
 				if( (recordsLayerRecord.m_order == prevRecordsLayerRecord.m_order)
 					&& (recordsLayerRecord.m_sequence == prevRecordsLayerRecord.m_sequence)
 					)
@@ -16,18 +16,26 @@ ConVar tf_bot_choose_target_interval( "tf_bot_choose_target_interval", "0.3f", F
 ConVar tf_bot_sniper_choose_target_interval( "tf_bot_sniper_choose_target_interval", "3.0f", FCVAR_CHEAT, "How often, in seconds, a zoomed-in Sniper can reselect his target" );
 
 
+//------------------------------------------------------------------------------------------
+// Return false if Update() is going to skip this tick, so the manager doesn't precompute a scan for it
+bool CTFBotVision::IsScanDue( void ) const
+{
+	return !TFGameRules()->IsMannVsMachineMode() || m_scanTimer.IsElapsed();
+}
+
+
 //------------------------------------------------------------------------------------------
 // Update internal state
 void CTFBotVision::Update( void )
 {
-	if ( TFGameRules()->IsMannVsMachineMode() )
+	// Throttle vision update rate of robots in MvM for perf at the expense of reaction times
+	if ( !IsScanDue() )
 	{
-		// Throttle vision update rate of robots in MvM for perf at the expense of reaction times
-		if ( !m_scanTimer.IsElapsed() )
-		{
-			return;
-		}
+		return;
+	}
 
+	if ( TFGameRules()->IsMannVsMachineMode() )
+	{
 		m_scanTimer.Start( RandomFloat( 0.9f, 1.1f ) );
 	}
 
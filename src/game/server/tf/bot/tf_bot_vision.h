@@ -19,6 +19,7 @@ public:
 	virtual ~CTFBotVision() { }
 
 	virtual void Update( void );								// update internal state
+	virtual bool IsScanDue( void ) const;						// return false if Update() is throttled this tick
 
 	/**
 	 * Populate "potentiallyVisible" with the set of all entities we could potentially see. 
@@ -413,6 +413,13 @@ CTFNavArea::CTFNavArea( void )
 	m_combatIntensity = 0.0f;
 	m_distanceToBombTarget = 0.0f;
 	m_TFMark = 0;
+	m_incursionFlowPassable = 0;
+	for( int i=0; i<TF_TEAM_COUNT; ++i )
+	{
+		m_distanceFromSpawnRoom[i] = -1.0f;
+		m_incursionFlowDistance[i] = -1.0f;
+		m_incursionFlowParent[i] = NULL;
+	}
 	m_invasionSearchMarker = (unsigned int)-1;
 	m_hScriptInstance = NULL;
 }
@@ -816,6 +823,28 @@ NavErrorType CTFNavArea::Load( CUtlBuffer &fileBuffer, unsigned int version, uns
 }
 
 
+//------------------------------------------------------------------------------------------------
+void CTFNavArea::SavePackedCustomData( CUtlBuffer &fileBuffer ) const
+{
+	unsigned int attributes = m_attributeFlags & TF_NAV_PERSISTENT_ATTRIBUTES;
+	fileBuffer.PutUnsignedInt( attributes );
+}
+
+
+//------------------------------------------------------------------------------------------------
+NavErrorType CTFNavArea::LoadPackedCustomData( CUtlBuffer &fileBuffer, unsigned int subVersion )
+{
+	m_attributeFlags = fileBuffer.GetUnsignedInt();
+	if ( !fileBuffer.IsValid() )
+	{
+		Warning( "Can't read TF-specific attributes\n" );
+		return NAV_INVALID_FILE;
+	}
+
+	return NAV_OK;
+}
+
+
 //--------------------------------------------------------------------------------------------------------
 unsigned int CTFNavArea::m_masterTFMark = 1;
 
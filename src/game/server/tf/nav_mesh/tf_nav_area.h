@@ -77,6 +77,8 @@ public:
 
 	virtual void Save( CUtlBuffer &fileBuffer, unsigned int version ) const;								// (EXTEND)
 	virtual NavErrorType Load( CUtlBuffer &fileBuffer, unsigned int version, unsigned int subVersion );		// (EXTEND)
+	virtual void SavePackedCustomData( CUtlBuffer &fileBuffer ) const;										// (EXTEND)
+	virtual NavErrorType LoadPackedCustomData( CUtlBuffer &fileBuffer, unsigned int subVersion );			// (EXTEND)
 
 	float GetIncursionDistance( int team ) const;				// return travel distance from the team's active spawn room to this area, -1 for invalid
 	CTFNavArea *GetNextIncursionArea( int team ) const;			// return adjacent area with largest increase in incursion distance
@@ -177,6 +179,11 @@ private:
 	friend class CTFNavMesh;
 
 	float m_distanceFromSpawnRoom[ TF_TEAM_COUNT ];
+
+	// the incursion flood fill results, kept so blocked status changes can update them locally
+	float m_incursionFlowDistance[ TF_TEAM_COUNT ];			// travel distance from each team's spawn room, before Red is derived from Blue
+	CTFNavArea *m_incursionFlowParent[ TF_TEAM_COUNT ];		// the area each team's travel distance was reached through
+	unsigned int m_incursionFlowPassable;					// bit per team, set if the flow passed through this area
 	CUtlVector< CTFNavArea * > m_invasionAreaVector[ TF_TEAM_COUNT ];	// use our team as index to get list of areas the enemy is invading from
 	unsigned int m_invasionSearchMarker;
 
@@ -43,6 +43,9 @@ ConVar tf_bot_min_setup_gate_sniper_defend_range( "tf_bot_min_setup_gate_sniper_
 ConVar tf_show_gate_defense_areas( "tf_show_gate_defense_areas", "0", FCVAR_CHEAT );
 ConVar tf_show_point_defense_areas( "tf_show_point_defense_areas", "0", FCVAR_CHEAT );
 
+ConVar tf_nav_incremental_recompute( "tf_nav_incremental_recompute", "1", FCVAR_CHEAT, "Update incursion distances and invasion areas only where blocked status changed, instead of recomputing them for the whole mesh" );
+ConVar tf_nav_incremental_recompute_verify( "tf_nav_incremental_recompute_verify", "0", FCVAR_CHEAT, "Compare each incremental nav mesh update against a full recompute and report any differences" );
+
 
 extern ConVar tf_bot_debug_select_defense_area;
 extern ConVar tf_nav_in_combat_duration;
@@ -455,6 +458,39 @@ CTFNavMesh::CTFNavMesh( void )
 	m_priorBotCount = 0;
 
 	m_recomputeInternalDataTimer.Invalidate();
+
+	InvalidateIncursionFlow();
+}
+
+
+//-------------------------------------------------------------------------
+/**
+ * Destroy Navigation Mesh data and revert to initial state
+ */
+void CTFNavMesh::Reset( void )
+{
+	// the areas the incursion flow refers to are about to be destroyed
+	InvalidateIncursionFlow();
+
+	CNavMesh::Reset();
+}
+
+
+//-------------------------------------------------------------------------
+void CTFNavMesh::OnEditCreateNotify( CNavArea *newArea )
+{
+	CNavMesh::OnEditCreateNotify( newArea );
+
+	InvalidateIncursionFlow();
+}
+
+
+//-------------------------------------------------------------------------
+void CTFNavMesh::OnEditDestroyNotify( CNavArea *deadArea )
+{
+	CNavMesh::OnEditDestroyNotify( deadArea );
+
+	InvalidateIncursionFlow();
 }
 
 
@@ -1029,6 +1065,14 @@ void CTFNavMesh::ComputeBombTargetDistance()
 		return;
 	}
 
+	// bomb travel distances ignore blocked areas, so they only change when the delivery zone moves
+	if ( zoneArea == m_bombTargetArea && m_recomputeReason != RESET && tf_nav_incremental_recompute.GetBool() )
+	{
+		return;
+	}
+
+	m_bombTargetArea = zoneArea;
+
 	// invalidate all travel distances
 	FOR_EACH_VEC( TheNavAreas, it )
 	{
@@ -1128,8 +1172,17 @@ void CTFNavMesh::RecomputeInternalData( void )
 	RemoveAllMeshDecoration();
 	DecorateMesh();
 	ComputeBlockedAreas();			// relies on DecorateMesh() being complete
-	ComputeIncursionDistances();
-	ComputeInvasionAreas();
+
+	if ( m_isIncursionFlowValid && m_recomputeReason != RESET && tf_nav_incremental_recompute.GetBool() )
+	{
+		UpdateIncursionDistances();
+	}
+	else
+	{
+		ComputeIncursionDistances();
+		ComputeInvasionAreas();
+	}
+
 	ComputeLegalBombDropAreas();
 	ComputeBombTargetDistance();	// for MvM
 
@@ -1244,17 +1297,26 @@ void CTFNavMesh::OnObjectChanged()
 	//  sentries will be able to shoot some spies in the face.
 	if ( ActiveSentries.Count() )
 	{
-		// We must iterate all of the nav areas because we're testing visibility
-		//  and arbitrary switchback routes make the use of SearchSurroundingAreas
-		//  not useful.
-		FOR_EACH_VEC( TheNavAreas, it )
+		// We can't use SearchSurroundingAreas because we're testing visibility
+		//  and arbitrary switchback routes make it not useful, but only areas
+		//  overlapping a sentry's range can be in range of it.
+		const Vector sentryRange( SENTRY_MAX_RANGE, SENTRY_MAX_RANGE, SENTRY_MAX_RANGE );
+		CUtlVector< CTFNavArea * > nearbyAreas;
+
+		FOR_EACH_VEC( ActiveSentries, oit )
 		{
-			CTFNavArea *area = static_cast< CTFNavArea *>( TheNavAreas[ it ] );
+			const CBaseObject* obj = ActiveSentries[ oit ];
+
+			Extent sentryExtent;
+			sentryExtent.lo = obj->GetAbsOrigin() - sentryRange;
+			sentryExtent.hi = obj->GetAbsOrigin() + sentryRange;
 
-			// Check all active sentries against this area.
-			FOR_EACH_VEC( ActiveSentries, oit )
+			nearbyAreas.RemoveAll();
+			CollectAreasOverlappingExtent( sentryExtent, &nearbyAreas );
+
+			FOR_EACH_VEC( nearbyAreas, it )
 			{
-				const CBaseObject* obj = ActiveSentries[ oit ];
+				CTFNavArea *area = nearbyAreas[ it ];
 
 				// If this area in range of this sentry?
 				Vector close;
@@ -1428,21 +1490,14 @@ void CTFNavMesh::LoadCustomData( CUtlBuffer &fileBuffer, unsigned int subVersion
 
 //-------------------------------------------------------------------------
 /**
- * Recompute travel distance from each team's spawn room for each nav area
+ * Find the area each team's incursion flow starts from - the area nearest the first
+ * usable spawn point in an active spawn room
  */
-void CTFNavMesh::ComputeIncursionDistances( void )
+void CTFNavMesh::CollectIncursionSpawnAreas( CTFNavArea *spawnArea[ TF_TEAM_COUNT ] )
 {
-	VPROF_BUDGET( "CTFNavMesh::ComputeIncursionDistances", "NextBot" );
-
-	// invalidate all travel distances
-	FOR_EACH_VEC( TheNavAreas, it )
+	for( int t=0; t<TF_TEAM_COUNT; ++t )
 	{
-		CTFNavArea *area = static_cast< CTFNavArea * >( TheNavAreas[ it ] );
-
-		for( int i=0; i<TF_TEAM_COUNT; ++i )
-		{
-			area->m_distanceFromSpawnRoom[i] = -1.0f;
-		}
+		spawnArea[t] = NULL;
 	}
 
 	bool isRedComputed = false;
@@ -1476,13 +1531,17 @@ void CTFNavMesh::ComputeIncursionDistances( void )
 
 			if ( spawnRoom->PointIsWithin( spawnSpot->GetAbsOrigin() ) )
 			{
-				// found a valid spawn spot in an active spawn room, compute travel distances throughout the nav mesh
-				CTFNavArea *spawnArea = static_cast< CTFNavArea * >( TheTFNavMesh()->GetNearestNavArea( spawnSpot ) );
-				if ( spawnArea )
+				// found a valid spawn spot in an active spawn room
+				CTFNavArea *area = static_cast< CTFNavArea * >( GetNearestNavArea( spawnSpot ) );
+				if ( area )
 				{
-					ComputeIncursionDistances( spawnArea, spawnSpot->GetTeamNumber() );
+					int team = spawnSpot->GetTeamNumber();
+					if ( team >= 0 && team < TF_TEAM_COUNT && spawnArea[ team ] == NULL )
+					{
+						spawnArea[ team ] = area;
+					}
 
-					if ( spawnSpot->GetTeamNumber() == TF_TEAM_RED )
+					if ( team == TF_TEAM_RED )
 					{
 						isRedComputed = true;
 					}
@@ -1496,47 +1555,275 @@ void CTFNavMesh::ComputeIncursionDistances( void )
 			}
 		}
 	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------
+/**
+ * Recompute travel distance from each team's spawn room for each nav area
+ */
+void CTFNavMesh::ComputeIncursionDistances( void )
+{
+	VPROF_BUDGET( "CTFNavMesh::ComputeIncursionDistances", "NextBot" );
+
+	// invalidate all travel distances
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		CTFNavArea *area = static_cast< CTFNavArea * >( TheNavAreas[ it ] );
+
+		for( int i=0; i<TF_TEAM_COUNT; ++i )
+		{
+			area->m_incursionFlowDistance[i] = -1.0f;
+			area->m_incursionFlowParent[i] = NULL;
+		}
+	}
+
+	CollectIncursionSpawnAreas( m_incursionSpawnArea );
+
+	for( int t=0; t<TF_TEAM_COUNT; ++t )
+	{
+		// compute travel distances throughout the nav mesh
+		ComputeIncursionDistances( m_incursionSpawnArea[t], t );
+	}
 
-	if ( !isRedComputed )
+	if ( !m_incursionSpawnArea[ TF_TEAM_RED ] )
 	{
 		Warning( "Can't compute incursion distances from the Red spawn room(s). Bots will perform poorly. This is caused by either a missing func_respawnroom, or missing info_player_teamspawn entities within the func_respawnroom.\n" );
 	}
 
-	if ( !isBlueComputed )
+	if ( !m_incursionSpawnArea[ TF_TEAM_BLUE ] )
 	{
 		Warning( "Can't compute incursion distances from the Blue spawn room(s). Bots will perform poorly. This is caused by either a missing func_respawnroom, or missing info_player_teamspawn entities within the func_respawnroom.\n" );
 	}
 
-	if ( !TFGameRules()->IsMannVsMachineMode() )
+	ApplyIncursionDistances( NULL );
+
+	// remember what the flow was computed with, so it can be updated later
+	FOR_EACH_VEC( TheNavAreas, it )
 	{
-		// In Raid mode, the Red (bot) team has no spawn room.
-		// So, we'll assume the Red incursion distance is the inverse of the Blue incursion distance for now.
-		// @TODO: Use the Boss battle room as the anchor for computing Red incursion distances
-		float maxBlueIncursionDistance = 0.0f;
+		CTFNavArea *area = static_cast< CTFNavArea * >( TheNavAreas[ it ] );
 
-		for( int i=0; i<TheNavAreas.Count(); ++i )
+		area->m_incursionFlowPassable = 0;
+		for( int t=0; t<TF_TEAM_COUNT; ++t )
 		{
-			CTFNavArea *area = static_cast< CTFNavArea * >( TheNavAreas[ i ] );
+			if ( IsIncursionFlowPassable( area, t ) )
+			{
+				area->m_incursionFlowPassable |= ( 1 << t );
+			}
+		}
+	}
+
+	m_isIncursionFlowValid = true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------
+/**
+ * Update the incursion distances after blocked status changed, redoing the flood fill only
+ * for the areas whose shortest route went through an area that is now blocked, and from
+ * areas that are no longer blocked.
+ */
+void CTFNavMesh::UpdateIncursionDistances( void )
+{
+	VPROF_BUDGET( "CTFNavMesh::UpdateIncursionDistances", "NextBot" );
+
+	CTFNavArea *spawnArea[ TF_TEAM_COUNT ];
+	CollectIncursionSpawnAreas( spawnArea );
+
+	int updatedCount = 0;
+	CUtlVector< CTFNavArea * > closedVector;
+	CUtlVector< CTFNavArea * > openedVector;
+	CUtlVector< CTFNavArea * > affectedVector;
 
-			if ( area->GetIncursionDistance( TF_TEAM_BLUE ) > maxBlueIncursionDistance )
+	for( int t=0; t<TF_TEAM_COUNT; ++t )
+	{
+		if ( spawnArea[t] != m_incursionSpawnArea[t] )
+		{
+			// the active spawn room moved, flood the whole mesh again
+			FOR_EACH_VEC( TheNavAreas, it )
 			{
-				maxBlueIncursionDistance = area->GetIncursionDistance( TF_TEAM_BLUE );
+				CTFNavArea *area = static_cast< CTFNavArea * >( TheNavAreas[ it ] );
+				area->m_incursionFlowDistance[t] = -1.0f;
+				area->m_incursionFlowParent[t] = NULL;
 			}
+
+			m_incursionSpawnArea[t] = spawnArea[t];
+			ComputeIncursionDistances( spawnArea[t], t );
+
+			updatedCount += TheNavAreas.Count();
+			continue;
 		}
 
-		for( int i=0; i<TheNavAreas.Count(); ++i )
+		if ( spawnArea[t] == NULL )
+			continue;
+
+		// find the areas the flow can no longer pass through, and the ones it now can
+		closedVector.RemoveAll();
+		openedVector.RemoveAll();
+
+		FOR_EACH_VEC( TheNavAreas, it )
 		{
-			CTFNavArea *area = static_cast< CTFNavArea * >( TheNavAreas[ i ] );
+			CTFNavArea *area = static_cast< CTFNavArea * >( TheNavAreas[ it ] );
+
+			bool wasPassable = ( area->m_incursionFlowPassable & ( 1 << t ) ) != 0;
+			if ( wasPassable != IsIncursionFlowPassable( area, t ) )
+			{
+				if ( wasPassable )
+					closedVector.AddToTail( area );
+				else
+					openedVector.AddToTail( area );
+			}
+		}
+
+		if ( closedVector.Count() == 0 && openedVector.Count() == 0 )
+			continue;
+
+		// every area reached through a closed area loses its travel distance
+		CTFNavArea::MakeNewTFMarker();
+		affectedVector.RemoveAll();
+
+		for( int i=0; i<closedVector.Count() + affectedVector.Count(); ++i )
+		{
+			CTFNavArea *area = ( i < closedVector.Count() ) ? closedVector[i] : affectedVector[ i - closedVector.Count() ];
+
+			for( int dir=0; dir<NUM_DIRECTIONS; ++dir )
+			{
+				const NavConnectVector *adjVector = area->GetAdjacentAreas( (NavDirType)dir );
+				FOR_EACH_VEC( (*adjVector), bit )
+				{
+					CTFNavArea *adjArea = static_cast< CTFNavArea * >( (*adjVector)[ bit ].area );
+
+					if ( adjArea->m_incursionFlowParent[t] == area && !adjArea->IsTFMarked() )
+					{
+						adjArea->TFMark();
+						affectedVector.AddToTail( adjArea );
+					}
+				}
+			}
+		}
+
+		FOR_EACH_VEC( affectedVector, ait )
+		{
+			affectedVector[ ait ]->m_incursionFlowDistance[t] = -1.0f;
+			affectedVector[ ait ]->m_incursionFlowParent[t] = NULL;
+		}
+
+		// restart the flood fill from the unaffected areas bordering the affected ones, and from the opened areas
+		CNavArea::ClearSearchLists();
+
+		FOR_EACH_VEC( affectedVector, ait )
+		{
+			CTFNavArea *area = affectedVector[ ait ];
+
+			for( int dir=0; dir<NUM_DIRECTIONS; ++dir )
+			{
+				const NavConnectVector *adjVector = area->GetAdjacentAreas( (NavDirType)dir );
+				FOR_EACH_VEC( (*adjVector), bit )
+				{
+					CTFNavArea *adjArea = static_cast< CTFNavArea * >( (*adjVector)[ bit ].area );
+
+					if ( adjArea->m_incursionFlowDistance[t] >= 0.0f && !adjArea->IsOpen() )
+					{
+						adjArea->AddToOpenListTail();
+					}
+				}
+
+				// one-way links into this area
+				const NavConnectVector *incomingVector = area->GetIncomingConnections( (NavDirType)dir );
+				FOR_EACH_VEC( (*incomingVector), bit )
+				{
+					CTFNavArea *adjArea = static_cast< CTFNavArea * >( (*incomingVector)[ bit ].area );
+
+					if ( adjArea->m_incursionFlowDistance[t] >= 0.0f && !adjArea->IsOpen() )
+					{
+						adjArea->AddToOpenListTail();
+					}
+				}
+			}
+		}
+
+		FOR_EACH_VEC( openedVector, oit )
+		{
+			CTFNavArea *area = openedVector[ oit ];
 
-			if ( area->GetIncursionDistance( TF_TEAM_BLUE ) >= 0.0f )
+			if ( area->m_incursionFlowDistance[t] >= 0.0f && !area->IsOpen() )
 			{
-				area->m_distanceFromSpawnRoom[ TF_TEAM_RED ] = maxBlueIncursionDistance - area->GetIncursionDistance( TF_TEAM_BLUE );
+				area->AddToOpenListTail();
 			}
 		}
+
+		PropagateIncursionFlow( t );
+
+		updatedCount += affectedVector.Count() + openedVector.Count();
+	}
+
+	// remember what the flow was computed with
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		CTFNavArea *area = static_cast< CTFNavArea * >( TheNavAreas[ it ] );
+
+		area->m_incursionFlowPassable = 0;
+		for( int t=0; t<TF_TEAM_COUNT; ++t )
+		{
+			if ( IsIncursionFlowPassable( area, t ) )
+			{
+				area->m_incursionFlowPassable |= ( 1 << t );
+			}
+		}
+	}
+
+	CUtlVector< CTFNavArea * > changedVector;
+	if ( ApplyIncursionDistances( &changedVector ) )
+	{
+		UpdateInvasionAreas( changedVector );
+	}
+	else
+	{
+		// the Red distances derived from Blue were shifted relative to the others
+		ComputeInvasionAreas();
+	}
+
+	if ( tf_nav_incremental_recompute_verify.GetBool() )
+	{
+		DevMsg( "CTFNavMesh: incremental update refilled %d areas, %d incursion distances changed.\n", updatedCount, changedVector.Count() );
+
+		VerifyIncursionUpdate();
 	}
 }
 
 
+//--------------------------------------------------------------------------------------------------------
+/**
+ * Return true if the incursion flow for the given team continues through the given area
+ */
+bool CTFNavMesh::IsIncursionFlowPassable( CTFNavArea *area, int team ) const
+{
+#ifdef TF_RAID_MODE
+	// TODO: Raid mode ignores blocked areas for now (cap gates break this)
+	if ( TFGameRules()->IsRaidMode()  )
+	{
+		return true;
+	}
+#endif // TF_RAID_MODE
+
+	// TODO: Ditto for Mann Vs Machine mode
+	if ( TFGameRules()->IsMannVsMachineMode() )
+	{
+		return true;
+	}
+
+	// ignore spawn room exits, since they presumably will be open
+	// ignore setup gates, since they will be open after the setup time
+	if ( !area->HasAttributeTF( TF_NAV_SPAWN_ROOM_EXIT | TF_NAV_BLUE_SETUP_GATE | TF_NAV_RED_SETUP_GATE ) && area->IsBlocked( team ) )
+	{
+		// don't pass through blocked areas
+		return false;
+	}
+
+	return true;
+}
+
+
 //--------------------------------------------------------------------------------------------------------
 /**
  * Flood-fill outwards, marking flow distance as we go.
@@ -1551,11 +1838,22 @@ void CTFNavMesh::ComputeIncursionDistances( CTFNavArea *spawnArea, int team )
 
 	CNavArea::ClearSearchLists();
 
-	spawnArea->m_distanceFromSpawnRoom[ team ] = 0.0f;
+	spawnArea->m_incursionFlowDistance[ team ] = 0.0f;
+	spawnArea->m_incursionFlowParent[ team ] = NULL;
 	spawnArea->AddToOpenList();
 	spawnArea->Mark();
 	spawnArea->SetParent( NULL );
 
+	PropagateIncursionFlow( team );
+}
+
+
+//--------------------------------------------------------------------------------------------------------
+/**
+ * Continue the incursion flood fill from the areas on the open list
+ */
+void CTFNavMesh::PropagateIncursionFlow( int team )
+{
 	CUtlVectorFixedGrowable< const NavConnect *, 64 > adjAreaVector;
 	//TFNavAttributeType teamSpawnRoom = ( team == TF_TEAM_RED ) ? TF_NAV_SPAWN_ROOM_RED : TF_NAV_SPAWN_ROOM_BLUE;
 
@@ -1563,32 +1861,11 @@ void CTFNavMesh::ComputeIncursionDistances( CTFNavArea *spawnArea, int team )
 	{
 		// get next area to check
 		CTFNavArea *area = static_cast< CTFNavArea * >( CNavArea::PopOpenList() );
-		
-		bool bIgnoreBlockedAreas = false;
-
-#ifdef TF_RAID_MODE
-		// TODO: Raid mode ignores blocked areas for now (cap gates break this)
-		if ( TFGameRules()->IsRaidMode()  )
-		{
-			bIgnoreBlockedAreas = true;
-		}
-#endif // TF_RAID_MODE
 
-		// TODO: Ditto for Mann Vs Machine mode
-		if ( TFGameRules()->IsMannVsMachineMode() )
+		if ( !IsIncursionFlowPassable( area, team ) )
 		{
-			bIgnoreBlockedAreas = true;
-		}
-
-		if ( !bIgnoreBlockedAreas )
-		{
-			// ignore spawn room exits, since they presumably will be open
-			// ignore setup gates, since they will be open after the setup time
-			if ( !area->HasAttributeTF( TF_NAV_SPAWN_ROOM_EXIT | TF_NAV_BLUE_SETUP_GATE | TF_NAV_RED_SETUP_GATE ) && area->IsBlocked( team ) )
-			{
-				// don't pass through blocked areas
-				continue;
-			}
+			// don't pass through blocked areas
+			continue;
 		}
 
 		// explore adjacent floor areas
@@ -1622,14 +1899,15 @@ void CTFNavMesh::ComputeIncursionDistances( CTFNavArea *spawnArea, int team )
 			// if ( !adjArea->HasAttributeTF( teamSpawnRoom ) )
 			{
 				float between = connect->length;
-				newTravelDistance = area->m_distanceFromSpawnRoom[ team ] + between;
+				newTravelDistance = area->m_incursionFlowDistance[ team ] + between;
 			}
 
-			float adjacentTravelDistance = adjArea->m_distanceFromSpawnRoom[ team ];
+			float adjacentTravelDistance = adjArea->m_incursionFlowDistance[ team ];
 
 			if ( adjacentTravelDistance < 0.0f || adjacentTravelDistance > newTravelDistance )
 			{
-				adjArea->m_distanceFromSpawnRoom[ team ] = newTravelDistance;
+				adjArea->m_incursionFlowDistance[ team ] = newTravelDistance;
+				adjArea->m_incursionFlowParent[ team ] = area;
 				adjArea->Mark();
 				adjArea->SetParent( area );
 
@@ -1645,6 +1923,224 @@ void CTFNavMesh::ComputeIncursionDistances( CTFNavArea *spawnArea, int team )
 }
 
 
+//--------------------------------------------------------------------------------------------------------
+/**
+ * Set each area's incursion distances from the flood fill results.  If changedVector is given,
+ * it is filled with the areas whose distances changed relative to the others.  Returns false
+ * if the change can't be described by that list.
+ */
+bool CTFNavMesh::ApplyIncursionDistances( CUtlVector< CTFNavArea * > *changedVector )
+{
+	bool isRedFromBlue = !TFGameRules()->IsMannVsMachineMode();
+
+	// In Raid mode, the Red (bot) team has no spawn room.
+	// So, we'll assume the Red incursion distance is the inverse of the Blue incursion distance for now.
+	// @TODO: Use the Boss battle room as the anchor for computing Red incursion distances
+	float maxBlueIncursionDistance = 0.0f;
+	float oldMaxBlueIncursionDistance = 0.0f;
+	bool hasUnderivedRed = false;
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		CTFNavArea *area = static_cast< CTFNavArea * >( TheNavAreas[ it ] );
+
+		maxBlueIncursionDistance = MAX( maxBlueIncursionDistance, area->m_incursionFlowDistance[ TF_TEAM_BLUE ] );
+		oldMaxBlueIncursionDistance = MAX( oldMaxBlueIncursionDistance, area->m_distanceFromSpawnRoom[ TF_TEAM_BLUE ] );
+	}
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		CTFNavArea *area = static_cast< CTFNavArea * >( TheNavAreas[ it ] );
+
+		bool isChanged = false;
+		for( int t=0; t<TF_TEAM_COUNT; ++t )
+		{
+			float distance = area->m_incursionFlowDistance[t];
+
+			if ( isRedFromBlue && t == TF_TEAM_RED )
+			{
+				if ( area->m_incursionFlowDistance[ TF_TEAM_BLUE ] >= 0.0f )
+				{
+					// a derived distance only changes relative to the others if the Blue distance changed
+					area->m_distanceFromSpawnRoom[t] = maxBlueIncursionDistance - area->m_incursionFlowDistance[ TF_TEAM_BLUE ];
+					continue;
+				}
+
+				hasUnderivedRed |= ( distance >= 0.0f );
+			}
+
+			if ( area->m_distanceFromSpawnRoom[t] != distance )
+			{
+				area->m_distanceFromSpawnRoom[t] = distance;
+				isChanged = true;
+			}
+		}
+
+		if ( isChanged && changedVector )
+		{
+			changedVector->AddToTail( area );
+		}
+	}
+
+	// shifting the derived Red distances changes how they compare to the ones that aren't derived
+	return !( hasUnderivedRed && maxBlueIncursionDistance != oldMaxBlueIncursionDistance );
+}
+
+
+//--------------------------------------------------------------------------------------------------------
+class IsAnyAreaTFMarked
+{
+public:
+	bool operator() ( CNavArea *baseArea )
+	{
+		// stop searching when a marked area is found
+		return !static_cast< CTFNavArea * >( baseArea )->IsTFMarked();
+	}
+};
+
+
+//--------------------------------------------------------------------------------------------------------
+/**
+ * Recompute the invasion areas of each area that can see an area whose incursion distance changed,
+ * or an area adjacent to one
+ */
+void CTFNavMesh::UpdateInvasionAreas( const CUtlVector< CTFNavArea * > &changedVector )
+{
+	VPROF_BUDGET( "CTFNavMesh::UpdateInvasionAreas", "NextBot" );
+
+	if ( changedVector.Count() == 0 )
+		return;
+
+	CTFNavArea::MakeNewTFMarker();
+
+	FOR_EACH_VEC( changedVector, it )
+	{
+		CTFNavArea *area = changedVector[ it ];
+		area->TFMark();
+
+		for( int dir=0; dir<NUM_DIRECTIONS; ++dir )
+		{
+			const NavConnectVector *adjVector = area->GetAdjacentAreas( (NavDirType)dir );
+			FOR_EACH_VEC( (*adjVector), bit )
+			{
+				static_cast< CTFNavArea * >( (*adjVector)[ bit ].area )->TFMark();
+			}
+
+			const NavConnectVector *incomingVector = area->GetIncomingConnections( (NavDirType)dir );
+			FOR_EACH_VEC( (*incomingVector), bit )
+			{
+				static_cast< CTFNavArea * >( (*incomingVector)[ bit ].area )->TFMark();
+			}
+		}
+	}
+
+	IsAnyAreaTFMarked isMarked;
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		CTFNavArea *area = static_cast< CTFNavArea * >( TheNavAreas[ it ] );
+
+		if ( area->IsTFMarked() || !area->ForAllCompletelyVisibleAreas( isMarked ) )
+		{
+			area->ComputeInvasionAreaVectors();
+		}
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------
+/**
+ * Compare the results of an incremental update against a full recompute, and keep the full results
+ */
+void CTFNavMesh::VerifyIncursionUpdate( void )
+{
+	CUtlVector< float > distanceVector;
+	CUtlVector< CTFNavArea * > invasionVector;
+	CUtlVector< int > invasionCountVector;
+
+	distanceVector.EnsureCapacity( TheNavAreas.Count() * TF_TEAM_COUNT );
+	invasionCountVector.EnsureCapacity( TheNavAreas.Count() * TF_TEAM_COUNT );
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		CTFNavArea *area = static_cast< CTFNavArea * >( TheNavAreas[ it ] );
+
+		for( int t=0; t<TF_TEAM_COUNT; ++t )
+		{
+			distanceVector.AddToTail( area->m_distanceFromSpawnRoom[t] );
+			invasionCountVector.AddToTail( area->m_invasionAreaVector[t].Count() );
+			invasionVector.AddVectorToTail( area->m_invasionAreaVector[t] );
+		}
+	}
+
+	ComputeIncursionDistances();
+	ComputeInvasionAreas();
+
+	const float tolerance = 0.01f;
+	int distanceMismatchCount = 0;
+	int invasionMismatchCount = 0;
+	int i = 0;
+	int invasion = 0;
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		CTFNavArea *area = static_cast< CTFNavArea * >( TheNavAreas[ it ] );
+
+		for( int t=0; t<TF_TEAM_COUNT; ++t, ++i )
+		{
+			if ( fabs( distanceVector[i] - area->m_distanceFromSpawnRoom[t] ) > tolerance )
+			{
+				if ( distanceMismatchCount++ < 10 )
+				{
+					Warning( "CTFNavMesh: area #%d team %d incursion distance is %f, should be %f\n", area->GetID(), t, distanceVector[i], area->m_distanceFromSpawnRoom[t] );
+				}
+			}
+
+			const CUtlVector< CTFNavArea * > &fullVector = area->m_invasionAreaVector[t];
+			bool isSame = ( invasionCountVector[i] == fullVector.Count() );
+			for( int v=0; isSame && v<fullVector.Count(); ++v )
+			{
+				isSame = ( invasionVector[ invasion + v ] == fullVector[v] );
+			}
+			invasion += invasionCountVector[i];
+
+			if ( !isSame )
+			{
+				if ( invasionMismatchCount++ < 10 )
+				{
+					Warning( "CTFNavMesh: area #%d team %d invasion areas differ from a full recompute\n", area->GetID(), t );
+				}
+			}
+		}
+	}
+
+	if ( distanceMismatchCount || invasionMismatchCount )
+	{
+		Warning( "CTFNavMesh: incremental update had %d incursion distance and %d invasion area mismatches.\n", distanceMismatchCount, invasionMismatchCount );
+	}
+	else
+	{
+		DevMsg( "CTFNavMesh: incremental update matches a full recompute.\n" );
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------
+/**
+ * Forget the incursion flow, so it is fully recomputed next time
+ */
+void CTFNavMesh::InvalidateIncursionFlow( void )
+{
+	m_isIncursionFlowValid = false;
+	m_bombTargetArea = NULL;
+
+	for( int t=0; t<TF_TEAM_COUNT; ++t )
+	{
+		m_incursionSpawnArea[t] = NULL;
+	}
+}
+
+
 //--------------------------------------------------------------------------------------------------------
 void CTFNavMesh::ComputeInvasionAreas( void )
 {
@@ -38,6 +38,7 @@ public:
 	CTFNavMesh( void );
 
 	virtual CTFNavArea *CreateArea( void ) const;						// CNavArea factory
+	virtual void Reset( void );											// destroy Navigation Mesh data and revert to initial state
 
 	virtual void Update( void );										// invoked on each game frame
 
@@ -110,6 +111,9 @@ public:
 
 	virtual void OnDoorCreated( CBaseEntity *door );					// invoked when a door is created
 
+	virtual void OnEditCreateNotify( CNavArea *newArea );				// invoked when given area has just been added to the mesh in edit mode
+	virtual void OnEditDestroyNotify( CNavArea *deadArea );				// invoked when given area has just been deleted from the mesh in edit mode
+
 protected:
 	virtual void BeginCustomAnalysis( bool bIncremental );
 	virtual void PostCustomAnalysis( void );							// invoked when custom analysis step is complete
@@ -118,9 +122,18 @@ protected:
 private:
 	void ComputeIncursionDistances( void );					// recompute travel distance from each team's spawn room for each nav area
 	void ComputeIncursionDistances( CTFNavArea *spawnArea, int team );
+	void UpdateIncursionDistances( void );					// update travel distances only where blocked status changed since they were computed
+	void CollectIncursionSpawnAreas( CTFNavArea *spawnArea[ TF_TEAM_COUNT ] );
+	bool IsIncursionFlowPassable( CTFNavArea *area, int team ) const;
+	void PropagateIncursionFlow( int team );				// continue the flood fill from the areas on the open list
+	bool ApplyIncursionDistances( CUtlVector< CTFNavArea * > *changedVector );
+	void UpdateInvasionAreas( const CUtlVector< CTFNavArea * > &changedVector );
+	void VerifyIncursionUpdate( void );
+	void InvalidateIncursionFlow( void );
 	void ComputeInvasionAreas( void );
 	void ComputeLegalBombDropAreas( void );
 	void ComputeBombTargetDistance();
+	CTFNavArea *m_bombTargetArea;							// the area bomb travel distances were computed from
 
 	void UpdateDebugDisplay( void ) const;
 
@@ -150,6 +163,9 @@ private:
 
 	CountdownTimer m_watchCartTimer;
 
+	CTFNavArea *m_incursionSpawnArea[ TF_TEAM_COUNT ];		// the area each team's incursion flow was computed from
+	bool m_isIncursionFlowValid;							// the incursion flow can be updated instead of recomputed
+
 	int m_priorBotCount;
 };
 
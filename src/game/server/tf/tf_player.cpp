@@ -74,6 +74,8 @@
 #include "tf_item_powerup_bottle.h"
 #include "nav_mesh/tf_nav_mesh.h"
 #include "tier0/vprof.h"
+#include "tier0/fasttimer.h"
+#include "bone_setup.h"
 #include "econ_gcmessages.h"
 #include "tf_gcmessages.h"
 #include "tf_obj_sentrygun.h"
@@ -20377,6 +20379,112 @@ CON_COMMAND_F( tf_crashclients, "testing only, crashes about 50 percent of the c
 	}
 }
 #endif // _DEBUG
+
+//-----------------------------------------------------------------------------
+// Purpose: Time bone setup of every player class model with and without
+//			the decoded animation cache
+//-----------------------------------------------------------------------------
+static float BenchSetupBones( CStudioHdr *pStudioHdr, int nIterations, Vector *pos, Quaternion *q, matrix3x4_t *pBoneToWorld )
+{
+	float flPoseParameter[MAXSTUDIOPOSEPARAM];
+	memset( flPoseParameter, 0, sizeof( flPoseParameter ) );
+
+	CFastTimer timer;
+	timer.Start();
+	for ( int i = 0; i < nIterations; i++ )
+	{
+		float flCycle = ( i + 0.5f ) / nIterations;
+		for ( int iSequence = 0; iSequence < pStudioHdr->GetNumSeq(); iSequence++ )
+		{
+			IBoneSetup boneSetup( pStudioHdr, BONE_USED_BY_ANYTHING, flPoseParameter );
+			boneSetup.InitPose( pos, q );
+			boneSetup.AccumulatePose( pos, q, iSequence, flCycle, 1.0f, gpGlobals->curtime, NULL );
+			Studio_BuildMatrices( pStudioHdr, vec3_angle, vec3_origin, pos, q, -1, 1.0f, pBoneToWorld, BONE_USED_BY_ANYTHING );
+		}
+	}
+	timer.End();
+	return timer.GetDuration().GetMillisecondsF();
+}
+
+CON_COMMAND_F( tf_bench_setupbones, "Time bone setup of every sequence of every player class model with and without anim_decodecache. Format is tf_bench_setupbones [iterations]", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	int nIterations = ( args.ArgC() > 1 ) ? MAX( 1, atoi( args[1] ) ) : 10;
+
+	ConVarRef anim_decodecache( "anim_decodecache" );
+	bool bWasEnabled = anim_decodecache.GetBool();
+
+	Vector *pos = new Vector[MAXSTUDIOBONES];
+	Quaternion *q = new Quaternion[MAXSTUDIOBONES];
+	matrix3x4_t *pBoneToWorld = new matrix3x4_t[MAXSTUDIOBONES];
+	matrix3x4_t *pCheckBoneToWorld = new matrix3x4_t[MAXSTUDIOBONES];
+
+	float flTotalWalk = 0.0f;
+	float flTotalCache = 0.0f;
+	for ( int iClass = TF_FIRST_NORMAL_CLASS; iClass < TF_LAST_NORMAL_CLASS; iClass++ )
+	{
+		const char *pszModel = GetPlayerClassData( iClass )->GetModelName();
+		const model_t *pModel = modelinfo->GetModel( modelinfo->GetModelIndex( pszModel ) );
+		if ( !pModel )
+			continue;
+
+		CStudioHdr studioHdr( modelinfo->GetStudiomodel( pModel ), mdlcache );
+		if ( !studioHdr.IsValid() )
+			continue;
+
+		// the first pass of each mode pages in the anim blocks and fills the cache
+		anim_decodecache.SetValue( 0 );
+		BenchSetupBones( &studioHdr, 1, pos, q, pBoneToWorld );
+		float flWalk = BenchSetupBones( &studioHdr, nIterations, pos, q, pBoneToWorld );
+
+		anim_decodecache.SetValue( 1 );
+		BenchSetupBones( &studioHdr, 1, pos, q, pBoneToWorld );
+		float flCache = BenchSetupBones( &studioHdr, nIterations, pos, q, pBoneToWorld );
+
+		// both paths should produce the same skeleton
+		float flPoseParameter[MAXSTUDIOPOSEPARAM];
+		memset( flPoseParameter, 0, sizeof( flPoseParameter ) );
+		float flMaxError = 0.0f;
+		for ( int iSequence = 0; iSequence < studioHdr.GetNumSeq(); iSequence++ )
+		{
+			for ( int iPass = 0; iPass < 2; iPass++ )
+			{
+				anim_decodecache.SetValue( iPass );
+				IBoneSetup boneSetup( &studioHdr, BONE_USED_BY_ANYTHING, flPoseParameter );
+				boneSetup.InitPose( pos, q );
+				boneSetup.AccumulatePose( pos, q, iSequence, 0.37f, 1.0f, gpGlobals->curtime, NULL );
+				Studio_BuildMatrices( &studioHdr, vec3_angle, vec3_origin, pos, q, -1, 1.0f, iPass ? pBoneToWorld : pCheckBoneToWorld, BONE_USED_BY_ANYTHING );
+			}
+
+			for ( int iBone = 0; iBone < studioHdr.numbones(); iBone++ )
+			{
+				const float *pA = pBoneToWorld[iBone].Base();
+				const float *pB = pCheckBoneToWorld[iBone].Base();
+				for ( int j = 0; j < 12; j++ )
+				{
+					flMaxError = MAX( flMaxError, fabs( pA[j] - pB[j] ) );
+				}
+			}
+		}
+
+		Msg( "%-24s %4d bones %4d seqs: walk %8.2f ms, cache %8.2f ms (%.2fx), max error %g\n",
+			V_GetFileName( pszModel ), studioHdr.numbones(), studioHdr.GetNumSeq(), flWalk, flCache, flCache > 0.0f ? flWalk / flCache : 0.0f, flMaxError );
+
+		flTotalWalk += flWalk;
+		flTotalCache += flCache;
+	}
+
+	Msg( "%d iterations: walk %.2f ms, cache %.2f ms (%.2fx)\n", nIterations, flTotalWalk, flTotalCache, flTotalCache > 0.0f ? flTotalWalk / flTotalCache : 0.0f );
+
+	anim_decodecache.SetValue( bWasEnabled );
+
+	delete[] pos;
+	delete[] q;
+	delete[] pBoneToWorld;
+	delete[] pCheckBoneToWorld;
+}
 //-----------------------------------------------------------------------------
 // Purpose: 
 //-----------------------------------------------------------------------------
@@ -3560,6 +3560,7 @@ bool VScriptServerReplaceClosures( const char *pszScriptName, HSCRIPT hScope, bo
 		return false;
 	}
 
+	CDefScriptScopeBase::InvalidateFunctionCaches();
 	g_pScriptVM->Call( hReplaceClosuresFunc, NULL, true, NULL, hNewScript, hScope );
 	g_pScriptVM->ReleaseFunction( hReplaceClosuresFunc );
 	g_pScriptVM->ReleaseScript( hNewScript );
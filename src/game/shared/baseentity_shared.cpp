@@ -440,7 +440,14 @@ bool CBaseEntity::KeyValue( const char *szKeyName, const char *szValue )
 	
 	if ( FStrEq( szKeyName, "targetname" ) )
 	{
-		m_iName = AllocPooledString( szValue );
+		SetName( AllocPooledString( szValue ) );
+		return true;
+	}
+
+	// handled here instead of through the "classname" key field so the entity list index stays current
+	if ( FStrEq( szKeyName, "classname" ) )
+	{
+		SetClassname( szValue );
 		return true;
 	}
 
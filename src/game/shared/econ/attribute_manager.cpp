@@ -12,6 +12,7 @@
 #include "fmtstr.h"
 #include "KeyValues.h"
 #include "econ_item_system.h"
+#include "utldict.h"
 
 #if defined( TF_DLL ) || defined( TF_CLIENT_DLL )
 	#include "tf_gamerules.h"								// attribute cache flushing; can be generalized if/when Dota needs similar functionality
@@ -20,6 +21,162 @@
 #define PROVIDER_PARITY_BITS		6
 #define PROVIDER_PARITY_MASK		((1<<PROVIDER_PARITY_BITS)-1)
 
+//==================================================================================================================
+// ATTRIBUTE HOOK REGISTRY
+//===================================================================================================================
+struct attrib_hook_info_t
+{
+	const char		*pszName;		// owned by the registry dictionary, never freed
+	unsigned int	nCacheHits;
+	unsigned int	nCacheMisses;
+	unsigned int	nUncached;		// requests with an item list, which always take the slow path
+};
+
+class CAttributeHookRegistry
+{
+public:
+	CAttributeHookRegistry() : m_IDs( k_eDictCompareTypeCaseInsensitive ) {}
+
+	attrib_hook_id_t Register( const char *pszAttribHook )
+	{
+		AUTO_LOCK( m_Mutex );
+
+		int iIndex = m_IDs.Find( pszAttribHook );
+		if ( iIndex != m_IDs.InvalidIndex() )
+			return m_IDs[iIndex];
+
+		attrib_hook_id_t iAttribHook = m_Info.AddToTail();
+		iIndex = m_IDs.Insert( pszAttribHook, iAttribHook );
+
+		attrib_hook_info_t &info = m_Info[iAttribHook];
+		info.pszName = m_IDs.GetElementName( iIndex );
+		info.nCacheHits = 0;
+		info.nCacheMisses = 0;
+		info.nUncached = 0;
+
+		return iAttribHook;
+	}
+
+	int Count() const { return m_Info.Count(); }
+	attrib_hook_info_t &operator[]( attrib_hook_id_t iAttribHook ) { return m_Info[iAttribHook]; }
+
+private:
+	CThreadFastMutex					m_Mutex;
+	CUtlDict< attrib_hook_id_t, int >	m_IDs;
+	CUtlVector< attrib_hook_info_t >	m_Info;
+};
+
+static CAttributeHookRegistry &AttributeHookRegistry()
+{
+	// Hooks are registered from function-local statics, so don't depend on global construction order
+	static CAttributeHookRegistry s_Registry;
+	return s_Registry;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Return the ID for the named hook, assigning a new one if it hasn't been seen before
+//-----------------------------------------------------------------------------
+attrib_hook_id_t CAttributeManager::RegisterAttribHook( const char *pszAttribHook )
+{
+	if ( pszAttribHook == NULL || pszAttribHook[0] == '\0' )
+		return INVALID_ATTRIB_HOOK_ID;
+
+	return AttributeHookRegistry().Register( pszAttribHook );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: 
+//-----------------------------------------------------------------------------
+const char *CAttributeManager::GetAttribHookName( attrib_hook_id_t iAttribHook )
+{
+	CAttributeHookRegistry &registry = AttributeHookRegistry();
+	if ( iAttribHook < 0 || iAttribHook >= registry.Count() )
+		return NULL;
+
+	return registry[iAttribHook].pszName;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: The attribute containers match hooks against the pooled class name of
+//			each attribute definition, so the slow path still needs a string_t.
+//-----------------------------------------------------------------------------
+static string_t GetAttribHookPooledString( attrib_hook_id_t iAttribHook )
+{
+	return AllocPooledString_StaticConstantStringPointer( AttributeHookRegistry()[iAttribHook].pszName );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Print cache hit rates for every hook that has been called
+//-----------------------------------------------------------------------------
+static int AttribHookStatsSort( const attrib_hook_id_t *pLeft, const attrib_hook_id_t *pRight )
+{
+	const attrib_hook_info_t &left = AttributeHookRegistry()[*pLeft];
+	const attrib_hook_info_t &right = AttributeHookRegistry()[*pRight];
+
+	unsigned int nLeft = left.nCacheHits + left.nCacheMisses + left.nUncached;
+	unsigned int nRight = right.nCacheHits + right.nCacheMisses + right.nUncached;
+	if ( nLeft != nRight )
+		return ( nLeft > nRight ) ? -1 : 1;
+
+	return *pLeft - *pRight;
+}
+
+static void PrintAttribHookStats( const CCommand &args )
+{
+	CAttributeHookRegistry &registry = AttributeHookRegistry();
+
+	if ( args.ArgC() > 1 && !V_stricmp( args[1], "reset" ) )
+	{
+		for ( int i = 0; i < registry.Count(); i++ )
+		{
+			registry[i].nCacheHits = 0;
+			registry[i].nCacheMisses = 0;
+			registry[i].nUncached = 0;
+		}
+		return;
+	}
+
+	CUtlVector< attrib_hook_id_t > sorted;
+	unsigned int nTotalHits = 0;
+	unsigned int nTotalCalls = 0;
+	for ( int i = 0; i < registry.Count(); i++ )
+	{
+		const attrib_hook_info_t &info = registry[i];
+		unsigned int nCalls = info.nCacheHits + info.nCacheMisses + info.nUncached;
+		if ( nCalls == 0 )
+			continue;
+
+		sorted.AddToTail( i );
+		nTotalHits += info.nCacheHits;
+		nTotalCalls += nCalls;
+	}
+	sorted.Sort( &AttribHookStatsSort );
+
+	Msg( "%10s %10s %10s %10s %7s  %s\n", "calls", "hits", "misses", "uncached", "hit%", "hook" );
+	FOR_EACH_VEC( sorted, i )
+	{
+		const attrib_hook_info_t &info = registry[ sorted[i] ];
+		unsigned int nCalls = info.nCacheHits + info.nCacheMisses + info.nUncached;
+		Msg( "%10u %10u %10u %10u %6.1f%%  %s\n", nCalls, info.nCacheHits, info.nCacheMisses, info.nUncached, 100.0f * info.nCacheHits / nCalls, info.pszName );
+	}
+	Msg( "%d hooks registered, %d called, %u calls, %.1f%% cache hits\n", registry.Count(), sorted.Count(), nTotalCalls, nTotalCalls ? 100.0f * nTotalHits / nTotalCalls : 0.0f );
+}
+
+#ifdef CLIENT_DLL
+CON_COMMAND_F( cl_attrib_hook_stats, "Show attribute hook cache hit rates on the client. Pass 'reset' to clear the counters.", FCVAR_CHEAT )
+{
+	PrintAttribHookStats( args );
+}
+#else
+CON_COMMAND_F( attrib_hook_stats, "Show attribute hook cache hit rates on the server. Pass 'reset' to clear the counters.", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	PrintAttribHookStats( args );
+}
+#endif
+
 //==================================================================================================================
 // ATTRIBUTE MANAGER SAVE/LOAD & NETWORKING
 //===================================================================================================================
@@ -129,6 +286,7 @@ CAttributeManager::CAttributeManager()
 {
 	m_nCalls = 0;
 	m_nCurrentTick = 0;
+	m_nCacheEpoch = 1;
 }
 
 #ifdef CLIENT_DLL
@@ -256,7 +414,16 @@ void CAttributeManager::ClearCache( void )
 	if ( m_bPreventLoopback )
 		return;
 
-	m_CachedResults.Purge();
+	// Invalidate every cached entry at once. New entries start at epoch 0, so never wrap back to it.
+	if ( m_nCacheEpoch == INT_MAX )
+	{
+		m_CachedResults.Purge();
+		m_nCacheEpoch = 1;
+	}
+	else
+	{
+		++m_nCacheEpoch;
+	}
 
 	m_bPreventLoopback = true;
 
@@ -325,10 +492,41 @@ bool CAttributeManager::IsBeingProvidedToBy( CBaseEntity *pEntity ) const
 // ATTRIBUTE HOOKS
 //=====================================================================================================
 
+//-----------------------------------------------------------------------------
+// Purpose: Return the cached result for a hook if it's still valid
+//-----------------------------------------------------------------------------
+CAttributeManager::cached_attribute_t *CAttributeManager::FindCachedResult( attrib_hook_id_t iAttribHook, bool bIsString )
+{
+	if ( iAttribHook >= m_CachedResults.Count() )
+		return NULL;
+
+	cached_attribute_t &entry = m_CachedResults[iAttribHook];
+	if ( entry.nEpoch != m_nCacheEpoch || entry.bIsString != bIsString )
+		return NULL;
+
+	return &entry;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Return the cache slot for a hook, growing the cache if this is the
+//			highest hook ID we've been asked about.
+//-----------------------------------------------------------------------------
+CAttributeManager::cached_attribute_t &CAttributeManager::GetCacheEntry( attrib_hook_id_t iAttribHook )
+{
+	int iOldCount = m_CachedResults.Count();
+	if ( iAttribHook >= iOldCount )
+	{
+		m_CachedResults.AddMultipleToTail( iAttribHook + 1 - iOldCount );
+		memset( m_CachedResults.Base() + iOldCount, 0, ( m_CachedResults.Count() - iOldCount ) * sizeof( cached_attribute_t ) );
+	}
+
+	return m_CachedResults[iAttribHook];
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Wrapper that checks to see if we've already got the result in our cache
 //-----------------------------------------------------------------------------
-float CAttributeManager::ApplyAttributeFloatWrapper( float flValue, CBaseEntity *pInitiator, string_t iszAttribHook, CUtlVector<CBaseEntity*> *pItemList )
+float CAttributeManager::ApplyAttributeFloatWrapper( float flValue, CBaseEntity *pInitiator, attrib_hook_id_t iAttribHook, CUtlVector<CBaseEntity*> *pItemList )
 {
 	VPROF_BUDGET( "CAttributeManager::ApplyAttributeFloatWrapper", VPROF_BUDGETGROUP_ATTRIBUTES );
 
@@ -352,45 +550,43 @@ float CAttributeManager::ApplyAttributeFloatWrapper( float flValue, CBaseEntity
 		m_iCacheVersion = iGlobalCacheVersion;
 	}
 
+	attrib_hook_info_t &hookInfo = AttributeHookRegistry()[iAttribHook];
+
 	// We can't cache off item references so if we asked for them we need to execute the whole slow path.
-	if ( !pItemList )
+	if ( pItemList )
 	{
-		int iCount = m_CachedResults.Count();
-		for ( int i = iCount-1; i >= 0; i-- )
-		{
-			if ( m_CachedResults[i].iAttribHook == iszAttribHook )
-			{
-				if ( m_CachedResults[i].in.fl == flValue )
-					return m_CachedResults[i].out.fl;
-
-				// We've got a cached result for a different flIn value. Remove the cached result to
-				// prevent stacking up entries for different requests (i.e. crit chance)
-				m_CachedResults.Remove(i);
-				break;
-			}
-		}
+		++hookInfo.nUncached;
+		return ApplyAttributeFloat( flValue, pInitiator, GetAttribHookPooledString( iAttribHook ), pItemList );
 	}
 
-	// Wasn't in cache, or we need item references. Do the work.
-	float flResult = ApplyAttributeFloat( flValue, pInitiator, iszAttribHook, pItemList );
-
-	// Add it to our cache if we didn't ask for item references. We could add the result value here
-	// even if we did but we'd need to walk the cache to search for an old entry to overwrite first.
-	if ( !pItemList )
+	// A cached result for a different flIn value is simply overwritten below, so we
+	// never stack up entries for different requests (i.e. crit chance)
+	const cached_attribute_t *pCached = FindCachedResult( iAttribHook, false );
+	if ( pCached && pCached->in.fl == flValue )
 	{
-		int iIndex = m_CachedResults.AddToTail();
-		m_CachedResults[iIndex].in.fl = flValue;
-		m_CachedResults[iIndex].out.fl = flResult;
-		m_CachedResults[iIndex].iAttribHook = iszAttribHook;
+		++hookInfo.nCacheHits;
+		return pCached->out.fl;
 	}
 
+	++hookInfo.nCacheMisses;
+
+	// Wasn't in cache. Do the work.
+	float flResult = ApplyAttributeFloat( flValue, pInitiator, GetAttribHookPooledString( iAttribHook ), pItemList );
+
+	// ApplyAttributeFloat can recurse into other hooks and grow the cache, so look the slot up again
+	cached_attribute_t &entry = GetCacheEntry( iAttribHook );
+	entry.in.fl = flValue;
+	entry.out.fl = flResult;
+	entry.nEpoch = m_nCacheEpoch;
+	entry.bIsString = false;
+
 	return flResult;
 }
 
 //-----------------------------------------------------------------------------
 // Purpose: Wrapper that checks to see if we've already got the result in our cache
 //-----------------------------------------------------------------------------
-string_t CAttributeManager::ApplyAttributeStringWrapper( string_t iszValue, CBaseEntity *pInitiator, string_t iszAttribHook, CUtlVector<CBaseEntity*> *pItemList /*= NULL*/ )
+string_t CAttributeManager::ApplyAttributeStringWrapper( string_t iszValue, CBaseEntity *pInitiator, attrib_hook_id_t iAttribHook, CUtlVector<CBaseEntity*> *pItemList /*= NULL*/ )
 {
 	// Have we requested a global attribute cache flush?
 	const int iGlobalCacheVersion = GetGlobalCacheVersion();
@@ -400,40 +596,33 @@ string_t CAttributeManager::ApplyAttributeStringWrapper( string_t iszValue, CBas
 		m_iCacheVersion = iGlobalCacheVersion;
 	}
 
+	attrib_hook_info_t &hookInfo = AttributeHookRegistry()[iAttribHook];
+
 	// We can't cache off item references so if we asked for them we need to execute the whole slow path.
-	if ( !pItemList )
+	if ( pItemList )
 	{
-		int iCount = m_CachedResults.Count();
-		for ( int i = iCount-1; i >= 0; i-- )
-		{
-			if ( m_CachedResults[i].iAttribHook == iszAttribHook )
-			{
-				if ( m_CachedResults[i].in.isz == iszValue )
-				{
-					return m_CachedResults[i].out.isz;
-				}
-
-				// We've got a cached result for a different flIn value. Remove the cached result to
-				// prevent stacking up entries for different requests (i.e. crit chance)
-				m_CachedResults.Remove(i);
-				break;
-			}
-		}
+		++hookInfo.nUncached;
+		return ApplyAttributeString( iszValue, pInitiator, GetAttribHookPooledString( iAttribHook ), pItemList );
 	}
 
-	// Wasn't in cache, or we need item references. Do the work.
-	string_t iszOut = ApplyAttributeString( iszValue, pInitiator, iszAttribHook, pItemList );
-
-	// Add it to our cache if we didn't ask for item references. We could add the result value here
-	// even if we did but we'd need to walk the cache to search for an old entry to overwrite first.
-	if ( !pItemList )
+	const cached_attribute_t *pCached = FindCachedResult( iAttribHook, true );
+	if ( pCached && pCached->in.isz == iszValue )
 	{
-		int iIndex = m_CachedResults.AddToTail();
-		m_CachedResults[iIndex].in.isz = iszValue;
-		m_CachedResults[iIndex].out.isz = iszOut;
-		m_CachedResults[iIndex].iAttribHook = iszAttribHook;
+		++hookInfo.nCacheHits;
+		return pCached->out.isz;
 	}
 
+	++hookInfo.nCacheMisses;
+
+	// Wasn't in cache. Do the work.
+	string_t iszOut = ApplyAttributeString( iszValue, pInitiator, GetAttribHookPooledString( iAttribHook ), pItemList );
+
+	cached_attribute_t &entry = GetCacheEntry( iAttribHook );
+	entry.in.isz = iszValue;
+	entry.out.isz = iszOut;
+	entry.nEpoch = m_nCacheEpoch;
+	entry.bIsString = true;
+
 	return iszOut;
 }
 
@@ -39,10 +39,21 @@ inline IHasAttributes *GetAttribInterface( CBaseEntity *pEntity )
 	return pAttribInterface;
 }
 
+//-----------------------------------------------------------------------------
+// Attribute hooks are identified by a small integer ID assigned the first time a
+// hook name is seen. IDs are stable for the lifetime of the process (unlike string_t,
+// which is invalidated when the game string pool is freed at level change).
+typedef int attrib_hook_id_t;
+#define INVALID_ATTRIB_HOOK_ID	( (attrib_hook_id_t)-1 )
+
+// Resolves a hook name to its ID once per call site.
+#define ATTRIB_HOOK_ID( hookName ) \
+	( []() -> attrib_hook_id_t { static const attrib_hook_id_t s_iAttribHookID = CAttributeManager::RegisterAttribHook( #hookName ); return s_iAttribHookID; }() )
+
 //-----------------------------------------------------------------------------
 // Macros for hooking the application of attributes
 #define CALL_ATTRIB_HOOK( vartype, retval, hookName, who, itemlist ) \
-	retval = CAttributeManager::AttribHookValue<vartype>( retval, #hookName, static_cast<const CBaseEntity*>( who ), itemlist, true );
+	retval = CAttributeManager::AttribHookValue<vartype>( retval, ATTRIB_HOOK_ID( hookName ), static_cast<const CBaseEntity*>( who ), itemlist );
 
 #define CALL_ATTRIB_HOOK_INT( retval, hookName )	CALL_ATTRIB_HOOK( int, retval, hookName, this, NULL )
 #define CALL_ATTRIB_HOOK_FLOAT( retval, hookName )	CALL_ATTRIB_HOOK( float, retval, hookName, this, NULL )
@@ -100,14 +111,28 @@ public:
 	void SetProviderType( attributeprovidertypes_t tType ) { m_ProviderType = tType; }
 	attributeprovidertypes_t GetProviderType( void ) const { return m_ProviderType; }
 
+	//--------------------------------------------------------
+	// Attribute hook IDs. Hook names are case-insensitive.
+	static attrib_hook_id_t RegisterAttribHook( const char *pszAttribHook );
+	static const char *GetAttribHookName( attrib_hook_id_t iAttribHook );
+
 	//--------------------------------------------------------
 	// Attribute hook. Use the CALL_ATTRIB_HOOK macros above.
 	template <class T> static T AttribHookValue( T TValue, const char *pszAttribHook, const CBaseEntity *pEntity, CUtlVector<CBaseEntity*> *pItemList = NULL, bool bIsGlobalConstString = false )
+	{
+		// Do we have a hook?
+		if ( pszAttribHook == NULL || pszAttribHook[0] == '\0' )
+			return TValue;
+
+		return AttribHookValue<T>( TValue, RegisterAttribHook( pszAttribHook ), pEntity, pItemList );
+	}
+
+	template <class T> static T AttribHookValue( T TValue, attrib_hook_id_t iAttribHook, const CBaseEntity *pEntity, CUtlVector<CBaseEntity*> *pItemList = NULL )
 	{
 		VPROF_BUDGET( "CAttributeManager::AttribHookValue", VPROF_BUDGETGROUP_ATTRIBUTES );
 
 		// Do we have a hook?
-		if ( pszAttribHook == NULL || pszAttribHook[0] == '\0' )
+		if ( iAttribHook == INVALID_ATTRIB_HOOK_ID )
 			return TValue;
 
 		// Verify that we have an entity, at least as "this"
@@ -121,23 +146,23 @@ public:
 
 		// Hook base attribute.
 		T Scratch;
-		AttribHookValueInternal( Scratch, TValue, pszAttribHook, pEntity, pAttribInterface, pItemList, bIsGlobalConstString );
+		AttribHookValueInternal( Scratch, TValue, iAttribHook, pEntity, pAttribInterface, pItemList );
 
 		return Scratch;
 	}
 
 private:
-	template <class T> static void TypedAttribHookValueInternal( T& out, T TValue, string_t iszAttribHook, const CBaseEntity *pEntity, IHasAttributes *pAttribInterface, CUtlVector<CBaseEntity*> *pItemList )
+	template <class T> static void TypedAttribHookValueInternal( T& out, T TValue, attrib_hook_id_t iAttribHook, const CBaseEntity *pEntity, IHasAttributes *pAttribInterface, CUtlVector<CBaseEntity*> *pItemList )
 	{
-		float flValue = pAttribInterface->GetAttributeManager()->ApplyAttributeFloatWrapper( static_cast<float>( TValue ), const_cast<CBaseEntity *>( pEntity ), iszAttribHook, pItemList );
+		float flValue = pAttribInterface->GetAttributeManager()->ApplyAttributeFloatWrapper( static_cast<float>( TValue ), const_cast<CBaseEntity *>( pEntity ), iAttribHook, pItemList );
 
 		out = AttributeConvertFromFloat<T>( flValue );
 	}
 
-	static void TypedAttribHookValueInternal( CAttribute_String& out, const CAttribute_String& TValue, string_t iszAttribHook, const CBaseEntity *pEntity, IHasAttributes *pAttribInterface, CUtlVector<CBaseEntity*> *pItemList )
+	static void TypedAttribHookValueInternal( CAttribute_String& out, const CAttribute_String& TValue, attrib_hook_id_t iAttribHook, const CBaseEntity *pEntity, IHasAttributes *pAttribInterface, CUtlVector<CBaseEntity*> *pItemList )
 	{
 		string_t iszIn = AllocPooledString( TValue.value().c_str() );
-		string_t iszOut = pAttribInterface->GetAttributeManager()->ApplyAttributeStringWrapper( iszIn, const_cast<CBaseEntity *>( pEntity ), iszAttribHook, pItemList );
+		string_t iszOut = pAttribInterface->GetAttributeManager()->ApplyAttributeStringWrapper( iszIn, const_cast<CBaseEntity *>( pEntity ), iAttribHook, pItemList );
 		const char* pszOut = STRING( iszOut );
 		// STRING() returns different value for server and client
 		// server will return "" for NULL_STRING
@@ -152,17 +177,15 @@ private:
 		}
 	}
 
-	template <class T> static void AttribHookValueInternal( T& out, T TValue, const char *pszAttribHook, const CBaseEntity *pEntity, IHasAttributes *pAttribInterface, CUtlVector<CBaseEntity*> *pItemList, bool bIsGlobalConstString )
+	template <class T> static void AttribHookValueInternal( T& out, T TValue, attrib_hook_id_t iAttribHook, const CBaseEntity *pEntity, IHasAttributes *pAttribInterface, CUtlVector<CBaseEntity*> *pItemList )
 	{
-		Assert( pszAttribHook );
-		Assert( pszAttribHook[0] );
+		Assert( iAttribHook != INVALID_ATTRIB_HOOK_ID );
 		Assert( pEntity );
 		Assert( pAttribInterface );
 		Assert( GetAttribInterface( (CBaseEntity*) pEntity ) == pAttribInterface );
 		Assert( pAttribInterface->GetAttributeManager() );
 		
-		string_t iszAttribHook = bIsGlobalConstString ? AllocPooledString_StaticConstantStringPointer( pszAttribHook ) : AllocPooledString( pszAttribHook );
-		return TypedAttribHookValueInternal( out, TValue, iszAttribHook, pEntity, pAttribInterface, pItemList );
+		return TypedAttribHookValueInternal( out, TValue, iAttribHook, pEntity, pAttribInterface, pItemList );
 	}
 	int m_nCurrentTick;
 	int m_nCalls;
@@ -202,11 +225,13 @@ private:
 	void	ClearCache();
 	int		GetGlobalCacheVersion() const;
 
-	virtual float	ApplyAttributeFloatWrapper( float flValue, CBaseEntity *pInitiator, string_t iszAttribHook, CUtlVector<CBaseEntity*> *pItemList = NULL );
-	virtual string_t ApplyAttributeStringWrapper( string_t iszValue, CBaseEntity *pInitiator, string_t iszAttribHook, CUtlVector<CBaseEntity*> *pItemList = NULL );
+	virtual float	ApplyAttributeFloatWrapper( float flValue, CBaseEntity *pInitiator, attrib_hook_id_t iAttribHook, CUtlVector<CBaseEntity*> *pItemList = NULL );
+	virtual string_t ApplyAttributeStringWrapper( string_t iszValue, CBaseEntity *pInitiator, attrib_hook_id_t iAttribHook, CUtlVector<CBaseEntity*> *pItemList = NULL );
 
 	// Cached attribute results
 	// We cache off requests for data, and wipe the cache whenever our providers change.
+	// The cache is indexed directly by hook ID. An entry is only valid if its epoch matches
+	// m_nCacheEpoch, so wiping the cache is a single increment.
 	union cached_attribute_types
 	{
 		float fl;
@@ -215,11 +240,16 @@ private:
 
 	struct cached_attribute_t
 	{
-		string_t	iAttribHook;
 		cached_attribute_types		in;
 		cached_attribute_types		out;
+		int							nEpoch;
+		bool						bIsString;
 	};
+	cached_attribute_t *FindCachedResult( attrib_hook_id_t iAttribHook, bool bIsString );
+	cached_attribute_t &GetCacheEntry( attrib_hook_id_t iAttribHook );
+
 	CUtlVector<cached_attribute_t>	m_CachedResults;
+	int								m_nCacheEpoch;
 
 #ifdef CLIENT_DLL
 public:
@@ -15,6 +15,10 @@
 #include "rtime.h"
 #include "item_selection_criteria.h"
 #include "checksum_sha1.h"
+#ifdef GAME_DLL
+#include "keyvaluescompiler.h"
+#endif
+#include "tier0/icommandline.h"
 
 #include <google/protobuf/text_format.h>
 #include <string.h>
@@ -4352,6 +4356,94 @@ CEconItemSchema &CEconItemSchema::operator=( CEconItemSchema &rhs )
 	return *this;
 }
 
+unsigned char g_sha1ItemSchemaText[ k_cubHash ];
+
+#ifdef GAME_DLL
+#ifdef _WIN32
+extern "C" unsigned char __stdcall SystemFunction036( void *pBuffer, unsigned long nSize );	// RtlGenRandom
+#pragma comment( lib, "advapi32.lib" )
+#endif
+
+#define SCHEMA_CACHE_KEY_SIZE	32
+
+//-----------------------------------------------------------------------------
+// Get the name of the compiled copy of a schema file.  The cache is only used
+// by dedicated servers started with -schemacache <directory>, which must be an
+// absolute path; it is kept out of the search paths so nothing the game
+// downloads or mounts can stand in for it.
+//-----------------------------------------------------------------------------
+static bool GetSchemaCacheFileName( const char *fileName, char *pszCompiledFileName, int nMaxLen )
+{
+	if ( !engine->IsDedicatedServer() )
+		return false;
+
+	const char *pszCacheDir = CommandLine()->ParmValue( "-schemacache", (const char *)NULL );
+	if ( !pszCacheDir || !pszCacheDir[0] )
+		return false;
+
+	if ( !V_IsAbsolutePath( pszCacheDir ) )
+	{
+		Warning( "-schemacache '%s' must be an absolute path, not using the item schema cache\n", pszCacheDir );
+		return false;
+	}
+
+	char szBaseName[ MAX_PATH ];
+	V_FileBase( fileName, szBaseName, sizeof( szBaseName ) );
+	V_ComposeFileName( pszCacheDir, szBaseName, pszCompiledFileName, nMaxLen );
+	V_strncat( pszCompiledFileName, ".kvc", nMaxLen );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Get the secret the compiled schema is signed with, creating it next to the
+// compiled file the first time
+//-----------------------------------------------------------------------------
+static bool GetSchemaCacheKey( const char *pszCompiledFileName, unsigned char *pKey, int nKeySize )
+{
+	char szKeyFileName[ MAX_PATH ];
+	V_snprintf( szKeyFileName, sizeof( szKeyFileName ), "%s.key", pszCompiledFileName );
+
+	CUtlBuffer bufKey;
+	if ( g_pFullFileSystem->ReadFile( szKeyFileName, NULL, bufKey ) )
+	{
+		if ( bufKey.TellPut() != nKeySize )
+		{
+			Warning( "'%s' is not a valid item schema cache key\n", szKeyFileName );
+			return false;
+		}
+
+		V_memcpy( pKey, bufKey.Base(), nKeySize );
+		return true;
+	}
+
+	bool bGenerated = false;
+#ifdef _WIN32
+	bGenerated = SystemFunction036( pKey, nKeySize ) != 0;
+#else
+	FILE *fp = fopen( "/dev/urandom", "rb" );
+	if ( fp )
+	{
+		bGenerated = fread( pKey, 1, nKeySize, fp ) == (size_t)nKeySize;
+		fclose( fp );
+	}
+#endif
+	if ( !bGenerated )
+	{
+		Warning( "Cannot generate an item schema cache key\n" );
+		return false;
+	}
+
+	bufKey.Put( pKey, nKeySize );
+	if ( !g_pFullFileSystem->WriteFile( szKeyFileName, NULL, bufKey ) )
+	{
+		Warning( "Cannot write '%s'\n", szKeyFileName );
+		return false;
+	}
+
+	return true;
+}
+#endif // GAME_DLL
+
 //-----------------------------------------------------------------------------
 // Initializes the schema, given KV filename
 //-----------------------------------------------------------------------------
@@ -4382,10 +4474,168 @@ bool CEconItemSchema::BInit( const char *fileName, const char *pathID, CUtlVecto
 	// Wrap it with a text buffer reader
 	CUtlBuffer bufText( bufRawData.Base(), bufRawData.TellPut(), CUtlBuffer::READ_ONLY | CUtlBuffer::TEXT_BUFFER );
 
+#ifdef GAME_DLL
+	// Dedicated servers can be told to go through a compiled copy of the file
+	char szCompiledFileName[ MAX_PATH ];
+	if ( GetSchemaCacheFileName( fileName, szCompiledFileName, sizeof( szCompiledFileName ) ) )
+	{
+		return BInitCompiledTextBuffer( fileName, szCompiledFileName, bufText, pVecErrors );
+	}
+#endif
+
 	// Use the standard init path
 	return BInitTextBuffer( bufText, pVecErrors );
 }
 
+#ifdef GAME_DLL
+//-----------------------------------------------------------------------------
+// Initializes the schema from the KV text that was read (and signature checked)
+// from fileName, instancing the KeyValues from pszCompiledFileName if it was 
+// signed with this server's cache key and built from exactly this text (see 
+// m_schemaSHA).  Otherwise the text is parsed and the compiled copy is 
+// rewritten, before BInitSchema() gets to the tree.
+//-----------------------------------------------------------------------------
+bool CEconItemSchema::BInitCompiledTextBuffer( const char *fileName, const char *pszCompiledFileName, CUtlBuffer &buffer, CUtlVector<CUtlString> *pVecErrors )
+{
+	// Save off the hash into a global variable, so VAC can check it
+	// later
+	GenerateHash( g_sha1ItemSchemaText, buffer.Base(), buffer.TellPut() );
+
+	Reset();
+
+	unsigned char key[ SCHEMA_CACHE_KEY_SIZE ];
+	bool bHaveKey = GetSchemaCacheKey( pszCompiledFileName, key, sizeof( key ) );
+
+	double flStartTime = Plat_FloatTime();
+
+	CCompiledKeyValuesTreeReader reader;
+	if ( bHaveKey && reader.LoadFile( pszCompiledFileName, NULL, m_schemaSHA.m_shaDigest, buffer.TellPut(), key, sizeof( key ) ) )
+	{
+		m_pKVRawDefinition = reader.Instance();
+	}
+
+	if ( m_pKVRawDefinition )
+	{
+		DevMsg( "Item schema instanced from '%s' (%d keys) in %.1f ms\n", pszCompiledFileName, reader.GetNumNodes(), ( Plat_FloatTime() - flStartTime ) * 1000.0 );
+	}
+	else
+	{
+		m_pKVRawDefinition = new KeyValues( "CEconItemSchema" );
+		if ( !m_pKVRawDefinition->LoadFromBuffer( NULL, buffer ) )
+		{
+			if ( pVecErrors )
+			{
+				pVecErrors->AddToTail( "Error parsing keyvalues" );
+			}
+			return false;
+		}
+
+		DevMsg( "Item schema parsed from '%s' in %.1f ms\n", fileName, ( Plat_FloatTime() - flStartTime ) * 1000.0 );
+
+		// The compiled copy must be of the tree as parsed, so write it out before it is used
+		CCompiledKeyValuesTreeWriter writer;
+		if ( bHaveKey && writer.Compile( m_pKVRawDefinition ) && writer.WriteFile( pszCompiledFileName, NULL, m_schemaSHA.m_shaDigest, buffer.TellPut(), key, sizeof( key ) ) )
+		{
+			DevMsg( "Wrote compiled item schema '%s' (%d keys)\n", pszCompiledFileName, writer.GetNumNodes() );
+		}
+	}
+
+	return BInitSchema( m_pKVRawDefinition, pVecErrors )
+		&& BPostSchemaInit( pVecErrors );
+}
+
+//-----------------------------------------------------------------------------
+// Times building the schema KeyValues by parsing the text and from the compiled copy
+//-----------------------------------------------------------------------------
+CON_COMMAND_F( econ_schema_bench_load, "Times building the item schema KeyValues from items_game.txt and from its compiled copy (dedicated servers started with -schemacache only).  Arguments: [iterations]", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	const char *pszFileName = "scripts/items/items_game.txt";
+	char szCompiledFileName[ MAX_PATH ];
+	unsigned char key[ SCHEMA_CACHE_KEY_SIZE ];
+	bool bHaveCache = GetSchemaCacheFileName( pszFileName, szCompiledFileName, sizeof( szCompiledFileName ) )
+		&& GetSchemaCacheKey( szCompiledFileName, key, sizeof( key ) );
+
+	CUtlBuffer bufRawData;
+	if ( !g_pFullFileSystem->ReadFile( pszFileName, "GAME", bufRawData ) )
+	{
+		Msg( "Cannot load file '%s'\n", pszFileName );
+		return;
+	}
+
+	CSHA sha;
+	GenerateHash( sha.m_shaDigest, bufRawData.Base(), bufRawData.TellPut() );
+
+	int iterations = ( args.ArgC() > 1 ) ? MAX( 1, atoi( args[1] ) ) : 5;
+
+	for( int compiled=0; compiled<2; ++compiled )
+	{
+		if ( compiled && !bHaveCache )
+		{
+			Msg( "The item schema cache is only used by dedicated servers started with -schemacache <absolute directory>\n" );
+			continue;
+		}
+
+		float totalTime = 0.0f;
+		float bestTime = FLT_MAX;
+		int loaded = 0;
+
+		for( int i=0; i<iterations; ++i )
+		{
+			CFastTimer timer;
+			timer.Start();
+
+			KeyValues *pKV = NULL;
+			if ( compiled )
+			{
+				CCompiledKeyValuesTreeReader reader;
+				if ( reader.LoadFile( szCompiledFileName, NULL, sha.m_shaDigest, bufRawData.TellPut(), key, sizeof( key ) ) )
+				{
+					pKV = reader.Instance();
+				}
+			}
+			else
+			{
+				CUtlBuffer bufText;
+				if ( g_pFullFileSystem->ReadFile( pszFileName, "GAME", bufText ) )
+				{
+					bufText.SetBufferType( true, false );
+					pKV = new KeyValues( "CEconItemSchema" );
+					if ( !pKV->LoadFromBuffer( NULL, bufText ) )
+					{
+						pKV->deleteThis();
+						pKV = NULL;
+					}
+				}
+			}
+
+			timer.End();
+
+			if ( !pKV )
+				break;
+
+			pKV->deleteThis();
+
+			float time = timer.GetDuration().GetMillisecondsF();
+			totalTime += time;
+			bestTime = MIN( bestTime, time );
+			++loaded;
+		}
+
+		const char *pszLoaded = compiled ? szCompiledFileName : pszFileName;
+		if ( loaded < iterations )
+		{
+			Msg( "%s could not be loaded%s\n", pszLoaded, compiled ? " - it is written the next time the schema is initialized from the text" : "" );
+			continue;
+		}
+
+		Msg( "%s: %u bytes, %d loads: average %.2f ms, best %.2f ms\n", pszLoaded, g_pFullFileSystem->Size( pszLoaded, compiled ? NULL : "GAME" ), loaded, totalTime / loaded, bestTime );
+	}
+}
+#endif // GAME_DLL
+
 //-----------------------------------------------------------------------------
 // Initializes the schema, given KV in binary form
 //-----------------------------------------------------------------------------
@@ -4405,8 +4655,6 @@ bool CEconItemSchema::BInitBinaryBuffer( CUtlBuffer &buffer, CUtlVector<CUtlStri
 	return false;
 }
 
-unsigned char g_sha1ItemSchemaText[ k_cubHash ];
-
 //-----------------------------------------------------------------------------
 // Initializes the schema, given KV in text form
 //-----------------------------------------------------------------------------
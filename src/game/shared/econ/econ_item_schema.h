@@ -2817,6 +2817,9 @@ protected:
 #endif // TF_CLIENT_DLL
 
 private:
+#ifdef GAME_DLL
+	bool BInitCompiledTextBuffer( const char *fileName, const char *pszCompiledFileName, CUtlBuffer &buffer, CUtlVector<CUtlString> *pVecErrors );
+#endif
 	bool BInitGameInfo( KeyValues *pKVGameInfo, CUtlVector<CUtlString> *pVecErrors );
 	bool BInitAttributeTypes( CUtlVector<CUtlString> *pVecErrors );
 	bool BInitDefinitionPrefabs( KeyValues *pKVPrefabs, CUtlVector<CUtlString> *pVecErrors );
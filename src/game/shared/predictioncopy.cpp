@@ -21,6 +21,7 @@
 #include "predictioncopy.h"
 #include "engine/ivmodelinfo.h"
 #include "tier1/fmtstr.h"
+#include "tier0/fasttimer.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -1394,6 +1395,417 @@ void CPredictionCopy::DetermineWatchField( const char *operation, int entindex,
 	m_pWatchField = FindFieldByName( pwatchvar.GetString(), dmap );
 }
 
+static ConVar cl_pred_copy_plans( "cl_pred_copy_plans", "1", FCVAR_CHEAT, "Use precompiled copy plans for prediction copies which don't compare or describe fields." );
+
+//-----------------------------------------------------------------------------
+// Purpose: A datamap flattened into the list of copies CopyFields would make
+//  for one (copy type, dest packing, src packing) combination. Plain data
+//  fields are coalesced into as few memcpys as possible, only strings,
+//  EHANDLEs and embedded pointers need special handling.
+//-----------------------------------------------------------------------------
+class CPredictionCopyPlan
+{
+public:
+	enum
+	{
+		OP_COPY = 0,		// memcpy m_nSize bytes
+		OP_STRING,			// null-terminated string
+		OP_EHANDLE,			// m_nSize handles
+		OP_EMBEDDED_PTR,	// run m_Children[ m_nSize ] on the embedded object, following pointers as needed
+	};
+
+	struct Op_t
+	{
+		int m_nOp;
+		int m_nDestOffset;
+		int m_nSrcOffset;
+		int m_nSize;
+		bool m_bDerefDest;
+		bool m_bDerefSrc;
+	};
+
+	CPredictionCopyPlan( int type, int destOffsetIndex, int srcOffsetIndex )
+	{
+		m_nType = type;
+		m_nDestOffsetIndex = destOffsetIndex;
+		m_nSrcOffsetIndex = srcOffsetIndex;
+		m_nFieldCount = 0;
+	}
+
+	~CPredictionCopyPlan()
+	{
+		m_Children.PurgeAndDeleteElements();
+	}
+
+	void Compile( datamap_t *dmap );
+	void Execute( void *pDest, void const *pSrc ) const;
+
+	int GetOpCount( void ) const;
+	int GetFieldCount( void ) const { return m_nFieldCount; }
+
+private:
+	void CompileFields_R( typedescription_t *pFields, int fieldCount, int destBase, int srcBase, CUtlVector< typedescription_t * > &overridden );
+	void AddOp( int op, int destOffset, int srcOffset, int size );
+	void CoalesceCopies( void );
+
+	int m_nType;
+	int m_nDestOffsetIndex;
+	int m_nSrcOffsetIndex;
+	int m_nFieldCount;
+
+	CUtlVector< Op_t > m_Ops;
+	CUtlVector< CPredictionCopyPlan * > m_Children;
+};
+
+void CPredictionCopyPlan::AddOp( int op, int destOffset, int srcOffset, int size )
+{
+	Op_t &newOp = m_Ops[ m_Ops.AddToTail() ];
+	newOp.m_nOp = op;
+	newOp.m_nDestOffset = destOffset;
+	newOp.m_nSrcOffset = srcOffset;
+	newOp.m_nSize = size;
+	newOp.m_bDerefDest = false;
+	newOp.m_bDerefSrc = false;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Mirrors the field selection in CPredictionCopy::CopyFields. A field
+//  which is the override_field of a field visited before it is skipped, which
+//  is what the override_count / chain_count marking does at runtime.
+//-----------------------------------------------------------------------------
+void CPredictionCopyPlan::CompileFields_R( typedescription_t *pFields, int fieldCount, int destBase, int srcBase, CUtlVector< typedescription_t * > &overridden )
+{
+	for ( int i = 0; i < fieldCount; i++ )
+	{
+		typedescription_t *pField = &pFields[ i ];
+		int flags = pField->flags;
+
+		// Mark any subchains first
+		if ( pField->override_field != NULL && !overridden.HasElement( pField->override_field ) )
+		{
+			overridden.AddToTail( pField->override_field );
+		}
+
+		// Skip this field?
+		if ( overridden.HasElement( pField ) )
+			continue;
+
+		// Always recurse into embeddeds
+		if ( pField->fieldType != FIELD_EMBEDDED )
+		{
+			if ( flags & FTYPEDESC_PRIVATE )
+				continue;
+
+			if ( m_nType == PC_NON_NETWORKED_ONLY && ( flags & FTYPEDESC_INSENDTABLE ) )
+				continue;
+
+			if ( m_nType == PC_NETWORKED_ONLY && !( flags & FTYPEDESC_INSENDTABLE ) )
+				continue;
+		}
+
+		int destOffset = destBase + pField->fieldOffset[ m_nDestOffsetIndex ];
+		int srcOffset = srcBase + pField->fieldOffset[ m_nSrcOffsetIndex ];
+		int fieldSize = pField->fieldSize;
+
+		switch( pField->fieldType )
+		{
+		case FIELD_EMBEDDED:
+			{
+				bool bDerefSrc = ( flags & FTYPEDESC_PTR ) && ( m_nSrcOffsetIndex == PC_DATA_NORMAL );
+				bool bDerefDest = ( flags & FTYPEDESC_PTR ) && ( m_nDestOffsetIndex == PC_DATA_NORMAL );
+				if ( !bDerefSrc && !bDerefDest )
+				{
+					CompileFields_R( pField->td->dataDesc, pField->td->dataNumFields, destOffset, srcOffset, overridden );
+					break;
+				}
+
+				// The embedded object lives somewhere else, so it gets its own plan
+				CPredictionCopyPlan *pChild = new CPredictionCopyPlan( m_nType, m_nDestOffsetIndex, m_nSrcOffsetIndex );
+				pChild->CompileFields_R( pField->td->dataDesc, pField->td->dataNumFields, 0, 0, overridden );
+				pChild->CoalesceCopies();
+				m_nFieldCount += pChild->m_nFieldCount;
+
+				AddOp( OP_EMBEDDED_PTR, destOffset, srcOffset, m_Children.AddToTail( pChild ) );
+				m_Ops.Tail().m_bDerefDest = bDerefDest;
+				m_Ops.Tail().m_bDerefSrc = bDerefSrc;
+			}
+			continue;
+
+		case FIELD_FLOAT:
+			AddOp( OP_COPY, destOffset, srcOffset, sizeof( float ) * fieldSize );
+			break;
+
+		case FIELD_STRING:
+			AddOp( OP_STRING, destOffset, srcOffset, fieldSize );
+			break;
+
+		case FIELD_VECTOR:
+			AddOp( OP_COPY, destOffset, srcOffset, sizeof( Vector ) * fieldSize );
+			break;
+
+		case FIELD_QUATERNION:
+			AddOp( OP_COPY, destOffset, srcOffset, sizeof( Quaternion ) * fieldSize );
+			break;
+
+		case FIELD_COLOR32:
+			AddOp( OP_COPY, destOffset, srcOffset, 4 * fieldSize );
+			break;
+
+		case FIELD_BOOLEAN:
+			AddOp( OP_COPY, destOffset, srcOffset, sizeof( bool ) * fieldSize );
+			break;
+
+		case FIELD_INTEGER:
+			AddOp( OP_COPY, destOffset, srcOffset, sizeof( int ) * fieldSize );
+			break;
+
+		case FIELD_SHORT:
+			AddOp( OP_COPY, destOffset, srcOffset, sizeof( short ) * fieldSize );
+			break;
+
+		case FIELD_CHARACTER:
+			AddOp( OP_COPY, destOffset, srcOffset, fieldSize );
+			break;
+
+		case FIELD_EHANDLE:
+			AddOp( OP_EHANDLE, destOffset, srcOffset, fieldSize );
+			break;
+
+		case FIELD_TIME:
+		case FIELD_TICK:
+		case FIELD_MODELINDEX:
+		case FIELD_MODELNAME:
+		case FIELD_SOUNDNAME:
+		case FIELD_CUSTOM:
+		case FIELD_CLASSPTR:
+		case FIELD_EDICT:
+		case FIELD_POSITION_VECTOR:
+		case FIELD_FUNCTION:
+			Assert( 0 );
+			continue;
+
+		case FIELD_VOID:
+			// Don't do anything, it's an empty data description
+			continue;
+
+		default:
+			Warning( "Bad field type\n" );
+			Assert( 0 );
+			continue;
+		}
+
+		++m_nFieldCount;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Merges plain copies which are contiguous in both source and
+//  destination. Copies are sorted by destination first unless two of them
+//  write the same bytes, in which case the datamap order has to be kept.
+//-----------------------------------------------------------------------------
+static int __cdecl PredictionCopyOpLessFunc( const CPredictionCopyPlan::Op_t *pLeft, const CPredictionCopyPlan::Op_t *pRight )
+{
+	return pLeft->m_nDestOffset - pRight->m_nDestOffset;
+}
+
+void CPredictionCopyPlan::CoalesceCopies( void )
+{
+	CUtlVector< Op_t > copies;
+	CUtlVector< Op_t > special;
+	FOR_EACH_VEC( m_Ops, i )
+	{
+		if ( m_Ops[i].m_nOp == OP_COPY )
+		{
+			copies.AddToTail( m_Ops[i] );
+		}
+		else
+		{
+			special.AddToTail( m_Ops[i] );
+		}
+	}
+
+	CUtlVector< Op_t > sorted;
+	sorted.CopyArray( copies.Base(), copies.Count() );
+	sorted.Sort( PredictionCopyOpLessFunc );
+
+	bool bOverlap = false;
+	for ( int i = 1; i < sorted.Count(); i++ )
+	{
+		if ( sorted[i-1].m_nDestOffset + sorted[i-1].m_nSize > sorted[i].m_nDestOffset )
+		{
+			bOverlap = true;
+			break;
+		}
+	}
+
+	if ( !bOverlap )
+	{
+		copies.Swap( sorted );
+	}
+
+	m_Ops.RemoveAll();
+	FOR_EACH_VEC( copies, i )
+	{
+		const Op_t &op = copies[i];
+		if ( m_Ops.Count() )
+		{
+			Op_t &last = m_Ops.Tail();
+			if ( last.m_nDestOffset + last.m_nSize == op.m_nDestOffset &&
+				 last.m_nSrcOffset + last.m_nSize == op.m_nSrcOffset )
+			{
+				last.m_nSize += op.m_nSize;
+				continue;
+			}
+		}
+
+		m_Ops.AddToTail( op );
+	}
+
+	m_Ops.AddVectorToTail( special );
+}
+
+void CPredictionCopyPlan::Compile( datamap_t *dmap )
+{
+	CUtlVector< typedescription_t * > overridden;
+
+	// Copy from here first, then baseclasses
+	for ( datamap_t *pMap = dmap; pMap; pMap = pMap->baseMap )
+	{
+		CompileFields_R( pMap->dataDesc, pMap->dataNumFields, 0, 0, overridden );
+	}
+
+	CoalesceCopies();
+}
+
+int CPredictionCopyPlan::GetOpCount( void ) const
+{
+	int count = m_Ops.Count();
+	FOR_EACH_VEC( m_Children, i )
+	{
+		count += m_Children[i]->GetOpCount();
+	}
+	return count;
+}
+
+void CPredictionCopyPlan::Execute( void *pDest, void const *pSrc ) const
+{
+	const Op_t *pOp = m_Ops.Base();
+	const Op_t *pEnd = pOp + m_Ops.Count();
+	for ( ; pOp != pEnd; ++pOp )
+	{
+		char *pOutputData = (char *)pDest + pOp->m_nDestOffset;
+		const char *pInputData = (const char *)pSrc + pOp->m_nSrcOffset;
+
+		switch ( pOp->m_nOp )
+		{
+		case OP_COPY:
+			memcpy( pOutputData, pInputData, pOp->m_nSize );
+			break;
+
+		case OP_STRING:
+			memcpy( pOutputData, pInputData, Q_strlen( pInputData ) + 1 );
+			break;
+
+		case OP_EHANDLE:
+			{
+				EHANDLE *pOut = (EHANDLE *)pOutputData;
+				const EHANDLE *pIn = (const EHANDLE *)pInputData;
+				for ( int i = 0; i < pOp->m_nSize; i++ )
+				{
+					pOut[ i ] = pIn[ i ];
+				}
+			}
+			break;
+
+		case OP_EMBEDDED_PTR:
+			{
+				void *pEmbeddedDest = pOp->m_bDerefDest ? *(void **)pOutputData : pOutputData;
+				void const *pEmbeddedSrc = pOp->m_bDerefSrc ? *(void **)pInputData : pInputData;
+				m_Children[ pOp->m_nSize ]->Execute( pEmbeddedDest, pEmbeddedSrc );
+			}
+			break;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Plans are compiled the first time a datamap is copied with a given
+//  combination of copy type and packing and live as long as the datamaps do.
+//-----------------------------------------------------------------------------
+class CPredictionCopyPlanCache
+{
+public:
+	CPredictionCopyPlanCache() : m_Plans( DefLessFunc( const datamap_t * ) )
+	{
+	}
+
+	~CPredictionCopyPlanCache()
+	{
+		FOR_EACH_MAP_FAST( m_Plans, i )
+		{
+			for ( int j = 0; j < ARRAYSIZE( m_Plans[i].m_pPlans ); j++ )
+			{
+				delete m_Plans[i].m_pPlans[j];
+			}
+		}
+	}
+
+	CPredictionCopyPlan *GetPlan( datamap_t *dmap, int type, int destOffsetIndex, int srcOffsetIndex )
+	{
+		unsigned short idx = m_Plans.Find( dmap );
+		if ( idx == m_Plans.InvalidIndex() )
+		{
+			PlanSet_t emptySet;
+			memset( &emptySet, 0, sizeof( emptySet ) );
+			idx = m_Plans.Insert( dmap, emptySet );
+		}
+
+		CPredictionCopyPlan *&pPlan = m_Plans[idx].m_pPlans[ ( type * TD_OFFSET_COUNT + destOffsetIndex ) * TD_OFFSET_COUNT + srcOffsetIndex ];
+		if ( !pPlan )
+		{
+			pPlan = new CPredictionCopyPlan( type, destOffsetIndex, srcOffsetIndex );
+			pPlan->Compile( dmap );
+		}
+
+		return pPlan;
+	}
+
+private:
+	struct PlanSet_t
+	{
+		CPredictionCopyPlan *m_pPlans[ 3 * TD_OFFSET_COUNT * TD_OFFSET_COUNT ];
+	};
+
+	CUtlMap< const datamap_t *, PlanSet_t > m_Plans;
+};
+
+static CPredictionCopyPlanCache g_PredictionCopyPlans;
+
+//-----------------------------------------------------------------------------
+// Purpose: Copies using the compiled plan when all we're doing is copying
+// Input  : *dmap - 
+// Output : Returns true if the data was transferred
+//-----------------------------------------------------------------------------
+bool CPredictionCopy::TransferDataUsingPlan( datamap_t *dmap )
+{
+	if ( !cl_pred_copy_plans.GetBool() )
+		return false;
+
+	if ( m_bErrorCheck || m_bDescribeFields || m_pWatchField || !m_bPerformCopy )
+		return false;
+
+	if ( m_nType < PC_EVERYTHING || m_nType > PC_NETWORKED_ONLY )
+		return false;
+
+	// Packed offsets are filled in when the intermediate data is first sized
+	if ( ( m_nDestOffsetIndex == TD_OFFSET_PACKED || m_nSrcOffsetIndex == TD_OFFSET_PACKED ) && !dmap->packed_offsets_computed )
+		return false;
+
+	CPredictionCopyPlan *pPlan = g_PredictionCopyPlans.GetPlan( dmap, m_nType, m_nDestOffsetIndex, m_nSrcOffsetIndex );
+	pPlan->Execute( m_pDest, m_pSrc );
+	return true;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: 
 // Input  : *operation - 
@@ -1412,11 +1824,84 @@ int CPredictionCopy::TransferData( const char *operation, int entindex, datamap_
 	
 	DetermineWatchField( operation, entindex, dmap );
 
+	if ( TransferDataUsingPlan( dmap ) )
+		return m_nErrorCount;
+
 	TransferData_R( g_nChainCount, dmap );
 
 	return m_nErrorCount;
 }
 
+#if defined( CLIENT_DLL )
+//-----------------------------------------------------------------------------
+// Purpose: Times the SaveData copy (entity to packed intermediate data) of the
+//  local player's prediction datamap with and without compiled copy plans
+//-----------------------------------------------------------------------------
+CON_COMMAND_F( cl_pred_copy_bench, "Times prediction copies of the local player with and without compiled copy plans.  Arguments: [iterations]", FCVAR_CHEAT )
+{
+	C_BasePlayer *pPlayer = C_BasePlayer::GetLocalPlayer();
+	if ( !pPlayer )
+	{
+		Msg( "cl_pred_copy_bench:  No local player\n" );
+		return;
+	}
+
+	datamap_t *dmap = pPlayer->GetPredDescMap();
+	if ( !dmap || !dmap->packed_offsets_computed )
+	{
+		Msg( "cl_pred_copy_bench:  Local player has no intermediate data yet\n" );
+		return;
+	}
+
+	int iterations = ( args.ArgC() > 1 ) ? MAX( 1, Q_atoi( args[1] ) ) : 10000;
+	int size = MAX( dmap->packed_size, 4 );
+
+	char *pWalkData = new char[ size ];
+	char *pPlanData = new char[ size ];
+
+	static const char *s_pszTypes[] = { "everything", "non-networked", "networked" };
+
+	bool bUsePlans = cl_pred_copy_plans.GetBool();
+
+	Msg( "%s: %d bytes of intermediate data, %d iterations\n", dmap->dataClassName, size, iterations );
+	for ( int type = PC_EVERYTHING; type <= PC_NETWORKED_ONLY; ++type )
+	{
+		CPredictionCopyPlan *pPlan = g_PredictionCopyPlans.GetPlan( dmap, type, TD_OFFSET_PACKED, TD_OFFSET_NORMAL );
+
+		memset( pWalkData, 0, size );
+		memset( pPlanData, 0, size );
+
+		float flTime[ 2 ];
+		for ( int plans = 0; plans < 2; ++plans )
+		{
+			cl_pred_copy_plans.SetValue( plans );
+			void *pDest = plans ? pPlanData : pWalkData;
+
+			CFastTimer timer;
+			timer.Start();
+			for ( int i = 0; i < iterations; ++i )
+			{
+				CPredictionCopy copyHelper( type, pDest, PC_DATA_PACKED, pPlayer, PC_DATA_NORMAL );
+				copyHelper.TransferData( "", -1, dmap );
+			}
+			timer.End();
+
+			flTime[ plans ] = timer.GetDuration().GetMillisecondsF();
+		}
+
+		Msg( "  %-14s %4d fields, %4d copy ops:  walk %8.2f ms  plan %8.2f ms  (%.1fx)%s\n",
+			s_pszTypes[ type ], pPlan->GetFieldCount(), pPlan->GetOpCount(), flTime[ 0 ], flTime[ 1 ],
+			( flTime[ 1 ] > 0.0f ) ? flTime[ 0 ] / flTime[ 1 ] : 0.0f,
+			memcmp( pWalkData, pPlanData, size ) ? "  MISMATCH" : "" );
+	}
+
+	cl_pred_copy_plans.SetValue( bUsePlans );
+
+	delete[] pWalkData;
+	delete[] pPlanData;
+}
+#endif
+
 /*
 //-----------------------------------------------------------------------------
 // Purpose: Simply dumps all data fields in object
@@ -84,6 +84,7 @@ public:
 
 private:
 	void	TransferData_R( int chaincount, datamap_t *dmap );
+	bool	TransferDataUsingPlan( datamap_t *dmap );
 
 	void	DetermineWatchField( const char *operation, int entindex,  datamap_t *dmap );
 	void	DumpWatchField( typedescription_t *field );
@@ -1196,6 +1196,33 @@ bool CTFPlayerShared::InCond( ETFCond eCond ) const
 	return (cPlayerCond.CondVar() & cPlayerCond.CondBit()) != 0;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Walk the set condition bits without testing every condition.
+//			Conditions handled only by m_ConditionList have no bit set.
+//-----------------------------------------------------------------------------
+ETFCond CTFPlayerShared::GetNextCondBit( int iFirst ) const
+{
+	const int nCondWords[] = { m_nPlayerCond, m_nPlayerCondEx, m_nPlayerCondEx2, m_nPlayerCondEx3, m_nPlayerCondEx4 };
+
+	for ( int iWord = iFirst >> 5; iWord < ARRAYSIZE( nCondWords ); iWord++ )
+	{
+		unsigned int nBits = (unsigned int)nCondWords[iWord];
+		if ( iWord == ( iFirst >> 5 ) )
+		{
+			// Mask off the bits below iFirst
+			nBits &= ~0u << ( iFirst & 31 );
+		}
+
+		if ( nBits )
+		{
+			int iCond = FirstBitInWord( nBits, iWord << 5 );
+			return ( iCond < TF_COND_LAST ) ? (ETFCond)iCond : TF_COND_LAST;
+		}
+	}
+
+	return TF_COND_LAST;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Return whether or not we were in this condition before.
 //-----------------------------------------------------------------------------
@@ -2312,10 +2339,22 @@ void CTFPlayerShared::ConditionGameRulesThink( void )
 		m_flNextCritUpdate = gpGlobals->curtime + 0.5;
 	}
 
-	for ( int i=0; i < TF_COND_LAST; ++i )
+	// Timed conditions that ran out this tick. They are removed after the loop, in
+	// the order they expired within the tick.
+	struct ExpiredCond_t
+	{
+		ETFCond eCond;
+		float flExpireFraction;
+	};
+	ExpiredCond_t expiredConds[ TF_COND_LAST ];
+	int nExpiredConds = 0;
+
+	// Only visit the conditions we're in. The bits are read again on each step, so
+	// conditions added or removed along the way are seen like in a full scan.
+	for ( int i = GetNextCondBit( 0 ); i < TF_COND_LAST; i = GetNextCondBit( i + 1 ) )
 	{
-		// if we're in this condition and it's not already being handled by the condition list
-		if ( InCond( (ETFCond)i ) && ((i >= 32) || !m_ConditionList.InCond( (ETFCond)i )) )
+		// if it's not already being handled by the condition list
+		if ( (i >= 32) || !m_ConditionList.InCond( (ETFCond)i ) )
 		{
 			// Ignore permanent conditions
 			if ( m_ConditionData[i].m_flExpireTime != PERMANENT_CONDITION )
@@ -2335,11 +2374,14 @@ void CTFPlayerShared::ConditionGameRulesThink( void )
 					}
 				}
 
-				m_ConditionData[i].m_flExpireTime = MAX( m_ConditionData[i].m_flExpireTime - flReduction, 0 );
+				float flTimeLeft = m_ConditionData[i].m_flExpireTime;
+				m_ConditionData[i].m_flExpireTime = MAX( flTimeLeft - flReduction, 0 );
 
 				if ( m_ConditionData[i].m_flExpireTime == 0 )
 				{
-					RemoveCond( (ETFCond)i );
+					expiredConds[nExpiredConds].eCond = (ETFCond)i;
+					expiredConds[nExpiredConds].flExpireFraction = ( flReduction > 0.f ) ? ( flTimeLeft / flReduction ) : 0.f;
+					nExpiredConds++;
 				}
 			}
 			else
@@ -2358,6 +2400,29 @@ void CTFPlayerShared::ConditionGameRulesThink( void )
 		}
 	}
 
+	// Insertion sort, there are rarely more than one or two
+	for ( int i = 1; i < nExpiredConds; i++ )
+	{
+		ExpiredCond_t cond = expiredConds[i];
+		int j = i - 1;
+		while ( j >= 0 && expiredConds[j].flExpireFraction > cond.flExpireFraction )
+		{
+			expiredConds[j + 1] = expiredConds[j];
+			j--;
+		}
+		expiredConds[j + 1] = cond;
+	}
+
+	for ( int i = 0; i < nExpiredConds; i++ )
+	{
+		// Removing an earlier condition may have removed this one, or added it again with a new duration
+		ETFCond eCond = expiredConds[i].eCond;
+		if ( m_ConditionData[eCond].m_flExpireTime == 0 )
+		{
+			RemoveCond( eCond );
+		}
+	}
+
 	// Our health will only decay ( from being medic buffed ) if we are not being healed by a medic
 	// Dispensers can give us the TF_COND_HEALTH_BUFF, but will not maintain or give us health above 100%s
 	bool bDecayHealth = true;
@@ -3056,6 +3121,83 @@ void CTFPlayerShared::ConditionGameRulesThink( void )
 #endif // GAME_DLL
 }
 
+#ifdef GAME_DLL
+//-----------------------------------------------------------------------------
+// Purpose: Compare a full condition scan against walking the condition bits,
+//			the way ConditionGameRulesThink finds timed conditions.
+//-----------------------------------------------------------------------------
+CON_COMMAND_F( tf_bench_conditions, "Time finding the active timed conditions of every living player. Arguments: [passes] [addconds]", FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	int nPasses = ( args.ArgC() > 1 ) ? MAX( atoi( args[1] ), 1 ) : 1000;
+
+	CUtlVector< CTFPlayer * > playerVector;
+	CollectPlayers( &playerVector, TEAM_ANY, COLLECT_ONLY_LIVING_PLAYERS );
+	if ( playerVector.Count() == 0 )
+	{
+		Msg( "No living players, add some with tf_bot_add 32\n" );
+		return;
+	}
+
+	if ( args.ArgC() > 2 && !V_stricmp( args[2], "addconds" ) )
+	{
+		// A typical mid-fight mix of timed and permanent conditions
+		FOR_EACH_VEC( playerVector, i )
+		{
+			playerVector[i]->m_Shared.AddCond( TF_COND_SPEED_BOOST, 30.f );
+			playerVector[i]->m_Shared.AddCond( TF_COND_MARKEDFORDEATH, 30.f );
+			playerVector[i]->m_Shared.AddCond( TF_COND_MAD_MILK, 30.f );
+			playerVector[i]->m_Shared.AddCond( TF_COND_OFFENSEBUFF );
+		}
+	}
+
+	int nScanFound = 0;
+	CFastTimer scanTimer;
+	scanTimer.Start();
+	for ( int iPass = 0; iPass < nPasses; iPass++ )
+	{
+		FOR_EACH_VEC( playerVector, i )
+		{
+			CTFPlayerShared &shared = playerVector[i]->m_Shared;
+			for ( int iCond = 0; iCond < TF_COND_LAST; ++iCond )
+			{
+				if ( shared.InCond( (ETFCond)iCond ) && shared.GetConditionDuration( (ETFCond)iCond ) != PERMANENT_CONDITION )
+				{
+					nScanFound++;
+				}
+			}
+		}
+	}
+	scanTimer.End();
+
+	int nBitsFound = 0;
+	CFastTimer bitsTimer;
+	bitsTimer.Start();
+	for ( int iPass = 0; iPass < nPasses; iPass++ )
+	{
+		FOR_EACH_VEC( playerVector, i )
+		{
+			CTFPlayerShared &shared = playerVector[i]->m_Shared;
+			for ( int iCond = shared.GetNextCondBit( 0 ); iCond < TF_COND_LAST; iCond = shared.GetNextCondBit( iCond + 1 ) )
+			{
+				if ( shared.GetConditionDuration( (ETFCond)iCond ) != PERMANENT_CONDITION )
+				{
+					nBitsFound++;
+				}
+			}
+		}
+	}
+	bitsTimer.End();
+
+	// Conditions held only by the condition list are found by the scan but not the bits
+	Msg( "%d players, %d passes, %.1f timed conditions per player\n", playerVector.Count(), nPasses, (float)nBitsFound / ( nPasses * playerVector.Count() ) );
+	Msg( "  full scan: %.3f ms (%d found)\n", scanTimer.GetDuration().GetMillisecondsF(), nScanFound );
+	Msg( "  bit walk:  %.3f ms (%d found)\n", bitsTimer.GetDuration().GetMillisecondsF(), nBitsFound );
+}
+#endif // GAME_DLL
+
 //-----------------------------------------------------------------------------
 // Purpose: call all the shared think funcs here
 //-----------------------------------------------------------------------------
@@ -305,6 +305,7 @@ public:
 	void	RemoveCond( ETFCond eCond, bool ignore_duration=false );
 	bool	InCond( ETFCond eCond ) const;
 	bool	WasInCond( ETFCond eCond ) const;
+	ETFCond	GetNextCondBit( int iFirst ) const;	// lowest condition >= iFirst whose bit is set, or TF_COND_LAST
 	void	ForceRecondNextSync( ETFCond eCond );
 	void	RemoveAllCond();
 	void	OnConditionAdded( ETFCond eCond );
@@ -167,6 +167,7 @@ bool VScriptRunScript( const char *pszScriptName, HSCRIPT hScope, bool bWarnMiss
 			}
 		}
 #endif
+		CDefScriptScopeBase::InvalidateFunctionCaches();
 		bSuccess = ( g_pScriptVM->Run( hScript, hScope ) != SCRIPT_ERROR );
 		if ( !bSuccess )
 		{
@@ -222,6 +223,8 @@ CON_COMMAND( script, "Run the text as a script" )
 		return;
 	}
 
+	CDefScriptScopeBase::InvalidateFunctionCaches();
+
 	if ( *pszScript != '\"' )
 	{
 		g_pScriptVM->Run( pszScript );
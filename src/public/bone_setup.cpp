@@ -18,6 +18,8 @@
 #include "mathlib/ssequaternion.h"
 #include "bitvec.h"
 #include "datamanager.h"
+#include "utlmap.h"
+#include "tier1/generichash.h"
 #include "convar.h"
 #include "tier0/tslist.h"
 #include "vphysics_interface.h"
@@ -566,6 +568,609 @@ inline void CalcBonePosition( int frame, float s,
 }
 
 
+//-----------------------------------------------------------------------------
+// Decoded animation cache
+//
+// Sampling a frame walks every channel's RLE run list from the start of the
+// stream, so the cost of a bone grows with the frame index.  Every player
+// plays the same handful of animations, so each (animation, section) is
+// decoded once into flat per-frame quaternions and positions and kept in a
+// size bounded LRU shared by all threads.  The LRU is split into buckets by
+// key, each with its own lock, so threads setting up bones for different
+// animations don't serialize on a single mutex.
+//-----------------------------------------------------------------------------
+ConVar anim_decodecache( "anim_decodecache", "1", FCVAR_REPLICATED | FCVAR_CHEAT, "Sample animations from a shared cache of decoded keyframes" );
+
+#define DECODED_ANIMATION_CACHE_SIZE	( 8 * 1024 * 1024 )
+#define DECODED_ANIMATION_CACHE_BUCKETS	8										// must be a power of two
+#define DECODED_ANIMATION_BUCKET_SIZE	( DECODED_ANIMATION_CACHE_SIZE / DECODED_ANIMATION_CACHE_BUCKETS )
+#define DECODED_ANIMATION_MAX_SIZE		( DECODED_ANIMATION_BUCKET_SIZE / 2 )	// larger animations are always sampled from the compressed data
+
+// Keyed by what the data is rather than where it was loaded, anim blocks can
+// be flushed and reloaded at a different (or a reused) address at any time
+struct decodedanimkey_t
+{
+	int checksum;						// studiohdr that owns the animdesc
+	int iAnimdesc;						// local animdesc index in that studiohdr
+	int iSection;						// see mstudioanimdesc_t::pAnim()
+};
+
+struct decodedanimparams_t
+{
+	decodedanimkey_t key;
+	const mstudioanim_t *pAnim;
+	const mstudiobone_t *pBones;
+	const mstudiolinearbone_t *pLinearBones;
+	int numframes;
+	int numbones;
+	int numquats;
+	int numpos;
+};
+
+struct decodedanimbone_t
+{
+	int		bone;						// bone index in the animation's studiohdr
+	int		iQuat;						// first quaternion of this bone
+	int		iPos;						// first position of this bone
+	int		iAlignment;					// quaternion to realign blended results to, -1 if not aligned
+	bool	bAnimRot;					// one quaternion per frame, otherwise constant
+	bool	bAnimPos;					// one position per frame, otherwise constant
+};
+
+class CDecodedAnimation
+{
+public:
+	static CDecodedAnimation *CreateResource( const decodedanimparams_t &params );
+	static unsigned int EstimatedSize( const decodedanimparams_t &params );
+	void DestroyResource();
+	CDecodedAnimation *GetData() { return this; }
+	unsigned int Size() { return m_size; }
+
+	const decodedanimkey_t &Key() const { return m_key; }
+	int NumFrames() const { return m_numframes; }
+	int NumBones() const { return m_numbones; }
+	const decodedanimbone_t &Bone( int i ) const { return BoneArray()[i]; }
+	const QuaternionAligned *Quat( int i ) const { return QuatArray() + i; }
+	const VectorAligned *Pos( int i ) const { return PosArray() + i; }
+
+private:
+	static unsigned int HeaderSize( const decodedanimparams_t &params );
+	void Decode( const decodedanimparams_t &params );
+
+	decodedanimbone_t *BoneArray() const { return (decodedanimbone_t *)( (byte *)this + sizeof(CDecodedAnimation) ); }
+	QuaternionAligned *QuatArray() const { return (QuaternionAligned *)( (byte *)this + m_quatOffset ); }
+	VectorAligned *PosArray() const { return (VectorAligned *)( (byte *)this + m_posOffset ); }
+
+	decodedanimkey_t m_key;
+	unsigned int m_size;
+	int m_numframes;
+	int m_numbones;
+	int m_quatOffset;
+	int m_posOffset;
+};
+
+static bool DecodedAnimKeyLessFunc( const decodedanimkey_t &lhs, const decodedanimkey_t &rhs )
+{
+	if ( lhs.checksum != rhs.checksum )
+		return lhs.checksum < rhs.checksum;
+	if ( lhs.iAnimdesc != rhs.iAnimdesc )
+		return lhs.iAnimdesc < rhs.iAnimdesc;
+	return lhs.iSection < rhs.iSection;
+}
+
+class CDecodedAnimationBucket
+{
+public:
+	CDecodedAnimationBucket() : m_Map( DecodedAnimKeyLessFunc ), m_Cache( DECODED_ANIMATION_BUCKET_SIZE ) {}
+
+	// NOTE: the map must be constructed before the cache, the cache removes its entries as it's destroyed
+	CUtlMap< decodedanimkey_t, memhandle_t > m_Map;
+	CDataManager<CDecodedAnimation, decodedanimparams_t, CDecodedAnimation *, CThreadFastMutex> m_Cache;
+};
+
+static CDecodedAnimationBucket g_DecodedAnimationBuckets[DECODED_ANIMATION_CACHE_BUCKETS];
+
+static CDecodedAnimationBucket &DecodedAnimationBucket( const decodedanimkey_t &key )
+{
+	unsigned int nHash = HashInt( key.checksum ^ ( key.iAnimdesc << 8 ) ^ ( key.iSection << 20 ) );
+	return g_DecodedAnimationBuckets[ nHash & ( DECODED_ANIMATION_CACHE_BUCKETS - 1 ) ];
+}
+
+unsigned int CDecodedAnimation::HeaderSize( const decodedanimparams_t &params )
+{
+	return ( sizeof(CDecodedAnimation) + params.numbones * sizeof(decodedanimbone_t) + 15 ) & ~15;
+}
+
+unsigned int CDecodedAnimation::EstimatedSize( const decodedanimparams_t &params )
+{
+	return HeaderSize( params ) + params.numquats * sizeof(QuaternionAligned) + params.numpos * sizeof(VectorAligned);
+}
+
+CDecodedAnimation *CDecodedAnimation::CreateResource( const decodedanimparams_t &params )
+{
+	unsigned int size = EstimatedSize( params );
+	CDecodedAnimation *pMem = (CDecodedAnimation *)MemAlloc_AllocAligned( size, 16 );
+	pMem->m_key = params.key;
+	pMem->m_size = size;
+	pMem->m_numframes = params.numframes;
+	pMem->m_numbones = params.numbones;
+	pMem->m_quatOffset = HeaderSize( params );
+	pMem->m_posOffset = pMem->m_quatOffset + params.numquats * sizeof(QuaternionAligned);
+	pMem->Decode( params );
+	return pMem;
+}
+
+void CDecodedAnimation::DestroyResource()
+{
+	// evicted by the LRU, forget the key so the next lookup decodes it again.
+	// Called with the bucket's mutex held.
+	CUtlMap< decodedanimkey_t, memhandle_t > &map = DecodedAnimationBucket( m_key ).m_Map;
+	unsigned short i = map.Find( m_key );
+	if ( map.IsValidIndex( i ) )
+	{
+		map.RemoveAt( i );
+	}
+	MemAlloc_FreeAligned( this );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: expand a whole RLE anim value stream, one value per frame
+//-----------------------------------------------------------------------------
+static void DecodeAnimValues( const mstudioanimvalue_t *panimvalue, float scale, int numframes, float *pOut, int nStride )
+{
+	int iFrame = 0;
+	if ( panimvalue )
+	{
+		while ( iFrame < numframes && panimvalue->num.total != 0 )
+		{
+			int total = panimvalue->num.total;
+			int valid = panimvalue->num.valid;
+			for ( int k = 0; k < total && iFrame < numframes; k++, iFrame++ )
+			{
+				// past the valid data the last value repeats
+				pOut[iFrame * nStride] = panimvalue[ MIN( k + 1, valid ) ].value * scale;
+			}
+			panimvalue += valid + 1;
+		}
+	}
+
+	for ( ; iFrame < numframes; iFrame++ )
+	{
+		pOut[iFrame * nStride] = 0;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: decode every bone in the animation, matching CalcBoneQuaternion()
+//			and CalcBonePosition() for each whole frame
+//-----------------------------------------------------------------------------
+void CDecodedAnimation::Decode( const decodedanimparams_t &params )
+{
+	decodedanimbone_t *pDecodedBone = BoneArray();
+	QuaternionAligned *pQuats = QuatArray();
+	VectorAligned *pPos = PosArray();
+	int iQuat = 0;
+	int iPos = 0;
+
+	const mstudioanim_t *panim = params.pAnim;
+	for ( int i = 0; i < m_numbones; i++, panim = panim->pNext(), pDecodedBone++ )
+	{
+		int bone = panim->bone;
+		const mstudiolinearbone_t *pLinearBones = params.pLinearBones;
+		const mstudiobone_t *pBone = &params.pBones[bone];
+
+		const Quaternion &baseQuat = pLinearBones ? pLinearBones->quat( bone ) : pBone->quat;
+		const RadianEuler &baseRot = pLinearBones ? pLinearBones->rot( bone ) : pBone->rot;
+		const Vector &baseRotScale = pLinearBones ? pLinearBones->rotscale( bone ) : pBone->rotscale;
+		int iBaseFlags = pLinearBones ? pLinearBones->flags( bone ) : pBone->flags;
+		const Quaternion &baseAlignment = pLinearBones ? pLinearBones->qalignment( bone ) : pBone->qAlignment;
+		const Vector &basePos = pLinearBones ? pLinearBones->pos( bone ) : pBone->pos;
+		const Vector &basePosScale = pLinearBones ? pLinearBones->posscale( bone ) : pBone->posscale;
+
+		bool bDelta = ( panim->flags & STUDIO_ANIM_DELTA ) != 0;
+
+		pDecodedBone->bone = bone;
+		pDecodedBone->iAlignment = -1;
+		pDecodedBone->iQuat = iQuat;
+		pDecodedBone->bAnimRot = !( panim->flags & ( STUDIO_ANIM_RAWROT | STUDIO_ANIM_RAWROT2 ) ) && ( panim->flags & STUDIO_ANIM_ANIMROT );
+
+		if ( panim->flags & STUDIO_ANIM_RAWROT )
+		{
+			pQuats[iQuat++] = *(panim->pQuat48());
+		}
+		else if ( panim->flags & STUDIO_ANIM_RAWROT2 )
+		{
+			pQuats[iQuat++] = *(panim->pQuat64());
+		}
+		else if ( !( panim->flags & STUDIO_ANIM_ANIMROT ) )
+		{
+			if ( bDelta )
+			{
+				pQuats[iQuat++].Init( 0.0f, 0.0f, 0.0f, 1.0f );
+			}
+			else
+			{
+				pQuats[iQuat++] = baseQuat;
+			}
+		}
+		else
+		{
+			QuaternionAligned *pFrames = &pQuats[iQuat];
+			iQuat += m_numframes;
+
+			// decode the euler angles in place, then convert each frame
+			mstudioanim_valueptr_t *pValuesPtr = panim->pRotV();
+			DecodeAnimValues( pValuesPtr->pAnimvalue( 0 ), baseRotScale.x, m_numframes, &pFrames->x, 4 );
+			DecodeAnimValues( pValuesPtr->pAnimvalue( 1 ), baseRotScale.y, m_numframes, &pFrames->y, 4 );
+			DecodeAnimValues( pValuesPtr->pAnimvalue( 2 ), baseRotScale.z, m_numframes, &pFrames->z, 4 );
+
+			bool bAlign = !bDelta && ( iBaseFlags & BONE_FIXED_ALIGNMENT );
+			for ( int iFrame = 0; iFrame < m_numframes; iFrame++ )
+			{
+				RadianEuler angle( pFrames[iFrame].x, pFrames[iFrame].y, pFrames[iFrame].z );
+				if ( !bDelta )
+				{
+					angle.x = angle.x + baseRot.x;
+					angle.y = angle.y + baseRot.y;
+					angle.z = angle.z + baseRot.z;
+				}
+
+				Assert( angle.IsValid() );
+				AngleQuaternion( angle, pFrames[iFrame] );
+				if ( bAlign )
+				{
+					QuaternionAlign( baseAlignment, pFrames[iFrame], pFrames[iFrame] );
+				}
+			}
+
+			if ( bAlign )
+			{
+				pDecodedBone->iAlignment = iQuat;
+				pQuats[iQuat++] = baseAlignment;
+			}
+		}
+
+		pDecodedBone->iPos = iPos;
+		pDecodedBone->bAnimPos = !( panim->flags & STUDIO_ANIM_RAWPOS ) && ( panim->flags & STUDIO_ANIM_ANIMPOS );
+
+		if ( panim->flags & STUDIO_ANIM_RAWPOS )
+		{
+			pPos[iPos++] = *(panim->pPos());
+		}
+		else if ( !( panim->flags & STUDIO_ANIM_ANIMPOS ) )
+		{
+			if ( bDelta )
+			{
+				pPos[iPos++].Init( 0.0f, 0.0f, 0.0f );
+			}
+			else
+			{
+				pPos[iPos++] = basePos;
+			}
+		}
+		else
+		{
+			VectorAligned *pFrames = &pPos[iPos];
+			iPos += m_numframes;
+
+			mstudioanim_valueptr_t *pPosV = panim->pPosV();
+			for ( int j = 0; j < 3; j++ )
+			{
+				DecodeAnimValues( pPosV->pAnimvalue( j ), basePosScale[j], m_numframes, &pFrames->Base()[j], 4 );
+			}
+
+			for ( int iFrame = 0; iFrame < m_numframes; iFrame++ )
+			{
+				if ( !bDelta )
+				{
+					pFrames[iFrame].x = pFrames[iFrame].x + basePos.x;
+					pFrames[iFrame].y = pFrames[iFrame].y + basePos.y;
+					pFrames[iFrame].z = pFrames[iFrame].z + basePos.z;
+				}
+				pFrames[iFrame].Base()[3] = 0.0f;		// keep the unused lane from holding denormals
+			}
+		}
+	}
+
+	Assert( iQuat * sizeof(QuaternionAligned) + m_quatOffset == (unsigned int)m_posOffset );
+	Assert( iPos * sizeof(VectorAligned) + m_posOffset == m_size );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: number of frames stored in the section of the animation that holds iFrame
+//-----------------------------------------------------------------------------
+static int DecodedAnimationFrameCount( const mstudioanimdesc_t &animdesc, int iFrame )
+{
+	if ( animdesc.sectionframes == 0 )
+		return animdesc.numframes;
+
+	// see mstudioanimdesc_t::pAnim(), the last frame on long anims is stored separately
+	if ( animdesc.numframes > animdesc.sectionframes && iFrame == animdesc.numframes - 1 )
+		return 1;
+
+	int section = iFrame / animdesc.sectionframes;
+	return MIN( animdesc.sectionframes + 1, animdesc.numframes - section * animdesc.sectionframes );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: section of the animation that holds iFrame, matching mstudioanimdesc_t::pAnim()
+//-----------------------------------------------------------------------------
+static int DecodedAnimationSection( const mstudioanimdesc_t &animdesc, int iFrame )
+{
+	if ( animdesc.sectionframes == 0 )
+		return 0;
+
+	if ( animdesc.numframes > animdesc.sectionframes && iFrame == animdesc.numframes - 1 )
+		return ( animdesc.numframes / animdesc.sectionframes ) + 1;
+
+	return iFrame / animdesc.sectionframes;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: find or decode the animation data that panim starts, locked until
+//			UnlockDecodedAnimation().  Returns NULL if it can't be cached.
+//-----------------------------------------------------------------------------
+static CDecodedAnimation *LockDecodedAnimation( const mstudioanimdesc_t &animdesc, const mstudioanim_t *panim, int iFrame, int iLocalFrame,
+	const mstudiobone_t *pBones, const mstudiolinearbone_t *pLinearBones, memhandle_t &hDecoded )
+{
+	const studiohdr_t *pStudioHdr = animdesc.pStudiohdr();
+
+	decodedanimkey_t key;
+	key.checksum = pStudioHdr->checksum;
+	key.iAnimdesc = (int)( &animdesc - pStudioHdr->pLocalAnimdesc( 0 ) );
+	key.iSection = DecodedAnimationSection( animdesc, iFrame );
+	Assert( key.iAnimdesc >= 0 && key.iAnimdesc < pStudioHdr->numlocalanim );
+
+	CDecodedAnimationBucket &bucket = DecodedAnimationBucket( key );
+	AUTO_LOCK( bucket.m_Cache.AccessMutex() );
+
+	CDecodedAnimation *pDecoded = NULL;
+	unsigned short i = bucket.m_Map.Find( key );
+	if ( bucket.m_Map.IsValidIndex( i ) )
+	{
+		hDecoded = bucket.m_Map[i];
+		pDecoded = bucket.m_Cache.LockResource( hDecoded );
+		if ( !pDecoded )
+		{
+			bucket.m_Map.RemoveAt( i );
+		}
+	}
+
+	if ( !pDecoded )
+	{
+		decodedanimparams_t params;
+		params.key = key;
+		params.pAnim = panim;
+		params.pBones = pBones;
+		params.pLinearBones = pLinearBones;
+		params.numframes = DecodedAnimationFrameCount( animdesc, iFrame );
+		params.numbones = 0;
+		params.numquats = 0;
+		params.numpos = 0;
+
+		// FIXME: change encoding so that bone -1 is never the case
+		for ( ; panim && panim->bone < 255; panim = panim->pNext() )
+		{
+			params.numbones++;
+
+			if ( !( panim->flags & ( STUDIO_ANIM_RAWROT | STUDIO_ANIM_RAWROT2 ) ) && ( panim->flags & STUDIO_ANIM_ANIMROT ) )
+			{
+				int iBaseFlags = pLinearBones ? pLinearBones->flags( panim->bone ) : pBones[panim->bone].flags;
+				bool bAlign = !( panim->flags & STUDIO_ANIM_DELTA ) && ( iBaseFlags & BONE_FIXED_ALIGNMENT );
+				params.numquats += params.numframes + ( bAlign ? 1 : 0 );
+			}
+			else
+			{
+				params.numquats++;
+			}
+
+			if ( !( panim->flags & STUDIO_ANIM_RAWPOS ) && ( panim->flags & STUDIO_ANIM_ANIMPOS ) )
+			{
+				params.numpos += params.numframes;
+			}
+			else
+			{
+				params.numpos++;
+			}
+		}
+
+		if ( params.numframes <= 0 || CDecodedAnimation::EstimatedSize( params ) > DECODED_ANIMATION_MAX_SIZE )
+			return NULL;
+
+		hDecoded = bucket.m_Cache.CreateResource( params, true );
+		bucket.m_Map.Insert( key, hDecoded );
+		pDecoded = bucket.m_Cache.GetResource_NoLock( hDecoded );
+	}
+
+	if ( iLocalFrame < 0 || iLocalFrame >= pDecoded->NumFrames() )
+	{
+		bucket.m_Cache.UnlockResource( hDecoded );
+		return NULL;
+	}
+
+	return pDecoded;
+}
+
+static void UnlockDecodedAnimation( CDecodedAnimation *pDecoded, memhandle_t hDecoded )
+{
+	DecodedAnimationBucket( pDecoded->Key() ).m_Cache.UnlockResource( hDecoded );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: samples bones of a decoded animation at a sub frame.  Rotations
+//			that need blending are queued and blended four at a time in SoA
+//			form; Flush() must be called before the results are used.
+//-----------------------------------------------------------------------------
+class CDecodedAnimationSampler
+{
+public:
+	CDecodedAnimationSampler( const CDecodedAnimation *pDecoded, int iFrame, float s );
+	~CDecodedAnimationSampler() { Assert( m_nPending == 0 ); }
+
+	void Sample( const decodedanimbone_t &bone, Quaternion &q, Vector &pos );
+	void Flush();
+
+private:
+	void BlendPending();
+
+	const CDecodedAnimation *m_pDecoded;
+	int m_iFrame;
+	int m_iNextFrame;
+	bool m_bBlend;
+	fltx4 m_s;
+	fltx4 m_oneMinusS;
+
+	int m_nPending;
+	const QuaternionAligned *m_pQ1[4];
+	const QuaternionAligned *m_pQ2[4];
+	const QuaternionAligned *m_pAlignment[4];
+	Quaternion *m_pOut[4];
+};
+
+CDecodedAnimationSampler::CDecodedAnimationSampler( const CDecodedAnimation *pDecoded, int iFrame, float s )
+{
+	m_pDecoded = pDecoded;
+	m_iFrame = iFrame;
+	m_iNextFrame = pDecoded ? MIN( iFrame + 1, pDecoded->NumFrames() - 1 ) : iFrame;
+	m_bBlend = ( s > 0.001f );
+	m_s = ReplicateX4( s );
+	m_oneMinusS = ReplicateX4( 1.0f - s );
+	m_nPending = 0;
+}
+
+void CDecodedAnimationSampler::Sample( const decodedanimbone_t &bone, Quaternion &q, Vector &pos )
+{
+	if ( !bone.bAnimPos )
+	{
+		pos = *m_pDecoded->Pos( bone.iPos );
+	}
+	else if ( m_bBlend )
+	{
+		fltx4 p1 = LoadAlignedSIMD( m_pDecoded->Pos( bone.iPos + m_iFrame ) );
+		fltx4 p2 = LoadAlignedSIMD( m_pDecoded->Pos( bone.iPos + m_iNextFrame ) );
+		fltx4 p = MaddSIMD( p2, m_s, MulSIMD( p1, m_oneMinusS ) );
+		StoreUnaligned3SIMD( pos.Base(), p );
+	}
+	else
+	{
+		pos = *m_pDecoded->Pos( bone.iPos + m_iFrame );
+	}
+	Assert( pos.IsValid() );
+
+	if ( !bone.bAnimRot )
+	{
+		q = *m_pDecoded->Quat( bone.iQuat );
+		return;
+	}
+
+	const QuaternionAligned *pQ1 = m_pDecoded->Quat( bone.iQuat + m_iFrame );
+	if ( !m_bBlend )
+	{
+		q = *pQ1;
+		return;
+	}
+
+	const QuaternionAligned *pQ2 = m_pDecoded->Quat( bone.iQuat + m_iNextFrame );
+	if ( *pQ1 == *pQ2 )
+	{
+		q = *pQ1;
+		return;
+	}
+
+	// the blend of q1 and an aligned q2 is already in q1's hemisphere, so
+	// aligning to q1 is a no-op for bones that don't need realigning
+	m_pQ1[m_nPending] = pQ1;
+	m_pQ2[m_nPending] = pQ2;
+	m_pAlignment[m_nPending] = ( bone.iAlignment >= 0 ) ? m_pDecoded->Quat( bone.iAlignment ) : pQ1;
+	m_pOut[m_nPending] = &q;
+	if ( ++m_nPending == 4 )
+	{
+		BlendPending();
+	}
+}
+
+void CDecodedAnimationSampler::Flush()
+{
+	if ( m_nPending > 0 )
+	{
+		BlendPending();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: QuaternionBlend() followed by QuaternionAlign() for up to four bones
+//-----------------------------------------------------------------------------
+void CDecodedAnimationSampler::BlendPending()
+{
+	// pad the unused lanes with the first bone
+	for ( int i = m_nPending; i < 4; i++ )
+	{
+		m_pQ1[i] = m_pQ1[0];
+		m_pQ2[i] = m_pQ2[0];
+		m_pAlignment[i] = m_pAlignment[0];
+	}
+
+	fltx4 x1 = LoadAlignedSIMD( m_pQ1[0] );
+	fltx4 y1 = LoadAlignedSIMD( m_pQ1[1] );
+	fltx4 z1 = LoadAlignedSIMD( m_pQ1[2] );
+	fltx4 w1 = LoadAlignedSIMD( m_pQ1[3] );
+	TransposeSIMD( x1, y1, z1, w1 );
+
+	fltx4 x2 = LoadAlignedSIMD( m_pQ2[0] );
+	fltx4 y2 = LoadAlignedSIMD( m_pQ2[1] );
+	fltx4 z2 = LoadAlignedSIMD( m_pQ2[2] );
+	fltx4 w2 = LoadAlignedSIMD( m_pQ2[3] );
+	TransposeSIMD( x2, y2, z2, w2 );
+
+	fltx4 signMask = LoadAlignedSIMD( g_SIMD_signmask );
+
+	// align q2 to q1
+	fltx4 dot = MaddSIMD( x1, x2, MaddSIMD( y1, y2, MaddSIMD( z1, z2, MulSIMD( w1, w2 ) ) ) );
+	fltx4 flip = AndSIMD( CmpLtSIMD( dot, Four_Zeros ), signMask );
+	x2 = XorSIMD( x2, flip );
+	y2 = XorSIMD( y2, flip );
+	z2 = XorSIMD( z2, flip );
+	w2 = XorSIMD( w2, flip );
+
+	// lerp and normalize
+	fltx4 x = MaddSIMD( x2, m_s, MulSIMD( x1, m_oneMinusS ) );
+	fltx4 y = MaddSIMD( y2, m_s, MulSIMD( y1, m_oneMinusS ) );
+	fltx4 z = MaddSIMD( z2, m_s, MulSIMD( z1, m_oneMinusS ) );
+	fltx4 w = MaddSIMD( w2, m_s, MulSIMD( w1, m_oneMinusS ) );
+
+	fltx4 lengthSqr = MaddSIMD( x, x, MaddSIMD( y, y, MaddSIMD( z, z, MulSIMD( w, w ) ) ) );
+	fltx4 invLength = MaskedAssign( CmpGtSIMD( lengthSqr, Four_Zeros ), ReciprocalSqrtSIMD( lengthSqr ), Four_Ones );
+	x = MulSIMD( x, invLength );
+	y = MulSIMD( y, invLength );
+	z = MulSIMD( z, invLength );
+	w = MulSIMD( w, invLength );
+
+	// align to the unified bone
+	fltx4 xa = LoadAlignedSIMD( m_pAlignment[0] );
+	fltx4 ya = LoadAlignedSIMD( m_pAlignment[1] );
+	fltx4 za = LoadAlignedSIMD( m_pAlignment[2] );
+	fltx4 wa = LoadAlignedSIMD( m_pAlignment[3] );
+	TransposeSIMD( xa, ya, za, wa );
+
+	dot = MaddSIMD( xa, x, MaddSIMD( ya, y, MaddSIMD( za, z, MulSIMD( wa, w ) ) ) );
+	flip = AndSIMD( CmpLtSIMD( dot, Four_Zeros ), signMask );
+	x = XorSIMD( x, flip );
+	y = XorSIMD( y, flip );
+	z = XorSIMD( z, flip );
+	w = XorSIMD( w, flip );
+
+	TransposeSIMD( x, y, z, w );
+	fltx4 result[4] = { x, y, z, w };
+	for ( int i = 0; i < m_nPending; i++ )
+	{
+		StoreUnalignedSIMD( m_pOut[i]->Base(), result[i] );
+		Assert( m_pOut[i]->IsValid() );
+	}
+
+	m_nPending = 0;
+}
+
+
 
 void SetupSingleBoneMatrix( 
 	CStudioHdr *pOwnerHdr, 
@@ -960,8 +1565,16 @@ static void CalcVirtualAnimation( virtualmodel_t *pVModel, const CStudioHdr *pSt
 		return;
 	}
 
+	memhandle_t hDecoded = NULL;
+	CDecodedAnimation *pDecoded = NULL;
+	if ( anim_decodecache.GetBool() )
+	{
+		pDecoded = LockDecodedAnimation( animdesc, panim, iFrame, iLocalFrame, pAnimbone, pAnimLinearBones, hDecoded );
+	}
+	CDecodedAnimationSampler sampler( pDecoded, iLocalFrame, s );
+
 	// FIXME: change encoding so that bone -1 is never the case
-	while (panim && panim->bone < 255)
+	for (int iDecoded = 0; panim && panim->bone < 255; iDecoded++)
 	{
 		int j = pAnimGroup->masterBone[panim->bone];
 		if ( j >= 0 && ( pStudioHdr->boneFlags(j) & boneMask ) )
@@ -970,8 +1583,16 @@ static void CalcVirtualAnimation( virtualmodel_t *pVModel, const CStudioHdr *pSt
 
 			if (k >= 0 && pweight[k] > 0.0f)
 			{
-				CalcBoneQuaternion( iLocalFrame, s, &pAnimbone[panim->bone], pAnimLinearBones, panim, q[j] );
-				CalcBonePosition  ( iLocalFrame, s, &pAnimbone[panim->bone], pAnimLinearBones, panim, pos[j] );
+				if ( pDecoded )
+				{
+					Assert( pDecoded->Bone( iDecoded ).bone == panim->bone );
+					sampler.Sample( pDecoded->Bone( iDecoded ), q[j], pos[j] );
+				}
+				else
+				{
+					CalcBoneQuaternion( iLocalFrame, s, &pAnimbone[panim->bone], pAnimLinearBones, panim, q[j] );
+					CalcBonePosition  ( iLocalFrame, s, &pAnimbone[panim->bone], pAnimLinearBones, panim, pos[j] );
+				}
 #ifdef STUDIO_ENABLE_PERF_COUNTERS
 				pStudioHdr->m_nPerfAnimatedBones++;
 #endif
@@ -980,6 +1601,12 @@ static void CalcVirtualAnimation( virtualmodel_t *pVModel, const CStudioHdr *pSt
 		panim = panim->pNext();
 	}
 
+	if ( pDecoded )
+	{
+		sampler.Flush();
+		UnlockDecodedAnimation( pDecoded, hDecoded );
+	}
+
 	// cross fade in previous zeroframe data
 	if (flStall > 0.0f)
 	{
@@ -1091,6 +1718,15 @@ static void CalcAnimation( const CStudioHdr *pStudioHdr,	Vector *pos, Quaternion
 		return;
 	}
 
+	memhandle_t hDecoded = NULL;
+	CDecodedAnimation *pDecoded = NULL;
+	if ( anim_decodecache.GetBool() )
+	{
+		pDecoded = LockDecodedAnimation( animdesc, panim, iFrame, iLocalFrame, pbone, pLinearBones, hDecoded );
+	}
+	CDecodedAnimationSampler sampler( pDecoded, iLocalFrame, s );
+	int iDecoded = 0;
+
 	// BUGBUG: the sequence, the anim, and the model can have all different bone mappings.
 	for (int i = 0; i < pStudioHdr->numbones(); i++, pbone++, pweight++)
 	{
@@ -1098,14 +1734,23 @@ static void CalcAnimation( const CStudioHdr *pStudioHdr,	Vector *pos, Quaternion
 		{
 			if (*pweight > 0 && (pStudioHdr->boneFlags(i) & boneMask))
 			{
-				CalcBoneQuaternion( iLocalFrame, s, pbone, pLinearBones, panim, q[i] );
-				CalcBonePosition  ( iLocalFrame, s, pbone, pLinearBones, panim, pos[i] );
+				if ( pDecoded )
+				{
+					Assert( pDecoded->Bone( iDecoded ).bone == i );
+					sampler.Sample( pDecoded->Bone( iDecoded ), q[i], pos[i] );
+				}
+				else
+				{
+					CalcBoneQuaternion( iLocalFrame, s, pbone, pLinearBones, panim, q[i] );
+					CalcBonePosition  ( iLocalFrame, s, pbone, pLinearBones, panim, pos[i] );
+				}
 #ifdef STUDIO_ENABLE_PERF_COUNTERS
 				pStudioHdr->m_nPerfAnimatedBones++;
 				pStudioHdr->m_nPerfUsedBones++;
 #endif
 			}
 			panim = panim->pNext();
+			iDecoded++;
 		}
 		else if (*pweight > 0 && (pStudioHdr->boneFlags(i) & boneMask))
 		{
@@ -1125,6 +1770,12 @@ static void CalcAnimation( const CStudioHdr *pStudioHdr,	Vector *pos, Quaternion
 		}
 	}
 
+	if ( pDecoded )
+	{
+		sampler.Flush();
+		UnlockDecodedAnimation( pDecoded, hDecoded );
+	}
+
 	// cross fade in previous zeroframe data
 	if (flStall > 0.0f)
 	{
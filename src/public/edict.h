@@ -130,6 +130,30 @@ public:
 };
 extern CSharedEdictChangeInfo *g_pSharedChangeInfo;
 
+// Dev builds of the game DLL can count how often changed edicts overflow the offset list
+// above and have every prop compared (see edictchangestats.h, sv_netprop_change_stats).
+#if defined( GAME_DLL ) && defined( STAGING_ONLY )
+#define EDICT_CHANGE_STATS
+#endif
+
+#ifdef EDICT_CHANGE_STATS
+// Why an edict's changes could not be described by its CEdictChangeInfo offset list.
+enum EdictFullChange_t
+{
+	EDICT_FULL_CHANGE_NONE = -1,		// the offset list still describes the change
+	EDICT_FULL_CHANGE_EXPLICIT = 0,		// StateChanged() was called without an offset
+	EDICT_FULL_CHANGE_OFFSET_LIMIT,		// more than MAX_CHANGE_OFFSETS offsets changed this frame
+	EDICT_FULL_CHANGE_INFO_LIMIT,		// more than MAX_EDICT_CHANGE_INFOS edicts changed this frame
+
+	EDICT_FULL_CHANGE_COUNT
+};
+
+// Off unless sv_netprop_change_stats_enable is set, which mirrors itself into g_bEdictChangeStats.
+class CBaseEdict;
+extern bool g_bEdictChangeStats;
+void EdictChangeStats_StateChanged( CBaseEdict *pEdict, EdictFullChange_t reason );
+#endif
+
 class IChangeInfoAccessor
 {
 public:
@@ -281,6 +305,13 @@ inline void	CBaseEdict::StateChanged()
 	// kind of pointer dereference. If the data is directly offsetable 
 	m_fStateFlags |= (FL_EDICT_CHANGED | FL_FULL_EDICT_CHANGED);
 	SetChangeInfoSerialNumber( 0 );
+
+#ifdef EDICT_CHANGE_STATS
+	if ( g_bEdictChangeStats )
+	{
+		EdictChangeStats_StateChanged( this, EDICT_FULL_CHANGE_EXPLICIT );
+	}
+#endif
 }
 
 inline void	CBaseEdict::StateChanged( unsigned short offset )
@@ -307,6 +338,13 @@ inline void	CBaseEdict::StateChanged( unsigned short offset )
 			// Invalidate our change info.
 			accessor->SetChangeInfoSerialNumber( 0 );
 			m_fStateFlags |= FL_FULL_EDICT_CHANGED; // So we don't get in here again.
+
+#ifdef EDICT_CHANGE_STATS
+			if ( g_bEdictChangeStats )
+			{
+				EdictChangeStats_StateChanged( this, EDICT_FULL_CHANGE_OFFSET_LIMIT );
+			}
+#endif
 		}
 		else
 		{
@@ -320,6 +358,13 @@ inline void	CBaseEdict::StateChanged( unsigned short offset )
 			// Shucks.. have to mark the edict as fully changed because we don't have room to remember this change.
 			accessor->SetChangeInfoSerialNumber( 0 );
 			m_fStateFlags |= FL_FULL_EDICT_CHANGED;
+
+#ifdef EDICT_CHANGE_STATS
+			if ( g_bEdictChangeStats )
+			{
+				EdictChangeStats_StateChanged( this, EDICT_FULL_CHANGE_INFO_LIMIT );
+			}
+#endif
 		}
 		else
 		{
@@ -332,6 +377,13 @@ inline void	CBaseEdict::StateChanged( unsigned short offset )
 			CEdictChangeInfo *p = &g_pSharedChangeInfo->m_ChangeInfos[accessor->GetChangeInfo()];
 			p->m_ChangeOffsets[0] = offset;
 			p->m_nChangeOffsets = 1;
+
+#ifdef EDICT_CHANGE_STATS
+			if ( g_bEdictChangeStats )
+			{
+				EdictChangeStats_StateChanged( this, EDICT_FULL_CHANGE_NONE );
+			}
+#endif
 		}
 	}
 }
@@ -6,6 +6,8 @@
 #include "keyvaluescompiler.h"
 #include "filesystem.h"
 #include "tier1/KeyValues.h"
+#include "tier1/checksum_sha1.h"
+#include "vstdlib/IKeyValuesSystem.h"
 
 extern IFileSystem *g_pFullFileSystem;
 
@@ -434,3 +436,402 @@ bool CCompiledKeyValuesReader::LookupKeyValuesRootKeyName( char const *kvfilenam
 	Q_strncpy( outbuf, m_StringTable.Lookup( m_Data[ info.nFirstIndex ].key ), bufsize );
 	return true;
 }
+
+
+COMPILE_TIME_ASSERT( sizeof( KVTreeNode_t ) == 24 );
+
+CCompiledKeyValuesTreeWriter::CCompiledKeyValuesTreeWriter()
+	: m_StringIndex( 0, 0, StringLessThan )
+{
+}
+
+int CCompiledKeyValuesTreeWriter::AddString( const char *pString )
+{
+	int idx = m_StringIndex.Find( pString );
+	if ( idx != m_StringIndex.InvalidIndex() )
+	{
+		return m_StringIndex[ idx ];
+	}
+
+	int nString = m_StringOffsets.AddToTail( m_StringData.Count() );
+	m_StringData.AddMultipleToTail( V_strlen( pString ) + 1, pString );
+	m_StringIndex.Insert( pString, nString );
+	return nString;
+}
+
+bool CCompiledKeyValuesTreeWriter::BuildNodes_R( KeyValues *kv )
+{
+	int index = m_Nodes.AddToTail();
+
+	KVTreeNode_t node;
+	node.key = AddString( kv->GetName() );
+	node.dataType = kv->GetDataType();
+	node.firstChild = -1;
+	node.nextSibling = -1;
+	node.uint64Value = 0;
+
+	switch ( node.dataType )
+	{
+	case KeyValues::TYPE_NONE:
+		break;
+	case KeyValues::TYPE_STRING:
+		node.stringValue = AddString( kv->GetString() );
+		break;
+	case KeyValues::TYPE_INT:
+		node.intValue = kv->GetInt();
+		break;
+	case KeyValues::TYPE_FLOAT:
+		node.floatValue = kv->GetFloat();
+		break;
+	case KeyValues::TYPE_UINT64:
+		node.uint64Value = kv->GetUint64();
+		break;
+	default:
+		return false;
+	}
+
+	// Then add children, depth first
+	int prevChild = -1;
+	for ( KeyValues *sub = kv->GetFirstSubKey(); sub; sub = sub->GetNextKey() )
+	{
+		int child = m_Nodes.Count();
+		if ( prevChild == -1 )
+		{
+			node.firstChild = child;
+		}
+		else
+		{
+			m_Nodes[ prevChild ].nextSibling = child;
+		}
+
+		if ( !BuildNodes_R( sub ) )
+		{
+			return false;
+		}
+
+		prevChild = child;
+	}
+
+	m_Nodes[ index ] = node;
+	return true;
+}
+
+bool CCompiledKeyValuesTreeWriter::Compile( KeyValues *kv )
+{
+	m_Nodes.Purge();
+	m_StringOffsets.Purge();
+	m_StringData.Purge();
+
+	bool bOK = true;
+	int prev = -1;
+	for ( ; kv && bOK; kv = kv->GetNextKey() )
+	{
+		int index = m_Nodes.Count();
+		if ( prev != -1 )
+		{
+			m_Nodes[ prev ].nextSibling = index;
+		}
+
+		bOK = BuildNodes_R( kv );
+		prev = index;
+	}
+
+	// the string lookup points into the tree, which the caller owns
+	m_StringIndex.Purge();
+
+	return bOK && m_Nodes.Count() > 0;
+}
+
+//-----------------------------------------------------------------------------
+// HMAC-SHA1 (RFC 2104) of a buffer
+//-----------------------------------------------------------------------------
+static void ComputeTreeMAC( const unsigned char *pKey, int nKeySize, const void *pData, int nSize, unsigned char *pMAC )
+{
+	const int nBlockSize = 64;
+
+	// keys longer than a block are hashed down, shorter ones are zero padded
+	unsigned char keyBlock[ nBlockSize ];
+	Q_memset( keyBlock, 0, sizeof( keyBlock ) );
+	if ( nKeySize > nBlockSize )
+	{
+		GenerateHash( keyBlock, pKey, nKeySize );
+	}
+	else
+	{
+		Q_memcpy( keyBlock, pKey, nKeySize );
+	}
+
+	unsigned char pad[ nBlockSize ];
+	unsigned char innerHash[ k_cubHash ];
+
+	CSHA1 inner;
+	for ( int i = 0; i < nBlockSize; ++i )
+	{
+		pad[ i ] = keyBlock[ i ] ^ 0x36;
+	}
+	inner.Update( pad, nBlockSize );
+	inner.Update( (unsigned char *)pData, nSize );
+	inner.Final();
+	inner.GetHash( innerHash );
+
+	CSHA1 outer;
+	for ( int i = 0; i < nBlockSize; ++i )
+	{
+		pad[ i ] = keyBlock[ i ] ^ 0x5c;
+	}
+	outer.Update( pad, nBlockSize );
+	outer.Update( innerHash, k_cubHash );
+	outer.Final();
+	outer.GetHash( pMAC );
+}
+
+void CCompiledKeyValuesTreeWriter::WriteToBuffer( CUtlBuffer& buf, const unsigned char *pSourceHash, unsigned int nSourceSize, const unsigned char *pKey, int nKeySize ) const
+{
+	Assert( pKey && nKeySize > 0 );
+
+	KVTreeHeader_t header;
+	header.fileid			= COMPILED_KEYVALUES_ID;
+	header.version			= COMPILED_KEYVALUES_TREE_VERSION;
+	Q_memcpy( header.sourceHash, pSourceHash, sizeof( header.sourceHash ) );
+	header.sourceSize		= nSourceSize;
+	Q_memset( header.dataMAC, 0, sizeof( header.dataMAC ) );
+	header.numStrings		= m_StringOffsets.Count();
+	header.stringDataSize	= m_StringData.Count();
+	header.numNodes			= m_Nodes.Count();
+	header.nodeOffset		= AlignValue( sizeof( header ) + header.numStrings * sizeof( int ) + header.stringDataSize, COMPILED_KEYVALUES_NODE_ALIGN );
+
+	int nStart = buf.TellPut();
+	buf.Put( &header, sizeof( header ) );
+	buf.Put( m_StringOffsets.Base(), m_StringOffsets.Count() * sizeof( int ) );
+	buf.Put( m_StringData.Base(), m_StringData.Count() );
+	while ( buf.TellPut() - nStart < header.nodeOffset )
+	{
+		buf.PutChar( 0 );
+	}
+	buf.Put( m_Nodes.Base(), m_Nodes.Count() * sizeof( KVTreeNode_t ) );
+
+	// sign the header and payload so only a tree this key holder wrote is ever instanced
+	KVTreeHeader_t *pHeader = (KVTreeHeader_t *)( (byte *)buf.Base() + nStart );
+	ComputeTreeMAC( pKey, nKeySize, pHeader, buf.TellPut() - nStart, pHeader->dataMAC );
+}
+
+bool CCompiledKeyValuesTreeWriter::WriteFile( char const *outfile, char const *pathID, const unsigned char *pSourceHash, unsigned int nSourceSize, const unsigned char *pKey, int nKeySize ) const
+{
+	CUtlBuffer buf;
+	WriteToBuffer( buf, pSourceHash, nSourceSize, pKey, nKeySize );
+
+	return g_pFullFileSystem->WriteFile( outfile, pathID, buf );
+}
+
+CCompiledKeyValuesTreeReader::CCompiledKeyValuesTreeReader()
+	: m_pNodes( NULL ),
+	m_nNodes( 0 )
+{
+}
+
+bool CCompiledKeyValuesTreeReader::LoadFile( char const *filename, char const *pathID, const unsigned char *pSourceHash, unsigned int nSourceSize, const unsigned char *pKey, int nKeySize )
+{
+	m_pNodes = NULL;
+	m_nNodes = 0;
+	m_Strings.Purge();
+	m_KeySymbols.Purge();
+	m_LoadBuffer.Purge();
+
+	// the node array is used where it was read, only the strings are indexed
+	if ( !g_pFullFileSystem->ReadFile( filename, pathID, m_LoadBuffer ) )
+	{
+		return false;
+	}
+
+	int nSize = m_LoadBuffer.TellPut();
+	if ( nSize < (int)sizeof( KVTreeHeader_t ) || !pKey || nKeySize <= 0 )
+	{
+		return false;
+	}
+
+	byte *pData = (byte *)m_LoadBuffer.Base();
+
+	KVTreeHeader_t header;
+	Q_memcpy( &header, pData, sizeof( header ) );
+
+	// nothing in the file is trusted until it checks out against the key
+	unsigned char mac[ COMPILED_KEYVALUES_MAC_SIZE ];
+	Q_memset( ( (KVTreeHeader_t *)pData )->dataMAC, 0, sizeof( header.dataMAC ) );
+	ComputeTreeMAC( pKey, nKeySize, pData, nSize, mac );
+
+	unsigned char nDiff = 0;
+	for ( int i = 0; i < COMPILED_KEYVALUES_MAC_SIZE; ++i )
+	{
+		nDiff |= mac[ i ] ^ header.dataMAC[ i ];
+	}
+	if ( nDiff )
+	{
+		return false;
+	}
+
+	if ( header.fileid != COMPILED_KEYVALUES_ID || header.version != COMPILED_KEYVALUES_TREE_VERSION )
+	{
+		return false;
+	}
+
+	// only valid for the exact text it was compiled from
+	if ( header.sourceSize != nSourceSize || Q_memcmp( header.sourceHash, pSourceHash, sizeof( header.sourceHash ) ) )
+	{
+		return false;
+	}
+
+	if ( header.numStrings <= 0 || header.stringDataSize <= 0 || header.numNodes <= 0 ||
+		 header.numStrings > ( nSize - (int)sizeof( header ) ) / (int)sizeof( int ) ||
+		 header.stringDataSize > nSize - (int)sizeof( header ) - header.numStrings * (int)sizeof( int ) ||
+		 header.nodeOffset != (int)AlignValue( sizeof( header ) + header.numStrings * sizeof( int ) + header.stringDataSize, COMPILED_KEYVALUES_NODE_ALIGN ) ||
+		 header.numNodes > ( nSize - header.nodeOffset ) / (int)sizeof( KVTreeNode_t ) ||
+		 header.nodeOffset + header.numNodes * (int)sizeof( KVTreeNode_t ) != nSize )
+	{
+		return false;
+	}
+
+	// every string must start inside the string data, which must end with a terminator
+	const int *pOffsets = (const int *)( pData + sizeof( header ) );
+	const char *pStringData = (const char *)( pOffsets + header.numStrings );
+	if ( pStringData[ header.stringDataSize - 1 ] != 0 )
+	{
+		return false;
+	}
+
+	m_Strings.EnsureCount( header.numStrings );
+	for ( int i = 0; i < header.numStrings; ++i )
+	{
+		if ( pOffsets[ i ] < 0 || pOffsets[ i ] >= header.stringDataSize )
+		{
+			m_Strings.Purge();
+			return false;
+		}
+		m_Strings[ i ] = pStringData + pOffsets[ i ];
+	}
+
+	m_KeySymbols.EnsureCount( header.numStrings );
+	for ( int i = 0; i < header.numStrings; ++i )
+	{
+		m_KeySymbols[ i ] = INVALID_KEY_SYMBOL;
+	}
+
+	m_pNodes = (const KVTreeNode_t *)( pData + header.nodeOffset );
+	m_nNodes = header.numNodes;
+
+	return true;
+}
+
+int CCompiledKeyValuesTreeReader::GetKeySymbol( int nString )
+{
+	int &symbol = m_KeySymbols[ nString ];
+	if ( symbol == INVALID_KEY_SYMBOL )
+	{
+		symbol = KeyValues::CallGetSymbolForString( m_Strings[ nString ], true );
+	}
+	return symbol;
+}
+
+bool CCompiledKeyValuesTreeReader::BuildKey_R( KeyValues *kv, const KVTreeNode_t& node, int &nNextNode )
+{
+	switch ( node.dataType )
+	{
+	case KeyValues::TYPE_NONE:
+		break;
+	case KeyValues::TYPE_STRING:
+		if ( node.stringValue < 0 || node.stringValue >= m_Strings.Count() )
+		{
+			return false;
+		}
+		kv->SetStringValue( m_Strings[ node.stringValue ] );
+		break;
+	case KeyValues::TYPE_INT:
+		kv->SetInt( NULL, node.intValue );
+		break;
+	case KeyValues::TYPE_FLOAT:
+		kv->SetFloat( NULL, node.floatValue );
+		break;
+	case KeyValues::TYPE_UINT64:
+		kv->SetUint64( NULL, node.uint64Value );
+		break;
+	default:
+		return false;
+	}
+
+	if ( node.firstChild != -1 && node.dataType != KeyValues::TYPE_NONE )
+	{
+		return false;
+	}
+
+	// Nodes are depth first, so each one visited must be the next one stored.  This
+	// also guarantees every node is used exactly once.
+	KeyValues *pLastChild = NULL;
+	for ( int child = node.firstChild; child != -1; child = m_pNodes[ child ].nextSibling )
+	{
+		if ( child != nNextNode || child >= m_nNodes )
+		{
+			return false;
+		}
+		++nNextNode;
+
+		const KVTreeNode_t &sub = m_pNodes[ child ];
+		if ( sub.key < 0 || sub.key >= m_Strings.Count() )
+		{
+			return false;
+		}
+
+		pLastChild = kv->CreateKeyFromSymbolUsingKnownLastChild( GetKeySymbol( sub.key ), pLastChild );
+		if ( !BuildKey_R( pLastChild, sub, nNextNode ) )
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+KeyValues *CCompiledKeyValuesTreeReader::Instance()
+{
+	if ( !m_nNodes )
+	{
+		return NULL;
+	}
+
+	KeyValues *root = NULL;
+	KeyValues *tail = NULL;
+	int nNextNode = 0;
+	bool bOK = true;
+
+	for ( int i = 0; i != -1 && bOK; i = m_pNodes[ i ].nextSibling )
+	{
+		if ( i != nNextNode || i >= m_nNodes || m_pNodes[ i ].key < 0 || m_pNodes[ i ].key >= m_Strings.Count() )
+		{
+			bOK = false;
+			break;
+		}
+		++nNextNode;
+
+		KeyValues *kv = new KeyValues( m_Strings[ m_pNodes[ i ].key ] );
+		if ( !root )
+		{
+			root = kv;
+		}
+		else
+		{
+			tail->SetNextKey( kv );
+		}
+		tail = kv;
+
+		bOK = BuildKey_R( kv, m_pNodes[ i ], nNextNode );
+	}
+
+	if ( !bOK || nNextNode != m_nNodes )
+	{
+		if ( root )
+		{
+			root->deleteThis();
+		}
+		return NULL;
+	}
+
+	return root;
+}
@@ -14,6 +14,7 @@
 #include "tier1/utlbuffer.h"
 #include "tier1/utlsymbol.h"
 #include "tier1/utldict.h"
+#include "tier1/utlmap.h"
 
 class KeyValues;
 
@@ -83,6 +84,54 @@ private:
 };
 #pragma pack()
 
+//-----------------------------------------------------------------------------
+// Version 2 holds a single parsed KeyValues tree (e.g. items_game.txt) along
+// with the hash of the text it was parsed from, so it can be instanced again
+// without tokenizing the text.  Indices are 32 bits and values keep the type
+// the text parser gave them.
+//
+// File layout:
+//	KVTreeHeader_t
+//	int			stringOffsets[ numStrings ]
+//	char		stringData[ stringDataSize ]
+//	KVTreeNode_t	nodes[ numNodes ]		at nodeOffset, aligned so the array can be used in place
+//
+// Nodes are stored depth first: a node's first subkey, if any, immediately
+// follows it.  Node 0 is the root; further top level keys are its siblings.
+//-----------------------------------------------------------------------------
+#define COMPILED_KEYVALUES_TREE_VERSION		2
+#define COMPILED_KEYVALUES_SOURCE_HASH_SIZE	20		// room for a SHA1 digest of the source text
+#define COMPILED_KEYVALUES_MAC_SIZE			20		// HMAC-SHA1
+#define COMPILED_KEYVALUES_NODE_ALIGN		16
+
+struct KVTreeHeader_t
+{
+	int				fileid;
+	int				version;
+	unsigned char	sourceHash[ COMPILED_KEYVALUES_SOURCE_HASH_SIZE ];
+	unsigned int	sourceSize;
+	unsigned char	dataMAC[ COMPILED_KEYVALUES_MAC_SIZE ];	// keyed MAC of the whole file, computed with this field zeroed
+	int				numStrings;
+	int				stringDataSize;
+	int				numNodes;
+	int				nodeOffset;
+};
+
+struct KVTreeNode_t
+{
+	int			key;			// string index of the key name
+	int			dataType;		// KeyValues::types_t
+	int			firstChild;		// node index, -1 if none
+	int			nextSibling;	// node index, -1 if none
+	union
+	{
+		int		stringValue;	// string index
+		int		intValue;
+		float	floatValue;
+		uint64	uint64Value;
+	};
+};
+
 //-----------------------------------------------------------------------------
 // Purpose: stringtable is a session global string table.
 //-----------------------------------------------------------------------------
@@ -185,4 +234,65 @@ private:
 	CUtlBuffer							m_LoadBuffer;
 };
 
+//-----------------------------------------------------------------------------
+// Purpose: Flattens a parsed KeyValues tree into the version 2 format
+//-----------------------------------------------------------------------------
+class CCompiledKeyValuesTreeWriter
+{
+public:
+
+	CCompiledKeyValuesTreeWriter();
+
+	// Returns false if the tree holds values the text format can't produce (wide strings, colors, pointers)
+	bool		Compile( KeyValues *kv );
+
+	// pKey is the secret the file is signed with; only a reader holding the same key will instance it
+	void		WriteToBuffer( CUtlBuffer& buf, const unsigned char *pSourceHash, unsigned int nSourceSize, const unsigned char *pKey, int nKeySize ) const;
+	bool		WriteFile( char const *outfile, char const *pathID, const unsigned char *pSourceHash, unsigned int nSourceSize, const unsigned char *pKey, int nKeySize ) const;
+
+	int			GetNumNodes() const { return m_Nodes.Count(); }
+
+private:
+
+	int			AddString( const char *pString );
+	bool		BuildNodes_R( KeyValues *kv );
+
+	CUtlVector< KVTreeNode_t >		m_Nodes;
+	CUtlVector< int >				m_StringOffsets;
+	CUtlVector< char >				m_StringData;
+	CUtlMap< const char *, int, int >	m_StringIndex;	// only valid while compiling, the keys point into the tree
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Loads a version 2 file and instances the KeyValues tree from it.
+//  Key names are resolved to KeyValues symbols once per distinct string.
+//-----------------------------------------------------------------------------
+class CCompiledKeyValuesTreeReader
+{
+public:
+
+	CCompiledKeyValuesTreeReader();
+
+	// Fails if the file is missing, damaged, wasn't signed with pKey, or wasn't compiled from source text with the given hash and size
+	bool		LoadFile( char const *filename, char const *pathID, const unsigned char *pSourceHash, unsigned int nSourceSize, const unsigned char *pKey, int nKeySize );
+
+	// Returns a new tree, or NULL if the node data is malformed
+	KeyValues	*Instance();
+
+	int			GetNumNodes() const { return m_nNodes; }
+	int			GetNumStrings() const { return m_Strings.Count(); }
+
+private:
+
+	bool		BuildKey_R( KeyValues *kv, const KVTreeNode_t& node, int &nNextNode );
+	int			GetKeySymbol( int nString );
+
+	CUtlBuffer					m_LoadBuffer;
+	const KVTreeNode_t			*m_pNodes;
+	int							m_nNodes;
+
+	CUtlVector< const char * >	m_Strings;
+	CUtlVector< int >			m_KeySymbols;	// resolved on first use
+};
+
 #endif // KEYVALUESCOMPILER_H
@@ -220,6 +220,41 @@ public:
 #define RTE_FLAGS_FAST_TREE_GENERATION 1
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_COLORS 2				// saves memory if not needed
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS 4
+#define RTE_FLAGS_PARALLEL_TREE_BUILD 8						// build the kd tree with the threaded binned SAH builder
+#define RTE_FLAGS_VERIFY_TREE_BUILD 16						// also build with RefineNode and compare traces (with
+															// RTE_FLAGS_PARALLEL_TREE_BUILD)
+#define RTE_FLAGS_NO_WIDE_PACKETS 32						// trace ray streams 4 at a time even if the cpu has AVX
+
+#define MAX_TREE_DEPTH 21									// deeper nodes are always leaves. Trace4Rays sizes its
+															// node stack from this.
+#define MAX_NODE_STACK_LEN (40*MAX_TREE_DEPTH)
+#define MAILBOX_HASH_SIZE 256
+
+// surface area heuristic costs used by the kd tree builders. see the comment above RefineNode.
+#define COST_OF_TRAVERSAL 75								// approximate #operations
+#define COST_OF_INTERSECTION 167							// approximate #operations
+
+inline float BoxSurfaceArea(Vector const &boxmin, Vector const &boxmax)
+{
+	Vector boxdim=boxmax-boxmin;
+	return 2.0*((boxdim[0]*boxdim[2])+(boxdim[0]*boxdim[1])+(boxdim[1]*boxdim[2]));
+}
+
+struct KDTreeBuildStats_t
+{
+	float m_flBuildTime;									// seconds spent building the tree
+	float m_flSubtreeTime;									// of which building subtrees on worker threads
+	int m_nNodes;
+	int m_nLeaves;
+	int m_nTriangleRefs;									// size of TriangleIndexList
+	int m_nSubtreeTasks;									// subtrees handed to worker threads
+
+	// filled in with RTE_FLAGS_VERIFY_TREE_BUILD
+	float m_flSerialBuildTime;
+	int m_nSerialNodes;
+	int m_nVerifyRays;
+	int m_nVerifyMismatches;								// rays whose hit differs between the two trees
+};
 
 enum RayTraceLightingMode_t {
 	DIRECT_LIGHTING,										// just dot product lighting
@@ -228,13 +263,33 @@ enum RayTraceLightingMode_t {
 };
 
 
+// eight rays with the same direction signs, traced together by the AVX stream tracer
+struct EightRays
+{
+	float origin[3][8];
+	float direction[3][8];									// normalized
+	float tmax[8];
+};
+
+struct RayTracingResult8
+{
+	int32 HitIds[8];										// -1=no hit. otherwise, triangle index
+	float HitDistance[8];
+	float surface_normal[3][8];
+};
+
+
+#define RAYSTREAM_BUCKET_SIZE 32							// rays buffered per direction octant. a full
+															// bucket is sorted by origin and traced in packets
+
 class RayStream
 {
 	friend class RayTracingEnvironment;
 
-	RayTracingSingleResult *PendingStreamOutputs[8][4];
+	RayTracingSingleResult *PendingStreamOutputs[8][RAYSTREAM_BUCKET_SIZE];
 	int n_in_stream[8];
-	FourRays PendingRays[8];
+	Vector PendingOrigins[8][RAYSTREAM_BUCKET_SIZE];
+	Vector PendingDeltas[8][RAYSTREAM_BUCKET_SIZE];
 
 public:
 	RayStream(void)
@@ -267,12 +322,14 @@ public:
 	CUtlVector<LightDesc_t> LightList;						//< the list of lights
 	CUtlVector<Vector> TriangleColors;						//< color of tries
 	CUtlVector<int32> TriangleMaterials;					//< material index of tries
+	KDTreeBuildStats_t m_TreeBuildStats;					//< filled in by SetupAccelerationStructure
 
 public:
 	RayTracingEnvironment() : OptimizedTriangleList( 1024 )
 	{
 		BackgroundColor.DuplicateVector(Vector(1,0,0));		// red
 		Flags=0;
+		memset( &m_TreeBuildStats, 0, sizeof( m_TreeBuildStats ) );
 	}
 
 
@@ -330,12 +387,22 @@ public:
 					 
 	/// raytracing stream - lets you trace an array of rays by feeding them to this function.
 	/// results will not be returned until FinishStream is called. This function handles sorting
-	/// the rays by direction, tracing them 4 at a time, and de-interleaving the results.
+	/// the rays by direction and origin, tracing them 8 (with AVX) or 4 at a time, and
+	/// de-interleaving the results.
 
 	void AddToRayStream(RayStream &s,
 						Vector const &start,Vector const &end,RayTracingSingleResult *rslt_out);
 
 	inline void FlushStreamEntry(RayStream &s,int msk);
+	void TraceStreamPacket4(RayStream &s,int msk,int const *entries,int nentries);
+	void TraceStreamPacket8(RayStream &s,int msk,int const *entries,int nentries);
+
+	/// true if ray streams are traced 8 rays at a time
+	bool UseWidePackets(void) const;
+
+	/// AVX version of Trace4Rays (trace_avx.cpp) for 8 rays which all have the direction signs
+	/// given by DirectionSignMask. Only call this when UseWidePackets() is true.
+	void Trace8Rays(EightRays const &rays, int DirectionSignMask, RayTracingResult8 *rslt_out);
 
 	/// call this when you are done. handles all cleanup. After this is called, all rslt ptrs
 	/// previously passed to AddToRaySteam will have been filled in.
@@ -352,6 +419,19 @@ public:
 		
 	void RefineNode(int node_number,int32 const *tri_list,int ntris,
 						 Vector MinBound,Vector MaxBound, int depth);
+
+	// serial kd tree build with RefineNode
+	void BuildKDTreeSerial(void);
+
+	// threaded kd tree build (kdtree_build.cpp). Chooses splits by binned SAH and builds independent
+	// subtrees on worker threads, producing the same node and triangle index layout as RefineNode.
+	// Does not touch the triangles' temporary data.
+	void BuildKDTreeParallel(void);
+
+	// trace random rays through the current tree and through the given one, which must index the
+	// same triangles, and return how many rays hit something different
+	int CompareKDTrees(CUtlVector<CacheOptimizedKDNode> &other_tree,
+					   CUtlVector<int32> &other_triangle_index_list, int nrays);
 	
 	void CalculateTriangleListBounds(int32 const *tris,int ntris,
 									 Vector &minout, Vector &maxout);
@@ -143,6 +143,7 @@
 #define VPROF_BUDGETGROUP_ATTRIBUTES				_T("Attributes")
 #define VPROF_BUDGETGROUP_FINDATTRIBUTE				_T("FindAttribute")
 #define VPROF_BUDGETGROUP_FINDATTRIBUTEUNSAFE		_T("FindAttributeUnsafe")
+#define VPROF_BUDGETGROUP_CHECKTRANSMIT				_T("CheckTransmit")
 	
 #ifdef _X360
 // update flags
@@ -265,8 +265,14 @@ public:
 
 	KeyValues* CreateKey( const char *keyName );
 
+	/// Create a child key from a key name symbol that has already been resolved, given that we know which
+	/// child is currently the last child.  Used when instancing precompiled KeyValues, where each distinct
+	/// key name is resolved once instead of once per key.
+	KeyValues* CreateKeyFromSymbolUsingKnownLastChild( int keySymbol, KeyValues *pLastChild );
+
 private:
 	KeyValues( KeyValues& );	// prevent copy constructor being used
+	KeyValues( int keySymbol, KeyValues *pParent );	// construct a child key from a resolved name symbol
 
 	// prevent delete being called except through deleteThis()
 	~KeyValues();
@@ -312,6 +318,14 @@ private:
 	void FreeAllocatedValue();
 	void AllocateValueBlock(int size);
 
+	// Keys with many children get a symbol -> child hash so FindKey doesn't walk the whole list
+	friend class CKeyValuesChildIndex;
+	void BuildChildIndex();
+	void ClearChildIndex();
+	KeyValues *FindKeyInChildIndex( int keySymbol, KeyValues **ppLastChild );
+	void AddToChildIndex( KeyValues *pSubkey );
+	void OnIndexedKeyChanged();
+
 	int m_iKeyName;	// keyname is a symbol defined in KeyValuesSystem
 
 	// These are needed out of the union because the API returns string pointers
@@ -330,7 +344,7 @@ private:
 	char	   m_iDataType;
 	char	   m_bHasEscapeSequences; // true, if while parsing this KeyValue, Escape Sequences are used (default false)
 	char	   m_bEvaluateConditionals; // true, if while parsing this KeyValue, conditionals blocks are evaluated (default true)
-	char	   unused[1];
+	char	   m_nChildIndexFlags; // whether m_pValue holds this key's child index, or it is listed in its parent's (see KeyValues.cpp)
 
 	KeyValues *m_pPeer;	// pointer to next key in list
 	KeyValues *m_pSub;	// pointer to Start of a new sub key list
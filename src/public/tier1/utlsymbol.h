@@ -85,6 +85,13 @@ protected:
 //    of strings to symbols and back. The symbol class itself contains
 //    a static version of this class for creating global strings, but this
 //    class can also be instanced to create local symbol tables.
+//
+//    Symbols are handed out sequentially starting at 0 and never change for
+//    the life of the table (until RemoveAll). Lookups go through an open
+//    addressing hash table of precomputed string hashes; the string data is
+//    appended to pools which never move. Nothing a lookup touches is ever
+//    moved or freed while symbols are being added, which is what lets
+//    CUtlSymbolTableMT perform Find and String without taking a lock.
 //-----------------------------------------------------------------------------
 
 class CUtlSymbolTable
@@ -113,46 +120,30 @@ public:
 
 	int GetNumStrings( void ) const
 	{
-		return m_Lookup.Count();
+		return m_nStrings;
 	}
 
 protected:
-	class CStringPoolIndex
+	// Each slot holds the top 16 bits of the string hash and the symbol + 1 in the
+	// bottom 16 bits, so most mismatches are rejected without touching the string.
+	// A zero slot is empty.
+	struct HashTable_t
 	{
-	public:
-		inline CStringPoolIndex()
-		{
-		}
-
-		inline CStringPoolIndex( unsigned short iPool, unsigned short iOffset )
-		{
-			m_iPool = iPool;
-			m_iOffset = iOffset;
-		}
-
-		inline bool operator==( const CStringPoolIndex &other )	const
-		{
-			return m_iPool == other.m_iPool && m_iOffset == other.m_iOffset;
-		}
-
-		unsigned short m_iPool;		// Index into m_StringPools.
-		unsigned short m_iOffset;	// Index into the string pool.
+		int m_nMask;
+		uint32 m_Slots[1];
 	};
 
-	class CLess
+	struct SymbolEntry_t
 	{
-	public:
-		CLess( int ignored = 0 ) {} // permits default initialization to NULL in CUtlRBTree
-		bool operator!() const { return false; }
-		bool operator()( const CStringPoolIndex &left, const CStringPoolIndex &right ) const;
+		const char *m_pString;
+		uint32 m_nHash;
 	};
 
-	// Stores the symbol lookup
-	class CTree : public CUtlRBTree<CStringPoolIndex, unsigned short, CLess>
+	enum
 	{
-	public:
-		CTree(  int growSize, int initSize ) : CUtlRBTree<CStringPoolIndex, unsigned short, CLess>( growSize, initSize ) {}
-		friend class CUtlSymbolTable::CLess; // Needed to allow CLess to calculate pointer to symbol table
+		SYMBOL_CHUNK_BITS = 8,
+		SYMBOL_CHUNK_SIZE = ( 1 << SYMBOL_CHUNK_BITS ),
+		SYMBOL_CHUNK_COUNT = ( 0x10000 >> SYMBOL_CHUNK_BITS ),
 	};
 
 	struct StringPool_t
@@ -162,20 +153,37 @@ protected:
 		char m_Data[1];
 	};
 
-	CTree m_Lookup;
+	// The current lookup table. Replaced tables are kept around until RemoveAll
+	// because a lock-free reader may still be probing them.
+	HashTable_t * volatile m_pHashTable;
+	CUtlVector<HashTable_t*> m_RetiredHashTables;
+
+	// symbol -> string and hash, in fixed size chunks which never move
+	SymbolEntry_t **m_ppSymbolChunks;
+	int m_nStrings;
+
+	int m_nInitSize;
 	bool m_bInsensitive;
-	mutable const char* m_pUserSearchString;
 
 	// stores the string data
 	CUtlVector<StringPool_t*> m_StringPools;
 
 private:
-	int FindPoolWithSpace( int len ) const;
-	const char* StringFromIndex( const CStringPoolIndex &index ) const;
-
-	friend class CLess;
+	uint32 HashSymbolString( const char *pString ) const;
+	bool StringsMatch( const char *pString1, const char *pString2 ) const;
+	UtlSymId_t FindInTable( const HashTable_t *pTable, const char *pString, uint32 nHash ) const;
+	void InsertIntoTable( HashTable_t *pTable, UtlSymId_t id, uint32 nHash );
+	void GrowHashTable( int nMinElements );
+	const char *CopyString( const char *pString );
+
+	const SymbolEntry_t &Entry( UtlSymId_t id ) const
+	{
+		return m_ppSymbolChunks[ id >> SYMBOL_CHUNK_BITS ][ id & ( SYMBOL_CHUNK_SIZE - 1 ) ];
+	}
 };
 
+// Thread-safe symbol table. Find and String are lock-free; only AddString
+// serializes, and only when the string isn't already in the table.
 class CUtlSymbolTableMT : private CUtlSymbolTable
 {
 public:
@@ -186,34 +194,26 @@ public:
 
 	CUtlSymbol AddString( const char* pString )
 	{
-		m_lock.LockForWrite();
-		CUtlSymbol result = CUtlSymbolTable::AddString( pString );
-		m_lock.UnlockWrite();
-		return result;
+		CUtlSymbol result = CUtlSymbolTable::Find( pString );
+		if ( result.IsValid() || !pString )
+			return result;
+
+		AUTO_LOCK( m_lock );
+		return CUtlSymbolTable::AddString( pString );
 	}
 
 	CUtlSymbol Find( const char* pString ) const
 	{
-		m_lock.LockForRead();
-		CUtlSymbol result = CUtlSymbolTable::Find( pString );
-		m_lock.UnlockRead();
-		return result;
+		return CUtlSymbolTable::Find( pString );
 	}
 
 	const char* String( CUtlSymbol id ) const
 	{
-		m_lock.LockForRead();
-		const char *pszResult = CUtlSymbolTable::String( id );
-		m_lock.UnlockRead();
-		return pszResult;
+		return CUtlSymbolTable::String( id );
 	}
-	
+
 private:
-#if defined(WIN32) || defined(_WIN32)
-	mutable CThreadSpinRWLock m_lock;
-#else
-	mutable CThreadRWLock m_lock;
-#endif
+	CThreadFastMutex m_lock;
 };
 
 
@@ -844,6 +844,19 @@ public:
 		extern IScriptVM *g_pScriptVM;
 		return g_pScriptVM;
 	}
+
+	// Running script code can define functions in any scope, so code that runs scripts
+	// calls InvalidateFunctionCaches() to drop every scope's LookupCachedFunction() handles
+	static int &FunctionCacheGeneration()
+	{
+		static int s_nGeneration = 0;
+		return s_nGeneration;
+	}
+
+	static void InvalidateFunctionCaches()
+	{
+		++FunctionCacheGeneration();
+	}
 };
 
 template <class BASE_CLASS = CDefScriptScopeBase>
@@ -852,7 +865,8 @@ class CScriptScopeT : public CDefScriptScopeBase
 public:
 	CScriptScopeT() :
 		m_hScope( INVALID_HSCRIPT ),
-		m_flags( 0 )
+		m_flags( 0 ),
+		m_nCachedFunctionGeneration( 0 )
 	{
 	}
 
@@ -902,6 +916,7 @@ public:
 				}
 			}
 			m_FuncHandles.Purge();
+			ReleaseCachedFunctions();
 			if ( m_hScope && pVM && !(m_flags & EXTERNAL) )
 			{
 				pVM->ReleaseScope( m_hScope );
@@ -937,12 +952,14 @@ public:
 	ScriptStatus_t Run( HSCRIPT hScript )
 	{
 		InvalidateCachedValues();
+		InvalidateFunctionCaches();
 		return GetVM()->Run( hScript, m_hScope );
 	}
 
 	ScriptStatus_t Run( const char *pszScriptText, const char *pszScriptName = NULL )
 	{
 		InvalidateCachedValues();
+		InvalidateFunctionCaches();
 		HSCRIPT hScript = GetVM()->CompileScript( pszScriptText, pszScriptName );
 		if ( hScript )
 		{
@@ -968,6 +985,46 @@ public:
 		GetVM()->ReleaseFunction( hScript );
 	}
 
+	// Like LookupFunction(), but the scope keeps the handle until script code is run or the
+	// scope is terminated.  The caller must not release it.  Misses aren't cached, so a
+	// function defined later is still found.
+	HSCRIPT LookupCachedFunction( const char *pszFunction, bool bNoDelegation = false )
+	{
+		if ( m_nCachedFunctionGeneration != FunctionCacheGeneration() )
+		{
+			ReleaseCachedFunctions();
+			m_nCachedFunctionGeneration = FunctionCacheGeneration();
+		}
+
+		for ( int i = 0; i < m_CachedFunctions.Count(); i++ )
+		{
+			if ( m_CachedFunctions[i].bNoDelegation == bNoDelegation && V_strcmp( m_CachedFunctions[i].pszName, pszFunction ) == 0 )
+				return m_CachedFunctions[i].hFunction;
+		}
+
+		HSCRIPT hFunction = LookupFunction( pszFunction, bNoDelegation );
+		if ( !hFunction )
+			return NULL;
+
+		CachedFunction_t &entry = m_CachedFunctions[ m_CachedFunctions.AddToTail() ];
+		entry.pszName = V_strdup( pszFunction );
+		entry.bNoDelegation = bNoDelegation;
+		entry.hFunction = hFunction;
+		return hFunction;
+	}
+
+	void ReleaseCachedFunctions()
+	{
+		IScriptVM *pVM = GetVM();
+		for ( int i = 0; i < m_CachedFunctions.Count(); i++ )
+		{
+			if ( pVM && m_CachedFunctions[i].hFunction )
+				pVM->ReleaseFunction( m_CachedFunctions[i].hFunction );
+			delete[] m_CachedFunctions[i].pszName;
+		}
+		m_CachedFunctions.Purge();
+	}
+
 	bool FunctionExists( const char *pszFunction )
 	{
 		HSCRIPT hFunction = GetVM()->LookupFunction( pszFunction, m_hScope );
@@ -1266,9 +1323,18 @@ public:
 	}
 
 protected:
+	struct CachedFunction_t
+	{
+		char *pszName;
+		bool bNoDelegation;
+		HSCRIPT hFunction;		// NULL if the scope has no such function
+	};
+
 	HSCRIPT m_hScope;
 	int m_flags;
 	CUtlVectorConservative<HSCRIPT *> m_FuncHandles;
+	CUtlVectorConservative<CachedFunction_t> m_CachedFunctions;
+	int m_nCachedFunctionGeneration;
 };
 
 typedef CScriptScopeT<> CScriptScope;
@@ -0,0 +1,449 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+// $Id$
+
+// Threaded kd tree builder for RayTracingEnvironment.
+//
+// RefineNode() evaluates each candidate split plane with a full pass over the node's triangles,
+// and builds the whole tree on one thread. This builder bins the triangle extents along each axis
+// and sweeps the bins to estimate the surface area heuristic cost of every bin boundary, then
+// classifies the triangles once against the best plane. The top of the tree is built on the main
+// thread; nodes that are small enough are left as placeholders and built as independent subtrees
+// on the worker threads, each into its own node and triangle index lists. The subtrees are then
+// spliced into the tree in the order they were deferred, so the result does not depend on thread
+// timing.
+
+#include "raytrace.h"
+#include <filesystem_tools.h>
+#include <cmdlib.h>
+#include <threads.h>
+#include <vstdlib/random.h>
+
+#define KDBUILD_NUM_BINS 32
+#define KDBUILD_MIN_SUBTREE_TRIS 1024						// smaller subtrees aren't worth a work item
+#define KDBUILD_SUBTREES_PER_THREAD 8						// more work items than threads, for balance
+
+struct KDBuildTriangleBounds
+{
+	Vector mins;
+	Vector maxs;
+};
+
+struct KDBuildSubtree
+{
+	int node_number;										// placeholder node in the top of the tree
+	int depth;
+	Vector mins;
+	Vector maxs;
+	CUtlVector<int32> triangles;
+
+	// built by a worker thread. node 0 is the subtree root
+	CUtlVector<CacheOptimizedKDNode> nodes;
+	CUtlVector<int32> triangle_index_list;
+};
+
+struct KDBuildContext
+{
+	CUtlVector<KDBuildTriangleBounds> triangle_bounds;		// indexed by triangle number
+	CUtlVector<KDBuildSubtree *> subtrees;
+	CUtlVector<int> subtree_work_order;						// largest first
+	int max_subtree_tris;
+};
+
+static KDBuildContext *s_pKDBuildContext;
+
+
+static int ClassifyBoundsAgainstAxisSplit(KDBuildTriangleBounds const &bounds,
+										  int split_plane, float split_value)
+{
+	// same rules as CacheOptimizedTriangle::ClassifyAgainstAxisSplit
+	float minc=bounds.mins[split_plane];
+	float maxc=bounds.maxs[split_plane];
+	if (minc>=split_value)
+		return PLANECHECK_POSITIVE;
+	if (maxc<=split_value)
+		return PLANECHECK_NEGATIVE;
+	if (minc==maxc)
+		return PLANECHECK_POSITIVE;
+	return PLANECHECK_STRADDLING;
+}
+
+
+static float SplitCost(int split_plane, Vector const &MinBound, Vector const &MaxBound, float split_value,
+					   int nleft, int nright, int nboth)
+{
+	Vector LeftMaxes=MaxBound;
+	Vector RightMins=MinBound;
+	LeftMaxes[split_plane]=split_value;
+	RightMins[split_plane]=split_value;
+	float SA_L=BoxSurfaceArea(MinBound,LeftMaxes);
+	float SA_R=BoxSurfaceArea(RightMins,MaxBound);
+	float ISA=1.0/BoxSurfaceArea(MinBound,MaxBound);
+	return COST_OF_TRAVERSAL+COST_OF_INTERSECTION*(nboth+(SA_L*ISA*(nleft))+(SA_R*ISA*(nright)));
+}
+
+
+// estimate the cost of splitting at each bin boundary on each axis. returns the best cost, or
+// 1.0e23 if the node can't be split
+static float FindBinnedSplit(KDBuildContext const &ctx, int32 const *tri_list, int ntris,
+							 Vector const &MinBound, Vector const &MaxBound,
+							 int &split_plane, float &split_value)
+{
+	float best_cost=1.0e23;
+	split_plane=-1;
+	split_value=0;
+
+	for(int axis=0;axis<3;axis++)
+	{
+		float extent=MaxBound[axis]-MinBound[axis];
+		if (extent<=0)
+			continue;
+
+		// count triangles by the bins holding their low and high coordinates
+		int nstart[KDBUILD_NUM_BINS];
+		int nend[KDBUILD_NUM_BINS];
+		memset(nstart,0,sizeof(nstart));
+		memset(nend,0,sizeof(nend));
+
+		float scale=KDBUILD_NUM_BINS/extent;
+		for(int t=0;t<ntris;t++)
+		{
+			KDBuildTriangleBounds const &bounds=ctx.triangle_bounds[tri_list[t]];
+			int lo=(int) ((bounds.mins[axis]-MinBound[axis])*scale);
+			int hi=(int) ((bounds.maxs[axis]-MinBound[axis])*scale);
+			nstart[clamp(lo,0,KDBUILD_NUM_BINS-1)]++;
+			nend[clamp(hi,0,KDBUILD_NUM_BINS-1)]++;
+		}
+
+		// a triangle is left of boundary k if it ends in a bin below k, and right of it if it
+		// starts in bin k or above
+		int nleft=0;
+		int nright=ntris;
+		for(int k=1;k<KDBUILD_NUM_BINS;k++)
+		{
+			nleft+=nend[k-1];
+			nright-=nstart[k-1];
+			float trial_splitvalue=MinBound[axis]+(extent*k)/KDBUILD_NUM_BINS;
+			float trial_cost=SplitCost(axis,MinBound,MaxBound,trial_splitvalue,
+									   nleft,nright,ntris-nleft-nright);
+			if (trial_cost<best_cost)
+			{
+				best_cost=trial_cost;
+				split_plane=axis;
+				split_value=trial_splitvalue;
+			}
+		}
+	}
+	return best_cost;
+}
+
+
+// classify the triangles against the chosen plane, exactly as CalculateCostsOfSplit does,
+// including growing an empty side. stores the classification in labels
+static float ClassifySplit(KDBuildContext const &ctx, int split_plane, int32 const *tri_list, int ntris,
+						   Vector const &MinBound, Vector const &MaxBound, float &split_value,
+						   int &nleft, int &nright, int &nboth, int8 *labels)
+{
+	nleft=nright=nboth=0;
+	float min_coord=1.0e23,max_coord=-1.0e23;
+
+	for(int t=0;t<ntris;t++)
+	{
+		KDBuildTriangleBounds const &bounds=ctx.triangle_bounds[tri_list[t]];
+		min_coord=min(min_coord,bounds.mins[split_plane]);
+		max_coord=max(max_coord,bounds.maxs[split_plane]);
+
+		labels[t]=ClassifyBoundsAgainstAxisSplit(bounds,split_plane,split_value);
+		switch(labels[t])
+		{
+			case PLANECHECK_NEGATIVE:
+				nleft++;
+				break;
+			case PLANECHECK_POSITIVE:
+				nright++;
+				break;
+			case PLANECHECK_STRADDLING:
+				nboth++;
+				break;
+		}
+	}
+
+	// if the split resulted in one half being empty, "grow" the empty half, keeping the plane
+	// inside the node
+	if (nleft && (nboth==0) && (nright==0))
+		split_value=min(max_coord,MaxBound[split_plane]);
+	if (nright && (nboth==0) && (nleft==0))
+		split_value=max(min_coord,MinBound[split_plane]);
+
+	return SplitCost(split_plane,MinBound,MaxBound,split_value,nleft,nright,nboth);
+}
+
+
+static void MakeLeaf(CUtlVector<CacheOptimizedKDNode> &nodes, CUtlVector<int32> &triangle_index_list,
+					 int node_number, int32 const *tri_list, int ntris,
+					 Vector const &MinBound, Vector const &MaxBound)
+{
+	nodes[node_number].Children=KDNODE_STATE_LEAF+(triangle_index_list.Count()<<2);
+	nodes[node_number].SetNumberOfTrianglesInLeafNode(ntris);
+#ifdef DEBUG_RAYTRACE
+	nodes[node_number].vecMins = MinBound;
+	nodes[node_number].vecMaxs = MaxBound;
+#endif
+	if (ntris)
+		triangle_index_list.AddMultipleToTail(ntris,tri_list);
+}
+
+
+// the binned equivalent of RayTracingEnvironment::RefineNode. if defer_subtrees is set, nodes
+// small enough for a worker thread are left as placeholders and queued in ctx.subtrees
+static void RefineNodeBinned(KDBuildContext &ctx, bool defer_subtrees,
+							 CUtlVector<CacheOptimizedKDNode> &nodes, CUtlVector<int32> &triangle_index_list,
+							 int node_number, int32 const *tri_list, int ntris,
+							 Vector MinBound, Vector MaxBound, int depth)
+{
+	if ((ntris<3) || (depth>MAX_TREE_DEPTH))					// never split empty lists
+	{
+		MakeLeaf(nodes,triangle_index_list,node_number,tri_list,ntris,MinBound,MaxBound);
+		return;
+	}
+
+	if (defer_subtrees && (ntris<=ctx.max_subtree_tris))
+	{
+		KDBuildSubtree *subtree=new KDBuildSubtree;
+		subtree->node_number=node_number;
+		subtree->depth=depth;
+		subtree->mins=MinBound;
+		subtree->maxs=MaxBound;
+		subtree->triangles.CopyArray(tri_list,ntris);
+		ctx.subtrees.AddToTail(subtree);
+		return;
+	}
+
+	int split_plane;
+	float split_value;
+	float best_cost=FindBinnedSplit(ctx,tri_list,ntris,MinBound,MaxBound,split_plane,split_value);
+	if (split_plane<0)
+	{
+		MakeLeaf(nodes,triangle_index_list,node_number,tri_list,ntris,MinBound,MaxBound);
+		return;
+	}
+
+	int8 *labels=new int8[ntris];
+	int nleft,nright,nboth;
+	best_cost=ClassifySplit(ctx,split_plane,tri_list,ntris,MinBound,MaxBound,split_value,
+							nleft,nright,nboth,labels);
+
+	float cost_of_no_split=COST_OF_INTERSECTION*ntris;
+	if (cost_of_no_split<=best_cost)
+	{
+		// no benefit to splitting. just make this a leaf node
+		delete[] labels;
+		MakeLeaf(nodes,triangle_index_list,node_number,tri_list,ntris,MinBound,MaxBound);
+		return;
+	}
+
+	// partition into left, straddling, right. the left child gets left+straddling and the
+	// right child gets straddling+right
+	int32 *new_triangle_list=new int32[ntris];
+	int n_left_output=0;
+	int n_both_output=0;
+	int n_right_output=0;
+	for(int t=0;t<ntris;t++)
+	{
+		switch(labels[t])
+		{
+			case PLANECHECK_NEGATIVE:
+				new_triangle_list[n_left_output++]=tri_list[t];
+				break;
+			case PLANECHECK_POSITIVE:
+				n_right_output++;
+				new_triangle_list[ntris-n_right_output]=tri_list[t];
+				break;
+			case PLANECHECK_STRADDLING:
+				new_triangle_list[nleft+n_both_output]=tri_list[t];
+				n_both_output++;
+				break;
+		}
+	}
+	delete[] labels;
+
+	Vector LeftMaxes=MaxBound;
+	Vector RightMins=MinBound;
+	LeftMaxes[split_plane]=split_value;
+	RightMins[split_plane]=split_value;
+
+	int left_child=nodes.Count();
+	int right_child=left_child+1;
+	nodes[node_number].Children=split_plane+(left_child<<2);
+	nodes[node_number].SplittingPlaneValue=split_value;
+#ifdef DEBUG_RAYTRACE
+	nodes[node_number].vecMins = MinBound;
+	nodes[node_number].vecMaxs = MaxBound;
+#endif
+	CacheOptimizedKDNode newnode{};
+	nodes.AddToTail(newnode);
+	nodes.AddToTail(newnode);
+
+	// now, recurse!
+	if ( (ntris<20) && ((nleft==0) || (nright==0)) )
+		depth+=100;
+	RefineNodeBinned(ctx,defer_subtrees,nodes,triangle_index_list,left_child,
+					 new_triangle_list,nleft+nboth,MinBound,LeftMaxes,depth+1);
+	RefineNodeBinned(ctx,defer_subtrees,nodes,triangle_index_list,right_child,
+					 new_triangle_list+nleft,nright+nboth,RightMins,MaxBound,depth+1);
+	delete[] new_triangle_list;
+}
+
+
+static void BuildKDSubtree(int iThread, int iWorkItem)
+{
+	KDBuildContext &ctx=*s_pKDBuildContext;
+	KDBuildSubtree &subtree=*ctx.subtrees[ctx.subtree_work_order[iWorkItem]];
+
+	CacheOptimizedKDNode root{};
+	subtree.nodes.AddToTail(root);
+	RefineNodeBinned(ctx,false,subtree.nodes,subtree.triangle_index_list,0,
+					 subtree.triangles.Base(),subtree.triangles.Count(),
+					 subtree.mins,subtree.maxs,subtree.depth);
+	subtree.triangles.Purge();
+}
+
+
+static int CompareSubtreeSize(const void *a, const void *b)
+{
+	int size_a=s_pKDBuildContext->subtrees[*(int const *) a]->triangles.Count();
+	int size_b=s_pKDBuildContext->subtrees[*(int const *) b]->triangles.Count();
+	if (size_a!=size_b)
+		return (size_a>size_b) ? -1 : 1;
+	return (*(int const *) a)-(*(int const *) b);
+}
+
+
+void RayTracingEnvironment::BuildKDTreeParallel(void)
+{
+	int ntris=OptimizedTriangleList.Count();
+
+	KDBuildContext ctx;
+	ctx.triangle_bounds.SetCount(ntris);
+	int32 *root_triangle_list=new int32[ntris];
+	for(int t=0;t<ntris;t++)
+	{
+		root_triangle_list[t]=t;
+		CacheOptimizedTriangle const &tri=OptimizedTriangleList[t];
+		KDBuildTriangleBounds &bounds=ctx.triangle_bounds[t];
+		bounds.mins=tri.Vertex(0);
+		bounds.maxs=tri.Vertex(0);
+		for(int v=1;v<3;v++)
+		{
+			VectorMin(bounds.mins,tri.Vertex(v),bounds.mins);
+			VectorMax(bounds.maxs,tri.Vertex(v),bounds.maxs);
+		}
+	}
+	CalculateTriangleListBounds(root_triangle_list,ntris,m_MinBound,m_MaxBound);
+
+	if (numthreads==-1)
+		ThreadSetDefault();
+	int nthreads=max(1,numthreads);
+	ctx.max_subtree_tris=max(KDBUILD_MIN_SUBTREE_TRIS,ntris/(nthreads*KDBUILD_SUBTREES_PER_THREAD));
+
+	// top of the tree, on this thread
+	CacheOptimizedKDNode root{};
+	OptimizedKDTree.AddToTail(root);
+	RefineNodeBinned(ctx,true,OptimizedKDTree,TriangleIndexList,0,root_triangle_list,ntris,
+					 m_MinBound,m_MaxBound,0);
+	delete[] root_triangle_list;
+
+	// subtrees, largest first
+	double start=Plat_FloatTime();
+	s_pKDBuildContext=&ctx;
+	ctx.subtree_work_order.SetCount(ctx.subtrees.Count());
+	for(int i=0;i<ctx.subtrees.Count();i++)
+		ctx.subtree_work_order[i]=i;
+	qsort(ctx.subtree_work_order.Base(),ctx.subtree_work_order.Count(),sizeof(int),CompareSubtreeSize);
+	RunThreadsOnIndividual(ctx.subtrees.Count(),false,BuildKDSubtree);
+	s_pKDBuildContext=NULL;
+	m_TreeBuildStats.m_flSubtreeTime=Plat_FloatTime()-start;
+	m_TreeBuildStats.m_nSubtreeTasks=ctx.subtrees.Count();
+
+	// splice each subtree in, in the order they were deferred. the subtree root replaces its
+	// placeholder and its other nodes are appended, keeping each pair of children adjacent
+	for(int i=0;i<ctx.subtrees.Count();i++)
+	{
+		KDBuildSubtree *subtree=ctx.subtrees[i];
+		int node_base=OptimizedKDTree.Count()-1;			// local node n>=1 goes to node_base+n
+		int triangle_base=TriangleIndexList.Count();
+
+		for(int n=0;n<subtree->nodes.Count();n++)
+		{
+			CacheOptimizedKDNode node=subtree->nodes[n];
+			if (node.NodeType()==KDNODE_STATE_LEAF)
+				node.Children+=(triangle_base<<2);
+			else
+				node.Children+=(node_base<<2);
+
+			if (n==0)
+				OptimizedKDTree[subtree->node_number]=node;
+			else
+				OptimizedKDTree.AddToTail(node);
+		}
+		TriangleIndexList.AddMultipleToTail(subtree->triangle_index_list.Count(),
+											subtree->triangle_index_list.Base());
+		delete subtree;
+	}
+}
+
+
+int RayTracingEnvironment::CompareKDTrees(CUtlVector<CacheOptimizedKDNode> &other_tree,
+										  CUtlVector<int32> &other_triangle_index_list, int nrays)
+{
+	CUniformRandomStream random;
+	random.SetSeed(1);
+
+	Vector extent=m_MaxBound-m_MinBound;
+	float trace_length=extent.Length();
+	fltx4 TMax=ReplicateX4(trace_length);
+
+	int nmismatches=0;
+	for(int r=0;r<nrays;r+=4)
+	{
+		// random segments through the bounds of the world
+		FourRays rays;
+		for(int i=0;i<4;i++)
+		{
+			Vector origin(random.RandomFloat(m_MinBound.x,m_MaxBound.x),
+						  random.RandomFloat(m_MinBound.y,m_MaxBound.y),
+						  random.RandomFloat(m_MinBound.z,m_MaxBound.z));
+			Vector direction(random.RandomFloat(-1,1),random.RandomFloat(-1,1),random.RandomFloat(-1,1));
+			if (VectorNormalize(direction)==0)
+				direction.Init(0,0,1);
+			rays.origin.X(i)=origin.x;
+			rays.origin.Y(i)=origin.y;
+			rays.origin.Z(i)=origin.z;
+			rays.direction.X(i)=direction.x;
+			rays.direction.Y(i)=direction.y;
+			rays.direction.Z(i)=direction.z;
+		}
+
+		RayTracingResult result;
+		Trace4Rays(rays,Four_Zeros,TMax,&result);
+
+		OptimizedKDTree.Swap(other_tree);
+		TriangleIndexList.Swap(other_triangle_index_list);
+		RayTracingResult other_result;
+		Trace4Rays(rays,Four_Zeros,TMax,&other_result);
+		OptimizedKDTree.Swap(other_tree);
+		TriangleIndexList.Swap(other_triangle_index_list);
+
+		for(int i=0;i<4;i++)
+		{
+			if (result.HitIds[i]==other_result.HitIds[i])
+				continue;
+			// coplanar triangles can be hit in either order at the same distance
+			if ((result.HitIds[i]!=-1) && (other_result.HitIds[i]!=-1) &&
+				(fabs(SubFloat(result.HitDistance,i)-SubFloat(other_result.HitDistance,i))<=
+				 1.0e-3*max(1.0f,SubFloat(result.HitDistance,i))))
+				continue;
+			nmismatches++;
+		}
+	}
+	return nmismatches;
+}
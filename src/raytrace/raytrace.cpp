@@ -253,9 +253,6 @@ int CacheOptimizedTriangle::ClassifyAgainstAxisSplit(int split_plane, float spli
 	return PLANECHECK_STRADDLING;
 }
 
-#define MAILBOX_HASH_SIZE 256
-#define MAX_TREE_DEPTH 21
-#define MAX_NODE_STACK_LEN (40*MAX_TREE_DEPTH)
 
 struct NodeToVisit {
 	CacheOptimizedKDNode const *node;
@@ -268,12 +265,6 @@ static fltx4 FourEpsilons={1.0e-10,1.0e-10,1.0e-10,1.0e-10};
 static fltx4 FourZeros={1.0e-10,1.0e-10,1.0e-10,1.0e-10};
 static fltx4 FourNegativeEpsilons={-1.0e-10,-1.0e-10,-1.0e-10,-1.0e-10};
 
-static float BoxSurfaceArea(Vector const &boxmin, Vector const &boxmax)
-{
-	Vector boxdim=boxmax-boxmin;
-	return 2.0*((boxdim[0]*boxdim[2])+(boxdim[0]*boxdim[1])+(boxdim[1]*boxdim[2]));
-}
-
 void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 TMax,
 									   RayTracingResult *rslt_out,
 									   int32 skip_id, ITransparentTriangleCallback *pCallback)
@@ -644,9 +635,6 @@ void RayTracingEnvironment::CalculateTriangleListBounds(int32 const *tris,int nt
 // one side being devoid of triangles, the empty side is "grown" as much as possible.
 //
 
-#define COST_OF_TRAVERSAL 75								// approximate #operations
-#define COST_OF_INTERSECTION 167							// approximate #operations
-
 
 float RayTracingEnvironment::CalculateCostsOfSplit(
 	int split_plane,int32 const *tri_list,int ntris,
@@ -869,7 +857,7 @@ void RayTracingEnvironment::RefineNode(int node_number,int32 const *tri_list,int
 }
 
 
-void RayTracingEnvironment::SetupAccelerationStructure(void)
+void RayTracingEnvironment::BuildKDTreeSerial(void)
 {
 	CacheOptimizedKDNode root{};
 	OptimizedKDTree.AddToTail(root);
@@ -880,10 +868,52 @@ void RayTracingEnvironment::SetupAccelerationStructure(void)
 								m_MaxBound);
 	RefineNode(0,root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,m_MaxBound,0);
 	delete[] root_triangle_list;
+}
+
+
+void RayTracingEnvironment::SetupAccelerationStructure(void)
+{
+	memset( &m_TreeBuildStats, 0, sizeof( m_TreeBuildStats ) );
+
+	double start=Plat_FloatTime();
+	if ( Flags & RTE_FLAGS_PARALLEL_TREE_BUILD )
+		BuildKDTreeParallel();
+	else
+		BuildKDTreeSerial();
+	m_TreeBuildStats.m_flBuildTime=Plat_FloatTime()-start;
+
+	m_TreeBuildStats.m_nNodes=OptimizedKDTree.Count();
+	m_TreeBuildStats.m_nTriangleRefs=TriangleIndexList.Count();
+	for(int i=0;i<OptimizedKDTree.Count();i++)
+		if (OptimizedKDTree[i].NodeType()==KDNODE_STATE_LEAF)
+			m_TreeBuildStats.m_nLeaves++;
+
+	// build the reference tree while the triangles are still in geometry format
+	CUtlVector<CacheOptimizedKDNode> serial_tree;
+	CUtlVector<int32> serial_triangle_index_list;
+	bool verify=( Flags & RTE_FLAGS_PARALLEL_TREE_BUILD ) && ( Flags & RTE_FLAGS_VERIFY_TREE_BUILD );
+	if ( verify )
+	{
+		OptimizedKDTree.Swap( serial_tree );
+		TriangleIndexList.Swap( serial_triangle_index_list );
+		start=Plat_FloatTime();
+		BuildKDTreeSerial();
+		m_TreeBuildStats.m_flSerialBuildTime=Plat_FloatTime()-start;
+		m_TreeBuildStats.m_nSerialNodes=OptimizedKDTree.Count();
+		OptimizedKDTree.Swap( serial_tree );
+		TriangleIndexList.Swap( serial_triangle_index_list );
+	}
 
 	// now, convert all triangles to "intersection format"
 	for(int i=0;i<OptimizedTriangleList.Count();i++)
 		OptimizedTriangleList[i].ChangeIntoIntersectionFormat();
+
+	if ( verify )
+	{
+		m_TreeBuildStats.m_nVerifyRays=100000;
+		m_TreeBuildStats.m_nVerifyMismatches=
+			CompareKDTrees( serial_tree, serial_triangle_index_list, m_TreeBuildStats.m_nVerifyRays );
+	}
 }
 
 
@@ -303,19 +303,113 @@ static unsigned int GetSignMask(Vector const &v)
 }
 
 
+// spread the low 10 bits of v out to every third bit, for building morton codes
+static uint32 SpreadBits10(uint32 v)
+{
+	v&=0x3ff;
+	v=(v|(v<<16))&0x030000ff;
+	v=(v|(v<<8))&0x0300f00f;
+	v=(v|(v<<4))&0x030c30c3;
+	v=(v|(v<<2))&0x09249249;
+	return v;
+}
+
+// an 8 ray packet only pays off when its rays visit mostly the same nodes. rays which start
+// far apart relative to their length diverge quickly, and are cheaper as two 4 ray packets.
+static bool IsCoherentPacket(Vector const *origins,Vector const *deltas,int const *entries,int nentries)
+{
+	Vector mins=origins[entries[0]];
+	Vector maxs=mins;
+	float min_len_sq=deltas[entries[0]].LengthSqr();
+	for(int r=1;r<nentries;r++)
+	{
+		Vector const &start=origins[entries[r]];
+		VectorMin(mins,start,mins);
+		VectorMax(maxs,start,maxs);
+		min_len_sq=min(min_len_sq,deltas[entries[r]].LengthSqr());
+	}
+	Vector spread=maxs-mins;
+	return 16.0*spread.LengthSqr()<=min_len_sq;
+}
+
 inline void RayTracingEnvironment::FlushStreamEntry(RayStream &s,int msk)
 {
 	assert(msk>=0);
 	assert(msk<8);
-	fltx4 tmax=s.PendingRays[msk].direction.length();
+	int cnt=s.n_in_stream[msk];
+
+	// order the rays along a morton curve through the world bounds, so that each packet holds
+	// rays which start near each other and tend to visit the same nodes
+	uint32 keys[RAYSTREAM_BUCKET_SIZE];
+	int order[RAYSTREAM_BUCKET_SIZE];
+	Vector extent=m_MaxBound-m_MinBound;
+	Vector scale;
+	for(int c=0;c<3;c++)
+		scale[c]=(extent[c]>0) ? 1023.0/extent[c] : 0;
+	for(int r=0;r<cnt;r++)
+	{
+		uint32 key=0;
+		for(int c=0;c<3;c++)
+		{
+			int cell=(int) ((s.PendingOrigins[msk][r][c]-m_MinBound[c])*scale[c]);
+			key|=SpreadBits10(clamp(cell,0,1023))<<c;
+		}
+		keys[r]=key;
+
+		// insertion sort - buckets are small
+		int pos=r;
+		while((pos>0) && (keys[order[pos-1]]>key))
+		{
+			order[pos]=order[pos-1];
+			pos--;
+		}
+		order[pos]=r;
+	}
+
+	bool wide=UseWidePackets();
+	for(int first=0;first<cnt;)
+	{
+		int n=min(8,cnt-first);
+		if (wide && (n>4) && IsCoherentPacket(s.PendingOrigins[msk],s.PendingDeltas[msk],order+first,n))
+		{
+			TraceStreamPacket8(s,msk,order+first,n);
+			first+=n;
+		}
+		else
+		{
+			n=min(4,n);
+			TraceStreamPacket4(s,msk,order+first,n);
+			first+=n;
+		}
+	}
+	s.n_in_stream[msk]=0;
+}
+
+void RayTracingEnvironment::TraceStreamPacket4(RayStream &s,int msk,int const *entries,int nentries)
+{
+	// fill in unused rays with dups of the first
+	FourRays rays;
+	for(int r=0;r<4;r++)
+	{
+		int e=entries[(r<nentries) ? r : 0];
+		Vector const &start=s.PendingOrigins[msk][e];
+		Vector const &delta=s.PendingDeltas[msk][e];
+		rays.origin.X(r)=start.x;
+		rays.origin.Y(r)=start.y;
+		rays.origin.Z(r)=start.z;
+		rays.direction.X(r)=delta.x;
+		rays.direction.Y(r)=delta.y;
+		rays.direction.Z(r)=delta.z;
+	}
+	fltx4 tmax=rays.direction.length();
 	fltx4 scl=ReciprocalSaturateSIMD(tmax);
-	s.PendingRays[msk].direction*=scl;					// normalize
+	rays.direction*=scl;									// normalize
 	RayTracingResult tmpresult;
-	Trace4Rays(s.PendingRays[msk],Four_Zeros,tmax,msk,&tmpresult);
+	Trace4Rays(rays,Four_Zeros,tmax,msk,&tmpresult);
 	// now, write out results
-	for(int r=0;r<4;r++)
+	for(int r=0;r<nentries;r++)
 	{
-		RayTracingSingleResult *out=s.PendingStreamOutputs[msk][r];
+		RayTracingSingleResult *out=s.PendingStreamOutputs[msk][entries[r]];
 		out->ray_length=SubFloat( tmax, r );
 		out->surface_normal.x=tmpresult.surface_normal.X(r);
 		out->surface_normal.y=tmpresult.surface_normal.Y(r);
@@ -323,7 +417,50 @@ inline void RayTracingEnvironment::FlushStreamEntry(RayStream &s,int msk)
 		out->HitID=tmpresult.HitIds[r];
 		out->HitDistance=SubFloat( tmpresult.HitDistance, r );
 	}
-	s.n_in_stream[msk]=0;
+}
+
+void RayTracingEnvironment::TraceStreamPacket8(RayStream &s,int msk,int const *entries,int nentries)
+{
+	EightRays rays;
+	for(int h=0;h<8;h+=4)
+	{
+		// normalize four at a time exactly like TraceStreamPacket4, so a ray gets the same
+		// direction and length whichever packet width traces it
+		FourVectors dirs;
+		for(int r=0;r<4;r++)
+		{
+			int e=entries[(h+r<nentries) ? h+r : 0];
+			Vector const &start=s.PendingOrigins[msk][e];
+			Vector const &delta=s.PendingDeltas[msk][e];
+			for(int c=0;c<3;c++)
+				rays.origin[c][h+r]=start[c];
+			dirs.X(r)=delta.x;
+			dirs.Y(r)=delta.y;
+			dirs.Z(r)=delta.z;
+		}
+		fltx4 tmax=dirs.length();
+		fltx4 scl=ReciprocalSaturateSIMD(tmax);
+		dirs*=scl;
+		for(int r=0;r<4;r++)
+		{
+			rays.direction[0][h+r]=dirs.X(r);
+			rays.direction[1][h+r]=dirs.Y(r);
+			rays.direction[2][h+r]=dirs.Z(r);
+			rays.tmax[h+r]=SubFloat( tmax, r );
+		}
+	}
+	RayTracingResult8 tmpresult;
+	Trace8Rays(rays,msk,&tmpresult);
+	for(int r=0;r<nentries;r++)
+	{
+		RayTracingSingleResult *out=s.PendingStreamOutputs[msk][entries[r]];
+		out->ray_length=rays.tmax[r];
+		out->surface_normal.x=tmpresult.surface_normal[0][r];
+		out->surface_normal.y=tmpresult.surface_normal[1][r];
+		out->surface_normal.z=tmpresult.surface_normal[2][r];
+		out->HitID=tmpresult.HitIds[r];
+		out->HitDistance=tmpresult.HitDistance[r];
+	}
 }
 
 void RayTracingEnvironment::AddToRayStream(RayStream &s,
@@ -336,41 +473,20 @@ void RayTracingEnvironment::AddToRayStream(RayStream &s,
 	assert(msk>=0);
 	assert(msk<8);
 	int pos=s.n_in_stream[msk];
-	assert(pos<4);
-	s.PendingRays[msk].origin.X(pos)=start.x;
-	s.PendingRays[msk].origin.Y(pos)=start.y;
-	s.PendingRays[msk].origin.Z(pos)=start.z;
-	s.PendingRays[msk].direction.X(pos)=delta.x;
-	s.PendingRays[msk].direction.Y(pos)=delta.y;
-	s.PendingRays[msk].direction.Z(pos)=delta.z;
+	assert(pos<RAYSTREAM_BUCKET_SIZE);
+	s.PendingOrigins[msk][pos]=start;
+	s.PendingDeltas[msk][pos]=delta;
 	s.PendingStreamOutputs[msk][pos]=rslt_out;
-	if (pos==3)
-	{
+	s.n_in_stream[msk]++;
+	if (pos==RAYSTREAM_BUCKET_SIZE-1)
 		FlushStreamEntry(s,msk);
-	}
-	else
-		s.n_in_stream[msk]++;
 }
 
 void RayTracingEnvironment::FinishRayStream(RayStream &s)
 {
 	for(int msk=0;msk<8;msk++)
 	{
-		int cnt=s.n_in_stream[msk];
-		if (cnt)
-		{
-			// fill in unfilled entries with dups of first
-			for(int c=cnt;c<4;c++)
-			{
-				s.PendingRays[msk].origin.X(c) = s.PendingRays[msk].origin.X(0);
-				s.PendingRays[msk].origin.Y(c) = s.PendingRays[msk].origin.Y(0);
-				s.PendingRays[msk].origin.Z(c) = s.PendingRays[msk].origin.Z(0);
-				s.PendingRays[msk].direction.X(c) = s.PendingRays[msk].direction.X(0);
-				s.PendingRays[msk].direction.Y(c) = s.PendingRays[msk].direction.Y(0);
-				s.PendingRays[msk].direction.Z(c) = s.PendingRays[msk].direction.Z(0);
-				s.PendingStreamOutputs[msk][c]=s.PendingStreamOutputs[msk][0];
-			}
+		if (s.n_in_stream[msk])
 			FlushStreamEntry(s,msk);
-		}
 	}
 }
@@ -0,0 +1,264 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+// $Id$
+
+// 8-wide AVX kd tree traversal for ray streams.
+//
+// Trace8Rays is Trace4Rays with __m256 in place of fltx4: the same traversal order, the same
+// epsilons and the same triangle test, so a ray gets the same result whichever path traces it.
+// It has no skip id or transparency callback, since ray streams use neither. AVX is only needed
+// for this file; the compiler flags for the rest of the library are unchanged, and the path is
+// only taken when the cpu reports AVX support.
+
+#include "raytrace.h"
+
+#if !defined( _X360 ) && !defined( _PS3 )
+#define RAYTRACE_HAVE_AVX 1
+#include <immintrin.h>
+#endif
+
+#if defined( __GNUC__ )
+#define RAYTRACE_AVX_TARGET __attribute__((target("avx")))
+#else
+#define RAYTRACE_AVX_TARGET
+#endif
+
+
+#ifdef RAYTRACE_HAVE_AVX
+static bool CPUSupportsAVX(void)
+{
+	static int s_nSupportsAVX=-1;
+	if (s_nSupportsAVX==-1)
+		s_nSupportsAVX=GetCPUInformation()->m_bAVX ? 1 : 0;
+	return s_nSupportsAVX!=0;
+}
+#endif
+
+
+bool RayTracingEnvironment::UseWidePackets(void) const
+{
+#ifdef RAYTRACE_HAVE_AVX
+	return ( ! ( Flags & RTE_FLAGS_NO_WIDE_PACKETS ) ) && CPUSupportsAVX();
+#else
+	return false;
+#endif
+}
+
+
+#ifdef RAYTRACE_HAVE_AVX
+
+// ReciprocalSIMD for eight floats: the same reciprocal estimate and newton iteration, so the
+// 4-wide and 8-wide paths compute the same 1/x
+static RAYTRACE_AVX_TARGET FORCEINLINE __m256 Reciprocal8(__m256 a)
+{
+	__m256 est=_mm256_rcp_ps(a);
+	return _mm256_sub_ps(_mm256_add_ps(est,est),_mm256_mul_ps(a,_mm256_mul_ps(est,est)));
+}
+
+struct NodeToVisit8 {
+	CacheOptimizedKDNode const *node;
+	__m256 TMin;
+	__m256 TMax;
+};
+
+RAYTRACE_AVX_TARGET void RayTracingEnvironment::Trace8Rays(EightRays const &rays, int DirectionSignMask,
+														   RayTracingResult8 *rslt_out)
+{
+	// same constants as FourEpsilons, FourNegativeEpsilons and FourZeros in raytrace.cpp
+	__m256 const epsilons=_mm256_set1_ps(1.0e-10f);
+	__m256 const negative_epsilons=_mm256_set1_ps(-1.0e-10f);
+	__m256 const near_zeros=_mm256_set1_ps(1.0e-10f);
+	__m256 const ones=_mm256_set1_ps(1.0f);
+	__m256 const zeros=_mm256_setzero_ps();
+
+	__m256 origin[3],direction[3],OneOverRayDir[3];
+	for(int c=0;c<3;c++)
+	{
+		origin[c]=_mm256_loadu_ps(rays.origin[c]);
+		direction[c]=_mm256_loadu_ps(rays.direction[c]);
+		// ReciprocalSaturateSIMD - convert zeros to epsilons, keeping the sign of -0
+		__m256 zero_mask=_mm256_cmp_ps(direction[c],zeros,_CMP_EQ_OQ);
+		__m256 safe=_mm256_or_ps(direction[c],_mm256_and_ps(_mm256_set1_ps(FLT_EPSILON),zero_mask));
+		OneOverRayDir[c]=Reciprocal8(safe);
+	}
+
+	__m256 hit_ids=_mm256_castsi256_ps(_mm256_set1_epi32(-1));
+	__m256 hit_distance=_mm256_set1_ps(1.0e23f);
+	__m256 surface_normal[3]={zeros,zeros,zeros};
+
+	__m256 TMin=zeros;
+	__m256 TMax=_mm256_loadu_ps(rays.tmax);
+
+	// now, clip rays against bounding box
+	for(int c=0;c<3;c++)
+	{
+		__m256 isect_min_t=_mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(m_MinBound[c]),origin[c]),OneOverRayDir[c]);
+		__m256 isect_max_t=_mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(m_MaxBound[c]),origin[c]),OneOverRayDir[c]);
+		TMin=_mm256_max_ps(TMin,_mm256_min_ps(isect_min_t,isect_max_t));
+		TMax=_mm256_min_ps(TMax,_mm256_max_ps(isect_min_t,isect_max_t));
+	}
+	__m256 active=_mm256_cmp_ps(TMin,TMax,_CMP_LE_OS);		// mask of which rays are active
+
+	if (_mm256_movemask_ps(active))
+	{
+		int32 mailboxids[MAILBOX_HASH_SIZE];					// used to avoid redundant triangle tests
+		memset(mailboxids,0xff,sizeof(mailboxids));
+
+		int front_idx[3],back_idx[3];							// based on ray direction, whether to
+																// visit left or right node first
+		for(int c=0;c<3;c++)
+		{
+			back_idx[c]=(DirectionSignMask & (1<<c)) ? 0 : 1;
+			front_idx[c]=1-back_idx[c];
+		}
+
+		NodeToVisit8 NodeQueue[MAX_NODE_STACK_LEN];
+		CacheOptimizedKDNode const *CurNode=&(OptimizedKDTree[0]);
+		NodeToVisit8 *stack_ptr=&NodeQueue[MAX_NODE_STACK_LEN];
+		while(1)
+		{
+			while (CurNode->NodeType() != KDNODE_STATE_LEAF)		// traverse until next leaf
+			{
+				int split_plane_number=CurNode->NodeType();
+				CacheOptimizedKDNode const *FrontChild=&(OptimizedKDTree[CurNode->LeftChild()]);
+
+				__m256 dist_to_sep_plane=							// dist=(split-org)/dir
+					_mm256_mul_ps(
+						_mm256_sub_ps(_mm256_set1_ps(CurNode->SplittingPlaneValue),
+									  origin[split_plane_number]),OneOverRayDir[split_plane_number]);
+				active=_mm256_cmp_ps(TMin,TMax,_CMP_LE_OS);
+
+				__m256 hits_front=_mm256_and_ps(active,_mm256_cmp_ps(dist_to_sep_plane,TMin,_CMP_GE_OS));
+				if (! _mm256_movemask_ps(hits_front))
+				{
+					// missed the front. only traverse back
+					CurNode=FrontChild+back_idx[split_plane_number];
+					TMin=_mm256_max_ps(TMin,dist_to_sep_plane);
+				}
+				else
+				{
+					__m256 hits_back=_mm256_and_ps(active,_mm256_cmp_ps(dist_to_sep_plane,TMax,_CMP_LE_OS));
+					if (! _mm256_movemask_ps(hits_back))
+					{
+						// missed the back - only need to traverse front node
+						CurNode=FrontChild+front_idx[split_plane_number];
+						TMax=_mm256_min_ps(TMax,dist_to_sep_plane);
+					}
+					else
+					{
+						// at least some rays hit both nodes.
+						// must push far, traverse near
+						assert(stack_ptr>NodeQueue);
+						--stack_ptr;
+						stack_ptr->node=FrontChild+back_idx[split_plane_number];
+						stack_ptr->TMin=_mm256_max_ps(TMin,dist_to_sep_plane);
+						stack_ptr->TMax=TMax;
+						CurNode=FrontChild+front_idx[split_plane_number];
+						TMax=_mm256_min_ps(TMax,dist_to_sep_plane);
+					}
+				}
+			}
+			// hit a leaf! must do intersection check
+			int ntris=CurNode->NumberOfTrianglesInLeaf();
+			if (ntris)
+			{
+				int32 const *tlist=&(TriangleIndexList[CurNode->TriangleIndexStart()]);
+				do
+				{
+					int tnum=*(tlist++);
+					// check mailbox
+					int mbox_slot=tnum & (MAILBOX_HASH_SIZE-1);
+					if ( mailboxids[mbox_slot] == tnum )
+						continue;
+					mailboxids[mbox_slot] = tnum;
+
+					TriIntersectData_t const *tri = &( OptimizedTriangleList[tnum].m_Data.m_IntersectData );
+
+					// compute plane intersection
+					__m256 Nx=_mm256_set1_ps( tri->m_flNx );
+					__m256 Ny=_mm256_set1_ps( tri->m_flNy );
+					__m256 Nz=_mm256_set1_ps( tri->m_flNz );
+
+					__m256 DDotN=_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(direction[0],Nx),
+															 _mm256_mul_ps(direction[1],Ny)),
+											   _mm256_mul_ps(direction[2],Nz));
+					// mask off zero or near zero (ray parallel to surface)
+					__m256 did_hit=_mm256_or_ps(_mm256_cmp_ps(DDotN,epsilons,_CMP_GT_OS),
+												_mm256_cmp_ps(DDotN,negative_epsilons,_CMP_LT_OS));
+
+					__m256 ODotN=_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(origin[0],Nx),
+															 _mm256_mul_ps(origin[1],Ny)),
+											   _mm256_mul_ps(origin[2],Nz));
+					__m256 numerator=_mm256_sub_ps(_mm256_set1_ps( tri->m_flD ),ODotN);
+
+					__m256 isect_t=_mm256_mul_ps(Reciprocal8(DDotN),numerator);	// DivSIMD
+					// now, we have the distance to the plane. lets update our mask
+					did_hit=_mm256_and_ps(did_hit,_mm256_cmp_ps(isect_t,near_zeros,_CMP_GT_OS));
+					did_hit=_mm256_and_ps(did_hit,_mm256_cmp_ps(isect_t,hit_distance,_CMP_LT_OS));
+
+					if (! _mm256_movemask_ps(did_hit))
+						continue;
+
+					// now, check 3 edges
+					__m256 hitc1=_mm256_add_ps(origin[tri->m_nCoordSelect0],
+											   _mm256_mul_ps(isect_t,direction[tri->m_nCoordSelect0]));
+					__m256 hitc2=_mm256_add_ps(origin[tri->m_nCoordSelect1],
+											   _mm256_mul_ps(isect_t,direction[tri->m_nCoordSelect1]));
+
+					// do barycentric coordinate check
+					__m256 B0=_mm256_mul_ps(_mm256_set1_ps( tri->m_ProjectedEdgeEquations[0] ),hitc1);
+					B0=_mm256_add_ps(B0,_mm256_mul_ps(_mm256_set1_ps( tri->m_ProjectedEdgeEquations[1] ),hitc2));
+					B0=_mm256_add_ps(B0,_mm256_set1_ps( tri->m_ProjectedEdgeEquations[2] ));
+
+					did_hit=_mm256_and_ps(did_hit,_mm256_cmp_ps(B0,near_zeros,_CMP_GE_OS));
+
+					__m256 B1=_mm256_mul_ps(_mm256_set1_ps( tri->m_ProjectedEdgeEquations[3] ),hitc1);
+					B1=_mm256_add_ps(B1,_mm256_mul_ps(_mm256_set1_ps( tri->m_ProjectedEdgeEquations[4] ),hitc2));
+					B1=_mm256_add_ps(B1,_mm256_set1_ps( tri->m_ProjectedEdgeEquations[5] ));
+
+					did_hit=_mm256_and_ps(did_hit,_mm256_cmp_ps(B1,near_zeros,_CMP_GE_OS));
+
+					__m256 B2=_mm256_add_ps(B1,B0);
+					did_hit=_mm256_and_ps(did_hit,_mm256_cmp_ps(B2,ones,_CMP_LE_OS));
+
+					if (! _mm256_movemask_ps(did_hit))
+						continue;
+
+					// now, set the hit_id and closest_hit fields for any enabled rays
+					hit_ids=_mm256_blendv_ps(hit_ids,_mm256_castsi256_ps(_mm256_set1_epi32(tnum)),did_hit);
+					hit_distance=_mm256_blendv_ps(hit_distance,isect_t,did_hit);
+					surface_normal[0]=_mm256_blendv_ps(surface_normal[0],Nx,did_hit);
+					surface_normal[1]=_mm256_blendv_ps(surface_normal[1],Ny,did_hit);
+					surface_normal[2]=_mm256_blendv_ps(surface_normal[2],Nz,did_hit);
+				} while (--ntris);
+				// now, check if all rays have terminated
+				__m256 raydone=_mm256_cmp_ps(TMax,hit_distance,_CMP_LE_OS);
+				if (! _mm256_movemask_ps(raydone))
+					break;
+			}
+
+			if (stack_ptr==&NodeQueue[MAX_NODE_STACK_LEN])
+				break;
+
+			// pop stack!
+			CurNode=stack_ptr->node;
+			TMin=stack_ptr->TMin;
+			TMax=stack_ptr->TMax;
+			stack_ptr++;
+		}
+	}
+
+	_mm256_storeu_ps((float *) rslt_out->HitIds,hit_ids);
+	_mm256_storeu_ps(rslt_out->HitDistance,hit_distance);
+	for(int c=0;c<3;c++)
+		_mm256_storeu_ps(rslt_out->surface_normal[c],surface_normal[c]);
+}
+
+#else
+
+void RayTracingEnvironment::Trace8Rays(EightRays const &rays, int DirectionSignMask,
+									   RayTracingResult8 *rslt_out)
+{
+	Assert( 0 );											// UseWidePackets() is always false here
+}
+
+#endif
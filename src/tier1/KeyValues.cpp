@@ -318,6 +318,311 @@ private:
 };
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Symbol -> child hash for keys with many children.  Schema files have
+//	keys with thousands of children that are looked up one by one, and walking
+//	the sibling list for each lookup makes that quadratic.
+//
+//	The layout of KeyValues is shared with other modules, so the index is kept
+//	in the value union, which a key with children (TYPE_NONE) doesn't use, and
+//	a flag says it is there.  It is freed with the key, whichever module's
+//	tier1 does that.  Children added or removed through KeyValues keep the index
+//	up to date; renaming or relinking a listed child directly invalidates every
+//	index, and each one is rebuilt the next time it is used.
+//
+//	Lookups don't lock.  Building or rebuilding an index takes a mutex, and a
+//	rebuilt index keeps the one it replaced until the key's index is dropped,
+//	since other threads may still be looking things up in it.
+//-----------------------------------------------------------------------------
+#define KEYVALUES_CHILD_INDEX_MIN_CHILDREN	32		// build an index once a lookup walks this many children
+
+enum
+{
+	KEYVALUES_HAS_CHILD_INDEX	= 0x01,		// m_pValue points at this key's child index
+	KEYVALUES_IN_CHILD_INDEX	= 0x02,		// this key is listed in its parent's index
+};
+
+static CThreadFastMutex s_ChildIndexBuildMutex;
+static CInterlockedInt s_nChildIndexGeneration;
+
+class CKeyValuesChildIndex
+{
+public:
+	CKeyValuesChildIndex() : m_pLastChild( NULL ), m_pRetired( NULL ), m_pGeneration( NULL ), m_nGeneration( 0 ), m_nCount( 0 ) {}
+	~CKeyValuesChildIndex() { delete m_pRetired; }
+
+	static CKeyValuesChildIndex *Get( const KeyValues *pKey );
+
+	void Build( KeyValues *pParent );
+	KeyValues *Find( int keySymbol ) const;
+	void Add( KeyValues *pChild );
+
+	// Built against this module's generation count since the last listed child changed
+	bool IsCurrent() const { return m_pGeneration == &s_nChildIndexGeneration && m_nGeneration == s_nChildIndexGeneration; }
+
+	KeyValues *m_pLastChild;
+	CKeyValuesChildIndex *m_pRetired;		// the index this one replaced
+
+private:
+	struct Entry_t
+	{
+		int keySymbol;
+		KeyValues *pChild;
+	};
+
+	static unsigned int HashSymbol( int keySymbol )
+	{
+		unsigned int h = (unsigned int)keySymbol;
+		h ^= h >> 16;
+		h *= 0x7feb352d;
+		h ^= h >> 15;
+		h *= 0x846ca68b;
+		h ^= h >> 16;
+		return h;
+	}
+
+	void Insert( KeyValues *pChild );
+	void Resize( int nSlots );
+
+	CUtlVector< Entry_t > m_Slots;		// open addressing, power of two size, at most half full
+	const CInterlockedInt *m_pGeneration;	// each module's tier1 has its own count
+	int m_nGeneration;
+	int m_nCount;
+};
+
+CKeyValuesChildIndex *CKeyValuesChildIndex::Get( const KeyValues *pKey )
+{
+	// a module without the index may have given the key a value since
+	if ( !( pKey->m_nChildIndexFlags & KEYVALUES_HAS_CHILD_INDEX ) || pKey->m_iDataType != KeyValues::TYPE_NONE )
+		return NULL;
+
+	ThreadMemoryBarrier();
+	return (CKeyValuesChildIndex *)pKey->m_pValue;
+}
+
+void CKeyValuesChildIndex::Resize( int nSlots )
+{
+	CUtlVector< Entry_t > oldSlots;
+	oldSlots.Swap( m_Slots );
+
+	m_Slots.SetCount( nSlots );
+	for ( int i = 0; i < nSlots; ++i )
+	{
+		m_Slots[i].keySymbol = INVALID_KEY_SYMBOL;
+		m_Slots[i].pChild = NULL;
+	}
+
+	m_nCount = 0;
+	for ( int i = 0; i < oldSlots.Count(); ++i )
+	{
+		if ( oldSlots[i].pChild )
+		{
+			Insert( oldSlots[i].pChild );
+		}
+	}
+}
+
+void CKeyValuesChildIndex::Insert( KeyValues *pChild )
+{
+	int nMask = m_Slots.Count() - 1;
+	for ( int i = HashSymbol( pChild->m_iKeyName ) & nMask; ; i = ( i + 1 ) & nMask )
+	{
+		Entry_t &entry = m_Slots[i];
+		if ( !entry.pChild )
+		{
+			entry.keySymbol = pChild->m_iKeyName;
+			entry.pChild = pChild;
+			++m_nCount;
+			return;
+		}
+
+		// FindKey returns the first child with a given name
+		if ( entry.keySymbol == pChild->m_iKeyName )
+			return;
+	}
+}
+
+void CKeyValuesChildIndex::Build( KeyValues *pParent )
+{
+	int nChildren = 0;
+	for ( KeyValues *dat = pParent->m_pSub; dat != NULL; dat = dat->m_pPeer )
+	{
+		++nChildren;
+	}
+
+	int nSlots = 16;
+	while ( nSlots < nChildren * 2 )
+	{
+		nSlots *= 2;
+	}
+
+	m_Slots.Purge();
+	Resize( nSlots );
+
+	m_pLastChild = NULL;
+	for ( KeyValues *dat = pParent->m_pSub; dat != NULL; dat = dat->m_pPeer )
+	{
+		dat->m_nChildIndexFlags |= KEYVALUES_IN_CHILD_INDEX;
+		Insert( dat );
+		m_pLastChild = dat;
+	}
+
+	m_pGeneration = &s_nChildIndexGeneration;
+	m_nGeneration = s_nChildIndexGeneration;
+}
+
+void CKeyValuesChildIndex::Add( KeyValues *pChild )
+{
+	if ( ( m_nCount + 1 ) * 2 > m_Slots.Count() )
+	{
+		Resize( m_Slots.Count() * 2 );
+	}
+
+	pChild->m_nChildIndexFlags |= KEYVALUES_IN_CHILD_INDEX;
+	Insert( pChild );
+	m_pLastChild = pChild;
+}
+
+KeyValues *CKeyValuesChildIndex::Find( int keySymbol ) const
+{
+	int nMask = m_Slots.Count() - 1;
+	for ( int i = HashSymbol( keySymbol ) & nMask; ; i = ( i + 1 ) & nMask )
+	{
+		const Entry_t &entry = m_Slots[i];
+		if ( !entry.pChild )
+			return NULL;
+
+		if ( entry.keySymbol == keySymbol )
+			return entry.pChild;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Index this key's children
+//-----------------------------------------------------------------------------
+void KeyValues::BuildChildIndex()
+{
+	// the index lives where a key with a value keeps it
+	if ( m_iDataType != TYPE_NONE )
+		return;
+
+	AUTO_LOCK( s_ChildIndexBuildMutex );
+
+	if ( m_nChildIndexFlags & KEYVALUES_HAS_CHILD_INDEX )
+		return;
+
+	CKeyValuesChildIndex *pIndex = new CKeyValuesChildIndex;
+	pIndex->Build( this );
+
+	// publish the index before the flag that says it's there
+	m_pValue = pIndex;
+	ThreadMemoryBarrier();
+	m_nChildIndexFlags |= KEYVALUES_HAS_CHILD_INDEX;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Drop this key's child index, if it has one
+//-----------------------------------------------------------------------------
+void KeyValues::ClearChildIndex()
+{
+	if ( !( m_nChildIndexFlags & KEYVALUES_HAS_CHILD_INDEX ) )
+		return;
+
+	delete CKeyValuesChildIndex::Get( this );
+	if ( m_iDataType == TYPE_NONE )
+	{
+		m_pValue = NULL;
+	}
+
+	for ( KeyValues *dat = m_pSub; dat != NULL; dat = dat->m_pPeer )
+	{
+		dat->m_nChildIndexFlags &= ~KEYVALUES_IN_CHILD_INDEX;
+	}
+
+	m_nChildIndexFlags &= ~KEYVALUES_HAS_CHILD_INDEX;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Look up a child through the index.  Also returns the last child, 
+//	for callers that append.
+//-----------------------------------------------------------------------------
+KeyValues *KeyValues::FindKeyInChildIndex( int keySymbol, KeyValues **ppLastChild )
+{
+	CKeyValuesChildIndex *pIndex = CKeyValuesChildIndex::Get( this );
+	if ( !pIndex )
+	{
+		// no index after all, walk the list
+		KeyValues *dat;
+		KeyValues *lastItem = NULL;
+		for ( dat = m_pSub; dat != NULL; dat = dat->m_pPeer )
+		{
+			lastItem = dat;
+			if ( dat->m_iKeyName == keySymbol )
+				break;
+		}
+
+		if ( ppLastChild )
+		{
+			*ppLastChild = lastItem;
+		}
+		return dat;
+	}
+
+	if ( !pIndex->IsCurrent() )
+	{
+		AUTO_LOCK( s_ChildIndexBuildMutex );
+
+		pIndex = CKeyValuesChildIndex::Get( this );
+		if ( !pIndex->IsCurrent() )
+		{
+			// other threads may still be in the old index, it goes when this key's index is dropped
+			CKeyValuesChildIndex *pRebuilt = new CKeyValuesChildIndex;
+			pRebuilt->Build( this );
+			pRebuilt->m_pRetired = pIndex;
+
+			ThreadMemoryBarrier();
+			m_pValue = pRebuilt;
+			pIndex = pRebuilt;
+		}
+	}
+
+	KeyValues *dat = pIndex->Find( keySymbol );
+	Assert( !dat || dat->m_iKeyName == keySymbol );
+
+	if ( ppLastChild )
+	{
+		*ppLastChild = pIndex->m_pLastChild;
+	}
+	return dat;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: List a child that was just appended
+//-----------------------------------------------------------------------------
+void KeyValues::AddToChildIndex( KeyValues *pSubkey )
+{
+	CKeyValuesChildIndex *pIndex = CKeyValuesChildIndex::Get( this );
+	if ( pIndex && pIndex->IsCurrent() )
+	{
+		pIndex->Add( pSubkey );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: A key listed in its parent's index is being renamed or relinked
+//	without going through the parent.  The key doesn't know its parent, so
+//	every index is rebuilt the next time it is used.
+//-----------------------------------------------------------------------------
+void KeyValues::OnIndexedKeyChanged()
+{
+	if ( m_nChildIndexFlags & KEYVALUES_IN_CHILD_INDEX )
+	{
+		++s_nChildIndexGeneration;
+		m_nChildIndexFlags &= ~KEYVALUES_IN_CHILD_INDEX;
+	}
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Sets whether the KeyValues system should use an arbitrarily growable
 //	string table. See the comment in the header for more info.
@@ -381,6 +686,20 @@ KeyValues::KeyValues( const char *setName )
 	SetName ( setName );
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Constructor for a child key whose name symbol is already known
+//-----------------------------------------------------------------------------
+KeyValues::KeyValues( int keySymbol, KeyValues *pParent )
+{
+	TRACK_KV_ADD( this, s_pfGetStringForSymbol( keySymbol ) );
+
+	Init();
+	m_iKeyName = keySymbol;
+
+	m_bHasEscapeSequences = pParent->m_bHasEscapeSequences; // use same format as parent does
+	m_bEvaluateConditionals = pParent->m_bEvaluateConditionals;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Constructor
 //-----------------------------------------------------------------------------
@@ -462,8 +781,7 @@ void KeyValues::Init()
 	m_bHasEscapeSequences = false;
 	m_bEvaluateConditionals = true;
 
-	// for future proof
-	memset( unused, 0, sizeof(unused) );
+	m_nChildIndexFlags = 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -473,6 +791,9 @@ KeyValues::~KeyValues()
 {
 	TRACK_KV_REMOVE( this );
 
+	// deleted while still listed in its parent's index
+	OnIndexedKeyChanged();
+
 	RemoveEverything();
 }
 
@@ -481,6 +802,8 @@ KeyValues::~KeyValues()
 //-----------------------------------------------------------------------------
 void KeyValues::RemoveEverything()
 {
+	ClearChildIndex();
+
 	KeyValues *dat;
 	KeyValues *datNext = NULL;
 	for ( dat = m_pSub; dat != NULL; dat = datNext )
@@ -967,10 +1290,21 @@ void KeyValues::SaveKeyToFile( KeyValues *dat, IBaseFileSystem *filesystem, File
 //-----------------------------------------------------------------------------
 KeyValues *KeyValues::FindKey(int keySymbol) const
 {
+	if ( m_nChildIndexFlags & KEYVALUES_HAS_CHILD_INDEX )
+		return const_cast< KeyValues * >( this )->FindKeyInChildIndex( keySymbol, NULL );
+
+	int nVisited = 0;
 	for (KeyValues *dat = m_pSub; dat != NULL; dat = dat->m_pPeer)
 	{
 		if (dat->m_iKeyName == keySymbol)
 			return dat;
+
+		// enough children to be worth indexing
+		if ( ++nVisited == KEYVALUES_CHILD_INDEX_MIN_CHILDREN )
+		{
+			const_cast< KeyValues * >( this )->BuildChildIndex();
+			return const_cast< KeyValues * >( this )->FindKeyInChildIndex( keySymbol, NULL );
+		}
 	}
 
 	return NULL;
@@ -1011,15 +1345,31 @@ KeyValues *KeyValues::FindKey(const char *keyName, bool bCreate)
 
 	KeyValues *lastItem = NULL;
 	KeyValues *dat;
-	// find the searchStr in the current peer list
-	for (dat = m_pSub; dat != NULL; dat = dat->m_pPeer)
+	if ( m_nChildIndexFlags & KEYVALUES_HAS_CHILD_INDEX )
 	{
-		lastItem = dat;	// record the last item looked at (for if we need to append to the end of the list)
-
-		// symbol compare
-		if (dat->m_iKeyName == iSearchStr)
+		dat = FindKeyInChildIndex( iSearchStr, &lastItem );
+	}
+	else
+	{
+		// find the searchStr in the current peer list
+		int nVisited = 0;
+		for (dat = m_pSub; dat != NULL; dat = dat->m_pPeer)
 		{
-			break;
+			lastItem = dat;	// record the last item looked at (for if we need to append to the end of the list)
+
+			// symbol compare
+			if (dat->m_iKeyName == iSearchStr)
+			{
+				break;
+			}
+
+			// enough children to be worth indexing
+			if ( ++nVisited == KEYVALUES_CHILD_INDEX_MIN_CHILDREN )
+			{
+				BuildChildIndex();
+				dat = FindKeyInChildIndex( iSearchStr, &lastItem );
+				break;
+			}
 		}
 	}
 
@@ -1050,9 +1400,15 @@ KeyValues *KeyValues::FindKey(const char *keyName, bool bCreate)
 				m_pSub = dat;
 			}
 			dat->m_pPeer = NULL;
+			AddToChildIndex( dat );
 
 			// a key graduates to be a submsg as soon as it's m_pSub is set
 			// this should be the only place m_pSub is set
+			if ( m_iDataType != TYPE_NONE )
+			{
+				// the value union isn't an index
+				m_nChildIndexFlags &= ~KEYVALUES_HAS_CHILD_INDEX;
+			}
 			m_iDataType = TYPE_NONE;
 		}
 		else
@@ -1125,6 +1481,18 @@ KeyValues* KeyValues::CreateKeyUsingKnownLastChild( const char *keyName, KeyValu
 	return dat;
 }
 
+//-----------------------------------------------------------------------------
+KeyValues* KeyValues::CreateKeyFromSymbolUsingKnownLastChild( int keySymbol, KeyValues *pLastChild )
+{
+	Assert( keySymbol != INVALID_KEY_SYMBOL );
+
+	KeyValues* dat = new KeyValues( keySymbol, this );
+
+	AddSubkeyUsingKnownLastChild( dat, pLastChild );
+
+	return dat;
+}
+
 //-----------------------------------------------------------------------------
 void KeyValues::AddSubkeyUsingKnownLastChild( KeyValues *pSubkey, KeyValues *pLastChild )
 {
@@ -1153,8 +1521,10 @@ void KeyValues::AddSubkeyUsingKnownLastChild( KeyValues *pSubkey, KeyValues *pLa
 //			Assert( pTempDat == pLastChild );
 //		#endif
 
-		pLastChild->SetNextKey( pSubkey );
+		pLastChild->m_pPeer = pSubkey;
 	}
+
+	AddToChildIndex( pSubkey );
 }
 
 
@@ -1174,14 +1544,22 @@ void KeyValues::AddSubKey( KeyValues *pSubkey )
 	}
 	else
 	{
+		// the index knows the last child
 		KeyValues *pTempDat = m_pSub;
+		if ( m_nChildIndexFlags & KEYVALUES_HAS_CHILD_INDEX )
+		{
+			FindKeyInChildIndex( INVALID_KEY_SYMBOL, &pTempDat );
+		}
+
 		while ( pTempDat->GetNextKey() != NULL )
 		{
 			pTempDat = pTempDat->GetNextKey();
 		}
 
-		pTempDat->SetNextKey( pSubkey );
+		pTempDat->m_pPeer = pSubkey;
 	}
+
+	AddToChildIndex( pSubkey );
 }
 
 
@@ -1194,6 +1572,9 @@ void KeyValues::RemoveSubKey(KeyValues *subKey)
 	if (!subKey)
 		return;
 
+	// rebuilt if it's needed again
+	ClearChildIndex();
+
 	// check the list pointer
 	if (m_pSub == subKey)
 	{
@@ -1242,6 +1623,8 @@ KeyValues *KeyValues::FindLastSubKey()
 //-----------------------------------------------------------------------------
 void KeyValues::SetNextKey( KeyValues *pDat )
 {
+	OnIndexedKeyChanged();
+
 	m_pPeer = pDat;
 }
 
@@ -1585,6 +1968,8 @@ void KeyValues::SetColor( const char *keyName, Color value)
 
 	if ( dat )
 	{
+		dat->ClearChildIndex();
+
 		dat->m_iDataType = TYPE_COLOR;
 		dat->m_Color[0] = value[0];
 		dat->m_Color[1] = value[1];
@@ -1595,6 +1980,8 @@ void KeyValues::SetColor( const char *keyName, Color value)
 
 void KeyValues::SetStringValue( char const *strValue )
 {
+	ClearChildIndex();
+
 	// delete the old value
 	delete [] m_sValue;
 	// make sure we're not storing the WSTRING  - as we're converting over to STRING
@@ -1624,6 +2011,8 @@ void KeyValues::SetString( const char *keyName, const char *value )
 
 	if ( dat )
 	{
+		dat->ClearChildIndex();
+
 		if ( dat->m_iDataType == TYPE_STRING && dat->m_sValue == value )
 		{
 			return;
@@ -1658,6 +2047,8 @@ void KeyValues::SetWString( const char *keyName, const wchar_t *value )
 	KeyValues *dat = FindKey( keyName, true );
 	if ( dat )
 	{
+		dat->ClearChildIndex();
+
 		// delete the old value
 		delete [] dat->m_wsValue;
 		// make sure we're not storing the STRING  - as we're converting over to WSTRING
@@ -1688,6 +2079,8 @@ void KeyValues::SetInt( const char *keyName, int value )
 
 	if ( dat )
 	{
+		dat->ClearChildIndex();
+
 		dat->m_iValue = value;
 		dat->m_iDataType = TYPE_INT;
 	}
@@ -1702,6 +2095,8 @@ void KeyValues::SetUint64( const char *keyName, uint64 value )
 
 	if ( dat )
 	{
+		dat->ClearChildIndex();
+
 		// delete the old value
 		delete [] dat->m_sValue;
 		// make sure we're not storing the WSTRING  - as we're converting over to STRING
@@ -1723,6 +2118,8 @@ void KeyValues::SetFloat( const char *keyName, float value )
 
 	if ( dat )
 	{
+		dat->ClearChildIndex();
+
 		dat->m_flValue = value;
 		dat->m_iDataType = TYPE_FLOAT;
 	}
@@ -1730,6 +2127,8 @@ void KeyValues::SetFloat( const char *keyName, float value )
 
 void KeyValues::SetName( const char * setName )
 {
+	OnIndexedKeyChanged();
+
 	m_iKeyName = s_pfGetSymbolForString( setName, true );
 }
 
@@ -1742,6 +2141,8 @@ void KeyValues::SetPtr( const char *keyName, void *value )
 
 	if ( dat )
 	{
+		dat->ClearChildIndex();
+
 		dat->m_pValue = value;
 		dat->m_iDataType = TYPE_PTR;
 	}
@@ -1813,6 +2214,7 @@ void KeyValues::CopyKeyValue( const KeyValues& src, size_t tmpBufferSizeB, char*
 	if ( src.m_pSub )
 		return;
 
+	ClearChildIndex();
 	m_iDataType = src.m_iDataType;
 		
 	switch( src.m_iDataType )
@@ -1876,6 +2278,9 @@ void KeyValues::CopyKeyValue( const KeyValues& src, size_t tmpBufferSizeB, char*
 
 KeyValues& KeyValues::operator=( const KeyValues& src )
 {
+	// renamed in place
+	OnIndexedKeyChanged();
+
 	RemoveEverything();
 	Init();	// reset all values
 	CopyKeyValuesFromRecursive( src );
@@ -2017,6 +2422,8 @@ bool KeyValues::IsEmpty(const char *keyName)
 //-----------------------------------------------------------------------------
 void KeyValues::Clear( void )
 {
+	ClearChildIndex();
+
 	delete m_pSub;
 	m_pSub = NULL;
 	m_iDataType = TYPE_NONE;
@@ -36,8 +36,6 @@
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
 
-#define INVALID_STRING_INDEX CStringPoolIndex( 0xFFFF, 0xFFFF )
-
 #define MIN_STRING_POOL_SIZE	2048
 
 //-----------------------------------------------------------------------------
@@ -126,37 +124,139 @@ bool CUtlSymbol::operator==( const char* pStr ) const
 // symbol table stuff
 //-----------------------------------------------------------------------------
 
-inline const char* CUtlSymbolTable::StringFromIndex( const CStringPoolIndex &index ) const
+// 32 bit FNV-1a. The caseless version folds the same way V_stricmp does.
+uint32 CUtlSymbolTable::HashSymbolString( const char *pString ) const
 {
-	Assert( index.m_iPool < m_StringPools.Count() );
-	Assert( index.m_iOffset < m_StringPools[index.m_iPool]->m_TotalLen );
+	const uint8 *k = (const uint8 *)pString;
+	uint32 nHash = 2166136261u;
 
-	return &m_StringPools[index.m_iPool]->m_Data[index.m_iOffset];
+	if ( !m_bInsensitive )
+	{
+		for ( ; *k; ++k )
+		{
+			nHash = ( nHash ^ *k ) * 16777619u;
+		}
+	}
+	else
+	{
+		for ( ; *k; ++k )
+		{
+			uint32 c = *k;
+			if ( c - 'A' <= (uint32)( 'Z' - 'A' ) )
+			{
+				c |= 0x20;
+			}
+			else if ( c >= 0x80 )
+			{
+				c = (uint8)tolower( c );
+			}
+			nHash = ( nHash ^ c ) * 16777619u;
+		}
+	}
+
+	return nHash;
 }
 
 
-bool CUtlSymbolTable::CLess::operator()( const CStringPoolIndex &i1, const CStringPoolIndex &i2 ) const
+inline bool CUtlSymbolTable::StringsMatch( const char *pString1, const char *pString2 ) const
 {
-	// Need to do pointer math because CUtlSymbolTable is used in CUtlVectors, and hence
-	// can be arbitrarily moved in memory on a realloc. Yes, this is portable. In reality,
-	// right now at least, because m_LessFunc is the first member of CUtlRBTree, and m_Lookup
-	// is the first member of CUtlSymbolTabke, this == pTable
-	CUtlSymbolTable *pTable = (CUtlSymbolTable *)( (byte *)this - offsetof(CUtlSymbolTable::CTree, m_LessFunc) ) - offsetof(CUtlSymbolTable, m_Lookup );
-	const char* str1 = (i1 == INVALID_STRING_INDEX) ? pTable->m_pUserSearchString :
-													  pTable->StringFromIndex( i1 );
-	const char* str2 = (i2 == INVALID_STRING_INDEX) ? pTable->m_pUserSearchString :
-													  pTable->StringFromIndex( i2 );
-
-	if ( !str1 && str2 )
-		return false;
-	if ( !str2 && str1 )
-		return true;
-	if ( !str1 && !str2 )
-		return false;
-	if ( !pTable->m_bInsensitive )
-		return V_strcmp( str1, str2 ) < 0;
+	if ( !m_bInsensitive )
+		return V_strcmp( pString1, pString2 ) == 0;
 	else
-		return V_stricmp( str1, str2 ) < 0;
+		return V_stricmp( pString1, pString2 ) == 0;
+}
+
+
+UtlSymId_t CUtlSymbolTable::FindInTable( const HashTable_t *pTable, const char *pString, uint32 nHash ) const
+{
+	uint32 nTag = nHash & 0xFFFF0000;
+	int nMask = pTable->m_nMask;
+	for ( int i = nHash & nMask; ; i = ( i + 1 ) & nMask )
+	{
+		uint32 nSlot = pTable->m_Slots[i];
+		if ( !nSlot )
+			return UTL_INVAL_SYMBOL;
+
+		if ( ( nSlot & 0xFFFF0000 ) == nTag )
+		{
+			UtlSymId_t id = (UtlSymId_t)( ( nSlot & 0xFFFF ) - 1 );
+			if ( StringsMatch( Entry( id ).m_pString, pString ) )
+				return id;
+		}
+	}
+}
+
+
+void CUtlSymbolTable::InsertIntoTable( HashTable_t *pTable, UtlSymId_t id, uint32 nHash )
+{
+	int nMask = pTable->m_nMask;
+	int i = nHash & nMask;
+	while ( pTable->m_Slots[i] )
+	{
+		i = ( i + 1 ) & nMask;
+	}
+
+	pTable->m_Slots[i] = ( nHash & 0xFFFF0000 ) | ( (uint32)id + 1 );
+}
+
+
+//-----------------------------------------------------------------------------
+// Builds a larger lookup table off to the side and then publishes it. The old
+// table is retired rather than freed, since readers may still be using it.
+//-----------------------------------------------------------------------------
+void CUtlSymbolTable::GrowHashTable( int nMinElements )
+{
+	// Keep the table at most half full so probe sequences stay short
+	int nSize = 16;
+	while ( nSize < nMinElements * 2 )
+	{
+		nSize <<= 1;
+	}
+
+	HashTable_t *pNewTable = (HashTable_t*)malloc( sizeof( HashTable_t ) + ( nSize - 1 ) * sizeof( uint32 ) );
+	pNewTable->m_nMask = nSize - 1;
+	memset( pNewTable->m_Slots, 0, nSize * sizeof( uint32 ) );
+
+	for ( int i = 0; i < m_nStrings; i++ )
+	{
+		InsertIntoTable( pNewTable, (UtlSymId_t)i, Entry( (UtlSymId_t)i ).m_nHash );
+	}
+
+	HashTable_t *pOldTable = m_pHashTable;
+
+	// The new table must be complete before anyone can see it
+	ThreadMemoryBarrier();
+	m_pHashTable = pNewTable;
+
+	if ( pOldTable )
+	{
+		m_RetiredHashTables.AddToTail( pOldTable );
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Appends the string to the current string pool, or starts a new one.
+//-----------------------------------------------------------------------------
+const char *CUtlSymbolTable::CopyString( const char *pString )
+{
+	int len = V_strlen( pString ) + 1;
+
+	StringPool_t *pPool = m_StringPools.Count() ? m_StringPools.Tail() : NULL;
+	if ( !pPool || ( pPool->m_TotalLen - pPool->m_SpaceUsed ) < len )
+	{
+		// Add a new pool.
+		int newPoolSize = max( len, MIN_STRING_POOL_SIZE );
+		pPool = (StringPool_t*)malloc( sizeof( StringPool_t ) + newPoolSize - 1 );
+		pPool->m_TotalLen = newPoolSize;
+		pPool->m_SpaceUsed = 0;
+		m_StringPools.AddToTail( pPool );
+	}
+
+	char *pDest = &pPool->m_Data[pPool->m_SpaceUsed];
+	memcpy( pDest, pString, len );
+	pPool->m_SpaceUsed += len;
+	return pDest;
 }
 
 
@@ -164,7 +264,8 @@ bool CUtlSymbolTable::CLess::operator()( const CStringPoolIndex &i1, const CStri
 // constructor, destructor
 //-----------------------------------------------------------------------------
 CUtlSymbolTable::CUtlSymbolTable( int growSize, int initSize, bool caseInsensitive ) : 
-	m_Lookup( growSize, initSize ), m_bInsensitive( caseInsensitive ), m_StringPools( 8 )
+	m_pHashTable( NULL ), m_ppSymbolChunks( NULL ), m_nStrings( 0 ), m_nInitSize( initSize ),
+	m_bInsensitive( caseInsensitive ), m_StringPools( 8 )
 {
 }
 
@@ -179,35 +280,13 @@ CUtlSymbol CUtlSymbolTable::Find( const char* pString ) const
 {	
 	if (!pString)
 		return CUtlSymbol();
-	
-	// Store a special context used to help with insertion
-	m_pUserSearchString = pString;
-	
-	// Passing this special invalid symbol makes the comparison function
-	// use the string passed in the context
-	UtlSymId_t idx = m_Lookup.Find( INVALID_STRING_INDEX );
 
-#ifdef _DEBUG
-	m_pUserSearchString = NULL;
-#endif
-
-	return CUtlSymbol( idx );
-}
-
-
-int CUtlSymbolTable::FindPoolWithSpace( int len )	const
-{
-	for ( int i=0; i < m_StringPools.Count(); i++ )
-	{
-		StringPool_t *pPool = m_StringPools[i];
-
-		if ( (pPool->m_TotalLen - pPool->m_SpaceUsed) >= len )
-		{
-			return i;
-		}
-	}
+	// Read the table pointer once; a concurrent AddString may replace it
+	const HashTable_t *pTable = m_pHashTable;
+	if ( !pTable )
+		return CUtlSymbol();
 
-	return -1;
+	return CUtlSymbol( FindInTable( pTable, pString, HashSymbolString( pString ) ) );
 }
 
 
@@ -220,42 +299,50 @@ CUtlSymbol CUtlSymbolTable::AddString( const char* pString )
 	if (!pString) 
 		return CUtlSymbol( UTL_INVAL_SYMBOL );
 
-	CUtlSymbol id = Find( pString );
-	
-	if (id.IsValid())
-		return id;
+	uint32 nHash = HashSymbolString( pString );
+	if ( m_pHashTable )
+	{
+		UtlSymId_t id = FindInTable( m_pHashTable, pString, nHash );
+		if ( id != UTL_INVAL_SYMBOL )
+			return CUtlSymbol( id );
+	}
+
+	if ( m_nStrings >= UTL_INVAL_SYMBOL )
+	{
+		Error( "CUtlSymbolTable overflow!\n" );
+	}
 
-	int len = V_strlen(pString) + 1;
+	UtlSymId_t id = (UtlSymId_t)m_nStrings;
 
-	// Find a pool with space for this string, or allocate a new one.
-	int iPool = FindPoolWithSpace( len );
-	if ( iPool == -1 )
+	// Fill in the symbol entry before anything can refer to it
+	if ( !m_ppSymbolChunks )
 	{
-		// Add a new pool.
-		int newPoolSize = max( len, MIN_STRING_POOL_SIZE );
-		StringPool_t *pPool = (StringPool_t*)malloc( sizeof( StringPool_t ) + newPoolSize - 1 );
-		pPool->m_TotalLen = newPoolSize;
-		pPool->m_SpaceUsed = 0;
-		iPool = m_StringPools.AddToTail( pPool );
+		m_ppSymbolChunks = (SymbolEntry_t**)malloc( SYMBOL_CHUNK_COUNT * sizeof( SymbolEntry_t* ) );
+		memset( m_ppSymbolChunks, 0, SYMBOL_CHUNK_COUNT * sizeof( SymbolEntry_t* ) );
 	}
 
-	// Copy the string in.
-	StringPool_t *pPool = m_StringPools[iPool];
-	Assert( pPool->m_SpaceUsed < 0xFFFF );	// This should never happen, because if we had a string > 64k, it
-											// would have been given its entire own pool.
-	
-	unsigned short iStringOffset = pPool->m_SpaceUsed;
+	SymbolEntry_t *&pChunk = m_ppSymbolChunks[ id >> SYMBOL_CHUNK_BITS ];
+	if ( !pChunk )
+	{
+		pChunk = (SymbolEntry_t*)malloc( SYMBOL_CHUNK_SIZE * sizeof( SymbolEntry_t ) );
+	}
 
-	memcpy( &pPool->m_Data[pPool->m_SpaceUsed], pString, len );
-	pPool->m_SpaceUsed += len;
+	SymbolEntry_t &entry = pChunk[ id & ( SYMBOL_CHUNK_SIZE - 1 ) ];
+	entry.m_pString = CopyString( pString );
+	entry.m_nHash = nHash;
+
+	if ( !m_pHashTable || ( m_nStrings + 1 ) * 2 > m_pHashTable->m_nMask + 1 )
+	{
+		// The grown table is built from the entries so far; this one goes in below
+		GrowHashTable( max( m_nStrings + 1, m_nInitSize ) );
+	}
 
-	// didn't find, insert the string into the vector.
-	CStringPoolIndex index;
-	index.m_iPool = iPool;
-	index.m_iOffset = iStringOffset;
+	// Publish the symbol. The entry and string must be visible first.
+	ThreadMemoryBarrier();
+	InsertIntoTable( m_pHashTable, id, nHash );
+	m_nStrings++;
 
-	UtlSymId_t idx = m_Lookup.Insert( index );
-	return CUtlSymbol( idx );
+	return CUtlSymbol( id );
 }
 
 
@@ -268,18 +355,36 @@ const char* CUtlSymbolTable::String( CUtlSymbol id ) const
 	if (!id.IsValid()) 
 		return "";
 	
-	Assert( m_Lookup.IsValidIndex((UtlSymId_t)id) );
-	return StringFromIndex( m_Lookup[id] );
+	Assert( (UtlSymId_t)id < m_nStrings );
+	return Entry( id ).m_pString;
 }
 
 
 //-----------------------------------------------------------------------------
-// Remove all symbols in the table.
+// Remove all symbols in the table. Not safe to call while other threads are
+// using the table.
 //-----------------------------------------------------------------------------
 
 void CUtlSymbolTable::RemoveAll()
 {
-	m_Lookup.Purge();
+	free( m_pHashTable );
+	m_pHashTable = NULL;
+
+	for ( int i=0; i < m_RetiredHashTables.Count(); i++ )
+		free( m_RetiredHashTables[i] );
+
+	m_RetiredHashTables.Purge();
+
+	if ( m_ppSymbolChunks )
+	{
+		for ( int i=0; i < SYMBOL_CHUNK_COUNT; i++ )
+			free( m_ppSymbolChunks[i] );
+
+		free( m_ppSymbolChunks );
+		m_ppSymbolChunks = NULL;
+	}
+
+	m_nStrings = 0;
 	
 	for ( int i=0; i < m_StringPools.Count(); i++ )
 		free( m_StringPools[i] );
@@ -18,8 +18,11 @@
 #define NO_THREAD_NAMES
 #include "threads.h"
 #include "pacifier.h"
+#include "tier1/utlvector.h"
 
-#define	MAX_THREADS	16
+
+#define WORK_CHUNK_TIME			0.002	// seconds of work per chunk once a thread has timed its items
+#define WORK_CHUNKS_PER_THREAD	4		// chunks are capped at 1/this of a thread's share of the items left
 
 
 class CRunThreadsData
@@ -30,18 +33,163 @@ public:
 	RunThreadsFn m_Fn;
 };
 
-CRunThreadsData g_RunThreadsData[MAX_THREADS];
+CRunThreadsData g_RunThreadsData[MAX_TOOL_THREADS];
+
+
+// Work items are handed out from the shared cursor in chunks.  The unclaimed rest of a
+// thread's chunk is a [begin,end) range packed into one 64 bit word so the owner can pop
+// items off the front and idle threads can steal the back half, both with a single
+// compare and swap, once the cursor runs dry.
+struct DECL_ALIGN(64) CThreadWork
+{
+	int64 volatile	m_Range;			// begin in the low word, end in the high word
+	double			m_flChunkStart;
+	int				m_nChunkItems;		// items popped since m_flChunkStart
+	float			m_flItemTime;		// running average seconds per item, 0 until it's been timed
+	int				m_iNode;			// NUMA node the thread is pinned to
+
+	// stats for the current RunThreadsOn
+	int				m_nChunks;
+	int				m_nSteals;
+	double			m_flEndTime;
+};
+
+struct CThreadPhaseStats
+{
+	const char		*m_pName;
+	int				m_nRuns;
+	int				m_nItems;
+	int				m_nChunks;
+	int				m_nSteals;
+	double			m_flWallTime;
+	double			m_flBusyTime;		// summed over the threads
+	double			m_flThreadTime;		// wall time * thread count
+};
 
 
-int		dispatch;
+static CThreadWork g_ThreadWork[MAX_TOOL_THREADS];
+static CTHREADLOCALINT g_iWorkThread;	// 1 + index into g_ThreadWork, 0 on threads RunThreads_Start didn't create
+static int32 volatile g_nPacifierBusy;
+
+static const char *g_pThreadPhaseName;
+static CUtlVector<CThreadPhaseStats> g_ThreadPhaseStats;
+
+int32 volatile	dispatch;
 int		workcount;
 qboolean		pacifier;
 
 qboolean	threaded;
 bool g_bLowPriorityThreads = false;
 
-HANDLE g_ThreadHandles[MAX_THREADS];
+HANDLE g_ThreadHandles[MAX_TOOL_THREADS];
+
+
+static inline int64 PackWorkRange( int iBegin, int iEnd )
+{
+	return (int64)(uint32)iBegin | ( (int64)iEnd << 32 );
+}
+
+static inline int WorkRangeBegin( int64 range )
+{
+	return (int)(uint32)range;
+}
+
+static inline int WorkRangeEnd( int64 range )
+{
+	return (int)( range >> 32 );
+}
+
+
+// Takes up to nGrain items off the shared cursor
+static bool ClaimWork( int nGrain, int *pBegin, int *pEnd )
+{
+	while ( 1 )
+	{
+		int iBegin = dispatch;
+		if ( iBegin >= workcount )
+			return false;
+
+		int iEnd = min( iBegin + nGrain, workcount );
+		if ( ThreadInterlockedAssignIf( &dispatch, iEnd, iBegin ) )
+		{
+			*pBegin = iBegin;
+			*pEnd = iEnd;
+			return true;
+		}
+	}
+}
+
 
+// Takes the back half of the fullest chunk another thread is still working through,
+// looking on our own NUMA node first
+static bool StealWork( int iThread, int *pBegin, int *pEnd )
+{
+	for ( int iPass = 0; iPass < 2; iPass++ )
+	{
+		while ( 1 )
+		{
+			CThreadWork *pVictim = NULL;
+			int64 victimRange = 0;
+			int nMost = 0;
+
+			for ( int i = 1; i < numthreads; i++ )
+			{
+				CThreadWork *pWork = &g_ThreadWork[ ( iThread + i ) % numthreads ];
+				if ( ( pWork->m_iNode == g_ThreadWork[iThread].m_iNode ) != ( iPass == 0 ) )
+					continue;
+
+				int64 range = pWork->m_Range;
+				int nLeft = WorkRangeEnd( range ) - WorkRangeBegin( range );
+				if ( nLeft > nMost )
+				{
+					pVictim = pWork;
+					victimRange = range;
+					nMost = nLeft;
+				}
+			}
+
+			if ( !pVictim )
+				break;
+
+			int iEnd = WorkRangeEnd( victimRange );
+			int iBegin = iEnd - ( nMost + 1 ) / 2;
+			if ( ThreadInterlockedAssignIf64( &pVictim->m_Range, PackWorkRange( WorkRangeBegin( victimRange ), iBegin ), victimRange ) )
+			{
+				*pBegin = iBegin;
+				*pEnd = iEnd;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+
+// Cheap items go out in bigger chunks, but never so big that the tail can't be shared out
+static int GetWorkGrain( const CThreadWork *pWork )
+{
+	int nMax = ( workcount - dispatch ) / ( numthreads * WORK_CHUNKS_PER_THREAD );
+	if ( nMax <= 1 || pWork->m_flItemTime <= 0 )
+		return 1;
+
+	float flGrain = WORK_CHUNK_TIME / pWork->m_flItemTime;
+	if ( flGrain >= nMax )
+		return nMax;
+
+	return max( (int)flGrain, 1 );
+}
+
+
+// Whichever thread gets here first draws the pacifier, the rest don't wait for it
+static void UpdateWorkPacifier( int iDispatched )
+{
+	if ( ThreadInterlockedAssignIf( &g_nPacifierBusy, 1, 0 ) )
+	{
+		UpdatePacifier( (float)iDispatched / workcount );
+		g_nPacifierBusy = 0;
+	}
+}
 
 
 /*
@@ -52,23 +200,73 @@ GetThreadWork
 */
 int	GetThreadWork (void)
 {
-	int	r;
+	int		iBegin, iEnd;
+	int		iThread = g_iWorkThread - 1;
+
+	if ( iThread < 0 )
+	{
+		// not a worker thread, so it has no chunk to keep and takes single items
+		if ( !ClaimWork( 1, &iBegin, &iEnd ) )
+			return -1;
+		UpdateWorkPacifier( iBegin );
+		return iBegin;
+	}
+
+	CThreadWork *pWork = &g_ThreadWork[iThread];
+
+	// pop the front of our own chunk.  Thieves only ever move its end down, so once
+	// it's empty nobody else touches it until we hand it the next chunk.
+	int64 range;
+	while ( 1 )
+	{
+		range = pWork->m_Range;
+		iBegin = WorkRangeBegin( range );
+		iEnd = WorkRangeEnd( range );
+		if ( iBegin >= iEnd )
+			break;
+
+		if ( ThreadInterlockedAssignIf64( &pWork->m_Range, PackWorkRange( iBegin + 1, iEnd ), range ) )
+		{
+			pWork->m_nChunkItems++;
+			return iBegin;
+		}
+	}
 
-	ThreadLock ();
+	// time the chunk we just finished to size the next one
+	double flNow = Plat_FloatTime();
+	if ( pWork->m_nChunkItems )
+	{
+		float flItemTime = max( (float)( flNow - pWork->m_flChunkStart ) / pWork->m_nChunkItems, 1e-7f );
+		if ( pWork->m_flItemTime > 0 )
+			flItemTime = pWork->m_flItemTime * 0.75f + flItemTime * 0.25f;
+		pWork->m_flItemTime = flItemTime;
+	}
 
-	if (dispatch == workcount)
+	if ( ClaimWork( GetWorkGrain( pWork ), &iBegin, &iEnd ) )
+	{
+		UpdateWorkPacifier( iBegin );
+	}
+	else if ( StealWork( iThread, &iBegin, &iEnd ) )
 	{
-		ThreadUnlock ();
+		pWork->m_nSteals++;
+	}
+	else
+	{
+		pWork->m_nChunkItems = 0;
 		return -1;
 	}
 
-	UpdatePacifier( (float)dispatch / workcount );
+	pWork->m_nChunks++;
+	pWork->m_flChunkStart = flNow;
+	pWork->m_nChunkItems = 1;
 
-	r = dispatch;
-	dispatch++;
-	ThreadUnlock ();
+	// keep the first item and publish the rest for ourselves and for thieves
+	if ( iEnd - iBegin > 1 )
+	{
+		Verify( ThreadInterlockedAssignIf64( &pWork->m_Range, PackWorkRange( iBegin + 1, iEnd ), range ) );
+	}
 
-	return r;
+	return iBegin;
 }
 
 
@@ -136,8 +334,10 @@ void ThreadSetDefault (void)
 	{
 		GetSystemInfo (&info);
 		numthreads = info.dwNumberOfProcessors;
-		if (numthreads < 1 || numthreads > 32)
+		if (numthreads < 1)
 			numthreads = 1;
+		if (numthreads > MAX_TOOL_THREADS)
+			numthreads = MAX_TOOL_THREADS;
 	}
 
 	Msg ("%i threads\n", numthreads);
@@ -169,11 +369,62 @@ void ThreadUnlock (void)
 DWORD WINAPI InternalRunThreadsFn( LPVOID pParameter )
 {
 	CRunThreadsData *pData = (CRunThreadsData*)pParameter;
+	g_iWorkThread = pData->m_iThread + 1;
 	pData->m_Fn( pData->m_iThread, pData->m_pUserData );
+	g_ThreadWork[pData->m_iThread].m_flEndTime = Plat_FloatTime();
 	return 0;
 }
 
 
+// Spreads the threads over the NUMA nodes in proportion to each node's processors,
+// keeping neighbouring thread indices together, and pins each thread to its node so
+// the memory it touches stays local and it steals from its neighbours first.
+// Called before the thread is resumed, so m_iNode is set before it looks for work.
+// A thread that can't be pinned is left on node 0.
+static void PinThreadToNode( int iThread, HANDLE hThread )
+{
+	g_ThreadWork[iThread].m_iNode = 0;
+
+	ULONG iHighestNode;
+	if ( !GetNumaHighestNodeNumber( &iHighestNode ) || iHighestNode == 0 )
+		return;
+
+	ULONGLONG nodeMasks[64];
+	int nNodes = min( (int)iHighestNode + 1, (int)ARRAYSIZE( nodeMasks ) );
+	int nProcessors = 0;
+	for ( int i = 0; i < nNodes; i++ )
+	{
+		if ( !GetNumaNodeProcessorMask( (UCHAR)i, &nodeMasks[i] ) )
+			nodeMasks[i] = 0;
+
+		// a 32 bit tool can only use the processors that fit in its affinity mask
+		nodeMasks[i] &= (ULONGLONG)(DWORD_PTR)~(DWORD_PTR)0;
+		for ( ULONGLONG mask = nodeMasks[i]; mask; mask &= mask - 1 )
+			nProcessors++;
+	}
+
+	if ( nProcessors == 0 )
+		return;
+
+	// the node holding this thread's share of the processors
+	int iProcessor = iThread * nProcessors / numthreads;
+	for ( int i = 0; i < nNodes; i++ )
+	{
+		for ( ULONGLONG mask = nodeMasks[i]; mask; mask &= mask - 1 )
+		{
+			if ( iProcessor-- == 0 )
+			{
+				if ( SetThreadAffinityMask( hThread, (DWORD_PTR)nodeMasks[i] ) )
+				{
+					g_ThreadWork[iThread].m_iNode = i;
+				}
+				return;
+			}
+		}
+	}
+}
+
+
 void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePriority )
 {
 	Assert( numthreads > 0 );
@@ -194,7 +445,7 @@ void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePr
 		   0,		// DWORD cbStack,
 		   InternalRunThreadsFn,	// LPTHREAD_START_ROUTINE lpStartAddr,
 		   &g_RunThreadsData[i],	// LPVOID lpvThreadParm,
-		   0,			// DWORD fdwCreate,
+		   CREATE_SUSPENDED,	// DWORD fdwCreate,
 		   &dwDummy );
 
 		if ( ePriority == k_eRunThreadsPriority_UseGlobalState )
@@ -206,6 +457,14 @@ void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePr
 		{
 			SetThreadPriority( g_ThreadHandles[i], THREAD_PRIORITY_IDLE );
 		}
+
+		PinThreadToNode( i, g_ThreadHandles[i] );
+	}
+
+	// only start once every thread's node is known, StealWork compares them
+	for ( int i=0; i < numthreads ;i++ )
+	{
+		ResumeThread( g_ThreadHandles[i] );
 	}
 }
 
@@ -218,6 +477,64 @@ void RunThreads_End()
 
 	threaded = false;
 }
+
+
+void ThreadSetPhaseName( const char *pName )
+{
+	g_pThreadPhaseName = pName;
+}
+
+
+// Adds the work the threads just finished to the stats for the current phase
+static void AddThreadPhaseStats( double flStart, double flEnd )
+{
+	const char *pName = g_pThreadPhaseName ? g_pThreadPhaseName : "(unnamed)";
+	g_pThreadPhaseName = NULL;
+
+	int iPhase;
+	for ( iPhase = 0; iPhase < g_ThreadPhaseStats.Count(); iPhase++ )
+	{
+		if ( !Q_stricmp( g_ThreadPhaseStats[iPhase].m_pName, pName ) )
+			break;
+	}
+
+	if ( iPhase == g_ThreadPhaseStats.Count() )
+	{
+		iPhase = g_ThreadPhaseStats.AddToTail();
+		memset( &g_ThreadPhaseStats[iPhase], 0, sizeof( CThreadPhaseStats ) );
+		g_ThreadPhaseStats[iPhase].m_pName = pName;
+	}
+
+	CThreadPhaseStats *pStats = &g_ThreadPhaseStats[iPhase];
+	pStats->m_nRuns++;
+	pStats->m_nItems += workcount;
+	pStats->m_flWallTime += flEnd - flStart;
+	pStats->m_flThreadTime += ( flEnd - flStart ) * numthreads;
+
+	for ( int i = 0; i < numthreads; i++ )
+	{
+		pStats->m_nChunks += g_ThreadWork[i].m_nChunks;
+		pStats->m_nSteals += g_ThreadWork[i].m_nSteals;
+		pStats->m_flBusyTime += g_ThreadWork[i].m_flEndTime - flStart;
+	}
+}
+
+
+void PrintThreadPhaseStats()
+{
+	if ( !g_ThreadPhaseStats.Count() )
+		return;
+
+	Msg( "\nThread utilization (%d threads):\n", numthreads );
+	Msg( "  %-24s %5s %9s %8s %7s %9s %6s\n", "phase", "runs", "items", "chunks", "steals", "wall", "util" );
+	for ( int i = 0; i < g_ThreadPhaseStats.Count(); i++ )
+	{
+		const CThreadPhaseStats *pStats = &g_ThreadPhaseStats[i];
+		float flUtilization = pStats->m_flThreadTime > 0 ? 100.0f * pStats->m_flBusyTime / pStats->m_flThreadTime : 100.0f;
+		Msg( "  %-24s %5d %9d %8d %7d %8.2fs %5.1f%%\n", pStats->m_pName, pStats->m_nRuns, pStats->m_nItems,
+			pStats->m_nChunks, pStats->m_nSteals, pStats->m_flWallTime, flUtilization );
+	}
+}
 	
 
 /*
@@ -228,8 +545,10 @@ RunThreadsOn
 void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pUserData )
 {
 	int		start, end;
+	double	flStart, flEnd;
 
-	start = Plat_FloatTime();
+	flStart = Plat_FloatTime();
+	start = flStart;
 	dispatch = 0;
 	workcount = workcnt;
 	StartPacifier("");
@@ -242,11 +561,25 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 #endif
 
 	
+	for ( int i = 0; i < MAX_TOOL_THREADS; i++ )
+	{
+		CThreadWork *pWork = &g_ThreadWork[i];
+		pWork->m_Range = 0;
+		pWork->m_flChunkStart = flStart;
+		pWork->m_nChunkItems = 0;
+		pWork->m_flItemTime = 0;
+		pWork->m_nChunks = 0;
+		pWork->m_nSteals = 0;
+		pWork->m_flEndTime = flStart;
+	}
+
 	RunThreads_Start( fn, pUserData );
 	RunThreads_End();
 
+	flEnd = Plat_FloatTime();
+	AddThreadPhaseStats( flStart, flEnd );
 
-	end = Plat_FloatTime();
+	end = flEnd;
 	if (pacifier)
 	{
 		EndPacifier(false);
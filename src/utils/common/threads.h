@@ -18,7 +18,8 @@
 
 // Arrays that are indexed by thread should always be MAX_TOOL_THREADS+1
 // large so THREADINDEX_MAIN can be used from the main thread.
-#define MAX_TOOL_THREADS	16
+// RunThreads_End waits on all the threads at once, so this can't go past MAXIMUM_WAIT_OBJECTS.
+#define MAX_TOOL_THREADS	64
 #define THREADINDEX_MAIN	(MAX_TOOL_THREADS)
 
 
@@ -43,6 +44,10 @@ enum ERunThreadsPriority
 void SetLowPriority();
 
 void ThreadSetDefault (void);
+
+// Work items come out of the shared counter in chunks sized from how long each thread's
+// last chunk took, and threads that run dry steal from the others, so items aren't
+// strictly handed out in order.
 int	GetThreadWork (void);
 
 void RunThreadsOnIndividual ( int workcnt, qboolean showpacifier, ThreadWorkerFn fn );
@@ -56,10 +61,16 @@ void RunThreads_End();
 void ThreadLock (void);
 void ThreadUnlock (void);
 
+// Names the next RunThreadsOn in the utilization stats.  The RunThreadsOn macros below do this for you.
+void ThreadSetPhaseName( const char *pName );
+
+// Prints how busy the threads were in each phase so far.  Call it at the end of a compile.
+void PrintThreadPhaseStats();
+
 
 #ifndef NO_THREAD_NAMES
-#define RunThreadsOn(n,p,f) { if (p) printf("%-20s ", #f ":"); RunThreadsOn(n,p,f); }
-#define RunThreadsOnIndividual(n,p,f) { if (p) printf("%-20s ", #f ":"); RunThreadsOnIndividual(n,p,f); }
+#define RunThreadsOn(n,p,f) { if (p) printf("%-20s ", #f ":"); ThreadSetPhaseName(#f); RunThreadsOn(n,p,f); }
+#define RunThreadsOnIndividual(n,p,f) { if (p) printf("%-20s ", #f ":"); ThreadSetPhaseName(#f); RunThreadsOnIndividual(n,p,f); }
 #endif
 
 #endif // THREADS_H
@@ -0,0 +1,231 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Benchmarks for the tier1 containers vbsp leans on, run with
+//
+//		vbsp -tier1bench [iterations]
+//
+//=============================================================================//
+
+#include "vbsp.h"
+#include "tier0/threadtools.h"
+#include "tier0/fasttimer.h"
+#include "tier1/utlsymbol.h"
+#include "tier1/utlstring.h"
+#include "tier1/fmtstr.h"
+#include "tier1/KeyValues.h"
+#include "vstdlib/random.h"
+
+//-----------------------------------------------------------------------------
+// Symbol table contention: lookups and a mix of lookups and inserts at 1-32
+// threads, against lookups wrapped in a read lock the way the table used to be
+//-----------------------------------------------------------------------------
+#define SYMBOL_BENCH_STRINGS	4096
+
+struct SymbolBenchJob_t
+{
+	CUtlSymbolTableMT *m_pTable;
+	CThreadRWLock *m_pReadLock;			// if set, wrap each Find in a read lock the way the table used to
+	const CUtlVector< CUtlString > *m_pStrings;
+	int m_nThread;
+	int m_nIterations;
+	int m_nAddEvery;					// if nonzero, every Nth operation adds a new string
+	int m_nMisses;
+};
+
+static uintp SymbolBenchThread( void *pParam )
+{
+	SymbolBenchJob_t *pJob = (SymbolBenchJob_t *)pParam;
+	const CUtlVector< CUtlString > &strings = *pJob->m_pStrings;
+	char name[ 64 ];
+	int nMisses = 0;
+
+	for ( int i = 0; i < pJob->m_nIterations; ++i )
+	{
+		if ( pJob->m_nAddEvery && ( i % pJob->m_nAddEvery ) == 0 )
+		{
+			Q_snprintf( name, sizeof( name ), "bench_%d_%d", pJob->m_nThread, i );
+			pJob->m_pTable->AddString( name );
+			continue;
+		}
+
+		const char *pString = strings[ ( i * 7 + pJob->m_nThread * 131 ) % strings.Count() ].Get();
+		if ( pJob->m_pReadLock )
+		{
+			pJob->m_pReadLock->LockForRead();
+		}
+
+		CUtlSymbol sym = pJob->m_pTable->Find( pString );
+
+		if ( pJob->m_pReadLock )
+		{
+			pJob->m_pReadLock->UnlockRead();
+		}
+
+		if ( !sym.IsValid() )
+		{
+			++nMisses;
+		}
+	}
+
+	pJob->m_nMisses = nMisses;
+	return 0;
+}
+
+static void BenchSymbolTable( int iterations )
+{
+	// keep the mixed test's inserts under the 64K symbol limit
+	iterations = clamp( iterations, 1, 50000 );
+
+	CUtlVector< CUtlString > strings;
+	strings.EnsureCapacity( SYMBOL_BENCH_STRINGS );
+	for ( int i = 0; i < SYMBOL_BENCH_STRINGS; ++i )
+	{
+		strings.AddToTail( CUtlString( CFmtStr( "models/props_bench/bench_prop%04d.mdl", i ) ) );
+	}
+
+	static const char *s_pszTests[] = { "locked find", "find", "find + 1/32 add" };
+
+	Msg( "%-16s %7s %10s %10s\n", "test", "threads", "ms", "Mops/s" );
+	for ( int test = 0; test < ARRAYSIZE( s_pszTests ); ++test )
+	{
+		for ( int nThreads = 1; nThreads <= 32; nThreads *= 2 )
+		{
+			CUtlSymbolTableMT table( 0, 32, true );
+			CThreadRWLock readLock;
+			FOR_EACH_VEC( strings, i )
+			{
+				table.AddString( strings[i].Get() );
+			}
+
+			SymbolBenchJob_t jobs[ 32 ];
+			ThreadHandle_t threads[ 32 ];
+			for ( int t = 0; t < nThreads; ++t )
+			{
+				jobs[t].m_pTable = &table;
+				jobs[t].m_pReadLock = ( test == 0 ) ? &readLock : NULL;
+				jobs[t].m_pStrings = &strings;
+				jobs[t].m_nThread = t;
+				jobs[t].m_nIterations = iterations;
+				jobs[t].m_nAddEvery = ( test == 2 ) ? 32 : 0;
+				jobs[t].m_nMisses = 0;
+			}
+
+			CFastTimer timer;
+			timer.Start();
+
+			for ( int t = 0; t < nThreads; ++t )
+			{
+				threads[t] = CreateSimpleThread( SymbolBenchThread, &jobs[t] );
+			}
+
+			int nMisses = 0;
+			for ( int t = 0; t < nThreads; ++t )
+			{
+				ThreadJoin( threads[t] );
+				ReleaseThreadHandle( threads[t] );
+				nMisses += jobs[t].m_nMisses;
+			}
+
+			timer.End();
+
+			float flMS = timer.GetDuration().GetMillisecondsF();
+			float flMops = ( flMS > 0.0f ) ? ( (float)nThreads * iterations / ( flMS * 1000.0f ) ) : 0.0f;
+			Msg( "%-16s %7d %10.2f %10.2f\n", s_pszTests[test], nThreads, flMS, flMops );
+
+			if ( nMisses )
+			{
+				Warning( "%d lookups failed\n", nMisses );
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// KeyValues::FindKey on a key with as many children as the items_game item
+// list (which gets the key's children indexed) against walking the sibling list
+//-----------------------------------------------------------------------------
+static void BenchFindKey( int nChildren, int iterations )
+{
+	// children named like item definitions, looked up in a different order than they were added
+	KeyValues *pItems = new KeyValues( "items" );
+	CUtlVector< int > vecSymbols;
+	vecSymbols.EnsureCapacity( nChildren );
+	KeyValues *pLastItem = NULL;
+	for ( int i = 0; i < nChildren; ++i )
+	{
+		KeyValues *pItem = new KeyValues( CFmtStr( "%d", i ) );
+		pItem->SetInt( "defindex", i );
+		pItems->AddSubkeyUsingKnownLastChild( pItem, pLastItem );
+		pLastItem = pItem;
+		vecSymbols.AddToTail( pItem->GetNameSymbol() );
+	}
+	for ( int i = vecSymbols.Count() - 1; i > 0; --i )
+	{
+		V_swap( vecSymbols[i], vecSymbols[ RandomInt( 0, i ) ] );
+	}
+
+	for( int indexed=0; indexed<2; ++indexed )
+	{
+		float totalTime = 0.0f;
+		float bestTime = FLT_MAX;
+		int nFound = 0;
+
+		for( int i=0; i<iterations; ++i )
+		{
+			CFastTimer timer;
+			timer.Start();
+
+			nFound = 0;
+			FOR_EACH_VEC( vecSymbols, j )
+			{
+				KeyValues *pFound = NULL;
+				if ( indexed )
+				{
+					pFound = pItems->FindKey( vecSymbols[j] );
+				}
+				else
+				{
+					for ( KeyValues *pSub = pItems->GetFirstSubKey(); pSub; pSub = pSub->GetNextKey() )
+					{
+						if ( pSub->GetNameSymbol() == vecSymbols[j] )
+						{
+							pFound = pSub;
+							break;
+						}
+					}
+				}
+
+				if ( pFound )
+				{
+					++nFound;
+				}
+			}
+
+			timer.End();
+
+			float time = timer.GetDuration().GetMillisecondsF();
+			totalTime += time;
+			bestTime = MIN( bestTime, time );
+		}
+
+		Msg( "%-12s %d children, %d of %d found: average %.2f ms, best %.2f ms\n", indexed ? "FindKey" : "linear walk", nChildren, nFound, vecSymbols.Count(), totalTime / iterations, bestTime );
+	}
+
+	pItems->deleteThis();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Runs the benchmarks.  Arguments: [iterations]
+//-----------------------------------------------------------------------------
+int RunTier1Benchmarks( int argc, char **argv )
+{
+	int iterations = ( argc > 0 ) ? atoi( argv[0] ) : 50000;
+
+	Msg( "CUtlSymbolTableMT, %d operations per thread\n", clamp( iterations, 1, 50000 ) );
+	BenchSymbolTable( iterations );
+
+	Msg( "\nKeyValues::FindKey, 30000 children\n" );
+	BenchFindKey( 30000, 5 );
+
+	return 0;
+}
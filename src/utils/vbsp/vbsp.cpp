@@ -891,6 +891,12 @@ int RunVBSP( int argc, char **argv )
 	MathLib_Init( 2.2f, 2.2f, 0.0f, OVERBRIGHT, false, false, false, false );
 	InstallSpewFunction();
 	SpewActivate( "developer", 1 );
+
+	// container benchmarks, no map involved
+	if ( argc > 1 && !Q_stricmp( argv[1], "-tier1bench" ) )
+	{
+		return RunTier1Benchmarks( argc - 2, argv + 2 );
+	}
 	
 	CmdLib_InitFileSystem( argv[ argc-1 ] );
 
@@ -1236,6 +1242,8 @@ int RunVBSP( int argc, char **argv )
 				"  -nox360		   : Disable generation Xbox360 version of vsp (default)\n"
 				"  -replacematerials : Substitute materials according to materialsub.txt in content\\maps\n"
 				"  -FullMinidumps  : Write large minidumps on crash.\n"
+				"  -tier1bench [#] : Given first and without a map, time the tier1 containers\n"
+				"                    vbsp uses (# = operations per thread) and exit.\n"
 				);
 			}
 
@@ -1413,6 +1421,8 @@ int RunVBSP( int argc, char **argv )
 		}
 	}
 
+	PrintThreadPhaseStats();
+
 	end = Plat_FloatTime();
 	
 	char str[512];
@@ -647,6 +647,10 @@ void OverlayTransition_AddFaceToLists( int iFace, side_t *pSide );
 void OverlayTransition_EmitOverlayFaces( void );
 void Overlay_Translate( mapoverlay_t *pOverlay, Vector &OriginOffset, QAngle &AngleOffset, matrix3x4_t &Matrix );
 
+//=============================================================================
+// tier1bench.cpp
+int RunTier1Benchmarks( int argc, char **argv );
+
 //=============================================================================
 
 void RemoveAreaPortalBrushes_R( node_t *node );
@@ -0,0 +1,479 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Packed patch to patch transfer matrix used by the bounce passes.
+//
+//=============================================================================//
+
+#include "vrad.h"
+#include "transfermatrix.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+
+// A source patch code of DELTA_ESCAPE is followed by the absolute patch index in two codes
+#define DELTA_ESCAPE	0xFFFF
+
+extern CUtlVector<Vector> emitlight;
+
+CTransferMatrix g_TransferMatrix;
+
+
+static int TransferCompare( const void *pA, const void *pB )
+{
+	return ( (const transfer_t *)pA )->patch - ( (const transfer_t *)pB )->patch;
+}
+
+static FORCEINLINE int DecodeSource( const unsigned short *&pDelta, int iSource )
+{
+	unsigned short nDelta = *pDelta++;
+	if ( nDelta != DELTA_ESCAPE )
+		return iSource + nDelta;
+
+	iSource = pDelta[0] | ( pDelta[1] << 16 );
+	pDelta += 2;
+	return iSource;
+}
+
+
+CTransferMatrix::CTransferMatrix()
+{
+	m_pRowStart = NULL;
+	m_pDeltaStart = NULL;
+	m_pRowScale = NULL;
+	m_pWeight = NULL;
+	m_pDelta = NULL;
+	m_nPatches = 0;
+	m_nTransfers = 0;
+	m_bKeepLists = false;
+	m_pRows = NULL;
+	m_nRowBytes = 0;
+	m_bSpilled = false;
+	m_szSpillFile[0] = 0;
+#ifdef _WIN32
+	m_hSpillFile = NULL;
+	m_hSpillMapping = NULL;
+#endif
+	m_nListBytes = 0;
+}
+
+CTransferMatrix::~CTransferMatrix()
+{
+	Purge();
+}
+
+void CTransferMatrix::Purge()
+{
+	FreeRows();
+
+	delete [] m_pRowStart;
+	delete [] m_pDeltaStart;
+	delete [] m_pRowScale;
+	m_pRowStart = NULL;
+	m_pDeltaStart = NULL;
+	m_pRowScale = NULL;
+	m_pWeight = NULL;
+	m_pDelta = NULL;
+	m_nPatches = 0;
+	m_nTransfers = 0;
+	m_nListBytes = 0;
+
+	m_ShootLight.Purge();
+	m_Origins.Purge();
+}
+
+
+//-----------------------------------------------------------------------------
+// The packed rows live either on the heap or in a file mapping
+//-----------------------------------------------------------------------------
+void *CTransferMatrix::AllocRows( size_t nBytes, const char *pSpillFilename )
+{
+	m_nRowBytes = nBytes;
+	if ( !pSpillFilename )
+	{
+		m_pRows = malloc( nBytes ? nBytes : 1 );
+		if ( !m_pRows )
+			Error( "Memory allocation failure packing %s of transfers\n", Q_pretifymem( nBytes, 2, true ) );
+		return m_pRows;
+	}
+
+	Q_strncpy( m_szSpillFile, pSpillFilename, sizeof( m_szSpillFile ) );
+	size_t nMapBytes = nBytes ? nBytes : 1;
+
+#ifdef _WIN32
+	HANDLE hFile = CreateFile( m_szSpillFile, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL );
+	if ( hFile == INVALID_HANDLE_VALUE )
+		Error( "Can't create transfer file %s\n", m_szSpillFile );
+
+	HANDLE hMapping = CreateFileMapping( hFile, NULL, PAGE_READWRITE, (DWORD)( (uint64)nMapBytes >> 32 ), (DWORD)nMapBytes, NULL );
+	if ( !hMapping )
+		Error( "Can't map %s of transfers into %s\n", Q_pretifymem( nBytes, 2, true ), m_szSpillFile );
+
+	m_pRows = MapViewOfFile( hMapping, FILE_MAP_ALL_ACCESS, 0, 0, nMapBytes );
+	if ( !m_pRows )
+		Error( "Can't map %s of transfers into %s\n", Q_pretifymem( nBytes, 2, true ), m_szSpillFile );
+
+	m_hSpillFile = hFile;
+	m_hSpillMapping = hMapping;
+#else
+	int fd = open( m_szSpillFile, O_RDWR | O_CREAT | O_TRUNC, 0600 );
+	if ( fd == -1 )
+		Error( "Can't create transfer file %s\n", m_szSpillFile );
+
+	if ( ftruncate( fd, nMapBytes ) != 0 )
+		Error( "Can't grow %s to %s\n", m_szSpillFile, Q_pretifymem( nBytes, 2, true ) );
+
+	m_pRows = mmap( NULL, nMapBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	close( fd );
+	if ( m_pRows == MAP_FAILED )
+	{
+		m_pRows = NULL;
+		Error( "Can't map %s of transfers into %s\n", Q_pretifymem( nBytes, 2, true ), m_szSpillFile );
+	}
+#endif
+
+	m_bSpilled = true;
+	return m_pRows;
+}
+
+void CTransferMatrix::FreeRows()
+{
+	if ( !m_pRows )
+		return;
+
+	if ( !m_bSpilled )
+	{
+		free( m_pRows );
+	}
+	else
+	{
+#ifdef _WIN32
+		UnmapViewOfFile( m_pRows );
+		CloseHandle( m_hSpillMapping );
+		CloseHandle( m_hSpillFile );		// FILE_FLAG_DELETE_ON_CLOSE removes it
+		m_hSpillMapping = NULL;
+		m_hSpillFile = NULL;
+#else
+		munmap( m_pRows, m_nRowBytes ? m_nRowBytes : 1 );
+		unlink( m_szSpillFile );
+#endif
+		m_bSpilled = false;
+		m_szSpillFile[0] = 0;
+	}
+
+	m_pRows = NULL;
+	m_nRowBytes = 0;
+}
+
+size_t CTransferMatrix::MemoryUsed() const
+{
+	if ( !IsBuilt() )
+		return 0;
+
+	return m_nRowBytes + ( m_nPatches + 1 ) * ( sizeof( int ) * 2 ) + m_nPatches * sizeof( float );
+}
+
+
+//-----------------------------------------------------------------------------
+// Sorts a row by source patch and measures its deltas and weights
+//-----------------------------------------------------------------------------
+void CTransferMatrix::SortRow( int iPatch )
+{
+	CPatch *pPatch = &g_Patches[iPatch];
+	transfer_t *pTransfers = pPatch->transfers;
+	int nCount = pPatch->numtransfers;
+
+	if ( nCount > 1 )
+	{
+		qsort( pTransfers, nCount, sizeof( transfer_t ), TransferCompare );
+	}
+
+	int nCodes = 0;
+	int iSource = 0;
+	float flMax = 0.0f;
+	for ( int k = 0; k < nCount; k++ )
+	{
+		unsigned int nDelta = pTransfers[k].patch - iSource;
+		nCodes += ( nDelta < DELTA_ESCAPE ) ? 1 : 3;
+		iSource = pTransfers[k].patch;
+		flMax = max( flMax, pTransfers[k].transfer );
+	}
+
+	// Build turns the counts into offsets
+	m_pDeltaStart[iPatch] = nCodes;
+	m_pRowScale[iPatch] = flMax / 65535.0f;
+}
+
+//-----------------------------------------------------------------------------
+// Encodes a sorted row into the packed block
+//-----------------------------------------------------------------------------
+void CTransferMatrix::PackRow( int iPatch )
+{
+	CPatch *pPatch = &g_Patches[iPatch];
+	const transfer_t *pTransfers = pPatch->transfers;
+	int nCount = pPatch->numtransfers;
+
+	unsigned short *pWeight = m_pWeight + m_pRowStart[iPatch];
+	unsigned short *pDelta = m_pDelta + m_pDeltaStart[iPatch];
+	float flQuantize = ( m_pRowScale[iPatch] > 0.0f ) ? 1.0f / m_pRowScale[iPatch] : 0.0f;
+
+	int iSource = 0;
+	for ( int k = 0; k < nCount; k++ )
+	{
+		unsigned int nDelta = pTransfers[k].patch - iSource;
+		if ( nDelta < DELTA_ESCAPE )
+		{
+			*pDelta++ = (unsigned short)nDelta;
+		}
+		else
+		{
+			*pDelta++ = DELTA_ESCAPE;
+			*pDelta++ = (unsigned short)( pTransfers[k].patch & 0xFFFF );
+			*pDelta++ = (unsigned short)( pTransfers[k].patch >> 16 );
+		}
+		iSource = pTransfers[k].patch;
+
+		float flWeight = pTransfers[k].transfer * flQuantize + 0.5f;
+		pWeight[k] = (unsigned short)min( flWeight, 65535.0f );
+	}
+	Assert( pDelta == m_pDelta + m_pDeltaStart[iPatch+1] );
+
+	if ( !m_bKeepLists )
+	{
+		free( pPatch->transfers );
+		pPatch->transfers = NULL;
+	}
+}
+
+void CTransferMatrix::SortRows_Thread( int iThread, void *pUserData )
+{
+	int iPatch;
+	while ( ( iPatch = GetThreadWork() ) != -1 )
+	{
+		g_TransferMatrix.SortRow( iPatch );
+	}
+}
+
+void CTransferMatrix::PackRows_Thread( int iThread, void *pUserData )
+{
+	int iPatch;
+	while ( ( iPatch = GetThreadWork() ) != -1 )
+	{
+		g_TransferMatrix.PackRow( iPatch );
+	}
+}
+
+void CTransferMatrix::Build( const char *pSpillFilename, bool bKeepLists )
+{
+	Purge();
+
+	m_nPatches = g_Patches.Count();
+	m_bKeepLists = bKeepLists;
+	m_pRowStart = new int[m_nPatches + 1];
+	m_pDeltaStart = new int[m_nPatches + 1];
+	m_pRowScale = new float[m_nPatches];
+
+	int64 nTransfers = 0;
+	for ( int i = 0; i < m_nPatches; i++ )
+	{
+		m_pRowStart[i] = (int)nTransfers;
+		nTransfers += g_Patches[i].numtransfers;
+		if ( nTransfers > INT_MAX )
+			Error( "Too many transfers to pack (%lld)\n", (long long)nTransfers );
+	}
+	m_pRowStart[m_nPatches] = (int)nTransfers;
+	m_nTransfers = (int)nTransfers;
+	m_nListBytes = (size_t)nTransfers * sizeof( transfer_t );
+
+	RunThreadsOn( m_nPatches, false, SortRows_Thread );
+
+	int64 nCodes = 0;
+	for ( int i = 0; i < m_nPatches; i++ )
+	{
+		int nRowCodes = m_pDeltaStart[i];
+		m_pDeltaStart[i] = (int)nCodes;
+		nCodes += nRowCodes;
+		if ( nCodes > INT_MAX )
+			Error( "Too many source patch codes to pack (%lld)\n", (long long)nCodes );
+	}
+	m_pDeltaStart[m_nPatches] = (int)nCodes;
+
+	// weights first, then the source patch codes
+	size_t nBytes = ( (size_t)nTransfers + (size_t)nCodes ) * sizeof( unsigned short );
+	m_pWeight = (unsigned short *)AllocRows( nBytes, pSpillFilename );
+	m_pDelta = m_pWeight + nTransfers;
+
+	RunThreadsOn( m_nPatches, false, PackRows_Thread );
+
+	m_ShootLight.SetCount( m_nPatches );
+	m_Origins.SetCount( m_nPatches );
+	for ( int i = 0; i < m_nPatches; i++ )
+	{
+		m_Origins[i].Init( g_Patches[i].origin.x, g_Patches[i].origin.y, g_Patches[i].origin.z );
+		m_Origins[i].Base()[3] = 0.0f;
+		m_ShootLight[i].Init( 0.0f, 0.0f, 0.0f );
+		m_ShootLight[i].Base()[3] = 0.0f;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Latches the light leaving every patch, so each row just gathers it
+//-----------------------------------------------------------------------------
+void CTransferMatrix::BeginBounce()
+{
+	Assert( emitlight.Count() >= m_nPatches );
+	for ( int i = 0; i < m_nPatches; i++ )
+	{
+		const Vector &reflectivity = g_Patches[i].reflectivity;
+		m_ShootLight[i].Init( emitlight[i].x * reflectivity.x, emitlight[i].y * reflectivity.y,
+			emitlight[i].z * reflectivity.z );
+	}
+}
+
+void CTransferMatrix::GatherRow( int iPatch, const Vector *pNormals, int nNormals, Vector *pLight ) const
+{
+	Assert( IsBuilt() && iPatch >= 0 && iPatch < m_nPatches );
+	if ( nNormals > 1 )
+	{
+		GatherRowBumped( iPatch, pNormals, nNormals, pLight );
+	}
+	else
+	{
+		GatherRowFlat( iPatch, pLight );
+	}
+}
+
+void CTransferMatrix::GatherRowFlat( int iPatch, Vector *pLight ) const
+{
+	const unsigned short *pWeight = m_pWeight + m_pRowStart[iPatch];
+	const unsigned short *pDelta = m_pDelta + m_pDeltaStart[iPatch];
+	const VectorAligned *pShoot = m_ShootLight.Base();
+	int nCount = m_pRowStart[iPatch+1] - m_pRowStart[iPatch];
+
+	// four independent sums so the adds don't serialize
+	fltx4 sum0 = Four_Zeros;
+	fltx4 sum1 = Four_Zeros;
+	fltx4 sum2 = Four_Zeros;
+	fltx4 sum3 = Four_Zeros;
+
+	int iSource = 0;
+	int k = 0;
+	for ( ; k + 4 <= nCount; k += 4 )
+	{
+		iSource = DecodeSource( pDelta, iSource );
+		sum0 = MaddSIMD( LoadAlignedSIMD( pShoot[iSource].Base() ), ReplicateX4( (float)pWeight[k] ), sum0 );
+		iSource = DecodeSource( pDelta, iSource );
+		sum1 = MaddSIMD( LoadAlignedSIMD( pShoot[iSource].Base() ), ReplicateX4( (float)pWeight[k+1] ), sum1 );
+		iSource = DecodeSource( pDelta, iSource );
+		sum2 = MaddSIMD( LoadAlignedSIMD( pShoot[iSource].Base() ), ReplicateX4( (float)pWeight[k+2] ), sum2 );
+		iSource = DecodeSource( pDelta, iSource );
+		sum3 = MaddSIMD( LoadAlignedSIMD( pShoot[iSource].Base() ), ReplicateX4( (float)pWeight[k+3] ), sum3 );
+	}
+	for ( ; k < nCount; k++ )
+	{
+		iSource = DecodeSource( pDelta, iSource );
+		sum0 = MaddSIMD( LoadAlignedSIMD( pShoot[iSource].Base() ), ReplicateX4( (float)pWeight[k] ), sum0 );
+	}
+
+	fltx4 sum = AddSIMD( AddSIMD( sum0, sum1 ), AddSIMD( sum2, sum3 ) );
+	sum = MulSIMD( sum, ReplicateX4( m_pRowScale[iPatch] ) );
+	StoreUnaligned3SIMD( pLight[0].Base(), sum );
+}
+
+//-----------------------------------------------------------------------------
+// Same as the flat row, but each transfer is also spread across the bump
+// normals by the direction it arrives from.  Four transfers at a time.
+//-----------------------------------------------------------------------------
+void CTransferMatrix::GatherRowBumped( int iPatch, const Vector *pNormals, int nNormals, Vector *pLight ) const
+{
+	Assert( nNormals <= NUM_BUMP_VECTS + 1 );
+
+	const unsigned short *pWeight = m_pWeight + m_pRowStart[iPatch];
+	const unsigned short *pDelta = m_pDelta + m_pDeltaStart[iPatch];
+	const VectorAligned *pShoot = m_ShootLight.Base();
+	const VectorAligned *pOrigins = m_Origins.Base();
+	int nCount = m_pRowStart[iPatch+1] - m_pRowStart[iPatch];
+	float flRowScale = m_pRowScale[iPatch];
+	const Vector &origin = g_Patches[iPatch].origin;
+
+	FourVectors origin4;
+	origin4.DuplicateVector( origin );
+	FourVectors normal4[NUM_BUMP_VECTS+1];
+	FourVectors sum4[NUM_BUMP_VECTS+1];
+	for ( int n = 0; n < nNormals; n++ )
+	{
+		normal4[n].DuplicateVector( pNormals[n] );
+		sum4[n].x = sum4[n].y = sum4[n].z = Four_Zeros;
+	}
+	fltx4 rowScale = ReplicateX4( flRowScale );
+
+	int iSource = 0;
+	int k = 0;
+	for ( ; k + 4 <= nCount; k += 4 )
+	{
+		int iSource0 = iSource = DecodeSource( pDelta, iSource );
+		int iSource1 = iSource = DecodeSource( pDelta, iSource );
+		int iSource2 = iSource = DecodeSource( pDelta, iSource );
+		int iSource3 = iSource = DecodeSource( pDelta, iSource );
+
+		// get vector to other patch
+		FourVectors delta;
+		delta.LoadAndSwizzleAligned( pOrigins[iSource0].Base(), pOrigins[iSource1].Base(), pOrigins[iSource2].Base(), pOrigins[iSource3].Base() );
+		delta -= origin4;
+		delta.VectorNormalize();
+
+		// remove normal already factored into transfer steradian
+		fltx4 weight = ReplicateX4( (float)pWeight[k] );
+		SubFloat( weight, 1 ) = (float)pWeight[k+1];
+		SubFloat( weight, 2 ) = (float)pWeight[k+2];
+		SubFloat( weight, 3 ) = (float)pWeight[k+3];
+		weight = MulSIMD( MulSIMD( weight, rowScale ), ReciprocalSIMD( delta * normal4[0] ) );
+
+		// find light emitted from other patch
+		FourVectors light;
+		light.LoadAndSwizzleAligned( pShoot[iSource0].Base(), pShoot[iSource1].Base(), pShoot[iSource2].Base(), pShoot[iSource3].Base() );
+		light *= weight;
+
+		for ( int n = 0; n < nNormals; n++ )
+		{
+			fltx4 dot = delta * normal4[n];
+			fltx4 facing = CmpGtSIMD( dot, Four_Zeros );
+			sum4[n].x = AddSIMD( sum4[n].x, AndSIMD( MulSIMD( light.x, dot ), facing ) );
+			sum4[n].y = AddSIMD( sum4[n].y, AndSIMD( MulSIMD( light.y, dot ), facing ) );
+			sum4[n].z = AddSIMD( sum4[n].z, AndSIMD( MulSIMD( light.z, dot ), facing ) );
+		}
+	}
+
+	for ( int n = 0; n < nNormals; n++ )
+	{
+		pLight[n].Init(
+			( SubFloat( sum4[n].x, 0 ) + SubFloat( sum4[n].x, 1 ) ) + ( SubFloat( sum4[n].x, 2 ) + SubFloat( sum4[n].x, 3 ) ),
+			( SubFloat( sum4[n].y, 0 ) + SubFloat( sum4[n].y, 1 ) ) + ( SubFloat( sum4[n].y, 2 ) + SubFloat( sum4[n].y, 3 ) ),
+			( SubFloat( sum4[n].z, 0 ) + SubFloat( sum4[n].z, 1 ) ) + ( SubFloat( sum4[n].z, 2 ) + SubFloat( sum4[n].z, 3 ) ) );
+	}
+
+	for ( ; k < nCount; k++ )
+	{
+		iSource = DecodeSource( pDelta, iSource );
+
+		Vector delta = pOrigins[iSource] - origin;
+		VectorNormalize( delta );
+
+		float scale = 1.0f / DotProduct( delta, pNormals[0] );
+		Vector v = pShoot[iSource] * ( pWeight[k] * flRowScale * scale );
+
+		for ( int n = 0; n < nNormals; n++ )
+		{
+			float dot = DotProduct( delta, pNormals[n] );
+			if ( dot <= 0 )
+				continue;
+			pLight[n] += v * dot;
+		}
+	}
+}
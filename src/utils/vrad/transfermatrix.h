@@ -0,0 +1,88 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Packed patch to patch transfer matrix used by the bounce passes.
+//
+//			MakeScales leaves each patch with its own calloc'ed transfer_t
+//			list, which GatherLight walks one transfer at a time every bounce.
+//			CTransferMatrix packs all of the lists into one compressed sparse
+//			row block: source patches sorted within each row and stored as
+//			16 bit deltas, and weights quantized to 16 bits against a per-row
+//			scale.  The block can be kept in a memory mapped file instead of
+//			the heap.
+//
+//=============================================================================//
+
+#ifndef TRANSFERMATRIX_H
+#define TRANSFERMATRIX_H
+#pragma once
+
+#include "mathlib/vector.h"
+#include "mathlib/ssemath.h"
+#include "tier1/utlvector.h"
+
+
+class CTransferMatrix
+{
+public:
+	CTransferMatrix();
+	~CTransferMatrix();
+
+	// Packs the transfer list of every patch.  The lists are freed as they're packed
+	// unless bKeepLists is set.  If pSpillFilename is set the packed rows are stored in
+	// a memory mapped file of that name rather than on the heap.
+	void Build( const char *pSpillFilename, bool bKeepLists );
+	void Purge();
+
+	bool IsBuilt() const { return m_pRowStart != NULL; }
+	bool IsSpilled() const { return m_bSpilled; }
+
+	// Bytes used by the packed matrix, and by the per-patch lists it replaced
+	size_t MemoryUsed() const;
+	size_t ListMemoryUsed() const { return m_nListBytes; }
+
+	// Latch emitlight * reflectivity of every patch for the next bounce
+	void BeginBounce();
+
+	// Light arriving at a patch along nNormals normals; normals[0] must be the patch normal
+	void GatherRow( int iPatch, const Vector *pNormals, int nNormals, Vector *pLight ) const;
+
+private:
+	static void SortRows_Thread( int iThread, void *pUserData );
+	static void PackRows_Thread( int iThread, void *pUserData );
+	void SortRow( int iPatch );
+	void PackRow( int iPatch );
+
+	void GatherRowFlat( int iPatch, Vector *pLight ) const;
+	void GatherRowBumped( int iPatch, const Vector *pNormals, int nNormals, Vector *pLight ) const;
+
+	void *AllocRows( size_t nBytes, const char *pSpillFilename );
+	void FreeRows();
+
+	int *m_pRowStart;						// first weight of each patch, and one past the last
+	int *m_pDeltaStart;						// first source patch code of each patch
+	float *m_pRowScale;						// dequantizes the weights in each row
+	unsigned short *m_pWeight;				// quantized form factor of each transfer
+	unsigned short *m_pDelta;				// source patch of each transfer as a delta from the previous one
+	int m_nPatches;
+	int m_nTransfers;
+	bool m_bKeepLists;
+
+	void *m_pRows;							// m_pWeight and m_pDelta live in here
+	size_t m_nRowBytes;
+	bool m_bSpilled;
+	char m_szSpillFile[MAX_PATH];
+#ifdef _WIN32
+	void *m_hSpillFile;
+	void *m_hSpillMapping;
+#endif
+	size_t m_nListBytes;
+
+	// one per patch
+	CUtlVector< VectorAligned, CUtlMemoryAligned< VectorAligned, 16 > > m_ShootLight;
+	CUtlVector< VectorAligned, CUtlMemoryAligned< VectorAligned, 16 > > m_Origins;
+};
+
+extern CTransferMatrix g_TransferMatrix;
+
+
+#endif // TRANSFERMATRIX_H
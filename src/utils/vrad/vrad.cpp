@@ -19,6 +19,7 @@
 #include "tools_minidump.h"
 #include "loadcmdline.h"
 #include "byteswap.h"
+#include "transfermatrix.h"
 
 #define ALLOWDEBUGOPTIONS (0 || _DEBUG)
 
@@ -57,6 +58,11 @@ float		g_MaxDispPatchRadius = 1500.0f;			// Maximum radius allowed for displacem
 qboolean	g_bDumpPatches;
 bool	    bDumpNormals = false;
 bool		g_bDumpRtEnv = false;
+bool		g_bSerialKDTree = false;
+bool		g_bVerifyKDTree = false;
+bool		g_bPackedTransfers = true;
+bool		g_bTransferTest = false;
+char		g_szTransferFile[MAX_PATH] = "";
 bool		bRed2Black = true;
 bool		g_bFastAmbient = false;
 bool        g_bNoSkyRecurse = false;
@@ -1532,6 +1538,40 @@ void PreGetBumpNormalsForDisp( texinfo_t *pTexinfo, Vector &vecU, Vector &vecV,
 	vecV = vecTexV;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Fills in the normals a bumped patch gathers light along.  normals[0]
+//          is the flat patch normal, the rest are the bump basis.
+//-----------------------------------------------------------------------------
+static void GetPatchBumpNormals( CPatch *patch, Vector normals[NUM_BUMP_VECTS+1] )
+{
+	// Disps
+	bool bDisp = ( g_pFaces[patch->faceNumber].dispinfo != -1 ); 
+	if ( bDisp )
+	{
+		normals[0] = patch->normal;
+		texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
+		Vector vecTexU, vecTexV;
+		PreGetBumpNormalsForDisp( pTexinfo, vecTexU, vecTexV, normals[0] );
+
+		// use facenormal along with the smooth normal to build the three bump map vectors
+		GetBumpNormals( vecTexU, vecTexV, normals[0], normals[0], &normals[1] ); 
+	}
+	else
+	{
+		GetPhongNormal( patch->faceNumber, patch->origin, normals[0] );
+
+		texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
+		// use facenormal along with the smooth normal to build the three bump map vectors
+		GetBumpNormals( pTexinfo->textureVecsTexelsPerWorldUnits[0], 
+			pTexinfo->textureVecsTexelsPerWorldUnits[1], patch->normal, 
+			normals[0], &normals[1] );
+	}
+
+	// force the base lightmap to use the flat normal instead of the phong normal
+	// FIXME: why does the patch not use the phong normal?
+	normals[0] = patch->normal;
+}
+
 void GatherLight (int threadnum, void *pUserData)
 {
 	int			i, j, k;
@@ -1555,33 +1595,7 @@ void GatherLight (int threadnum, void *pUserData)
 			Vector delta;
 			Vector bumpSum[NUM_BUMP_VECTS+1];
 			Vector normals[NUM_BUMP_VECTS+1];
-
-			// Disps
-			bool bDisp = ( g_pFaces[patch->faceNumber].dispinfo != -1 ); 
-			if ( bDisp )
-			{
-				normals[0] = patch->normal;
-				texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
-				Vector vecTexU, vecTexV;
-				PreGetBumpNormalsForDisp( pTexinfo, vecTexU, vecTexV, normals[0] );
-
-				// use facenormal along with the smooth normal to build the three bump map vectors
-				GetBumpNormals( vecTexU, vecTexV, normals[0], normals[0], &normals[1] ); 
-			}
-			else
-			{
-				GetPhongNormal( patch->faceNumber, patch->origin, normals[0] );
-
-				texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
-				// use facenormal along with the smooth normal to build the three bump map vectors
-				GetBumpNormals( pTexinfo->textureVecsTexelsPerWorldUnits[0], 
-					pTexinfo->textureVecsTexelsPerWorldUnits[1], patch->normal, 
-					normals[0], &normals[1] );
-			}
-
-			// force the base lightmap to use the flat normal instead of the phong normal
-			// FIXME: why does the patch not use the phong normal?
-			normals[0] = patch->normal;
+			GetPatchBumpNormals( patch, normals );
 
 			for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
 			{
@@ -1640,6 +1654,51 @@ void GatherLight (int threadnum, void *pUserData)
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: GatherLight through g_TransferMatrix instead of the per-patch
+//          transfer lists.
+//-----------------------------------------------------------------------------
+void GatherLightPacked( int threadnum, void *pUserData )
+{
+	int j;
+	while ( ( j = GetThreadWork() ) != -1 )
+	{
+		CPatch *patch = &g_Patches[j];
+		if ( patch->needsBumpmap )
+		{
+			Vector normals[NUM_BUMP_VECTS+1];
+			GetPatchBumpNormals( patch, normals );
+			g_TransferMatrix.GatherRow( j, normals, NUM_BUMP_VECTS+1, addlight[j].light );
+		}
+		else
+		{
+			g_TransferMatrix.GatherRow( j, &patch->normal, 1, addlight[j].light );
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Largest difference between two sets of gathered light, relative to
+//          the light itself (or to 1 for very dark patches).
+//-----------------------------------------------------------------------------
+static float MaxGatherDifference( const CUtlVector<bumplights_t> &a, const CUtlVector<bumplights_t> &b )
+{
+	float flMaxDiff = 0.0f;
+	for ( int i = 0; i < a.Count(); i++ )
+	{
+		int nBumps = g_Patches[i].needsBumpmap ? NUM_BUMP_VECTS+1 : 1;
+		for ( int n = 0; n < nBumps; n++ )
+		{
+			for ( int c = 0; c < 3; c++ )
+			{
+				float flLight = max( fabs( a[i].light[n][c] ), 1.0f );
+				flMaxDiff = max( flMaxDiff, (float)fabs( a[i].light[n][c] - b[i].light[n][c] ) / flLight );
+			}
+		}
+	}
+	return flMaxDiff;
+}
+
 #ifdef _WIN32
 #pragma warning (default:4701)
 #endif
@@ -1700,19 +1759,50 @@ void BounceLight (void)
 	}
 #endif
 
+	CUtlVector<bumplights_t> listLight;
+	double flGatherTime = 0.0;
+
 	i = 0;
 	while ( bouncing )
 	{
 		// transfer light from to the leaf patches from other patches via transfers
 		// this moves shooter->emitlight to receiver->addlight
 		unsigned int uiPatchCount = g_Patches.Size();
-		RunThreadsOn (uiPatchCount, true, GatherLight);
+		double flStart = Plat_FloatTime();
+		if ( g_TransferMatrix.IsBuilt() )
+		{
+			double flListTime = 0.0;
+			if ( g_bTransferTest )
+			{
+				// run the transfer lists too, so the two can be compared
+				RunThreadsOn (uiPatchCount, false, GatherLight);
+				flListTime = Plat_FloatTime() - flStart;
+				listLight.CopyArray( addlight.Base(), addlight.Count() );
+				flStart = Plat_FloatTime();
+			}
+
+			g_TransferMatrix.BeginBounce();
+			RunThreadsOn (uiPatchCount, true, GatherLightPacked);
+
+			if ( g_bTransferTest )
+			{
+				Msg( "\tBounce #%i transfer lists %.2fs, packed %.2fs, max difference %.4f%%\n", i+1,
+					flListTime, Plat_FloatTime() - flStart, MaxGatherDifference( listLight, addlight ) * 100.0f );
+			}
+		}
+		else
+		{
+			RunThreadsOn (uiPatchCount, true, GatherLight);
+		}
+		double flBounceTime = Plat_FloatTime() - flStart;
+		flGatherTime += flBounceTime;
+
 		// move newly received light (addlight) to light to be sent out (emitlight)
 		// start at children and pull light up to parents
 		// light is always received to leaf patches
 		CollectLight( added );
 
-		qprintf ("\tBounce #%i added RGB(%.0f, %.0f, %.0f)\n", i+1, added[0], added[1], added[2] );
+		qprintf ("\tBounce #%i added RGB(%.0f, %.0f, %.0f) in %.2f seconds\n", i+1, added[0], added[1], added[2], flBounceTime );
 
 		if ( i+1 == numbounce || (added[0] < 1.0 && added[1] < 1.0 && added[2] < 1.0) )
 			bouncing = false;
@@ -1724,6 +1814,8 @@ void BounceLight (void)
 			WriteWorld (name, 0);
 		}
 	}
+
+	qprintf ("gathered %d bounces in %.2f seconds\n", i, flGatherTime );
 }
 
 
@@ -2069,8 +2161,19 @@ bool RadWorld_Go()
 
 			MakeAllScales ();
 
+			if ( g_bPackedTransfers )
+			{
+				g_TransferMatrix.Build( g_szTransferFile[0] ? g_szTransferFile : NULL, g_bTransferTest );
+				qprintf ("packed transfers: %5.1f megs%s, down from %5.1f megs of lists\n",
+					(float)g_TransferMatrix.MemoryUsed() / (1024*1024),
+					g_TransferMatrix.IsSpilled() ? " (mapped)" : "",
+					(float)g_TransferMatrix.ListMemoryUsed() / (1024*1024));
+			}
+
 			// spread light around
 			BounceLight ();
+
+			g_TransferMatrix.Purge();
 		}
 
 		//
@@ -2283,12 +2386,36 @@ void VRAD_LoadBSP( char const *pFilename )
 		WriteRTEnv("trace.txt");
 
 	// Build acceleration structure
+	if ( !g_bSerialKDTree )
+	{
+		g_RtEnv.Flags |= RTE_FLAGS_PARALLEL_TREE_BUILD;
+		if ( g_bVerifyKDTree )
+			g_RtEnv.Flags |= RTE_FLAGS_VERIFY_TREE_BUILD;
+	}
+
 	printf ( "Setting up ray-trace acceleration structure... ");
 	float start = Plat_FloatTime();
 	g_RtEnv.SetupAccelerationStructure();
 	float end = Plat_FloatTime();
 	printf ( "Done (%.2f seconds)\n", end-start );
 
+	const KDTreeBuildStats_t &treeStats = g_RtEnv.m_TreeBuildStats;
+	if ( verbose || g_bVerifyKDTree )
+	{
+		printf( "  kd tree: %d nodes, %d leaves, %d triangle refs, built in %.2f seconds",
+			treeStats.m_nNodes, treeStats.m_nLeaves, treeStats.m_nTriangleRefs, treeStats.m_flBuildTime );
+		if ( !g_bSerialKDTree )
+			printf( " (%d subtrees on %d threads took %.2f seconds)", treeStats.m_nSubtreeTasks, numthreads, treeStats.m_flSubtreeTime );
+		printf( "\n" );
+	}
+	if ( treeStats.m_nVerifyRays )
+	{
+		printf( "  serial kd tree: %d nodes, built in %.2f seconds\n", treeStats.m_nSerialNodes, treeStats.m_flSerialBuildTime );
+		printf( "  traced %d rays through both trees: %d mismatches\n", treeStats.m_nVerifyRays, treeStats.m_nVerifyMismatches );
+		if ( treeStats.m_nVerifyMismatches )
+			Warning( "Warning: the parallel and serial kd trees disagree on %d of %d rays\n", treeStats.m_nVerifyMismatches, treeStats.m_nVerifyRays );
+	}
+
 #if 0  // To test only k-d build
 	exit(0);
 #endif
@@ -2357,6 +2484,8 @@ void VRAD_Finish()
 
 	StaticPropMgr()->Shutdown();
 
+	PrintThreadPhaseStats();
+
 	double end = Plat_FloatTime();
 	
 	char str[512];
@@ -2432,6 +2561,34 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		{
 			g_bDumpRtEnv = true;
 		}
+		else if ( !Q_stricmp( argv[i], "-serialkdtree" ) )
+		{
+			g_bSerialKDTree = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-kdtreetest" ) )
+		{
+			g_bVerifyKDTree = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-unpackedtransfers" ) )
+		{
+			g_bPackedTransfers = false;
+		}
+		else if ( !Q_stricmp( argv[i], "-transfertest" ) )
+		{
+			g_bTransferTest = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-transferfile" ) )
+		{
+			if ( ++i < argc )
+			{
+				Q_strncpy( g_szTransferFile, argv[i], sizeof( g_szTransferFile ) );
+			}
+			else
+			{
+				Warning( "Error: expected a filename after '-transferfile'\n" );
+				return -1;
+			}
+		}
 		else if ( !Q_stricmp( argv[i], "-LargeDispSampleRadius" ) )
 		{
 			g_bLargeDispSampleRadius = true;
@@ -2836,6 +2993,16 @@ void PrintUsage( int argc, char **argv )
 		"  -dump           : Write debugging .txt files.\n"
 		"  -dumpnormals    : Write normals to debug files.\n"
 		"  -dumptrace      : Write ray-tracing environment to debug files.\n"
+		"  -serialkdtree   : Build the ray-tracing kd tree on one thread with the original\n"
+		"                    builder.\n"
+		"  -kdtreetest     : Also build the kd tree with the serial builder, and report any\n"
+		"                    rays that trace differently through the two trees.\n"
+		"  -unpackedtransfers : Bounce light through the per-patch transfer lists instead\n"
+		"                    of the packed transfer matrix.\n"
+		"  -transferfile <file> : Keep the packed transfer matrix in a memory mapped file\n"
+		"                    instead of in memory.\n"
+		"  -transfertest   : Bounce light through both the transfer lists and the packed\n"
+		"                    matrix, and report the time and largest difference of each.\n"
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
 		"                    or processors on your machine).\n"
 		"  -lights <file>  : Load a lights file in addition to lights.rad and the\n"
@@ -7,6 +7,8 @@
 //=============================================================================//
 #include "vis.h"
 #include "vmpi.h"
+#include "threads.h"
+#include "mathlib/ssemath.h"
 
 int g_TraceClusterStart = -1;
 int g_TraceClusterStop = -1;
@@ -34,14 +36,65 @@ int CountBits (byte *bits, int numbits)
 	int		i;
 	int		c;
 
+	// whole words first, then whatever bits are left over
 	c = 0;
-	for (i=0 ; i<numbits ; i++)
+	for (i=0 ; i+32<=numbits ; i+=32)
+	{
+		uint32 v = bits[i>>3] | (bits[(i>>3)+1] << 8) | (bits[(i>>3)+2] << 16) | ((uint32)bits[(i>>3)+3] << 24);
+		v = v - ((v >> 1) & 0x55555555);
+		v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+		c += (((v + (v >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+	}
+	for ( ; i<numbits ; i++)
 		if ( CheckBit( bits, i ) )
 			c++;
 
 	return c;
 }
 
+
+/*
+==============
+Portal bit strings
+
+portalbytes is a multiple of 32, so these run 256 bits at a time as
+two SSE registers.  Everything is done with the bitwise ops, which
+don't care what the bits look like as floats.
+==============
+*/
+
+// might = a & b, and returns true if might has any bits that vis doesn't
+static FORCEINLINE bool AndPortalBits (byte *might, const byte *a, const byte *b, const byte *vis)
+{
+	fltx4	more = Four_Zeros;
+
+	for (int j=0 ; j<portalbytes ; j+=32)
+	{
+		fltx4 m0 = AndSIMD( LoadUnalignedSIMD( a + j ), LoadUnalignedSIMD( b + j ) );
+		fltx4 m1 = AndSIMD( LoadUnalignedSIMD( a + j + 16 ), LoadUnalignedSIMD( b + j + 16 ) );
+		StoreUnalignedSIMD( (float *)( might + j ), m0 );
+		StoreUnalignedSIMD( (float *)( might + j + 16 ), m1 );
+		more = OrSIMD( more, AndNotSIMD( LoadUnalignedSIMD( vis + j ), m0 ) );
+		more = OrSIMD( more, AndNotSIMD( LoadUnalignedSIMD( vis + j + 16 ), m1 ) );
+	}
+
+	// IsAllZeros compares as floats, which would miss a lone sign bit
+	ALIGN16 uint32 nMore[4] ALIGN16_POST;
+	StoreAlignedSIMD( (float *)nMore, more );
+	return ( nMore[0] | nMore[1] | nMore[2] | nMore[3] ) != 0;
+}
+
+// Sets a bit in a bit string that other threads may be setting bits in too
+static FORCEINLINE void SetBitInterlocked (byte *bits, int bitNumber)
+{
+	int32 volatile *pWord = (int32 volatile *)bits + ( bitNumber >> 5 );
+	int32 nMask = 1 << ( bitNumber & 31 );
+	if ( !( *pWord & nMask ) )
+	{
+		ThreadInterlockedOr( pWord, nMask );
+	}
+}
+
 int		c_fullskip;
 int		c_portalskip, c_leafskip;
 int		c_vistest, c_mighttest;
@@ -477,14 +530,18 @@ Flood fill through the leafs
 If src_portal is NULL, this is the originating leaf
 ==================
 */
+void FlowIntoLeaf (int leafnum, threaddata_t *thread, pstack_t *stack);
+void FinishPortalFlow (portal_t *p, int c_chains);
+
 void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 {
 	pstack_t	stack;
 	portal_t	*p;
 	plane_t		backplane;
 	leaf_t 		*leaf;
-	int			i, j;
-	long		*test, *might, *vis, more;
+	int			i;
+	byte		*test;
+	bool		more;
 	int			pnum;
 
 #ifdef MPI
@@ -510,9 +567,6 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 	stack.leaf = leaf;
 	stack.portal = NULL;
 
-	might = (long *)stack.mightsee;
-	vis = (long *)thread->base->portalvis;
-	
 	// check all portals for flowing into other leafs	
 	for (i=0 ; i<leaf->portals.Count() ; i++)
 	{
@@ -528,19 +582,14 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		// if the portal can't see anything we haven't allready seen, skip it
 		if (p->status == stat_done)
 		{
-			test = (long *)p->portalvis;
+			test = p->portalvis;
 		}
 		else
 		{
-			test = (long *)p->portalflood;
+			test = p->portalflood;
 		}
 
-		more = 0;
-		for (j=0 ; j<portallongs ; j++)
-		{
-			might[j] = ((long *)prevstack->mightsee)[j] & test[j];
-			more |= (might[j] & ~vis[j]);
-		}
+		more = AndPortalBits (stack.mightsee, prevstack->mightsee, test, thread->base->portalvis);
 		
 		if ( !more && CheckBit( thread->base->portalvis, pnum ) )
 		{	// can't see anything new
@@ -598,9 +647,9 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		{	// the second leaf can only be blocked if coplanar
 
 			// mark the portal as visible
-			SetBit( thread->base->portalvis, pnum );
+			SetBitInterlocked( thread->base->portalvis, pnum );
 
-			RecursiveLeafFlow (p->leaf, thread, &stack);
+			FlowIntoLeaf (p->leaf, thread, &stack);
 			continue;
 		}
 
@@ -613,10 +662,10 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 			continue;
 
 		// mark the portal as visible
-		SetBit( thread->base->portalvis, pnum );
+		SetBitInterlocked( thread->base->portalvis, pnum );
 
 		// flow through it for real
-		RecursiveLeafFlow (p->leaf, thread, &stack);
+		FlowIntoLeaf (p->leaf, thread, &stack);
 	}	
 }
 
@@ -631,33 +680,342 @@ generates the portalvis bit vector
 void PortalFlow (int iThread, int portalnum)
 {
 	threaddata_t	data;
-	int				i;
 	portal_t		*p;
-	int				c_might, c_can;
 
 	p = sorted_portals[portalnum];
 	p->status = stat_working;
-				
-	c_might = CountBits (p->portalflood, g_numportals*2);
+	p->flowtasks = 1;
+	p->c_chains = 0;
 
 	memset (&data, 0, sizeof(data));
 	data.base = p;
+	data.iThread = iThread;
 	
 	data.pstack_head.portal = p;
 	data.pstack_head.source = p->winding;
 	data.pstack_head.portalplane = p->plane;
-	for (i=0 ; i<portallongs ; i++)
-		((long *)data.pstack_head.mightsee)[i] = ((long *)p->portalflood)[i];
+	memcpy (data.pstack_head.mightsee, p->portalflood, portalbytes);
 
 	RecursiveLeafFlow (p->leaf, &data, &data.pstack_head);
 
+	FinishPortalFlow (p, data.c_chains);
+}
+
+
+/*
+===============================================================================
+
+Splitting portal flow across threads
+
+The portals are handed out biggest last, so near the end of a run a few
+threads are left flowing huge portals while the rest sit idle.  While any
+thread is idle, RecursiveLeafFlow hands the leafs it would recurse into to
+its thread's queue instead, and the idle threads steal them from the far
+end.  The base portal is done when the last of its subtasks finishes.
+
+The portalvis a subtask builds doesn't depend on the order the subtasks
+run in: a flow is only skipped when every portal it could mark is already
+marked, so the final bits are the same as flowing the portal on one thread.
+
+===============================================================================
+*/
+
+bool	g_bSplitFlow = true;
+
+struct flowtask_t
+{
+	portal_t	*base;
+	int			leafnum;
+	pstack_t	stack;		// prevstack for the RecursiveLeafFlow into leafnum
+};
+
+struct flowqueue_t
+{
+	CThreadFastMutex			m_Mutex;
+	CUtlVector<flowtask_t *>	m_Tasks;
+};
+
+static flowqueue_t	g_FlowQueues[MAX_TOOL_THREADS+1];
+static bool			g_bFlowQueuesActive;
+static int32 volatile	g_nIdleFlowThreads;
+static int32 volatile	g_nFlowPortalsLeft;
+static int32 volatile	g_nFlowTasksSplit;
+static int32 volatile	g_nFlowTasksStolen;
+
+
+/*
+==============
+FinishPortalFlow
+
+Called as PortalFlow and each of its subtasks finish
+==============
+*/
+void FinishPortalFlow (portal_t *p, int c_chains)
+{
+	int		c_might, c_can;
+
+	ThreadInterlockedExchangeAdd( &p->c_chains, c_chains );
+	if ( ThreadInterlockedDecrement( &p->flowtasks ) != 0 )
+		return;
 
 	p->status = stat_done;
 
+	c_might = CountBits (p->portalflood, g_numportals*2);
 	c_can = CountBits (p->portalvis, g_numportals*2);
 
 	qprintf ("portal:%4i  mightsee:%4i  cansee:%4i (%i chains)\n", 
-		(int)(p - portals),	c_might, c_can, data.c_chains);
+		(int)(p - portals),	c_might, c_can, p->c_chains);
+
+	if ( g_bFlowQueuesActive )
+	{
+		ThreadInterlockedDecrement( &g_nFlowPortalsLeft );
+	}
+}
+
+/*
+==============
+CopyStackWinding
+
+The source and pass windings are either the base and pass portals' own,
+or chopped ones living in some pstack_t up the recursion, which will be
+gone by the time a stolen subtask runs.
+==============
+*/
+static winding_t *CopyStackWinding (winding_t *w, threaddata_t *thread, pstack_t *from, pstack_t *stack, int slot)
+{
+	if ( !w || w == thread->base->winding || w == from->portal->winding )
+		return w;
+
+	Assert( w->numpoints <= MAX_POINTS_ON_FIXED_WINDING );
+	winding_t *copy = &stack->windings[slot];
+	copy->original = false;
+	copy->numpoints = w->numpoints;
+	memcpy (copy->points, w->points, w->numpoints * sizeof(Vector));
+	stack->freewindings[slot] = 0;
+	return copy;
+}
+
+/*
+==============
+FlowIntoLeaf
+
+Recurses into the leaf, or queues it for an idle thread to pick up
+==============
+*/
+void FlowIntoLeaf (int leafnum, threaddata_t *thread, pstack_t *stack)
+{
+	flowqueue_t *queue = &g_FlowQueues[thread->iThread];
+	if ( !g_bFlowQueuesActive || g_nIdleFlowThreads <= queue->m_Tasks.Count() )
+	{
+		RecursiveLeafFlow (leafnum, thread, stack);
+		return;
+	}
+
+	flowtask_t *task = new flowtask_t;
+	task->base = thread->base;
+	task->leafnum = leafnum;
+
+	pstack_t *copy = &task->stack;
+	memcpy (copy->mightsee, stack->mightsee, portalbytes);
+	copy->next = NULL;
+	copy->leaf = stack->leaf;
+	copy->portal = stack->portal;
+	copy->portalplane = stack->portalplane;
+	copy->freewindings[0] = copy->freewindings[1] = copy->freewindings[2] = 1;
+	copy->source = CopyStackWinding (stack->source, thread, stack, copy, 0);
+	copy->pass = CopyStackWinding (stack->pass, thread, stack, copy, 1);
+
+	ThreadInterlockedIncrement( &thread->base->flowtasks );
+	ThreadInterlockedIncrement( &g_nFlowTasksSplit );
+
+	AUTO_LOCK( queue->m_Mutex );
+	queue->m_Tasks.AddToTail (task);
+}
+
+/*
+==============
+RunFlowTask
+==============
+*/
+static void RunFlowTask (int iThread, flowtask_t *task)
+{
+	threaddata_t	*data;
+	portal_t		*p = task->base;
+
+	data = new threaddata_t;
+	memset (data, 0, sizeof(*data));
+	data->base = p;
+	data->iThread = iThread;
+
+	data->pstack_head.portal = p;
+	data->pstack_head.source = p->winding;
+	data->pstack_head.portalplane = p->plane;
+	data->pstack_head.next = &task->stack;
+
+	RecursiveLeafFlow (task->leafnum, data, &task->stack);
+
+	FinishPortalFlow (p, data->c_chains);
+
+	delete data;
+	delete task;
+}
+
+/*
+==============
+PopFlowTask
+
+Takes the newest task off of our own queue, or the oldest (and so
+likely the biggest) off of someone else's
+==============
+*/
+static flowtask_t *PopFlowTask (int iThread, bool bSteal)
+{
+	if ( !bSteal )
+	{
+		flowqueue_t *queue = &g_FlowQueues[iThread];
+		if ( !queue->m_Tasks.Count() )
+			return NULL;
+
+		AUTO_LOCK( queue->m_Mutex );
+		if ( !queue->m_Tasks.Count() )
+			return NULL;
+
+		flowtask_t *task = queue->m_Tasks.Tail();
+		queue->m_Tasks.RemoveMultipleFromTail( 1 );
+		return task;
+	}
+
+	for ( int i = 1; i < numthreads; i++ )
+	{
+		flowqueue_t *queue = &g_FlowQueues[( iThread + i ) % numthreads];
+		if ( !queue->m_Tasks.Count() )
+			continue;
+
+		AUTO_LOCK( queue->m_Mutex );
+		if ( !queue->m_Tasks.Count() )
+			continue;
+
+		flowtask_t *task = queue->m_Tasks.Head();
+		queue->m_Tasks.Remove( 0 );
+		ThreadInterlockedIncrement( &g_nFlowTasksStolen );
+		return task;
+	}
+
+	return NULL;
+}
+
+/*
+==============
+PortalFlowThread
+==============
+*/
+static void PortalFlowThread (int iThread, void *pUserData)
+{
+	bool	bMorePortals = true;
+	bool	bIdle = false;
+
+	while ( 1 )
+	{
+		flowtask_t *task = PopFlowTask (iThread, false);
+
+		// new portals come before stealing, so they still go smallest first
+		if ( !task && bMorePortals )
+		{
+			int portalnum = GetThreadWork ();
+			if ( portalnum != -1 )
+			{
+				PortalFlow (iThread, portalnum);
+				continue;
+			}
+			bMorePortals = false;
+		}
+
+		if ( !task )
+		{
+			task = PopFlowTask (iThread, true);
+		}
+
+		if ( task )
+		{
+			if ( bIdle )
+			{
+				ThreadInterlockedDecrement( &g_nIdleFlowThreads );
+				bIdle = false;
+			}
+			RunFlowTask (iThread, task);
+			continue;
+		}
+
+		if ( !g_nFlowPortalsLeft )
+			break;
+
+		if ( !bIdle )
+		{
+			ThreadInterlockedIncrement( &g_nIdleFlowThreads );
+			bIdle = true;
+		}
+		ThreadSleep (0);
+	}
+
+	if ( bIdle )
+	{
+		ThreadInterlockedDecrement( &g_nIdleFlowThreads );
+	}
+}
+
+/*
+==============
+RunPortalFlow
+
+Runs PortalFlow on every portal, splitting the big ones across idle
+threads unless -nosplitflow is set
+==============
+*/
+void RunPortalFlow (void)
+{
+	double	start, end;
+	bool	bSplit;
+
+	if (numthreads == -1)
+		ThreadSetDefault ();
+
+	// tracing needs the whole stack of each flow
+	bSplit = g_bSplitFlow && g_TraceClusterStop < 0 && numthreads > 1;
+
+	start = Plat_FloatTime();
+
+	if ( !bSplit )
+	{
+		RunThreadsOnIndividual (g_numportals*2, true, PortalFlow);
+	}
+	else
+	{
+		g_nIdleFlowThreads = 0;
+		g_nFlowPortalsLeft = g_numportals*2;
+		g_nFlowTasksSplit = 0;
+		g_nFlowTasksStolen = 0;
+		g_bFlowQueuesActive = true;
+
+		RunThreadsOn (g_numportals*2, true, PortalFlowThread);
+
+		g_bFlowQueuesActive = false;
+		for ( int i = 0; i < ARRAYSIZE( g_FlowQueues ); i++ )
+		{
+			Assert( !g_FlowQueues[i].m_Tasks.Count() );
+			g_FlowQueues[i].m_Tasks.Purge();
+		}
+	}
+
+	end = Plat_FloatTime();
+
+	if ( !bSplit )
+	{
+		Msg ("portal flow: %.2f seconds\n", end - start);
+	}
+	else
+	{
+		Msg ("portal flow: %.2f seconds, %i subtasks split off, %i stolen\n", end - start, g_nFlowTasksSplit, g_nFlowTasksStolen);
+	}
 }
 
 
@@ -829,8 +1187,7 @@ void RecursiveLeafBitFlow (int leafnum, byte *mightsee, byte *cansee)
 {
 	portal_t	*p;
 	leaf_t 		*leaf;
-	int			i, j;
-	long		more;
+	int			i;
 	int			pnum;
 	byte		newmight[MAX_PORTALS/8];
 
@@ -847,15 +1204,7 @@ void RecursiveLeafBitFlow (int leafnum, byte *mightsee, byte *cansee)
 			continue;
 
 		// if this portal can see some portals we mightsee, recurse
-		more = 0;
-		for (j=0 ; j<portallongs ; j++)
-		{
-			((long *)newmight)[j] = ((long *)mightsee)[j] 
-				& ((long *)p->portalflood)[j];
-			more |= ((long *)newmight)[j] & ~((long *)cansee)[j];
-		}
-
-		if (!more)
+		if ( !AndPortalBits (newmight, mightsee, p->portalflood, cansee) )
 			continue;	// can't see anything new
 
 		SetBit( cansee, pnum );
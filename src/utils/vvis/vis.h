@@ -56,6 +56,9 @@ struct portal_t
 	byte		*portalvis;		// [portals], final
 
 	int			nummightsee;	// bit count on portalflood for sort
+
+	int32 volatile	flowtasks;	// PortalFlow and the subtasks split off of it still running
+	int32 volatile	c_chains;
 };
 
 struct leaf_t
@@ -82,6 +85,7 @@ struct pstack_t
 struct threaddata_t
 {
 	portal_t	*base;
+	int			iThread;
 	int			c_chains;
 	pstack_t	pstack_head;
 };
@@ -106,6 +110,8 @@ extern	byte		*uncompressed;
 extern	int		leafbytes, leaflongs;
 extern	int		portalbytes, portallongs;
 
+extern	bool	g_bSplitFlow;
+
 
 void LeafFlow (int leafnum);
 
@@ -113,6 +119,7 @@ void LeafFlow (int leafnum);
 void BasePortalVis (int iThread, int portalnum);
 void BetterPortalVis (int portalnum);
 void PortalFlow (int iThread, int portalnum);
+void RunPortalFlow (void);
 void WritePortalTrace( const char *source );
 
 extern	portal_t	*sorted_portals[MAX_MAP_PORTALS*2];
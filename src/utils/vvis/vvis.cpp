@@ -310,7 +310,7 @@ void CalcPortalVis (void)
 	else 
 #endif
 	{
-		RunThreadsOnIndividual (g_numportals*2, true, PortalFlow);
+		RunPortalFlow ();
 	}
 }
 
@@ -478,7 +478,8 @@ void LoadPortals (char *name)
 	leafbytes = ((portalclusters+63)&~63)>>3;
 	leaflongs = leafbytes/sizeof(long);
 	
-	portalbytes = ((g_numportals*2+63)&~63)>>3;
+	// portal bit strings are worked on 256 bits at a time
+	portalbytes = ((g_numportals*2+255)&~255)>>3;
 	portallongs = portalbytes/sizeof(long);
 
 // each file portal is split into two memory portals
@@ -953,6 +954,10 @@ int ParseCommandLine( int argc, char **argv )
 			Msg ("nosort = true\n");
 			nosort = true;
 		}
+		else if (!Q_stricmp (argv[i],"-nosplitflow"))
+		{
+			g_bSplitFlow = false;
+		}
 		else if (!Q_stricmp (argv[i],"-tmpin"))
 			strcpy (inbase, "/tmp");
 		else if( !Q_stricmp( argv[i], "-low" ) )
@@ -1042,6 +1047,7 @@ void PrintUsage( int argc, char **argv )
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
 		"                    or processors on your machine).\n"
 		"  -nosort         : Don't sort portals (sorting is an optimization).\n"
+		"  -nosplitflow    : Don't split the flow of big portals across idle threads.\n"
 		"  -tmpin          : Make portals come from \\tmp\\<mapname>.\n"
 		"  -tmpout         : Make portals come from \\tmp\\<mapname>.\n"
 		"  -trace <start cluster> <end cluster> : Writes a linefile that traces the vis from one cluster to another for debugging map vis.\n"
@@ -1210,6 +1216,8 @@ int RunVVis( int argc, char **argv )
 		WritePortalTrace(source);
 	}
 
+	PrintThreadPhaseStats();
+
 	end = Plat_FloatTime();
 
 	char str[512];